@@ -0,0 +1,148 @@
+/*
+ * Cost of device allocations on the hot path. A job is the task 2 pattern
+ * of lab1: a buffer per element, the inout kernel writing one value into
+ * each and a read of every value. The buffers come from clCreateBuffer()
+ * and clReleaseMemObject() per job, from the free lists of an arena
+ * (common/arena.c) or from an arena in the bump mode reset after the job.
+ */
+
+#define ARENA_NUM_ELEMENTS 16
+#define ARENA_FIRST_VALUE 0xBEEF
+#define ARENA_SIZE (64 << 10)   // room for the blocks at any alignment
+
+enum arena_source
+{
+    ARENA_SOURCE_CREATE,
+    ARENA_SOURCE_FREE_LIST,
+    ARENA_SOURCE_BUMP
+};
+
+struct arena_env
+{
+    cl_kernel kernel;
+    enum arena_source source;
+    struct arena arena;
+    cl_int results[ARENA_NUM_ELEMENTS];
+};
+
+static cl_int
+arena_job(struct arena_env* ae, cl_command_queue queue, cl_context context,
+        cl_mem* bufs, struct arena_block** blocks)
+{
+    cl_int rv = CL_SUCCESS;
+
+    for(int i = 0; i < ARENA_NUM_ELEMENTS && CL_SUCCESS == rv; ++i)
+    {
+        if(ARENA_SOURCE_CREATE == ae->source)
+            bufs[i] = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
+                    sizeof(cl_int), NULL, &rv);
+        else if(NULL != (blocks[i] = arena_alloc(&ae->arena,
+                        sizeof(cl_int), &rv)))
+            bufs[i] = blocks[i]->mem;
+    }
+    for(cl_int i = 0; i < ARENA_NUM_ELEMENTS && CL_SUCCESS == rv; ++i)
+    {
+        cl_int value = ARENA_FIRST_VALUE + i;
+        rv  = clSetKernelArg(ae->kernel, 0, sizeof(cl_mem), &bufs[i]);
+        rv |= clSetKernelArg(ae->kernel, 1, sizeof(cl_int), &value);
+        if(CL_SUCCESS == rv)
+            rv = clEnqueueTask(queue, ae->kernel, 0, NULL, NULL);
+    }
+    for(int i = 0; i < ARENA_NUM_ELEMENTS && CL_SUCCESS == rv; ++i)
+        rv = clEnqueueReadBuffer(queue, bufs[i], i == ARENA_NUM_ELEMENTS - 1,
+                0, sizeof(cl_int), &ae->results[i], 0, NULL, NULL);
+    return rv;
+}
+
+static cl_int
+arena_once(struct bench_env* env, void* arg, double* device_us)
+{
+    cl_int rv;
+    struct arena_env* ae = arg;
+    cl_mem bufs[ARENA_NUM_ELEMENTS] = { NULL };
+    struct arena_block* blocks[ARENA_NUM_ELEMENTS] = { NULL };
+
+    rv = arena_job(ae, env->cmd_q, env->context, bufs, blocks);
+    switch(ae->source)
+    {
+        case ARENA_SOURCE_CREATE:
+            for(int i = 0; i < ARENA_NUM_ELEMENTS; ++i)
+                if(NULL != bufs[i])
+                    clReleaseMemObject(bufs[i]);
+            break;
+        case ARENA_SOURCE_FREE_LIST:
+            for(int i = 0; i < ARENA_NUM_ELEMENTS; ++i)
+                arena_free(&ae->arena, blocks[i]);
+            break;
+        case ARENA_SOURCE_BUMP:
+        default:
+            arena_reset(&ae->arena);
+            break;
+    }
+    if(CL_SUCCESS != rv)
+        return rv;
+
+    for(int i = 0; i < ARENA_NUM_ELEMENTS; ++i)
+    {
+        if(ARENA_FIRST_VALUE + i != ae->results[i])
+        {
+            fprintf(stderr, "Element %d holds %X instead of %X\n", i,
+                    ae->results[i], ARENA_FIRST_VALUE + i);
+            return CL_INVALID_VALUE;
+        }
+    }
+    return CL_SUCCESS;
+}
+
+cl_int
+bench_arena(struct bench_env* env)
+{
+    static const char * const names[] = {
+        "arena/create", "arena/free-list", "arena/bump"
+    };
+    cl_int rv;
+    cl_program program;
+    struct arena_env ae;
+
+    memset(&ae, 0, sizeof(ae));
+    rv = build_program(&program, &env->context, &env->device,
+            env->kernel_file_name);
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Failed to build a program:", rv, stderr);
+        return rv;
+    }
+    ae.kernel = clCreateKernel(program, "inout", &rv);
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Failed to create a kernel object:", rv, stderr);
+        clReleaseProgram(program);
+        return rv;
+    }
+
+    for(ae.source = ARENA_SOURCE_CREATE;
+            ae.source <= ARENA_SOURCE_BUMP && CL_SUCCESS == rv; ++ae.source)
+    {
+        if(ARENA_SOURCE_CREATE != ae.source)
+            rv = arena_init(&ae.arena, env->context, env->device,
+                    CL_MEM_WRITE_ONLY, ARENA_SIZE,
+                    (ARENA_SOURCE_BUMP == ae.source) ? ARENA_BUMP
+                    : ARENA_FREE_LIST);
+        if(CL_SUCCESS == rv)
+            rv = bench_measure(env, names[ae.source], 0, arena_once, &ae);
+        if(ARENA_SOURCE_CREATE != ae.source)
+        {
+            // the first job created every sub-buffer the others used
+            if(CL_SUCCESS == rv)
+            {
+                printf("%s: ", names[ae.source]);
+                arena_print_stats(&ae.arena, stdout);
+            }
+            arena_release(&ae.arena);
+        }
+    }
+
+    clReleaseKernel(ae.kernel);
+    clReleaseProgram(program);
+    return rv;
+}
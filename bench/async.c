@@ -0,0 +1,167 @@
+/*
+ * Host post-processing overlapped with transfers. Every job writes its
+ * data to the device, reads it back and hashes the result on the host.
+ * The jobs run one by one, waiting for each read, and through the worker
+ * pool of common/async.c, which hashes a job as soon as its read completes
+ * while the next jobs are still being transferred.
+ */
+
+#define ASYNC_NUM_JOBS 16
+#define ASYNC_JOB_SIZE (1 << 20)
+#define ASYNC_NUM_THREADS 2
+
+struct async_bench_job
+{
+    cl_mem buf;
+    unsigned char* in_data;
+    unsigned char* out_data;
+    size_t size;
+    unsigned int expected;
+    unsigned int hash;
+    cl_int status;
+};
+
+struct async_bench
+{
+    struct async_pool pool;
+    struct async_bench_job jobs[ASYNC_NUM_JOBS];
+};
+
+static unsigned int
+async_hash(const unsigned char* data, size_t size)
+{
+    unsigned int hash = 2166136261u;
+    for(size_t i = 0; i < size; ++i)
+        hash = (hash ^ data[i]) * 16777619u;
+    return hash;
+}
+
+static void
+async_process(cl_event event, cl_int status, void* arg)
+{
+    struct async_bench_job* job = arg;
+    job->status = status;
+    job->hash = (CL_COMPLETE == status)
+        ? async_hash(job->out_data, job->size) : 0;
+}
+
+static cl_int
+async_enqueue_job(struct bench_env* env, struct async_bench_job* job,
+        cl_bool blocking, cl_event* event)
+{
+    cl_int rv = clEnqueueWriteBuffer(env->cmd_q, job->buf, CL_FALSE, 0,
+            job->size, job->in_data, 0, NULL, NULL);
+    if(CL_SUCCESS == rv)
+        rv = clEnqueueReadBuffer(env->cmd_q, job->buf, blocking, 0,
+                job->size, job->out_data, 0, NULL, event);
+    return rv;
+}
+
+static cl_int
+async_sync_once(struct bench_env* env, void* arg, double* device_us)
+{
+    cl_int rv = CL_SUCCESS;
+    struct async_bench* ab = arg;
+
+    for(int i = 0; i < ASYNC_NUM_JOBS && CL_SUCCESS == rv; ++i)
+    {
+        rv = async_enqueue_job(env, &ab->jobs[i], CL_TRUE, NULL);
+        if(CL_SUCCESS == rv)
+            async_process(NULL, CL_COMPLETE, &ab->jobs[i]);
+    }
+    return rv;
+}
+
+static cl_int
+async_pool_once(struct bench_env* env, void* arg, double* device_us)
+{
+    cl_int rv = CL_SUCCESS;
+    struct async_bench* ab = arg;
+
+    for(int i = 0; i < ASYNC_NUM_JOBS && CL_SUCCESS == rv; ++i)
+    {
+        cl_event event;
+        rv = async_enqueue_job(env, &ab->jobs[i], CL_FALSE, &event);
+        if(CL_SUCCESS != rv)
+            break;
+        rv = async_submit(&ab->pool, event, async_process, &ab->jobs[i]);
+        clReleaseEvent(event);
+        // start the transfers of this job while the next one is enqueued
+        if(CL_SUCCESS == rv)
+            rv = clFlush(env->cmd_q);
+    }
+    if(CL_SUCCESS != rv)
+        clFinish(env->cmd_q);
+    async_wait(&ab->pool);
+    return rv;
+}
+
+static cl_int
+async_check(struct async_bench* ab, const char* name)
+{
+    for(int i = 0; i < ASYNC_NUM_JOBS; ++i)
+    {
+        struct async_bench_job* job = &ab->jobs[i];
+        if(CL_COMPLETE != job->status || job->hash != job->expected)
+        {
+            fprintf(stderr, "%s: job %d hashed to %08X instead of %08X\n",
+                    name, i, job->hash, job->expected);
+            return CL_INVALID_VALUE;
+        }
+        job->hash = 0;
+    }
+    return CL_SUCCESS;
+}
+
+cl_int
+bench_async(struct bench_env* env)
+{
+    cl_int rv = CL_SUCCESS;
+    struct async_bench ab;
+    size_t job_size = (env->max_size < ASYNC_JOB_SIZE)
+        ? env->max_size : ASYNC_JOB_SIZE;
+    size_t bytes = 2 * ASYNC_NUM_JOBS * job_size;
+
+    memset(&ab, 0, sizeof(ab));
+    for(int i = 0; i < ASYNC_NUM_JOBS && CL_SUCCESS == rv; ++i)
+    {
+        struct async_bench_job* job = &ab.jobs[i];
+        job->size = job_size;
+        job->in_data = malloc(job_size);
+        job->out_data = malloc(job_size);
+        if(NULL == job->in_data || NULL == job->out_data)
+        {
+            rv = CL_OUT_OF_HOST_MEMORY;
+            break;
+        }
+        for(size_t j = 0; j < job_size; ++j)
+            job->in_data[j] = (unsigned char) ((i * job_size + j) * 0x9E37 >> 8);
+        job->expected = async_hash(job->in_data, job_size);
+        job->buf = clCreateBuffer(env->context, CL_MEM_READ_WRITE, job_size,
+                NULL, &rv);
+        if(CL_SUCCESS != rv)
+            print_cl_error("Failed to create a buffer object:", rv, stderr);
+    }
+    if(CL_SUCCESS == rv)
+        rv = async_init(&ab.pool, ASYNC_NUM_THREADS, ASYNC_NUM_JOBS);
+
+    if(CL_SUCCESS == rv)
+        rv = bench_measure(env, "async/sync", bytes, async_sync_once, &ab);
+    if(CL_SUCCESS == rv)
+        rv = async_check(&ab, "async/sync");
+    if(CL_SUCCESS == rv)
+        rv = bench_measure(env, "async/pool", bytes, async_pool_once, &ab);
+    if(CL_SUCCESS == rv)
+        rv = async_check(&ab, "async/pool");
+
+    if(NULL != ab.pool.threads)
+        async_release(&ab.pool);
+    for(int i = 0; i < ASYNC_NUM_JOBS; ++i)
+    {
+        if(NULL != ab.jobs[i].buf)
+            clReleaseMemObject(ab.jobs[i].buf);
+        free(ab.jobs[i].in_data);
+        free(ab.jobs[i].out_data);
+    }
+    return rv;
+}
@@ -0,0 +1,124 @@
+/*
+ * Bandwidth of blocking host<->device transfers (write, read, map/unmap)
+ * and of a copy between two device buffers over a sweep of buffer sizes
+ * growing four times a step.
+ */
+
+enum transfer_op
+{
+    OP_WRITE,
+    OP_READ,
+    OP_MAP,
+    OP_COPY
+};
+
+struct transfer_arg
+{
+    enum transfer_op op;
+    cl_mem buf_a;
+    cl_mem buf_b;
+    void* host_ptr;
+    size_t size;
+};
+
+static cl_int
+transfer_once(struct bench_env* env, void* arg, double* device_us)
+{
+    cl_int rv;
+    cl_event event, unmap_event;
+    struct transfer_arg* ta = arg;
+    void* mapped;
+
+    switch(ta->op)
+    {
+        case OP_WRITE:
+            rv = clEnqueueWriteBuffer(env->cmd_q, ta->buf_a, CL_TRUE, 0,
+                    ta->size, ta->host_ptr, 0, NULL, &event);
+            break;
+        case OP_READ:
+            rv = clEnqueueReadBuffer(env->cmd_q, ta->buf_a, CL_TRUE, 0,
+                    ta->size, ta->host_ptr, 0, NULL, &event);
+            break;
+        case OP_MAP:
+            mapped = clEnqueueMapBuffer(env->cmd_q, ta->buf_a, CL_TRUE,
+                    CL_MAP_READ | CL_MAP_WRITE, 0, ta->size, 0, NULL,
+                    &event, &rv);
+            if(CL_SUCCESS != rv)
+                return rv;
+            rv = clEnqueueUnmapMemObject(env->cmd_q, ta->buf_a, mapped,
+                    0, NULL, &unmap_event);
+            if(CL_SUCCESS != rv)
+            {
+                clReleaseEvent(event);
+                return rv;
+            }
+            rv = clWaitForEvents(1, &unmap_event);
+            if(CL_SUCCESS == rv)
+                *device_us = event_us(event, CL_PROFILING_COMMAND_START,
+                        CL_PROFILING_COMMAND_END)
+                    + event_us(unmap_event, CL_PROFILING_COMMAND_START,
+                        CL_PROFILING_COMMAND_END);
+            clReleaseEvent(unmap_event);
+            clReleaseEvent(event);
+            return rv;
+        case OP_COPY:
+        default:
+            rv = clEnqueueCopyBuffer(env->cmd_q, ta->buf_a, ta->buf_b, 0, 0,
+                    ta->size, 0, NULL, &event);
+            if(CL_SUCCESS == rv)
+                rv = clWaitForEvents(1, &event);
+            break;
+    }
+    if(CL_SUCCESS != rv)
+        return rv;
+
+    *device_us = event_us(event, CL_PROFILING_COMMAND_START,
+            CL_PROFILING_COMMAND_END);
+    clReleaseEvent(event);
+    return CL_SUCCESS;
+}
+
+cl_int
+bench_bandwidth(struct bench_env* env)
+{
+    static const char * const op_names[] = { "write", "read", "map", "copy" };
+    cl_int rv;
+    struct transfer_arg ta;
+    char name[STATS_NAME_SIZE], size_buf[16];
+
+    ta.host_ptr = malloc(env->max_size);
+    if(NULL == ta.host_ptr)
+        return CL_OUT_OF_HOST_MEMORY;
+    memset(ta.host_ptr, 0x5A, env->max_size);
+
+    ta.buf_b = NULL;
+    ta.buf_a = clCreateBuffer(env->context, CL_MEM_READ_WRITE, env->max_size,
+            NULL, &rv);
+    if(CL_SUCCESS == rv)
+        ta.buf_b = clCreateBuffer(env->context, CL_MEM_READ_WRITE,
+                env->max_size, NULL, &rv);
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Failed to create a buffer object:", rv, stderr);
+        if(NULL != ta.buf_a)
+            clReleaseMemObject(ta.buf_a);
+        free(ta.host_ptr);
+        return rv;
+    }
+
+    for(ta.size = env->min_size; ta.size <= env->max_size && CL_SUCCESS == rv;
+            ta.size *= 4)
+    {
+        for(ta.op = OP_WRITE; ta.op <= OP_COPY && CL_SUCCESS == rv; ++ta.op)
+        {
+            snprintf(name, sizeof(name), "%s/%s", op_names[ta.op],
+                    size_str(ta.size, size_buf, sizeof(size_buf)));
+            rv = bench_measure(env, name, ta.size, transfer_once, &ta);
+        }
+    }
+
+    clReleaseMemObject(ta.buf_a);
+    clReleaseMemObject(ta.buf_b);
+    free(ta.host_ptr);
+    return rv;
+}
@@ -0,0 +1,191 @@
+/*
+ * Throughput of many small launches of the scalar inout kernel
+ * (lab1/core.cl), each writing its own value into its own slot of one
+ * output buffer through a sub-buffer. The launches go one by one with a
+ * blocking read per result, as in task 2, and through common/batch.c on
+ * the in-order queue and on an out-of-order queue if the device has one.
+ */
+
+#define BATCH_NUM_LAUNCHES 64
+#define BATCH_FIRST_VALUE 0xF00D
+
+struct batch_env
+{
+    cl_kernel kernel;
+    cl_command_queue queue;     // the one launches go to
+    cl_mem buf_out;
+    cl_mem slots[BATCH_NUM_LAUNCHES];
+    size_t stride;              // bytes between the slots
+    unsigned char* results;
+    struct batch batch;
+};
+
+static cl_int
+batch_serial_once(struct bench_env* env, void* arg, double* device_us)
+{
+    cl_int rv = CL_SUCCESS;
+    struct batch_env* be = arg;
+
+    for(cl_int i = 0; i < BATCH_NUM_LAUNCHES && CL_SUCCESS == rv; ++i)
+    {
+        cl_int value = BATCH_FIRST_VALUE + i;
+        rv  = clSetKernelArg(be->kernel, 0, sizeof(cl_mem), &be->slots[i]);
+        rv |= clSetKernelArg(be->kernel, 1, sizeof(cl_int), &value);
+        if(CL_SUCCESS == rv)
+            rv = clEnqueueTask(be->queue, be->kernel, 0, NULL, NULL);
+    }
+    if(CL_SUCCESS == rv)
+        rv = clFinish(be->queue);
+    for(int i = 0; i < BATCH_NUM_LAUNCHES && CL_SUCCESS == rv; ++i)
+        rv = clEnqueueReadBuffer(be->queue, be->slots[i], CL_TRUE, 0,
+                sizeof(cl_int), be->results + i * be->stride, 0, NULL, NULL);
+    return rv;
+}
+
+static cl_int
+batch_submit_once(struct bench_env* env, void* arg, double* device_us)
+{
+    cl_int rv = CL_SUCCESS;
+    struct batch_env* be = arg;
+    cl_event done;
+
+    for(cl_int i = 0; i < BATCH_NUM_LAUNCHES && CL_SUCCESS == rv; ++i)
+    {
+        size_t index;
+        cl_int value = BATCH_FIRST_VALUE + i;
+        rv = batch_launch(&be->batch, be->kernel, 0, 0, &index);
+        if(CL_SUCCESS == rv)
+            rv = batch_arg(&be->batch, index, 0, sizeof(cl_mem),
+                    &be->slots[i]);
+        if(CL_SUCCESS == rv)
+            rv = batch_arg(&be->batch, index, 1, sizeof(cl_int), &value);
+    }
+    if(CL_SUCCESS == rv)
+        rv = batch_read(&be->batch, be->buf_out, 0,
+                BATCH_NUM_LAUNCHES * be->stride, be->results);
+    if(CL_SUCCESS != rv)
+    {
+        batch_clear(&be->batch);
+        return rv;
+    }
+    if(CL_SUCCESS != (rv = batch_submit(&be->batch, be->queue, &done)))
+        return rv;
+    rv = clWaitForEvents(1, &done);
+    clReleaseEvent(done);
+    return rv;
+}
+
+/**
+ * Run once more with cleared results and check every slot.
+ */
+static cl_int
+batch_verify(struct bench_env* env, struct batch_env* be, bench_fn fn,
+        const char* name)
+{
+    cl_int rv;
+    double device_us;
+
+    memset(be->results, 0, BATCH_NUM_LAUNCHES * be->stride);
+    if(CL_SUCCESS != (rv = fn(env, be, &device_us)))
+        return rv;
+    for(int i = 0; i < BATCH_NUM_LAUNCHES; ++i)
+    {
+        cl_int value;
+        memcpy(&value, be->results + i * be->stride, sizeof(value));
+        if(BATCH_FIRST_VALUE + i != value)
+        {
+            fprintf(stderr, "%s: slot %d holds %X instead of %X\n", name, i,
+                    value, BATCH_FIRST_VALUE + i);
+            return CL_INVALID_VALUE;
+        }
+    }
+    return CL_SUCCESS;
+}
+
+static cl_int
+batch_run(struct bench_env* env, struct batch_env* be, bench_fn fn,
+        const char* name)
+{
+    cl_int rv = bench_measure(env, name, 0, fn, be);
+    if(CL_SUCCESS == rv)
+        rv = batch_verify(env, be, fn, name);
+    return rv;
+}
+
+cl_int
+bench_batch(struct bench_env* env)
+{
+    cl_int rv;
+    cl_program program;
+    cl_uint align_bits = env->caps->mem_base_addr_align;
+    cl_command_queue ooo_q = NULL;
+    int out_of_order = 0;
+    struct batch_env be;
+
+    memset(&be, 0, sizeof(be));
+    batch_init(&be.batch);
+    // sub-buffers must start at a multiple of the base address alignment
+    be.stride = (align_bits / 8 > sizeof(cl_int)) ? align_bits / 8
+        : sizeof(cl_int);
+
+    rv = build_program(&program, &env->context, &env->device,
+            env->kernel_file_name);
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Failed to build a program:", rv, stderr);
+        return rv;
+    }
+    be.kernel = clCreateKernel(program, "inout", &rv);
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Failed to create a kernel object:", rv, stderr);
+        clReleaseProgram(program);
+        return rv;
+    }
+
+    be.results = malloc(BATCH_NUM_LAUNCHES * be.stride);
+    if(NULL == be.results)
+        rv = CL_OUT_OF_HOST_MEMORY;
+    if(CL_SUCCESS == rv)
+        be.buf_out = clCreateBuffer(env->context, CL_MEM_WRITE_ONLY,
+                BATCH_NUM_LAUNCHES * be.stride, NULL, &rv);
+    for(int i = 0; i < BATCH_NUM_LAUNCHES && CL_SUCCESS == rv; ++i)
+    {
+        cl_buffer_region region = { i * be.stride, sizeof(cl_int) };
+        be.slots[i] = clCreateSubBuffer(be.buf_out, CL_MEM_WRITE_ONLY,
+                CL_BUFFER_CREATE_TYPE_REGION, &region, &rv);
+    }
+    if(CL_SUCCESS != rv)
+        print_cl_error("Failed to create a buffer object:", rv, stderr);
+
+    if(CL_SUCCESS == rv)
+    {
+        be.queue = env->cmd_q;
+        rv = batch_run(env, &be, batch_serial_once, "batch/serial");
+    }
+    if(CL_SUCCESS == rv)
+        rv = batch_run(env, &be, batch_submit_once, "batch/in-order");
+    if(CL_SUCCESS == rv)
+        rv = batch_create_queue(env->context, env->device, &ooo_q,
+                &out_of_order);
+    if(CL_SUCCESS == rv && out_of_order)
+    {
+        be.queue = ooo_q;
+        rv = batch_run(env, &be, batch_submit_once, "batch/out-of-order");
+    }
+    else if(CL_SUCCESS == rv)
+        puts("The device has no out-of-order queues, skipping them");
+
+    if(NULL != ooo_q)
+        clReleaseCommandQueue(ooo_q);
+    for(int i = 0; i < BATCH_NUM_LAUNCHES; ++i)
+        if(NULL != be.slots[i])
+            clReleaseMemObject(be.slots[i]);
+    if(NULL != be.buf_out)
+        clReleaseMemObject(be.buf_out);
+    free(be.results);
+    batch_free(&be.batch);
+    clReleaseKernel(be.kernel);
+    clReleaseProgram(program);
+    return rv;
+}
@@ -0,0 +1,145 @@
+/*
+ * Compressed transfers (common/codec.c) over the largest buffer size: ints
+ * are written to the device, add_value runs on them and they are read
+ * back, plain, compressed and as the auto policy decides. Smooth data
+ * packs into a few bits per int, random data doesn't pack at all and
+ * shows what the attempt costs. The round trip is checked after every
+ * measurement. The program comes from codec.cl (lab1/codec.cl copied to
+ * the build directory) or codec.aocx on accelerators.
+ */
+
+#define CODEC_BINARY_FILE_NAME "codec.aocx"
+#define CODEC_SOURCE_FILE_NAME "codec.cl"
+
+struct codec_arg
+{
+    struct codec_device cd;
+    struct codec_policy write_policy;
+    struct codec_policy read_policy;
+    cl_kernel add;
+    cl_mem buffer;
+    size_t count;
+    cl_int* data;
+    cl_int* result;
+};
+
+static cl_int
+codec_round_trip(struct bench_env* env, void* arg, double* device_us)
+{
+    struct codec_arg* ca = arg;
+    cl_int rv = codec_write(&ca->cd, &ca->write_policy, ca->buffer, ca->data,
+            ca->count);
+    if(CL_SUCCESS == rv)
+        rv = clEnqueueNDRangeKernel(ca->cd.queue, ca->add, 1, NULL,
+                &ca->count, NULL, 0, NULL, NULL);
+    if(CL_SUCCESS == rv)
+        rv = codec_read(&ca->cd, &ca->read_policy, ca->buffer, ca->result,
+                ca->count);
+    return rv;
+}
+
+static cl_int
+codec_measure(struct bench_env* env, struct codec_arg* ca,
+        const char* pattern, enum codec_mode mode)
+{
+    char name[STATS_NAME_SIZE];
+    const struct stats_result* r;
+    cl_int rv;
+
+    codec_policy_init(&ca->write_policy, mode);
+    codec_policy_init(&ca->read_policy, mode);
+    snprintf(name, sizeof(name), "codec/%s_%s", pattern,
+            codec_mode_str(mode));
+    rv = bench_measure(env, name, 2 * ca->count * sizeof(cl_int),
+            codec_round_trip, ca);
+    if(CL_SUCCESS != rv)
+    {
+        fprintf(stderr, "%s failed: %s\n", name, cl_error_str(rv));
+        return rv;
+    }
+    for(size_t i = 0; i < ca->count; ++i)
+    {
+        cl_int expected = (cl_int) ((cl_uint) ca->data[i] + 1);
+        if(ca->result[i] != expected)
+        {
+            fprintf(stderr, "%s: int %zu is %d instead of %d\n", name, i,
+                    ca->result[i], expected);
+            return CL_INVALID_VALUE;
+        }
+    }
+    if(NULL != (r = bench_host_result(env, name)))
+        printf("%s: OK, %.1f MB/s, ratio %.2f\n", name, stats_bandwidth(r),
+                ca->write_policy.ratio);
+    fputs("\twrite ", stdout);
+    codec_print_policy(&ca->write_policy, stdout);
+    fputs("\tread  ", stdout);
+    codec_print_policy(&ca->read_policy, stdout);
+    return CL_SUCCESS;
+}
+
+cl_int
+bench_codec(struct bench_env* env)
+{
+    cl_int rv;
+    cl_program program;
+    struct codec_arg ca;
+    cl_int one = 1;
+    size_t data_size = env->max_size / sizeof(cl_int) * sizeof(cl_int);
+    const char* patterns[] = { "smooth", "random" };
+
+    memset(&ca, 0, sizeof(ca));
+    ca.count = data_size / sizeof(cl_int);
+    rv = build_program(&program, &env->context, &env->device,
+            (CL_DEVICE_TYPE_ACCELERATOR & env->type)
+            ? CODEC_BINARY_FILE_NAME : CODEC_SOURCE_FILE_NAME);
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Failed to build a program:", rv, stderr);
+        return rv;
+    }
+    if(0 == ca.count)
+        rv = CL_INVALID_BUFFER_SIZE;
+    if(CL_SUCCESS == rv)
+        rv = codec_device_init(&ca.cd, env->context, env->cmd_q, program,
+                ca.count);
+    if(CL_SUCCESS == rv)
+        ca.add = clCreateKernel(program, "add_value", &rv);
+    if(CL_SUCCESS == rv)
+        rv = clSetKernelArg(ca.add, 1, sizeof(cl_int), &one);
+    if(CL_SUCCESS == rv)
+        ca.buffer = clCreateBuffer(env->context, CL_MEM_READ_WRITE,
+                data_size, NULL, &rv);
+    if(CL_SUCCESS == rv)
+        rv = clSetKernelArg(ca.add, 0, sizeof(cl_mem), &ca.buffer);
+    ca.data = malloc(data_size);
+    ca.result = malloc(data_size);
+    if(CL_SUCCESS == rv && (NULL == ca.data || NULL == ca.result))
+        rv = CL_OUT_OF_HOST_MEMORY;
+    if(CL_SUCCESS == rv)
+        printf("Compressed round trips of %zu ints, blocks of %d\n",
+                ca.count, CODEC_BLOCK);
+
+    for(int p = 0; p < 2 && CL_SUCCESS == rv; ++p)
+    {
+        cl_uint seed = 12345;
+        for(size_t i = 0; i < ca.count; ++i)
+        {
+            seed = seed * 1664525u + 1013904223u;
+            // a slow ramp with a little noise, or all 32 bits random
+            ca.data[i] = (0 == p) ? (cl_int) (i / 4 + (seed >> 29))
+                : (cl_int) seed;
+        }
+        for(int m = CODEC_AUTO; m < CODEC_NUM_MODES && CL_SUCCESS == rv; ++m)
+            rv = codec_measure(env, &ca, patterns[p], m);
+    }
+
+    if(NULL != ca.buffer)
+        clReleaseMemObject(ca.buffer);
+    if(NULL != ca.add)
+        clReleaseKernel(ca.add);
+    free(ca.data);
+    free(ca.result);
+    codec_device_release(&ca.cd);
+    clReleaseProgram(program);
+    return rv;
+}
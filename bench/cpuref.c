@@ -0,0 +1,138 @@
+/*
+ * When offloading pays off: a copy of a buffer on the host with the CPU
+ * reference of common/cpuref.c against the same copy on the device with
+ * the transfers to it and back (write, copy between device buffers, read).
+ * The output of every device run is checked against the reference. After
+ * the sweep the suite reports the smallest size at which the device wins.
+ */
+
+struct cpuref_arg
+{
+    struct cpuref ref;
+    cl_mem buf_in;
+    cl_mem buf_out;
+    cl_int* in;
+    cl_int* out;
+    cl_int* expected;
+    size_t size;
+};
+
+static cl_int
+cpuref_host_once(struct bench_env* env, void* arg, double* device_us)
+{
+    struct cpuref_arg* ca = arg;
+    ca->ref.copy(ca->expected, ca->in, ca->size / sizeof(cl_int));
+    return CL_SUCCESS;
+}
+
+static cl_int
+cpuref_device_once(struct bench_env* env, void* arg, double* device_us)
+{
+    cl_int rv;
+    struct cpuref_arg* ca = arg;
+    size_t count = ca->size / sizeof(cl_int);
+
+    rv = clEnqueueWriteBuffer(env->cmd_q, ca->buf_in, CL_FALSE, 0, ca->size,
+            ca->in, 0, NULL, NULL);
+    if(CL_SUCCESS == rv)
+        rv = clEnqueueCopyBuffer(env->cmd_q, ca->buf_in, ca->buf_out, 0, 0,
+                ca->size, 0, NULL, NULL);
+    if(CL_SUCCESS == rv)
+        rv = clEnqueueReadBuffer(env->cmd_q, ca->buf_out, CL_TRUE, 0,
+                ca->size, ca->out, 0, NULL, NULL);
+    if(CL_SUCCESS != rv)
+        return rv;
+
+    size_t i = cpuref_diff(ca->out, ca->expected, count);
+    if(i != count)
+    {
+        fprintf(stderr, "Device result differs from the reference at %zu: "
+                "%X != %X\n", i, ca->out[i], ca->expected[i]);
+        return CL_INVALID_VALUE;
+    }
+    return CL_SUCCESS;
+}
+
+static double
+cpuref_median(const struct bench_env* env, const char* name)
+{
+    const struct stats_result* r = bench_host_result(env, name);
+    return (NULL != r) ? r->summary.median : -1.0;
+}
+
+cl_int
+bench_cpuref(struct bench_env* env)
+{
+    cl_int rv;
+    struct cpuref_arg ca;
+    char name[STATS_NAME_SIZE], size_buf[16];
+    size_t crossover = 0, largest = 0;
+
+    memset(&ca, 0, sizeof(ca));
+    cpuref_init(&ca.ref);
+    ca.in = malloc(env->max_size);
+    ca.out = malloc(env->max_size);
+    ca.expected = malloc(env->max_size);
+    if(NULL == ca.in || NULL == ca.out || NULL == ca.expected)
+    {
+        rv = CL_OUT_OF_HOST_MEMORY;
+        goto out;
+    }
+    for(size_t i = 0; i < env->max_size / sizeof(cl_int); ++i)
+        ca.in[i] = (cl_int) (i * 2654435761u);
+
+    ca.buf_in = clCreateBuffer(env->context, CL_MEM_READ_ONLY, env->max_size,
+            NULL, &rv);
+    if(CL_SUCCESS == rv)
+        ca.buf_out = clCreateBuffer(env->context, CL_MEM_READ_WRITE,
+                env->max_size, NULL, &rv);
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Failed to create a buffer object:", rv, stderr);
+        goto out;
+    }
+
+    printf("CPU reference: %s\n", cpuref_isa_str(ca.ref.isa));
+    for(ca.size = env->min_size; ca.size <= env->max_size && CL_SUCCESS == rv;
+            ca.size *= 4)
+    {
+        double host_us, device_us;
+        size_str(ca.size, size_buf, sizeof(size_buf));
+
+        // the host run goes first, it produces the expected output
+        snprintf(name, sizeof(name), "cpuref/%s/%s",
+                cpuref_isa_str(ca.ref.isa), size_buf);
+        rv = bench_measure(env, name, ca.size, cpuref_host_once, &ca);
+        host_us = cpuref_median(env, name);
+        if(CL_SUCCESS != rv)
+            break;
+        snprintf(name, sizeof(name), "cpuref/device/%s", size_buf);
+        rv = bench_measure(env, name, ca.size, cpuref_device_once, &ca);
+        device_us = cpuref_median(env, name);
+        largest = ca.size;
+
+        if(CL_SUCCESS == rv && 0 == crossover && device_us >= 0.0
+                && device_us < host_us)
+            crossover = ca.size;
+    }
+
+    if(CL_SUCCESS == rv)
+    {
+        if(0 != crossover)
+            printf("The device beats the CPU from %s on\n",
+                    size_str(crossover, size_buf, sizeof(size_buf)));
+        else
+            printf("The CPU is faster up to %s\n",
+                    size_str(largest, size_buf, sizeof(size_buf)));
+    }
+
+out:
+    if(NULL != ca.buf_in)
+        clReleaseMemObject(ca.buf_in);
+    if(NULL != ca.buf_out)
+        clReleaseMemObject(ca.buf_out);
+    free(ca.in);
+    free(ca.out);
+    free(ca.expected);
+    return rv;
+}
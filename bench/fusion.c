@@ -0,0 +1,233 @@
+/*
+ * Kernel fusion (common/fusion.c): a chain of element-wise stages over
+ * the largest buffer size of floats, map x * x, scale, clamp and convert
+ * to uchar, runs as one generated kernel and as a generated kernel per
+ * stage with buffers between them. The suite reports the chain runs and
+ * kernel launches per second and the bytes moved in global memory per
+ * run, and checks both against the chain computed on the host. On
+ * accelerators the programs are the binaries compiled offline from the
+ * generated sources.
+ */
+
+#define FUSION_MAX_LAUNCHES FUSION_MAX_STAGES
+#define FUSION_TOLERANCE 1      // the host may contract x * x * 0.25 + 16
+
+struct fusion_arg
+{
+    struct fusion_chain chain;
+    cl_program fused;
+    cl_program unfused;
+    cl_kernel kernels[FUSION_MAX_LAUNCHES];
+    size_t num_kernels;
+    cl_mem in;
+    cl_mem links[FUSION_MAX_LAUNCHES];  // the output of every stage
+    cl_mem out;
+    cl_uint count;
+};
+
+static cl_int
+fusion_once(struct bench_env* env, void* arg, double* device_us)
+{
+    struct fusion_arg* fa = arg;
+    size_t global_size = fa->count;
+    cl_int rv = CL_SUCCESS;
+
+    for(size_t k = 0; k < fa->num_kernels && CL_SUCCESS == rv; ++k)
+        rv = clEnqueueNDRangeKernel(env->cmd_q, fa->kernels[k], 1, NULL,
+                &global_size, NULL, 0, NULL, NULL);
+    if(CL_SUCCESS == rv)
+        rv = clFinish(env->cmd_q);
+    return rv;
+}
+
+static void
+fusion_release_kernels(struct fusion_arg* fa)
+{
+    for(size_t k = 0; k < fa->num_kernels; ++k)
+        clReleaseKernel(fa->kernels[k]);
+    fa->num_kernels = 0;
+}
+
+/**
+ * Create the kernels of the fused or the unfused program and link them
+ * from the input buffer to the output one.
+ */
+static cl_int
+fusion_setup(struct bench_env* env, struct fusion_arg* fa, int fused)
+{
+    cl_int rv = CL_SUCCESS;
+    size_t n = fused ? 1 : fa->chain.count;
+    char name[FUSION_NAME_SIZE];
+
+    for(size_t k = 0; k < n && CL_SUCCESS == rv; ++k)
+    {
+        const struct fusion_stage* s = &fa->chain.stages[k];
+        cl_mem* in = (0 == k) ? &fa->in : &fa->links[k - 1];
+        if(k + 1 < n && NULL == fa->links[k])
+            fa->links[k] = clCreateBuffer(env->context, CL_MEM_READ_WRITE,
+                    fa->count * fusion_type_size(s->out_type), NULL, &rv);
+        snprintf(name, sizeof(name), "stage%zu", k);
+        if(CL_SUCCESS == rv)
+            fa->kernels[k] = clCreateKernel(fused ? fa->fused : fa->unfused,
+                    fused ? "fused" : name, &rv);
+        if(CL_SUCCESS != rv)
+            break;
+        fa->num_kernels = k + 1;
+        rv  = clSetKernelArg(fa->kernels[k], 0, sizeof(cl_mem),
+                (k + 1 < n) ? &fa->links[k] : &fa->out);
+        rv |= clSetKernelArg(fa->kernels[k], 1, sizeof(cl_mem), in);
+        rv |= clSetKernelArg(fa->kernels[k], 2, sizeof(cl_uint), &fa->count);
+    }
+    if(CL_SUCCESS != rv)
+        print_cl_error("Failed to set up the chain:", rv, stderr);
+    return rv;
+}
+
+static cl_int
+fusion_measure(struct bench_env* env, struct fusion_arg* fa, int fused,
+        unsigned char* result)
+{
+    const char* name = fused ? "fusion/fused" : "fusion/unfused";
+    const struct stats_result* r;
+    size_t bytes = 0;
+    cl_int rv = fusion_setup(env, fa, fused);
+
+    if(CL_SUCCESS == rv)
+    {
+        for(size_t k = 0; k < fa->num_kernels; ++k)
+            bytes += fused ? fusion_bytes(&fa->chain, 0, fa->chain.count,
+                    fa->count) : fusion_bytes(&fa->chain, k, k + 1, fa->count);
+        rv = bench_measure(env, name, bytes, fusion_once, fa);
+    }
+    if(CL_SUCCESS == rv)
+        rv = clEnqueueReadBuffer(env->cmd_q, fa->out, CL_TRUE, 0, fa->count,
+                result, 0, NULL, NULL);
+    if(CL_SUCCESS == rv && NULL != (r = bench_host_result(env, name)))
+        printf("%s: %zu launch(es) per run, %.1f runs/s, %.1f launches/s, "
+                "%zu KiB moved per run, %.1f MB/s\n", name, fa->num_kernels,
+                1e6 / r->summary.median, 1e6 * fa->num_kernels
+                / r->summary.median, bytes >> 10, stats_bandwidth(r));
+    fusion_release_kernels(fa);
+    return rv;
+}
+
+/* The chain of bench_fusion() on the host */
+static unsigned char
+fusion_reference(cl_float x)
+{
+    float v = x * x * 0.25f + 16.0f;
+    if(v < 0.0f)
+        v = 0.0f;
+    if(v > 255.0f)
+        v = 255.0f;
+    return (unsigned char) rintf(v);
+}
+
+static cl_int
+fusion_check(const char* name, const unsigned char* result,
+        const cl_float* data, cl_uint count)
+{
+    for(cl_uint i = 0; i < count; ++i)
+    {
+        int expected = fusion_reference(data[i]);
+        if(abs(result[i] - expected) > FUSION_TOLERANCE)
+        {
+            fprintf(stderr, "%s: element %u is %u instead of %d\n", name, i,
+                    result[i], expected);
+            return CL_INVALID_VALUE;
+        }
+    }
+    return CL_SUCCESS;
+}
+
+cl_int
+bench_fusion(struct bench_env* env)
+{
+    cl_int rv;
+    struct fusion_arg fa;
+    cl_float* data = NULL;
+    unsigned char* fused_result = NULL;
+    unsigned char* unfused_result = NULL;
+
+    memset(&fa, 0, sizeof(fa));
+    fa.count = env->max_size / sizeof(cl_float);
+    rv = fusion_init(&fa.chain, "float");
+    if(CL_SUCCESS == rv)
+        rv = fusion_map(&fa.chain, "x * x");
+    if(CL_SUCCESS == rv)
+        rv = fusion_scale(&fa.chain, 0.25f, 16.0f);
+    if(CL_SUCCESS == rv)
+        rv = fusion_clamp(&fa.chain, 0.0f, 255.0f);
+    if(CL_SUCCESS == rv)
+        rv = fusion_convert(&fa.chain, "uchar");
+    if(CL_SUCCESS == rv && 0 == fa.count)
+        rv = CL_INVALID_BUFFER_SIZE;
+    if(CL_SUCCESS == rv)
+        rv = fusion_build(&fa.chain, 1, env->context, env->device, &fa.fused);
+    if(CL_SUCCESS == rv)
+        rv = fusion_build(&fa.chain, 0, env->context, env->device,
+                &fa.unfused);
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Failed to build the chain:", rv, stderr);
+        if(NULL != fa.fused)
+            clReleaseProgram(fa.fused);
+        return rv;
+    }
+
+    data = malloc(fa.count * sizeof(cl_float));
+    fused_result = malloc(fa.count);
+    unfused_result = malloc(fa.count);
+    if(NULL == data || NULL == fused_result || NULL == unfused_result)
+        rv = CL_OUT_OF_HOST_MEMORY;
+    if(CL_SUCCESS == rv)
+        fa.in = clCreateBuffer(env->context, CL_MEM_READ_ONLY,
+                fa.count * sizeof(cl_float), NULL, &rv);
+    if(CL_SUCCESS == rv)
+        fa.out = clCreateBuffer(env->context, CL_MEM_WRITE_ONLY, fa.count,
+                NULL, &rv);
+    if(CL_SUCCESS == rv)
+    {
+        // about a third of the elements end up above 255 before clamping
+        for(cl_uint i = 0; i < fa.count; ++i)
+            data[i] = (cl_float) (i % 97) - 48.5f;
+        rv = clEnqueueWriteBuffer(env->cmd_q, fa.in, CL_TRUE, 0,
+                fa.count * sizeof(cl_float), data, 0, NULL, NULL);
+    }
+    if(CL_SUCCESS == rv)
+        printf("A chain of %zu stages over %u floats\n", fa.chain.count,
+                fa.count);
+
+    if(CL_SUCCESS == rv)
+        rv = fusion_measure(env, &fa, 0, unfused_result);
+    if(CL_SUCCESS == rv)
+        rv = fusion_measure(env, &fa, 1, fused_result);
+    if(CL_SUCCESS == rv)
+        rv = fusion_check("fusion/unfused", unfused_result, data, fa.count);
+    if(CL_SUCCESS == rv)
+        rv = fusion_check("fusion/fused", fused_result, data, fa.count);
+    for(cl_uint i = 0; i < fa.count && CL_SUCCESS == rv; ++i)
+    {
+        if(fused_result[i] != unfused_result[i])
+        {
+            fprintf(stderr, "Element %u is %u fused and %u unfused\n", i,
+                    fused_result[i], unfused_result[i]);
+            rv = CL_INVALID_VALUE;
+        }
+    }
+
+    fusion_release_kernels(&fa);
+    for(size_t k = 0; k < FUSION_MAX_LAUNCHES; ++k)
+        if(NULL != fa.links[k])
+            clReleaseMemObject(fa.links[k]);
+    if(NULL != fa.in)
+        clReleaseMemObject(fa.in);
+    if(NULL != fa.out)
+        clReleaseMemObject(fa.out);
+    clReleaseProgram(fa.fused);
+    clReleaseProgram(fa.unfused);
+    free(data);
+    free(fused_result);
+    free(unfused_result);
+    return rv;
+}
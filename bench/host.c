@@ -0,0 +1,365 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "CL/opencl.h"
+
+#include "../common/errorcodes.c"
+#include "../common/utils.c"
+#include "../common/stats.c"
+#include "../common/xfer.c"
+#include "../common/batch.c"
+#include "../common/async.c"
+#include "../common/caps.c"
+#include "../common/cpuref.c"
+#include "../common/arena.c"
+#include "../common/workers.c"
+#include "../common/primitives.c"
+#include "../common/codec.c"
+#include "../common/segbuf.c"
+#include "../common/fusion.c"
+
+#define BINARY_FILE_NAME "lab1.aocx"
+#define SOURCE_FILE_NAME "bench.cl"
+#define NUM_WARMUP 10
+#define NUM_REPETITIONS 100
+#define MIN_SIZE (4 << 10)
+#define MAX_SIZE (16 << 20)
+#define THRESHOLD 5.0 // percent
+
+/* Everything a benchmark suite needs */
+struct bench_env
+{
+    cl_device_id device;
+    cl_device_type type;
+    const struct device_caps* caps; // from the cache written by lab0
+    cl_context context;
+    cl_command_queue cmd_q;     // in-order, with profiling enabled
+    const char* kernel_file_name;
+    int num_warmup;
+    int num_repetitions;
+    size_t min_size;
+    size_t max_size;
+    enum xfer_mode xfer_mode;   // XFER_UNSET runs all the modes
+    struct stats_report report;
+};
+
+/*
+ * A single run of a measured operation. It must finish the operation before
+ * returning and may set device_us to the time the device reports for it.
+ */
+typedef cl_int (*bench_fn)(struct bench_env* env, void* arg,
+        double* device_us);
+
+/**
+ * Warm up and then repeatedly run an operation. The host time of every run
+ * goes to the result "<name>/host", the device time, if the operation
+ * reports it, to "<name>/device".
+ */
+cl_int
+bench_measure(struct bench_env* env, const char* name, size_t bytes,
+        bench_fn fn, void* arg)
+{
+    cl_int rv = CL_SUCCESS;
+    char result_name[STATS_NAME_SIZE];
+    int n = env->num_repetitions;
+    double* host = malloc(n * sizeof(double));
+    double* device = malloc(n * sizeof(double));
+    int num_device = 0;
+
+    if(NULL == host || NULL == device)
+    {
+        free(host);
+        free(device);
+        return CL_OUT_OF_HOST_MEMORY;
+    }
+
+    for(int i = 0; i < env->num_warmup && CL_SUCCESS == rv; ++i)
+    {
+        double device_us = -1.0;
+        rv = fn(env, arg, &device_us);
+    }
+    for(int i = 0; i < n && CL_SUCCESS == rv; ++i)
+    {
+        double device_us = -1.0;
+        double start = stats_now();
+        rv = fn(env, arg, &device_us);
+        host[i] = (stats_now() - start) * 1e6;
+        if(device_us >= 0.0)
+            device[num_device++] = device_us;
+    }
+
+    if(CL_SUCCESS == rv)
+    {
+        snprintf(result_name, sizeof(result_name), "%s/host", name);
+        stats_add(&env->report, result_name, bytes, host, n);
+        if(num_device == n)
+        {
+            snprintf(result_name, sizeof(result_name), "%s/device", name);
+            stats_add(&env->report, result_name, bytes, device, n);
+        }
+    }
+    else
+    {
+        snprintf(result_name, sizeof(result_name), "%s:", name);
+        print_cl_error(result_name, rv, stderr);
+    }
+    free(host);
+    free(device);
+    return rv;
+}
+
+/**
+ * The host times bench_measure() recorded for name, NULL if there are none.
+ */
+const struct stats_result*
+bench_host_result(const struct bench_env* env, const char* name)
+{
+    char result_name[STATS_NAME_SIZE];
+
+    // a name too long for a result was cut the same way when recorded
+    if(snprintf(result_name, sizeof(result_name), "%s/host", name) < 0)
+        return NULL;
+    return stats_find(&env->report, result_name);
+}
+
+/**
+ * Microseconds between two profiling points of a completed command.
+ */
+double
+event_us(cl_event event, cl_profiling_info from, cl_profiling_info to)
+{
+    cl_ulong t0 = 0, t1 = 0;
+    clGetEventProfilingInfo(event, from, sizeof(t0), &t0, NULL);
+    clGetEventProfilingInfo(event, to, sizeof(t1), &t1, NULL);
+    return (t1 - t0) / 1e3;
+}
+
+/**
+ * Human-readable size for the result names, e.g. 4KiB or 16MiB.
+ */
+const char*
+size_str(size_t size, char* buf, size_t buf_size)
+{
+    if(0 == size % (1 << 20))
+        snprintf(buf, buf_size, "%zuMiB", size >> 20);
+    else if(0 == size % (1 << 10))
+        snprintf(buf, buf_size, "%zuKiB", size >> 10);
+    else
+        snprintf(buf, buf_size, "%zuB", size);
+    return buf;
+}
+
+#include "latency.c"
+#include "bandwidth.c"
+#include "xfer.c"
+#include "batch.c"
+#include "async.c"
+#include "cpuref.c"
+#include "arena.c"
+#include "threads.c"
+#include "primitives.c"
+#include "codec.c"
+#include "segments.c"
+#include "fusion.c"
+
+struct bench_suite
+{
+    const char* name;
+    cl_int (*run)(struct bench_env* env);
+    const char* description;
+};
+
+static const struct bench_suite g_suites[] = {
+    { "latency", bench_latency,
+        "clEnqueueTask vs clEnqueueNDRangeKernel launch of inout" },
+    { "bandwidth", bench_bandwidth,
+        "host<->device read, write, map and device copy over buffer sizes" },
+    { "xfer", bench_xfer,
+        "host<->device transfers with copies vs mapped host memory" },
+    { "batch", bench_batch,
+        "64 small launches one by one vs batched, in-order and out-of-order" },
+    { "async", bench_async,
+        "host hashing of results after each read vs on a worker pool" },
+    { "cpuref", bench_cpuref,
+        "copy on the CPU reference vs on the device, the crossover size" },
+    { "arena", bench_arena,
+        "a buffer per element created per job vs taken from an arena" },
+    { "threads", bench_threads,
+        "jobs/s of independent jobs on 1 to 8 host threads" },
+    { "primitives", bench_primitives,
+        "reduction, scan and histogram in local memory, checked, in GB/s" },
+    { "codec", bench_codec,
+        "round trips plain vs delta-compressed vs auto, smooth and random" },
+    { "segments", bench_segments,
+        "a buffer beyond the allocation limit split into 4 to 16 segments" },
+    { "fusion", bench_fusion,
+        "a generated fused kernel vs a kernel per stage, launches and bytes" },
+};
+
+#define NUM_SUITES (sizeof(g_suites) / sizeof(g_suites[0]))
+
+void
+usage(const char* prog)
+{
+    fprintf(stderr, "Usage: %s [options]\n"
+            "\t-d <selector>  device to run on (see common/devices.c)\n"
+            "\t-k <file>      kernel file, %s or %s by default\n"
+            "\t-s <suites>    comma-separated suites to run, all by default\n"
+            "\t-w <n>         warm-up runs (%d)\n"
+            "\t-r <n>         measured runs (%d)\n"
+            "\t-m <bytes>     smallest buffer size (%d)\n"
+            "\t-M <bytes>     largest buffer size (%d)\n"
+            "\t-o <file>      save the results as JSON\n"
+            "\t-b <file>      compare with the results saved before\n"
+            "\t-T <percent>   slowdown treated as a regression (%.0f)\n"
+            "\t-x <mode>      transfer mode for xfer: copy, alloc, use or all\n"
+            "\t               (OCL_XFER)\n"
+            "\t-C <mode>      program cache mode: on, off, refresh, clear\n"
+            "Suites:\n", prog, BINARY_FILE_NAME, SOURCE_FILE_NAME,
+            NUM_WARMUP, NUM_REPETITIONS, MIN_SIZE, MAX_SIZE, THRESHOLD);
+    for(size_t i = 0; i < NUM_SUITES; ++i)
+        fprintf(stderr, "\t%-12s %s\n", g_suites[i].name,
+                g_suites[i].description);
+}
+
+int
+suite_selected(const char* suites, const char* name)
+{
+    size_t len = strlen(name);
+    if(NULL == suites)
+        return 1;
+    for(const char* p = suites; NULL != p; p = strchr(p, ','))
+    {
+        if(',' == *p)
+            ++p;
+        if(0 == strncmp(p, name, len) && (',' == p[len] || '\0' == p[len]))
+            return 1;
+    }
+    return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+    cl_int rv;
+    struct bench_env env;
+    const char* selector = NULL;
+    const char* suites = NULL;
+    const char* output = NULL;
+    const char* baseline_file = NULL;
+    double threshold = THRESHOLD;
+    int opt;
+
+    memset(&env, 0, sizeof(env));
+    env.num_warmup = NUM_WARMUP;
+    env.num_repetitions = NUM_REPETITIONS;
+    env.min_size = MIN_SIZE;
+    env.max_size = MAX_SIZE;
+    env.xfer_mode = (NULL != getenv("OCL_XFER")) ? xfer_mode() : XFER_UNSET;
+
+    while(-1 != (opt = getopt(argc, argv, "d:k:s:w:r:m:M:o:b:T:x:C:h")))
+    {
+        switch(opt)
+        {
+            case 'd': selector = optarg; break;
+            case 'k': env.kernel_file_name = optarg; break;
+            case 's': suites = optarg; break;
+            case 'w': env.num_warmup = atoi(optarg); break;
+            case 'r': env.num_repetitions = atoi(optarg); break;
+            case 'm': env.min_size = strtoul(optarg, NULL, 0); break;
+            case 'M': env.max_size = strtoul(optarg, NULL, 0); break;
+            case 'o': output = optarg; break;
+            case 'b': baseline_file = optarg; break;
+            case 'T': threshold = atof(optarg); break;
+            case 'x':
+                if(0 != strcmp(optarg, "all") && CL_SUCCESS
+                        != xfer_mode_from_str(optarg, &env.xfer_mode))
+                    return CL_INVALID_VALUE;
+                break;
+            case 'C':
+                if(CL_SUCCESS != progcache_set_mode_str(optarg))
+                    return CL_INVALID_VALUE;
+                break;
+            default:
+                usage(argv[0]);
+                return CL_INVALID_VALUE;
+        }
+    }
+    if(env.num_warmup < 0 || env.num_repetitions <= 0
+            || 0 == env.min_size || env.min_size > env.max_size)
+    {
+        usage(argv[0]);
+        return CL_INVALID_VALUE;
+    }
+
+    if(CL_SUCCESS != (rv = platform_layer_select(selector,
+                    &env.device, &env.context)))
+        return rv;
+    struct caps_db caps_db;
+    caps_load(&caps_db);
+    if(NULL == (env.caps = caps_get(&caps_db, env.device)))
+        return CL_OUT_OF_HOST_MEMORY;
+    env.type = env.caps->type;
+    if(0 != env.caps->max_mem_alloc_size
+            && env.max_size > env.caps->max_mem_alloc_size)
+        env.max_size = env.caps->max_mem_alloc_size;
+    if(NULL == env.kernel_file_name)
+        env.kernel_file_name = (CL_DEVICE_TYPE_ACCELERATOR & env.type)
+            ? BINARY_FILE_NAME : SOURCE_FILE_NAME;
+
+    env.cmd_q = clCreateCommandQueue(env.context, env.device,
+            CL_QUEUE_PROFILING_ENABLE, &rv);
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Failed to create a command queue:", rv, stderr);
+        return rv;
+    }
+
+    const char* device_name = env.caps->name;
+    printf("Device: %s\n", NULL != device_name ? device_name : "?");
+    for(size_t i = 0; i < NUM_SUITES; ++i)
+    {
+        if(!suite_selected(suites, g_suites[i].name))
+            continue;
+        printf("Running %s...\n", g_suites[i].name);
+        if(CL_SUCCESS != (rv = g_suites[i].run(&env)))
+            return rv;
+    }
+    // the suites on top of common/ are traced with OCL_TRACE
+    trace_finish();
+    stats_print(&env.report, stdout);
+
+    if(NULL != output)
+    {
+        FILE* fp = fopen(output, "w");
+        if(NULL == fp)
+        {
+            perror(output);
+            return CL_INVALID_VALUE;
+        }
+        stats_write_json(&env.report, NULL != device_name ? device_name : "",
+                fp);
+        fclose(fp);
+    }
+
+    int regressions = 0;
+    if(NULL != baseline_file)
+    {
+        struct stats_report baseline;
+        if(stats_read_json(baseline_file, &baseline))
+            return CL_INVALID_VALUE;
+        regressions = stats_compare(&env.report, &baseline, threshold, stdout);
+        printf("%d regression(s) over %.1f%%\n", regressions, threshold);
+        stats_free(&baseline);
+    }
+
+    caps_db_free(&caps_db);
+    stats_free(&env.report);
+    clReleaseCommandQueue(env.cmd_q);
+    clReleaseContext(env.context);
+
+    return regressions ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,88 @@
+/*
+ * Launch latency of the inout kernel (lab1/core.cl): the round trip of
+ * a single launch with clEnqueueTask() and with a one work item
+ * clEnqueueNDRangeKernel(), as the host and as the device see it.
+ */
+
+struct launch_arg
+{
+    cl_kernel kernel;
+    int use_ndrange;
+};
+
+static cl_int
+launch_once(struct bench_env* env, void* arg, double* device_us)
+{
+    cl_int rv;
+    cl_event event;
+    struct launch_arg* la = arg;
+    size_t global_work_size = 1;
+
+    if(la->use_ndrange)
+        rv = clEnqueueNDRangeKernel(env->cmd_q, la->kernel, 1, NULL,
+                &global_work_size, NULL, 0, NULL, &event);
+    else
+        rv = clEnqueueTask(env->cmd_q, la->kernel, 0, NULL, &event);
+    if(CL_SUCCESS != rv)
+        return rv;
+    rv = clWaitForEvents(1, &event);
+    if(CL_SUCCESS == rv)
+        *device_us = event_us(event, CL_PROFILING_COMMAND_QUEUED,
+                CL_PROFILING_COMMAND_END);
+    clReleaseEvent(event);
+    return rv;
+}
+
+cl_int
+bench_latency(struct bench_env* env)
+{
+    cl_int rv;
+    cl_program program;
+    cl_int data_in = 0xCAFE;
+    struct launch_arg la;
+
+    rv = build_program(&program, &env->context, &env->device,
+            env->kernel_file_name);
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Failed to build a program:", rv, stderr);
+        return rv;
+    }
+    la.kernel = clCreateKernel(program, "inout", &rv);
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Failed to create a kernel object:", rv, stderr);
+        clReleaseProgram(program);
+        return rv;
+    }
+    cl_mem buf_out = clCreateBuffer(env->context, CL_MEM_WRITE_ONLY,
+            sizeof(cl_int), NULL, &rv);
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Failed to create a buffer object:", rv, stderr);
+        clReleaseKernel(la.kernel);
+        clReleaseProgram(program);
+        return rv;
+    }
+
+    rv  = clSetKernelArg(la.kernel, 0, sizeof(cl_mem), &buf_out);
+    rv |= clSetKernelArg(la.kernel, 1, sizeof(cl_int), &data_in);
+    if(CL_SUCCESS != rv)
+        print_cl_error("Failed to set an argument:", rv, stderr);
+
+    if(CL_SUCCESS == rv)
+    {
+        la.use_ndrange = 0;
+        rv = bench_measure(env, "launch/task", 0, launch_once, &la);
+    }
+    if(CL_SUCCESS == rv)
+    {
+        la.use_ndrange = 1;
+        rv = bench_measure(env, "launch/ndrange", 0, launch_once, &la);
+    }
+
+    clReleaseMemObject(buf_out);
+    clReleaseKernel(la.kernel);
+    clReleaseProgram(program);
+    return rv;
+}
@@ -0,0 +1,257 @@
+/*
+ * Throughput of the data-parallel primitives (common/primitives.c) over
+ * the largest buffer size: the reductions, both scans and the histogram.
+ * The result of every primitive is checked against the host once before
+ * it is measured, and before that over a few counts which leave partial
+ * work-groups: 1, a work-group less one and two work-groups and 3. The
+ * program comes from primitives.cl (lab1/primitives.cl copied to the build
+ * directory) or primitives.aocx on accelerators.
+ */
+
+#define PRIM_BINARY_FILE_NAME "primitives.aocx"
+#define PRIM_SOURCE_FILE_NAME "primitives.cl"
+
+enum prim_kind
+{
+    PRIM_KIND_REDUCE,
+    PRIM_KIND_SCAN,
+    PRIM_KIND_HISTOGRAM
+};
+
+struct prim_arg
+{
+    struct prim prim;
+    enum prim_kind kind;
+    enum prim_op op;
+    int exclusive;
+    size_t count;               // ints in the input
+    cl_mem in;
+    cl_mem out;
+    cl_int* data;
+    cl_int* result;             // of a scan
+    cl_int value;               // of a reduction
+    cl_uint bins[PRIM_HISTOGRAM_BINS];
+};
+
+static cl_int
+prim_once(struct bench_env* env, void* arg, double* device_us)
+{
+    struct prim_arg* pa = arg;
+    switch(pa->kind)
+    {
+        case PRIM_KIND_REDUCE:
+            return prim_reduce(&pa->prim, pa->op, pa->in, pa->count,
+                    &pa->value);
+        case PRIM_KIND_SCAN:
+            return prim_scan(&pa->prim, pa->in, pa->out, pa->count,
+                    pa->exclusive);
+        case PRIM_KIND_HISTOGRAM:
+        default:
+            return prim_histogram(&pa->prim, pa->in,
+                    pa->count * sizeof(cl_int), pa->bins);
+    }
+}
+
+/**
+ * Run the primitive once and compare its result with the host's.
+ */
+static cl_int
+prim_check(struct prim_arg* pa)
+{
+    cl_int rv = prim_once(NULL, pa, NULL);
+    cl_uint bins[PRIM_HISTOGRAM_BINS] = { 0 };
+    const unsigned char* bytes = (const unsigned char*) pa->data;
+    // unsigned, so that the sums wrap around as on the device
+    cl_uint acc = 0;
+
+    if(CL_SUCCESS != rv)
+        return rv;
+    switch(pa->kind)
+    {
+        case PRIM_KIND_REDUCE:
+            acc = pa->data[0];
+            for(size_t i = 1; i < pa->count; ++i)
+            {
+                cl_int x = pa->data[i];
+                if(PRIM_SUM == pa->op)
+                    acc += x;
+                else if(PRIM_MIN == pa->op ? x < (cl_int) acc
+                        : x > (cl_int) acc)
+                    acc = x;
+            }
+            if((cl_int) acc == pa->value)
+                return CL_SUCCESS;
+            fprintf(stderr, "The %s is %d instead of %d\n",
+                    prim_op_str(pa->op), pa->value, (cl_int) acc);
+            return CL_INVALID_VALUE;
+        case PRIM_KIND_SCAN:
+            rv = clEnqueueReadBuffer(pa->prim.queue, pa->out, CL_TRUE, 0,
+                    pa->count * sizeof(cl_int), pa->result, 0, NULL, NULL);
+            for(size_t i = 0; i < pa->count && CL_SUCCESS == rv; ++i)
+            {
+                if(!pa->exclusive)
+                    acc += pa->data[i];
+                if((cl_int) acc != pa->result[i])
+                {
+                    fprintf(stderr, "Prefix sum %zu is %d instead of %d\n",
+                            i, pa->result[i], (cl_int) acc);
+                    return CL_INVALID_VALUE;
+                }
+                if(pa->exclusive)
+                    acc += pa->data[i];
+            }
+            return rv;
+        case PRIM_KIND_HISTOGRAM:
+        default:
+            for(size_t i = 0; i < pa->count * sizeof(cl_int); ++i)
+                ++bins[bytes[i]];
+            for(int i = 0; i < PRIM_HISTOGRAM_BINS; ++i)
+            {
+                if(bins[i] != pa->bins[i])
+                {
+                    fprintf(stderr, "Bin %d holds %u instead of %u\n", i,
+                            pa->bins[i], bins[i]);
+                    return CL_INVALID_VALUE;
+                }
+            }
+            return CL_SUCCESS;
+    }
+}
+
+/*
+ * Check every primitive over counts that don't fill the work-groups, the
+ * tails the full size, a power of 2, never has.
+ */
+static cl_int
+prim_check_tails(struct prim_arg* pa)
+{
+    size_t full = pa->count;
+    size_t local = pa->prim.local_size;
+    size_t counts[] = { 1, local - 1, 2 * local + 3 };
+    cl_int rv = CL_SUCCESS;
+
+    for(size_t i = 0; i < sizeof(counts) / sizeof(counts[0])
+            && CL_SUCCESS == rv; ++i)
+    {
+        if(0 == counts[i] || counts[i] > full)
+            continue;
+        pa->count = counts[i];
+        pa->kind = PRIM_KIND_REDUCE;
+        for(pa->op = PRIM_SUM; pa->op < PRIM_NUM_OPS && CL_SUCCESS == rv;
+                ++pa->op)
+            rv = prim_check(pa);
+        pa->kind = PRIM_KIND_SCAN;
+        for(pa->exclusive = 0; pa->exclusive < 2 && CL_SUCCESS == rv;
+                ++pa->exclusive)
+            rv = prim_check(pa);
+        pa->kind = PRIM_KIND_HISTOGRAM;
+        if(CL_SUCCESS == rv)
+            rv = prim_check(pa);
+        if(CL_SUCCESS != rv)
+            fprintf(stderr, "The primitives fail over %zu int(s): %s\n",
+                    counts[i], cl_error_str(rv));
+    }
+    pa->count = full;
+    return rv;
+}
+
+static cl_int
+prim_measure(struct bench_env* env, struct prim_arg* pa, const char* name)
+{
+    size_t bytes = pa->count * sizeof(cl_int);
+    const struct stats_result* r;
+    cl_int rv = prim_check(pa);
+
+    if(CL_SUCCESS != rv)
+    {
+        fprintf(stderr, "%s failed: %s\n", name, cl_error_str(rv));
+        return rv;
+    }
+    if(CL_SUCCESS != (rv = bench_measure(env, name, bytes, prim_once, pa)))
+        return rv;
+    if(NULL != (r = bench_host_result(env, name)))
+        printf("%s: OK, %.2f GB/s of input\n", name,
+                stats_bandwidth(r) / 1e3);
+    return CL_SUCCESS;
+}
+
+cl_int
+bench_primitives(struct bench_env* env)
+{
+    cl_int rv;
+    cl_program program;
+    struct prim_arg pa;
+    char name[STATS_NAME_SIZE];
+    size_t data_size = env->max_size / sizeof(cl_int) * sizeof(cl_int);
+
+    memset(&pa, 0, sizeof(pa));
+    pa.count = data_size / sizeof(cl_int);
+    rv = build_program(&program, &env->context, &env->device,
+            (CL_DEVICE_TYPE_ACCELERATOR & env->type)
+            ? PRIM_BINARY_FILE_NAME : PRIM_SOURCE_FILE_NAME);
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Failed to build a program:", rv, stderr);
+        return rv;
+    }
+    if(0 == pa.count)
+        rv = CL_INVALID_BUFFER_SIZE;
+    if(CL_SUCCESS == rv)
+        rv = prim_init(&pa.prim, env->context, env->device, env->cmd_q,
+                program);
+    if(CL_SUCCESS != rv)
+    {
+        clReleaseProgram(program);
+        return rv;
+    }
+
+    pa.data = malloc(data_size);
+    pa.result = malloc(data_size);
+    if(NULL == pa.data || NULL == pa.result)
+        rv = CL_OUT_OF_HOST_MEMORY;
+    if(CL_SUCCESS == rv)
+        pa.in = clCreateBuffer(env->context, CL_MEM_READ_ONLY, data_size,
+                NULL, &rv);
+    if(CL_SUCCESS == rv)
+        pa.out = clCreateBuffer(env->context, CL_MEM_READ_WRITE, data_size,
+                NULL, &rv);
+    if(CL_SUCCESS == rv)
+    {
+        // small values, so that no prefix sum of 16 MiB overflows
+        for(size_t i = 0; i < pa.count; ++i)
+            pa.data[i] = (cl_int) ((cl_uint) (i * 2654435761u) >> 24) - 128;
+        rv = clEnqueueWriteBuffer(env->cmd_q, pa.in, CL_TRUE, 0, data_size,
+                pa.data, 0, NULL, NULL);
+    }
+    if(CL_SUCCESS == rv)
+        printf("Primitives over %zu ints, work-groups of %zu\n", pa.count,
+                pa.prim.local_size);
+    if(CL_SUCCESS == rv)
+        rv = prim_check_tails(&pa);
+
+    pa.kind = PRIM_KIND_REDUCE;
+    for(pa.op = PRIM_SUM; pa.op < PRIM_NUM_OPS && CL_SUCCESS == rv; ++pa.op)
+    {
+        snprintf(name, sizeof(name), "primitives/reduce_%s",
+                prim_op_str(pa.op));
+        rv = prim_measure(env, &pa, name);
+    }
+    pa.kind = PRIM_KIND_SCAN;
+    for(pa.exclusive = 0; pa.exclusive < 2 && CL_SUCCESS == rv;
+            ++pa.exclusive)
+        rv = prim_measure(env, &pa, pa.exclusive
+                ? "primitives/scan_exclusive" : "primitives/scan_inclusive");
+    pa.kind = PRIM_KIND_HISTOGRAM;
+    if(CL_SUCCESS == rv)
+        rv = prim_measure(env, &pa, "primitives/histogram");
+
+    if(NULL != pa.in)
+        clReleaseMemObject(pa.in);
+    if(NULL != pa.out)
+        clReleaseMemObject(pa.out);
+    free(pa.data);
+    free(pa.result);
+    prim_release(&pa.prim);
+    clReleaseProgram(program);
+    return rv;
+}
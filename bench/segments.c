@@ -0,0 +1,139 @@
+/*
+ * Segmented buffers (common/segbuf.c): a buffer of SEGMENTS_SCALE times
+ * the largest buffer size, which the suite otherwise keeps within
+ * CL_DEVICE_MAX_MEM_ALLOC_SIZE, is written, scaled by a kernel run per
+ * segment and read back, with segments of the largest buffer size and
+ * of its half and quarter, or only of OCL_SEGMENT_SIZE when it is set.
+ * The result depends on the global index, so it shows whether the
+ * offsets of the segments are right; it is checked after every
+ * measurement. The program comes from segments.cl
+ * (lab1/segments.cl copied to the build directory) or segments.aocx on
+ * accelerators.
+ */
+
+#define SEGMENTS_BINARY_FILE_NAME "segments.aocx"
+#define SEGMENTS_SOURCE_FILE_NAME "segments.cl"
+#define SEGMENTS_SCALE 4
+#define SEGMENTS_FACTOR 3
+
+struct segments_arg
+{
+    struct segbuf buffer;
+    cl_kernel kernel;
+    cl_int* data;
+    cl_int* result;
+};
+
+static cl_int
+segments_once(struct bench_env* env, void* arg, double* device_us)
+{
+    struct segments_arg* sa = arg;
+    cl_int rv = segbuf_write(env->cmd_q, &sa->buffer, CL_FALSE, 0,
+            sa->buffer.size, sa->data);
+    if(CL_SUCCESS == rv)
+        rv = segbuf_enqueue_kernel(env->cmd_q, &sa->buffer, sa->kernel, 0);
+    if(CL_SUCCESS == rv)
+        rv = segbuf_read(env->cmd_q, &sa->buffer, CL_TRUE, 0,
+                sa->buffer.size, sa->result);
+    return rv;
+}
+
+static cl_int
+segments_measure(struct bench_env* env, struct segbuf_pool* pool,
+        struct segments_arg* sa, size_t size)
+{
+    char name[STATS_NAME_SIZE];
+    const struct stats_result* r;
+    size_t count = size / sizeof(cl_int);
+    cl_int rv = segbuf_create(&sa->buffer, pool, CL_MEM_READ_WRITE, size,
+            sizeof(cl_int));
+
+    if(CL_SUCCESS != rv)
+        return rv;
+    snprintf(name, sizeof(name), "segments/%zu", sa->buffer.num_segments);
+    rv = bench_measure(env, name, 2 * size, segments_once, sa);
+    for(size_t i = 0; i < count && CL_SUCCESS == rv; ++i)
+    {
+        cl_int expected = (cl_int) ((cl_uint) sa->data[i] * SEGMENTS_FACTOR
+                + (cl_uint) i);
+        if(sa->result[i] != expected)
+        {
+            fprintf(stderr, "%s: int %zu is %d instead of %d\n", name, i,
+                    sa->result[i], expected);
+            rv = CL_INVALID_VALUE;
+        }
+    }
+    if(CL_SUCCESS == rv && NULL != (r = bench_host_result(env, name)))
+    {
+        printf("%s: OK, %.1f MB/s\n", name, stats_bandwidth(r));
+        putchar('\t');
+        segbuf_print_pool(pool, stdout);
+    }
+    segbuf_release(&sa->buffer);
+    return rv;
+}
+
+cl_int
+bench_segments(struct bench_env* env)
+{
+    cl_int rv;
+    cl_program program;
+    struct segbuf_pool pool;
+    struct segments_arg sa;
+    cl_int factor = SEGMENTS_FACTOR;
+    size_t max_size = env->max_size / sizeof(cl_int) * sizeof(cl_int);
+    size_t size = SEGMENTS_SCALE * max_size;
+    const char* limit_env = getenv(SEGBUF_SIZE_ENV);
+
+    memset(&sa, 0, sizeof(sa));
+    rv = build_program(&program, &env->context, &env->device,
+            (CL_DEVICE_TYPE_ACCELERATOR & env->type)
+            ? SEGMENTS_BINARY_FILE_NAME : SEGMENTS_SOURCE_FILE_NAME);
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Failed to build a program:", rv, stderr);
+        return rv;
+    }
+    if(0 == max_size)
+        rv = CL_INVALID_BUFFER_SIZE;
+    if(CL_SUCCESS == rv)
+        rv = segbuf_pool_init(&pool, env->context, env->device);
+    if(CL_SUCCESS == rv)
+        sa.kernel = clCreateKernel(program, "scale_index", &rv);
+    if(CL_SUCCESS == rv)
+        rv = clSetKernelArg(sa.kernel, 1, sizeof(cl_int), &factor);
+    // the job is limited by the host memory only
+    sa.data = malloc(size);
+    sa.result = malloc(size);
+    if(CL_SUCCESS == rv && (NULL == sa.data || NULL == sa.result))
+        rv = CL_OUT_OF_HOST_MEMORY;
+    if(CL_SUCCESS == rv)
+    {
+        for(size_t i = 0; i < size / sizeof(cl_int); ++i)
+            sa.data[i] = (cl_int) (i * 2654435761u);
+        printf("A buffer of %zu bytes, device buffers of up to %llu bytes\n",
+                size, (unsigned long long) pool.max_alloc);
+    }
+
+    if(NULL != limit_env && '\0' != *limit_env)
+    {
+        // the segment size is set by the user
+        if(CL_SUCCESS == rv)
+            rv = segments_measure(env, &pool, &sa, size);
+    }
+    else for(size_t parts = 1; parts <= 4 && CL_SUCCESS == rv; parts *= 2)
+    {
+        size_t limit = max_size / parts;
+        if(limit < sizeof(cl_int) || limit > pool.max_alloc)
+            continue;
+        pool.segment_limit = limit;
+        rv = segments_measure(env, &pool, &sa, size);
+    }
+
+    if(NULL != sa.kernel)
+        clReleaseKernel(sa.kernel);
+    free(sa.data);
+    free(sa.result);
+    clReleaseProgram(program);
+    return rv;
+}
@@ -0,0 +1,150 @@
+/*
+ * Scaling of independent jobs over host threads (common/workers.c). Every
+ * thread has its own queue and kernel object; a job writes its data to
+ * the thread's buffer, launches inout (lab1/core.cl) to put the job number
+ * into the first int and reads the buffer back. The same number of jobs
+ * runs on 1, 2, 4, ... threads and the suite reports jobs per second, which
+ * stops growing once the device, not the host, is the limit.
+ */
+
+#define THREADS_NUM_JOBS 256
+#define THREADS_MAX 8
+#define THREADS_JOB_SIZE (64 << 10)
+
+struct threads_data
+{
+    cl_mem buf;
+    cl_int* in_data;
+    cl_int* out_data;
+};
+
+struct threads_arg
+{
+    struct worker_group group;
+    size_t job_size;
+};
+
+static cl_int
+threads_job(struct worker* w, size_t job, void* arg)
+{
+    cl_int rv;
+    struct threads_arg* ta = arg;
+    struct threads_data* td = w->data;
+    size_t count = ta->job_size / sizeof(cl_int);
+    cl_int value = (cl_int) job;
+
+    td->in_data[count - 1] = value;
+    rv = clEnqueueWriteBuffer(w->queue, td->buf, CL_FALSE, 0, ta->job_size,
+            td->in_data, 0, NULL, NULL);
+    if(CL_SUCCESS == rv)
+        rv = clSetKernelArg(w->kernel, 0, sizeof(cl_mem), &td->buf);
+    if(CL_SUCCESS == rv)
+        rv = clSetKernelArg(w->kernel, 1, sizeof(cl_int), &value);
+    if(CL_SUCCESS == rv)
+        rv = clEnqueueTask(w->queue, w->kernel, 0, NULL, NULL);
+    if(CL_SUCCESS == rv)
+        rv = clEnqueueReadBuffer(w->queue, td->buf, CL_TRUE, 0, ta->job_size,
+                td->out_data, 0, NULL, NULL);
+    if(CL_SUCCESS != rv)
+        return rv;
+
+    if(value != td->out_data[0] || value != td->out_data[count - 1])
+    {
+        fprintf(stderr, "Job %zu on thread %u: got %X and %X\n", job,
+                w->index, td->out_data[0], td->out_data[count - 1]);
+        return CL_INVALID_VALUE;
+    }
+    return CL_SUCCESS;
+}
+
+static cl_int
+threads_once(struct bench_env* env, void* arg, double* device_us)
+{
+    struct threads_arg* ta = arg;
+    return workers_run(&ta->group, THREADS_NUM_JOBS, threads_job, ta);
+}
+
+static void
+threads_release_data(struct worker_group* g)
+{
+    for(unsigned int i = 0; i < g->num_workers; ++i)
+    {
+        struct threads_data* td = g->workers[i].data;
+        if(NULL == td)
+            continue;
+        if(NULL != td->buf)
+            clReleaseMemObject(td->buf);
+        free(td->in_data);
+        free(td->out_data);
+        free(td);
+    }
+}
+
+static cl_int
+threads_create_data(struct bench_env* env, struct worker_group* g,
+        size_t job_size)
+{
+    cl_int rv = CL_SUCCESS;
+
+    for(unsigned int i = 0; i < g->num_workers && CL_SUCCESS == rv; ++i)
+    {
+        struct threads_data* td = calloc(1, sizeof(*td));
+        if(NULL == (g->workers[i].data = td)
+                || NULL == (td->in_data = calloc(1, job_size))
+                || NULL == (td->out_data = malloc(job_size)))
+            return CL_OUT_OF_HOST_MEMORY;
+        td->buf = clCreateBuffer(env->context, CL_MEM_READ_WRITE, job_size,
+                NULL, &rv);
+        if(CL_SUCCESS != rv)
+            print_cl_error("Failed to create a buffer object:", rv, stderr);
+    }
+    return rv;
+}
+
+cl_int
+bench_threads(struct bench_env* env)
+{
+    cl_int rv;
+    cl_program program;
+    struct threads_arg ta;
+    char name[STATS_NAME_SIZE];
+    double base_rate = 0.0;
+
+    ta.job_size = (env->max_size < THREADS_JOB_SIZE)
+        ? env->max_size : THREADS_JOB_SIZE;
+    rv = build_program(&program, &env->context, &env->device,
+            env->kernel_file_name);
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Failed to build a program:", rv, stderr);
+        return rv;
+    }
+
+    for(unsigned int n = 1; n <= THREADS_MAX && CL_SUCCESS == rv; n *= 2)
+    {
+        rv = workers_init(&ta.group, env->context, env->device, program,
+                "inout", n);
+        if(CL_SUCCESS != rv)
+            break;
+        rv = threads_create_data(env, &ta.group, ta.job_size);
+        snprintf(name, sizeof(name), "threads/%u", n);
+        if(CL_SUCCESS == rv)
+            rv = bench_measure(env, name, 2 * THREADS_NUM_JOBS * ta.job_size,
+                    threads_once, &ta);
+        threads_release_data(&ta.group);
+        workers_release(&ta.group);
+
+        const struct stats_result* r = bench_host_result(env, name);
+        if(CL_SUCCESS == rv && NULL != r && r->summary.median > 0.0)
+        {
+            double rate = THREADS_NUM_JOBS / (r->summary.median * 1e-6);
+            if(1 == n)
+                base_rate = rate;
+            printf("%u thread(s): %.0f jobs/s, %.2fx\n", n, rate,
+                    rate / base_rate);
+        }
+    }
+
+    clReleaseProgram(program);
+    return rv;
+}
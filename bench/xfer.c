@@ -0,0 +1,93 @@
+/*
+ * Host<->device transfers in each of the modes of common/xfer.c. A write
+ * fills the mapped data on the host and unmaps it, a read maps the buffer
+ * and sums the data, so the host time includes the copies a mode makes
+ * and the cost of touching the memory the host gets.
+ */
+
+struct xfer_arg
+{
+    struct xfer_buffer buf;
+    cl_map_flags flags;
+    size_t size;
+    unsigned long checksum;
+};
+
+static double
+xfer_event_us(cl_event event)
+{
+    double us = 0.0;
+    if(NULL != event)
+    {
+        us = event_us(event, CL_PROFILING_COMMAND_START,
+                CL_PROFILING_COMMAND_END);
+        clReleaseEvent(event);
+    }
+    return us;
+}
+
+static cl_int
+xfer_once(struct bench_env* env, void* arg, double* device_us)
+{
+    cl_int rv;
+    cl_event map_event, unmap_event;
+    struct xfer_arg* xa = arg;
+    unsigned char* data;
+
+    data = xfer_map(&xa->buf, env->cmd_q, xa->flags, 0, xa->size,
+            &map_event, &rv);
+    if(CL_SUCCESS != rv)
+        return rv;
+    if(CL_MAP_WRITE & xa->flags)
+        memset(data, 0x5A, xa->size);
+    else
+        for(size_t i = 0; i < xa->size; ++i)
+            xa->checksum += data[i];
+
+    rv = xfer_unmap(&xa->buf, env->cmd_q, &unmap_event);
+    if(CL_SUCCESS == rv)
+        rv = clFinish(env->cmd_q);
+    *device_us = xfer_event_us(map_event) + xfer_event_us(unmap_event);
+    return rv;
+}
+
+cl_int
+bench_xfer(struct bench_env* env)
+{
+    cl_int rv = CL_SUCCESS;
+    struct xfer_arg xa;
+    char name[STATS_NAME_SIZE], size_buf[16];
+
+    xa.checksum = 0;
+    for(int mode = XFER_COPY; mode < XFER_NUM_MODES && CL_SUCCESS == rv;
+            ++mode)
+    {
+        if(XFER_UNSET != env->xfer_mode && mode != (int) env->xfer_mode)
+            continue;
+        rv = xfer_create(&xa.buf, env->context, CL_MEM_READ_WRITE,
+                env->max_size, mode);
+        if(CL_SUCCESS != rv)
+        {
+            print_cl_error("Failed to create a transfer buffer:", rv, stderr);
+            return rv;
+        }
+
+        for(xa.size = env->min_size;
+                xa.size <= env->max_size && CL_SUCCESS == rv; xa.size *= 4)
+        {
+            size_str(xa.size, size_buf, sizeof(size_buf));
+            xa.flags = CL_MAP_WRITE;
+            snprintf(name, sizeof(name), "xfer/%s/write/%s",
+                    xfer_mode_str(mode), size_buf);
+            rv = bench_measure(env, name, xa.size, xfer_once, &xa);
+            if(CL_SUCCESS != rv)
+                break;
+            xa.flags = CL_MAP_READ;
+            snprintf(name, sizeof(name), "xfer/%s/read/%s",
+                    xfer_mode_str(mode), size_buf);
+            rv = bench_measure(env, name, xa.size, xfer_once, &xa);
+        }
+        xfer_release(&xa.buf);
+    }
+    return rv;
+}
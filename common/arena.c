@@ -0,0 +1,311 @@
+#ifndef OCL_LABS_ARENA_C
+#define OCL_LABS_ARENA_C
+
+/*
+ * Device memory arena of sub-buffers.
+ *
+ * The arena is one large buffer created up front. An allocation is rounded
+ * up to a size class, a power of two not smaller than the base address
+ * alignment of the device, so every block starts where a sub-buffer may.
+ * A free block keeps its sub-buffer and goes to the free list of its class;
+ * a new block is carved from the end of the used part of the arena with
+ * clCreateSubBuffer() only when the list is empty. Jobs that allocate the
+ * same sizes over and over thus create no memory objects once the arena
+ * has warmed up.
+ *
+ * In the bump mode arena_free() does nothing and arena_reset() frees every
+ * block at once, for buffers that live as long as a batch of work: the
+ * reset rewinds the carve offset to the start of the arena, and the next
+ * allocations reuse the sub-buffers found at the same offsets with the
+ * same size class. A sub-buffer the new layout doesn't fit is released
+ * when a block is carved over it, so a batch repeating its sizes in the
+ * same order creates no memory objects after the first one.
+ * A reset in the default mode frees every block and keeps the offset.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "CL/opencl.h"
+
+#define ARENA_MIN_CLASS 64      // bytes, if the device asks for less
+#define ARENA_NUM_CLASSES 48
+
+enum arena_mode
+{
+    ARENA_FREE_LIST,
+    ARENA_BUMP
+};
+
+struct arena_block
+{
+    cl_mem mem;                 // the sub-buffer
+    size_t offset;              // in the arena
+    size_t requested;           // bytes asked for
+    int size_class;
+    int live;                   // not on a free list
+    struct arena_block* next;   // in a free list
+    struct arena_block* next_all;
+};
+
+struct arena_stats
+{
+    size_t in_use;              // bytes of the size classes of live blocks
+    size_t requested;           // bytes asked for by live blocks
+    size_t high_water;          // most bytes in use at once
+    size_t carved;              // bytes covered by existing sub-buffers
+    size_t num_allocs;
+    size_t num_reused;          // allocations served from a free list
+    size_t num_sub_buffers;     // sub-buffers created
+    size_t num_dropped;         // released to carve over, in the bump mode
+};
+
+struct arena
+{
+    cl_mem mem;
+    size_t size;
+    size_t min_class;           // bytes of class 0
+    enum arena_mode mode;
+    size_t top;                 // where the next block is carved
+    struct arena_block* free_lists[ARENA_NUM_CLASSES];
+    struct arena_block* blocks; // all of them, through next_all
+    struct arena_stats stats;
+};
+
+/**
+ * Create an arena of size bytes for the device. The flags are those of the
+ * arena buffer, the blocks inherit them.
+ */
+cl_int
+arena_init(struct arena* a, cl_context context, cl_device_id device,
+        cl_mem_flags flags, size_t size, enum arena_mode mode)
+{
+    cl_int rv;
+    cl_uint align_bits = 0;
+
+    memset(a, 0, sizeof(*a));
+    clGetDeviceInfo(device, CL_DEVICE_MEM_BASE_ADDR_ALIGN,
+            sizeof(align_bits), &align_bits, NULL);
+    a->min_class = ARENA_MIN_CLASS;
+    while(a->min_class < align_bits / 8)
+        a->min_class *= 2;
+    a->size = size;
+    a->mode = mode;
+    a->mem = clCreateBuffer(context, flags, size, NULL, &rv);
+    if(CL_SUCCESS != rv)
+        print_cl_error("Failed to create the arena:", rv, stderr);
+    return rv;
+}
+
+void
+arena_release(struct arena* a)
+{
+    struct arena_block* block = a->blocks;
+    while(NULL != block)
+    {
+        struct arena_block* next = block->next_all;
+        clReleaseMemObject(block->mem);
+        free(block);
+        block = next;
+    }
+    if(NULL != a->mem)
+        clReleaseMemObject(a->mem);
+    memset(a, 0, sizeof(*a));
+}
+
+static int
+arena_size_class(const struct arena* a, size_t size)
+{
+    int size_class = 0;
+    for(size_t class_size = a->min_class; class_size < size; class_size *= 2)
+        ++size_class;
+    return size_class;
+}
+
+static size_t
+arena_class_size(const struct arena* a, int size_class)
+{
+    return a->min_class << size_class;
+}
+
+static struct arena_block*
+arena_carve(struct arena* a, int size_class, cl_int* rv)
+{
+    cl_buffer_region region;
+    struct arena_block* block;
+
+    region.origin = a->top;
+    region.size = arena_class_size(a, size_class);
+    if(region.size > a->size - region.origin)
+    {
+        *rv = CL_MEM_OBJECT_ALLOCATION_FAILURE;
+        return NULL;
+    }
+    if(NULL == (block = calloc(1, sizeof(*block))))
+    {
+        *rv = CL_OUT_OF_HOST_MEMORY;
+        return NULL;
+    }
+    block->mem = clCreateSubBuffer(a->mem, 0, CL_BUFFER_CREATE_TYPE_REGION,
+            &region, rv);
+    if(CL_SUCCESS != *rv)
+    {
+        free(block);
+        return NULL;
+    }
+    block->offset = region.origin;
+    block->size_class = size_class;
+    block->next_all = a->blocks;
+    a->blocks = block;
+    a->top += region.size;
+    a->stats.carved += region.size;
+    ++a->stats.num_sub_buffers;
+    return block;
+}
+
+/*
+ * The next block of the bump mode: the free sub-buffer left at the carve
+ * offset by a previous batch if it has the class, else a new one carved
+ * there after releasing the free sub-buffers it would overlap. Every live
+ * block lies below the offset, so only free ones can be in the way.
+ */
+static struct arena_block*
+arena_bump(struct arena* a, int size_class, cl_int* rv)
+{
+    struct arena_block** link = &a->blocks;
+    size_t end = a->top + arena_class_size(a, size_class);
+
+    for(struct arena_block* b = a->blocks; NULL != b; b = b->next_all)
+    {
+        if(!b->live && b->offset == a->top && b->size_class == size_class)
+        {
+            a->top = end;
+            ++a->stats.num_reused;
+            return b;
+        }
+    }
+    if(end > a->size)
+    {
+        *rv = CL_MEM_OBJECT_ALLOCATION_FAILURE;
+        return NULL;
+    }
+    while(NULL != *link)
+    {
+        struct arena_block* b = *link;
+        size_t b_size = arena_class_size(a, b->size_class);
+        if(!b->live && b->offset < end && a->top < b->offset + b_size)
+        {
+            *link = b->next_all;
+            clReleaseMemObject(b->mem);
+            a->stats.carved -= b_size;
+            ++a->stats.num_dropped;
+            free(b);
+        }
+        else
+            link = &b->next_all;
+    }
+    return arena_carve(a, size_class, rv);
+}
+
+/**
+ * Get a block of at least size bytes. Returns NULL and sets *rv to
+ * CL_MEM_OBJECT_ALLOCATION_FAILURE if the arena has no room left.
+ */
+struct arena_block*
+arena_alloc(struct arena* a, size_t size, cl_int* rv)
+{
+    struct arena_block* block;
+    int size_class = arena_size_class(a, size);
+
+    *rv = CL_SUCCESS;
+    if(size_class >= ARENA_NUM_CLASSES)
+    {
+        *rv = CL_INVALID_BUFFER_SIZE;
+        return NULL;
+    }
+    if(ARENA_BUMP == a->mode)
+    {
+        if(NULL == (block = arena_bump(a, size_class, rv)))
+            return NULL;
+    }
+    else if(NULL != (block = a->free_lists[size_class]))
+    {
+        a->free_lists[size_class] = block->next;
+        ++a->stats.num_reused;
+    }
+    else if(NULL == (block = arena_carve(a, size_class, rv)))
+        return NULL;
+
+    block->next = NULL;
+    block->requested = size;
+    block->live = 1;
+    ++a->stats.num_allocs;
+    a->stats.requested += size;
+    a->stats.in_use += arena_class_size(a, size_class);
+    if(a->stats.in_use > a->stats.high_water)
+        a->stats.high_water = a->stats.in_use;
+    return block;
+}
+
+static void
+arena_put(struct arena* a, struct arena_block* block)
+{
+    a->stats.requested -= block->requested;
+    a->stats.in_use -= arena_class_size(a, block->size_class);
+    block->live = 0;
+    // the bump mode finds its free blocks by offset
+    if(ARENA_BUMP == a->mode)
+        return;
+    block->next = a->free_lists[block->size_class];
+    a->free_lists[block->size_class] = block;
+}
+
+/**
+ * Give a block back. Does nothing in the bump mode, see arena_reset().
+ */
+void
+arena_free(struct arena* a, struct arena_block* block)
+{
+    if(ARENA_BUMP != a->mode && NULL != block && block->live)
+        arena_put(a, block);
+}
+
+/**
+ * Free every live block. The sub-buffers stay for the next allocations;
+ * in the bump mode these start again at the beginning of the arena.
+ */
+void
+arena_reset(struct arena* a)
+{
+    for(struct arena_block* b = a->blocks; NULL != b; b = b->next_all)
+        if(b->live)
+            arena_put(a, b);
+    if(ARENA_BUMP == a->mode)
+        a->top = 0;
+}
+
+/**
+ * The part of the carved memory that doesn't hold requested bytes, both
+ * the rounding up to the size classes and the blocks on the free lists.
+ */
+double
+arena_fragmentation(const struct arena* a)
+{
+    return (0 != a->stats.carved)
+        ? 1.0 - (double) a->stats.requested / a->stats.carved : 0.0;
+}
+
+void
+arena_print_stats(const struct arena* a, FILE* fp)
+{
+    const struct arena_stats* s = &a->stats;
+    fprintf(fp, "Arena of %zu bytes: %zu in use (%zu requested), "
+            "high-water mark %zu, %zu carved into %zu sub-buffer(s) "
+            "(%zu dropped), %zu of %zu allocation(s) reused, "
+            "fragmentation %.1f%%\n", a->size, s->in_use, s->requested,
+            s->high_water, s->carved, s->num_sub_buffers, s->num_dropped,
+            s->num_reused, s->num_allocs, 100.0 * arena_fragmentation(a));
+}
+
+#endif // OCL_LABS_ARENA_C
@@ -0,0 +1,286 @@
+#ifndef OCL_LABS_ASYNC_C
+#define OCL_LABS_ASYNC_C
+
+/*
+ * Asynchronous completion of commands handled by a pool of host threads.
+ *
+ * async_submit() attaches a callback to the event of a command with
+ * clSetEventCallback(). When the command completes, the runtime calls it
+ * on one of its own threads; the callback only pushes the job onto a
+ * bounded lock-free queue (Vyukov's MPMC ring) and posts a semaphore, so
+ * the runtime is never blocked: async_submit() keeps the jobs in flight
+ * within the capacity of the queue, so it can't fill up. The worker
+ * threads of the pool pop the jobs and run the handlers, which
+ * post-process the results while the device works on the next commands.
+ *
+ * Link with the threads library (${CMAKE_THREAD_LIBS_INIT}).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+
+#include "CL/opencl.h"
+
+/*
+ * Handle a completed command. The status is CL_COMPLETE or a negative
+ * error code if the command was terminated.
+ */
+typedef void (*async_fn)(cl_event event, cl_int status, void* arg);
+
+struct async_job
+{
+    cl_event event;
+    cl_int status;
+    async_fn fn;
+    void* arg;
+    struct async_pool* pool;
+};
+
+struct async_cell
+{
+    size_t sequence;
+    struct async_job* job;
+};
+
+struct async_pool
+{
+    struct async_cell* cells;
+    size_t mask;                // capacity - 1, the capacity is a power of 2
+    size_t enqueue_pos;
+    size_t dequeue_pos;
+    sem_t ready;                // jobs in the queue
+    pthread_t* threads;
+    unsigned int num_threads;
+    int stop;
+    size_t pending;             // submitted and not handled yet
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle;        // pending dropped to 0
+};
+
+static int
+async_push(struct async_pool* pool, struct async_job* job)
+{
+    size_t pos = __atomic_load_n(&pool->enqueue_pos, __ATOMIC_RELAXED);
+    for(;;)
+    {
+        struct async_cell* cell = &pool->cells[pos & pool->mask];
+        size_t seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        long diff = (long) seq - (long) pos;
+        if(0 == diff)
+        {
+            if(__atomic_compare_exchange_n(&pool->enqueue_pos, &pos, pos + 1,
+                        1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                cell->job = job;
+                __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+                return 1;
+            }
+        }
+        else if(diff < 0)
+            return 0; // full
+        else
+            pos = __atomic_load_n(&pool->enqueue_pos, __ATOMIC_RELAXED);
+    }
+}
+
+static struct async_job*
+async_pop(struct async_pool* pool)
+{
+    size_t pos = __atomic_load_n(&pool->dequeue_pos, __ATOMIC_RELAXED);
+    for(;;)
+    {
+        struct async_cell* cell = &pool->cells[pos & pool->mask];
+        size_t seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        long diff = (long) seq - (long) (pos + 1);
+        if(0 == diff)
+        {
+            if(__atomic_compare_exchange_n(&pool->dequeue_pos, &pos, pos + 1,
+                        1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                struct async_job* job = cell->job;
+                __atomic_store_n(&cell->sequence, pos + pool->mask + 1,
+                        __ATOMIC_RELEASE);
+                return job;
+            }
+        }
+        else if(diff < 0)
+            return NULL; // empty
+        else
+            pos = __atomic_load_n(&pool->dequeue_pos, __ATOMIC_RELAXED);
+    }
+}
+
+static void
+async_job_done(struct async_pool* pool)
+{
+    if(1 == __atomic_fetch_sub(&pool->pending, 1, __ATOMIC_ACQ_REL))
+    {
+        pthread_mutex_lock(&pool->idle_lock);
+        pthread_cond_broadcast(&pool->idle);
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+}
+
+static void*
+async_worker(void* arg)
+{
+    struct async_pool* pool = arg;
+    for(;;)
+    {
+        struct async_job* job;
+        while(0 != sem_wait(&pool->ready))
+            ; // interrupted by a signal
+        // a push before ours may have its cell but not the job in it yet:
+        // the token is for a job that is about to be there, keep it
+        while(NULL == (job = async_pop(pool))
+                && !__atomic_load_n(&pool->stop, __ATOMIC_ACQUIRE))
+            sched_yield();
+        if(NULL == job)
+            break;
+        job->fn(job->event, job->status, job->arg);
+        clReleaseEvent(job->event);
+        free(job);
+        async_job_done(pool);
+    }
+    return NULL;
+}
+
+/* Runs on a thread of the OpenCL runtime, must not block */
+static void CL_CALLBACK
+async_event_cb(cl_event event, cl_int status, void* user_data)
+{
+    struct async_job* job = user_data;
+    struct async_pool* pool = job->pool;   // a worker may free the job
+    job->status = status;
+    // async_submit() keeps the queue from filling, a push can only wait
+    // for a worker which has taken the job of the cell and not yet freed it
+    while(!async_push(pool, job))
+        sched_yield();
+    sem_post(&pool->ready);
+}
+
+/**
+ * Start num_threads workers. The queue holds up to capacity completed jobs
+ * (rounded up to a power of 2), which is also the most jobs that may be in
+ * flight: async_submit() refuses more.
+ */
+cl_int
+async_init(struct async_pool* pool, unsigned int num_threads,
+        size_t capacity)
+{
+    size_t size = 2;
+
+    memset(pool, 0, sizeof(*pool));
+    while(size < capacity)
+        size *= 2;
+    pool->cells = malloc(size * sizeof(*pool->cells));
+    pool->threads = malloc(num_threads * sizeof(*pool->threads));
+    if(NULL == pool->cells || NULL == pool->threads)
+    {
+        free(pool->cells);
+        free(pool->threads);
+        return CL_OUT_OF_HOST_MEMORY;
+    }
+    for(size_t i = 0; i < size; ++i)
+        pool->cells[i].sequence = i;
+    pool->mask = size - 1;
+    sem_init(&pool->ready, 0, 0);
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+
+    for(; pool->num_threads < num_threads; ++pool->num_threads)
+    {
+        if(0 != pthread_create(&pool->threads[pool->num_threads], NULL,
+                    async_worker, pool))
+        {
+            perror("Failed to start a worker thread");
+            break;
+        }
+    }
+    return (0 != pool->num_threads) ? CL_SUCCESS : CL_OUT_OF_RESOURCES;
+}
+
+/**
+ * Have fn called on a worker thread once the command of the event
+ * completes. The event is retained until the handler returns. Returns
+ * CL_OUT_OF_RESOURCES if the capacity of the pool is in flight already.
+ */
+cl_int
+async_submit(struct async_pool* pool, cl_event event, async_fn fn,
+        void* arg)
+{
+    cl_int rv;
+    struct async_job* job;
+    size_t pending = __atomic_load_n(&pool->pending, __ATOMIC_RELAXED);
+
+    // the callback must find room in the queue, so count the job first
+    do
+    {
+        if(pending > pool->mask)
+        {
+            fputs("Too many jobs in flight for the async pool\n", stderr);
+            return CL_OUT_OF_RESOURCES;
+        }
+    }
+    while(!__atomic_compare_exchange_n(&pool->pending, &pending, pending + 1,
+                1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+    if(NULL == (job = malloc(sizeof(*job))))
+    {
+        async_job_done(pool);
+        return CL_OUT_OF_HOST_MEMORY;
+    }
+    job->event = event;
+    job->status = CL_COMPLETE;
+    job->fn = fn;
+    job->arg = arg;
+    job->pool = pool;
+
+    clRetainEvent(event);
+    rv = clSetEventCallback(event, CL_COMPLETE, async_event_cb, job);
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Failed to set an event callback:", rv, stderr);
+        clReleaseEvent(event);
+        free(job);
+        async_job_done(pool);
+    }
+    return rv;
+}
+
+/**
+ * Wait until the handlers of all submitted jobs have returned.
+ */
+void
+async_wait(struct async_pool* pool)
+{
+    pthread_mutex_lock(&pool->idle_lock);
+    while(0 != __atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE))
+        pthread_cond_wait(&pool->idle, &pool->idle_lock);
+    pthread_mutex_unlock(&pool->idle_lock);
+}
+
+/**
+ * Wait for the submitted jobs and stop the workers.
+ */
+void
+async_release(struct async_pool* pool)
+{
+    async_wait(pool);
+    __atomic_store_n(&pool->stop, 1, __ATOMIC_RELEASE);
+    for(unsigned int i = 0; i < pool->num_threads; ++i)
+        sem_post(&pool->ready);
+    for(unsigned int i = 0; i < pool->num_threads; ++i)
+        pthread_join(pool->threads[i], NULL);
+    sem_destroy(&pool->ready);
+    pthread_mutex_destroy(&pool->idle_lock);
+    pthread_cond_destroy(&pool->idle);
+    free(pool->cells);
+    free(pool->threads);
+    memset(pool, 0, sizeof(*pool));
+}
+
+#endif // OCL_LABS_ASYNC_C
@@ -0,0 +1,314 @@
+#ifndef OCL_LABS_AUTOTUNE_C
+#define OCL_LABS_AUTOTUNE_C
+
+/*
+ * Tuned launch configurations of kernels and a file of them.
+ *
+ * A configuration is a kernel variant, the work a work item does and the
+ * local work size. A program sweeps the configurations that fit the limits
+ * of its device (autotune_local_sizes() gives the local sizes to try),
+ * times each with autotune_time() and keeps the fastest with
+ * autotune_store(). The results are keyed by the device name, its driver
+ * version, the kernel and a size bucket, the size of the problem rounded up
+ * to a power of two, and saved as JSON with one result per line, so that
+ * later runs find theirs with autotune_find() and launch with it.
+ *
+ * Environment:
+ *  OCL_AUTOTUNE  file of the results, ".oclautotune.json" by default,
+ *                "off" to neither read nor write it
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "CL/opencl.h"
+
+#include "caps.c"
+#include "stats.c"
+
+#define AUTOTUNE_ENV "OCL_AUTOTUNE"
+#define AUTOTUNE_DEFAULT ".oclautotune.json"
+#define AUTOTUNE_NAME_SIZE 64
+#define AUTOTUNE_RUNS 10            // timed runs of a configuration
+
+struct autotune_config
+{
+    char variant[AUTOTUNE_NAME_SIZE];
+    size_t work_per_item;           // elements a work item moves
+    size_t local_size;              // 0 lets the runtime choose
+    double kernel_us;               // median of the timed runs
+};
+
+struct autotune_entry
+{
+    char* device;
+    char* driver_version;
+    char kernel[AUTOTUNE_NAME_SIZE];
+    size_t bucket;                  // bytes, a power of two
+    struct autotune_config config;
+};
+
+struct autotune_db
+{
+    struct autotune_entry* entries;
+    size_t count;
+    size_t capacity;
+};
+
+/**
+ * Path of the results file or NULL if it is disabled.
+ */
+const char*
+autotune_path(void)
+{
+    const char* path = getenv(AUTOTUNE_ENV);
+    if(NULL == path || '\0' == *path)
+        return AUTOTUNE_DEFAULT;
+    return (0 == strcmp(path, "off")) ? NULL : path;
+}
+
+/**
+ * The bucket of a problem of a given size.
+ */
+size_t
+autotune_bucket(size_t bytes)
+{
+    size_t bucket = 1;
+    while(bucket < bytes)
+        bucket *= 2;
+    return bucket;
+}
+
+void
+autotune_free(struct autotune_db* db)
+{
+    for(size_t i = 0; i < db->count; ++i)
+    {
+        free(db->entries[i].device);
+        free(db->entries[i].driver_version);
+    }
+    free(db->entries);
+    memset(db, 0, sizeof(*db));
+}
+
+static struct autotune_entry*
+autotune_new(struct autotune_db* db)
+{
+    struct autotune_entry* e;
+    if(db->count == db->capacity)
+    {
+        size_t capacity = db->capacity ? 2 * db->capacity : 8;
+        e = realloc(db->entries, capacity * sizeof(*e));
+        if(NULL == e)
+            return NULL;
+        db->entries = e;
+        db->capacity = capacity;
+    }
+    e = &db->entries[db->count++];
+    memset(e, 0, sizeof(*e));
+    return e;
+}
+
+static void
+autotune_copy_str(char* dst, size_t size, const char* line, const char* key)
+{
+    char* value = caps_json_str(line, key);
+    snprintf(dst, size, "%s", (NULL != value) ? value : "");
+    free(value);
+}
+
+/**
+ * Read the results from the file, none if there is no file yet.
+ */
+void
+autotune_load(struct autotune_db* db)
+{
+    const char* path = autotune_path();
+    FILE* fp;
+    char* line = NULL;
+    size_t size = 0;
+
+    memset(db, 0, sizeof(*db));
+    if(NULL == path || NULL == (fp = fopen(path, "r")))
+        return;
+    while(-1 != getline(&line, &size, fp))
+    {
+        struct autotune_entry* e;
+        const char* us = caps_json_value(line, "kernel_us");
+        if(NULL == strstr(line, "\"device\": ")
+                || NULL == (e = autotune_new(db)))
+            continue;
+        e->device = caps_json_str(line, "device");
+        e->driver_version = caps_json_str(line, "driver_version");
+        autotune_copy_str(e->kernel, sizeof(e->kernel), line, "kernel");
+        autotune_copy_str(e->config.variant, sizeof(e->config.variant),
+                line, "variant");
+        e->bucket = caps_json_ulong(line, "bucket");
+        e->config.work_per_item = caps_json_ulong(line, "work_per_item");
+        e->config.local_size = caps_json_ulong(line, "local_size");
+        e->config.kernel_us = (NULL != us) ? strtod(us, NULL) : 0.0;
+    }
+    free(line);
+    fclose(fp);
+}
+
+/**
+ * Write all the results to the file. Returns 0 on success.
+ */
+int
+autotune_save(const struct autotune_db* db)
+{
+    const char* path = autotune_path();
+    FILE* fp;
+
+    if(NULL == path || NULL == (fp = fopen(path, "w")))
+        return -1;
+    for(size_t i = 0; i < db->count; ++i)
+    {
+        const struct autotune_entry* e = &db->entries[i];
+        fprintf(fp, "{\"bucket\": %zu, \"work_per_item\": %zu, "
+                "\"local_size\": %zu, \"kernel_us\": %.3f, ", e->bucket,
+                e->config.work_per_item, e->config.local_size,
+                e->config.kernel_us);
+        caps_write_str(fp, "kernel", e->kernel);
+        fputs(", ", fp);
+        caps_write_str(fp, "variant", e->config.variant);
+        fputs(", ", fp);
+        caps_write_str(fp, "driver_version", e->driver_version);
+        fputs(", ", fp);
+        caps_write_str(fp, "device", e->device);
+        fputs("}\n", fp);
+    }
+    return fclose(fp);
+}
+
+static struct autotune_entry*
+autotune_lookup(struct autotune_db* db, cl_device_id device,
+        const char* kernel, size_t bucket)
+{
+    char* name = caps_info_str(NULL, device, CL_DEVICE_NAME);
+    char* driver_version = caps_info_str(NULL, device, CL_DRIVER_VERSION);
+    struct autotune_entry* entry = NULL;
+
+    for(size_t i = 0; i < db->count && NULL == entry; ++i)
+    {
+        struct autotune_entry* e = &db->entries[i];
+        if(e->bucket == bucket && 0 == strcmp(e->kernel, kernel)
+                && caps_same_str(e->device, name)
+                && caps_same_str(e->driver_version, driver_version))
+            entry = e;
+    }
+    free(name);
+    free(driver_version);
+    return entry;
+}
+
+/**
+ * The tuned configuration of a kernel for a problem of a given size on the
+ * device, NULL if it hasn't been tuned.
+ */
+const struct autotune_config*
+autotune_find(struct autotune_db* db, cl_device_id device,
+        const char* kernel, size_t bytes)
+{
+    struct autotune_entry* e = autotune_lookup(db, device, kernel,
+            autotune_bucket(bytes));
+    return (NULL != e) ? &e->config : NULL;
+}
+
+/**
+ * Keep a configuration as the tuned one and save the file.
+ */
+int
+autotune_store(struct autotune_db* db, cl_device_id device,
+        const char* kernel, size_t bytes, const struct autotune_config* config)
+{
+    size_t bucket = autotune_bucket(bytes);
+    struct autotune_entry* e = autotune_lookup(db, device, kernel, bucket);
+
+    if(NULL == e)
+    {
+        if(NULL == (e = autotune_new(db)))
+            return -1;
+        e->device = caps_info_str(NULL, device, CL_DEVICE_NAME);
+        e->driver_version = caps_info_str(NULL, device, CL_DRIVER_VERSION);
+        snprintf(e->kernel, sizeof(e->kernel), "%s", kernel);
+        e->bucket = bucket;
+    }
+    e->config = *config;
+    return autotune_save(db);
+}
+
+/**
+ * Local sizes to try for a kernel launched over global_size work items:
+ * 0 (up to the runtime) and the powers of two that divide global_size and
+ * fit both the device limits and the kernel's own. Returns their number.
+ */
+size_t
+autotune_local_sizes(const struct device_caps* caps, cl_device_id device,
+        cl_kernel kernel, size_t global_size, size_t* sizes, size_t max)
+{
+    size_t limit = caps->max_work_group_size;
+    size_t kernel_limit = 0;
+    size_t count = 0;
+
+    if(0 != caps->max_work_item_sizes[0]
+            && caps->max_work_item_sizes[0] < limit)
+        limit = caps->max_work_item_sizes[0];
+    if(CL_SUCCESS == clGetKernelWorkGroupInfo(kernel, device,
+                CL_KERNEL_WORK_GROUP_SIZE, sizeof(kernel_limit),
+                &kernel_limit, NULL)
+            && 0 != kernel_limit && kernel_limit < limit)
+        limit = kernel_limit;
+
+    if(count < max)
+        sizes[count++] = 0;
+    for(size_t local = 1; local <= limit && count < max; local *= 2)
+        if(0 == global_size % local)
+            sizes[count++] = local;
+    return count;
+}
+
+/**
+ * Median time of a kernel in microseconds, by the profiling events of
+ * AUTOTUNE_RUNS launches after a warm-up one. The queue must have
+ * profiling enabled and the arguments must be set. A global size of 0
+ * launches the kernel as a single work item.
+ */
+cl_int
+autotune_time(cl_command_queue queue, cl_kernel kernel, size_t global_size,
+        size_t local_size, double* kernel_us)
+{
+    cl_int rv = CL_SUCCESS;
+    double samples[AUTOTUNE_RUNS];
+    struct stats_summary s;
+
+    for(int i = -1; i < AUTOTUNE_RUNS && CL_SUCCESS == rv; ++i)
+    {
+        cl_event event;
+        cl_ulong t0 = 0, t1 = 0;
+        if(0 == global_size)
+            rv = clEnqueueTask(queue, kernel, 0, NULL, &event);
+        else
+            rv = clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &global_size,
+                    local_size ? &local_size : NULL, 0, NULL, &event);
+        if(CL_SUCCESS != rv)
+            break;
+        rv = clWaitForEvents(1, &event);
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START,
+                sizeof(t0), &t0, NULL);
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END,
+                sizeof(t1), &t1, NULL);
+        clReleaseEvent(event);
+        if(i >= 0)
+            samples[i] = (t1 - t0) / 1e3;
+    }
+    if(CL_SUCCESS != rv)
+        return rv;
+    stats_summarize(samples, AUTOTUNE_RUNS, &s);
+    *kernel_us = s.median;
+    return CL_SUCCESS;
+}
+
+#endif // OCL_LABS_AUTOTUNE_C
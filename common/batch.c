@@ -0,0 +1,289 @@
+#ifndef OCL_LABS_BATCH_C
+#define OCL_LABS_BATCH_C
+
+/*
+ * Batched submission of many small kernel launches.
+ *
+ * A batch records launches together with the values of their arguments
+ * and the launches each of them depends on, plus non-blocking reads of the
+ * results. Nothing reaches the runtime until batch_submit(), which sets
+ * the arguments and enqueues the whole batch with explicit event wait
+ * lists and flushes the queue once. On an out-of-order queue independent
+ * launches may then run concurrently; a read waits for all the launches
+ * recorded before it, so a single read can collect the results of the
+ * whole batch.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "CL/opencl.h"
+
+#include "trace.c"
+
+#define BATCH_MAX_ARGS 8
+#define BATCH_MAX_DEPS 4
+#define BATCH_ARG_SIZE 16   // enough for a cl_mem or a 4-component vector
+
+struct batch_arg
+{
+    cl_uint index;
+    size_t size;
+    int is_local;           // __local memory of size bytes, no value
+    unsigned char value[BATCH_ARG_SIZE];
+};
+
+struct batch_command
+{
+    cl_kernel kernel;       // NULL for a read
+    size_t global_size;     // 0 to launch with clEnqueueTask()
+    size_t local_size;      // 0 to let the runtime choose
+    cl_uint num_args;
+    struct batch_arg args[BATCH_MAX_ARGS];
+    cl_uint num_deps;
+    size_t deps[BATCH_MAX_DEPS]; // indices of earlier commands
+    cl_mem buffer;          // of a read
+    size_t offset;
+    size_t size;
+    void* ptr;
+};
+
+struct batch
+{
+    struct batch_command* commands;
+    size_t count;
+    size_t capacity;
+};
+
+/**
+ * Create a command queue for batches, out-of-order if the device can do
+ * it. The queue has profiling enabled.
+ */
+cl_int
+batch_create_queue(cl_context context, cl_device_id device,
+        cl_command_queue* queue, int* out_of_order)
+{
+    cl_int rv;
+    cl_command_queue_properties props = 0;
+
+    clGetDeviceInfo(device, CL_DEVICE_QUEUE_PROPERTIES, sizeof(props),
+            &props, NULL);
+    *out_of_order = 0 != (CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE & props);
+    *queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE
+            | (*out_of_order ? CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE : 0),
+            &rv);
+    if(CL_SUCCESS != rv)
+        print_cl_error("Failed to create a command queue:", rv, stderr);
+    return rv;
+}
+
+void
+batch_init(struct batch* b)
+{
+    memset(b, 0, sizeof(*b));
+}
+
+void
+batch_free(struct batch* b)
+{
+    free(b->commands);
+    batch_init(b);
+}
+
+/* Drop the recorded commands, keeping the memory for the next batch */
+void
+batch_clear(struct batch* b)
+{
+    b->count = 0;
+}
+
+static struct batch_command*
+batch_new_command(struct batch* b, size_t* index)
+{
+    struct batch_command* c;
+    if(b->count == b->capacity)
+    {
+        size_t capacity = b->capacity ? 2 * b->capacity : 64;
+        c = realloc(b->commands, capacity * sizeof(*c));
+        if(NULL == c)
+            return NULL;
+        b->commands = c;
+        b->capacity = capacity;
+    }
+    *index = b->count;
+    c = &b->commands[b->count++];
+    memset(c, 0, sizeof(*c));
+    return c;
+}
+
+/**
+ * Record a launch of the kernel over global_size work items (a task if 0).
+ * Its index is returned to set the arguments and refer to it later.
+ */
+cl_int
+batch_launch(struct batch* b, cl_kernel kernel, size_t global_size,
+        size_t local_size, size_t* index)
+{
+    struct batch_command* c = batch_new_command(b, index);
+    if(NULL == c)
+        return CL_OUT_OF_HOST_MEMORY;
+    c->kernel = kernel;
+    c->global_size = global_size;
+    c->local_size = local_size;
+    return CL_SUCCESS;
+}
+
+/**
+ * Record an argument of a launch. The value is copied, so it may change
+ * right after the call. A NULL value allocates size bytes of __local memory.
+ */
+cl_int
+batch_arg(struct batch* b, size_t index, cl_uint arg_index, size_t size,
+        const void* value)
+{
+    struct batch_command* c = &b->commands[index];
+    struct batch_arg* a;
+
+    if(NULL == c->kernel || BATCH_MAX_ARGS == c->num_args
+            || (NULL != value && size > BATCH_ARG_SIZE))
+        return CL_INVALID_ARG_SIZE;
+    a = &c->args[c->num_args++];
+    a->index = arg_index;
+    a->size = size;
+    a->is_local = (NULL == value);
+    if(NULL != value)
+        memcpy(a->value, value, size);
+    return CL_SUCCESS;
+}
+
+/**
+ * Make a command wait for an earlier one.
+ */
+cl_int
+batch_depend(struct batch* b, size_t index, size_t on)
+{
+    struct batch_command* c = &b->commands[index];
+    if(on >= index || BATCH_MAX_DEPS == c->num_deps)
+        return CL_INVALID_EVENT_WAIT_LIST;
+    c->deps[c->num_deps++] = on;
+    return CL_SUCCESS;
+}
+
+/**
+ * Record a non-blocking read of the buffer into ptr after all the launches
+ * recorded so far. The data is there once batch_submit()'s event completes.
+ */
+cl_int
+batch_read(struct batch* b, cl_mem buffer, size_t offset, size_t size,
+        void* ptr)
+{
+    size_t index;
+    struct batch_command* c = batch_new_command(b, &index);
+    if(NULL == c)
+        return CL_OUT_OF_HOST_MEMORY;
+    c->buffer = buffer;
+    c->offset = offset;
+    c->size = size;
+    c->ptr = ptr;
+    return CL_SUCCESS;
+}
+
+/**
+ * Collect the wait list of a command: its explicit dependencies, and for a
+ * read all the launches since the previous read and that read, which has
+ * waited for the launches before it.
+ */
+static cl_uint
+batch_wait_list(const struct batch* b, size_t index, const cl_event* events,
+        cl_event* wait_list)
+{
+    const struct batch_command* c = &b->commands[index];
+    cl_uint n = 0;
+
+    for(cl_uint i = 0; i < c->num_deps; ++i)
+        wait_list[n++] = events[c->deps[i]];
+    if(NULL == c->kernel)
+    {
+        size_t i = index;
+        while(i-- > 0 && NULL != b->commands[i].kernel)
+            wait_list[n++] = events[i];
+        if(i < index)
+            wait_list[n++] = events[i];
+    }
+    return n;
+}
+
+static cl_int
+batch_enqueue(const struct batch_command* c, cl_command_queue queue,
+        cl_uint num_wait, const cl_event* wait_list, cl_event* event)
+{
+    cl_int rv = CL_SUCCESS;
+    const cl_event* waits = (0 != num_wait) ? wait_list : NULL;
+
+    if(NULL == c->kernel)
+        return clEnqueueReadBuffer(queue, c->buffer, CL_FALSE, c->offset,
+                c->size, c->ptr, num_wait, waits, event);
+
+    for(cl_uint i = 0; i < c->num_args && CL_SUCCESS == rv; ++i)
+        rv = clSetKernelArg(c->kernel, c->args[i].index, c->args[i].size,
+                c->args[i].is_local ? NULL : c->args[i].value);
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Failed to set an argument:", rv, stderr);
+        return rv;
+    }
+    if(0 == c->global_size)
+        return clEnqueueTask(queue, c->kernel, num_wait, waits, event);
+    return clEnqueueNDRangeKernel(queue, c->kernel, 1, NULL, &c->global_size,
+            (0 != c->local_size) ? &c->local_size : NULL,
+            num_wait, waits, event);
+}
+
+/**
+ * Enqueue the whole batch and flush the queue once. If done is not NULL
+ * it gets an event which completes with all the commands of the batch.
+ * The batch is cleared for recording the next one.
+ */
+cl_int
+batch_submit(struct batch* b, cl_command_queue queue, cl_event* done)
+{
+    cl_int rv = CL_SUCCESS;
+    cl_event* events = calloc(b->count + 1, sizeof(cl_event));
+    cl_event* wait_list = malloc((b->count + BATCH_MAX_DEPS)
+            * sizeof(cl_event));
+
+    if(NULL == events || NULL == wait_list)
+    {
+        free(events);
+        free(wait_list);
+        return CL_OUT_OF_HOST_MEMORY;
+    }
+
+    for(size_t i = 0; i < b->count && CL_SUCCESS == rv; ++i)
+    {
+        cl_uint n = batch_wait_list(b, i, events, wait_list);
+        rv = batch_enqueue(&b->commands[i], queue, n, wait_list, &events[i]);
+        if(CL_SUCCESS != rv)
+            print_cl_error("Failed to enqueue a batched command:", rv, stderr);
+        else if(NULL == b->commands[i].kernel)
+            trace_add(events[i], "batch read", b->commands[i].size);
+        else
+            trace_add(events[i], "batch kernel", 0);
+    }
+    // a marker waits for everything enqueued before it on this queue
+    if(CL_SUCCESS == rv && NULL != done)
+        rv = clEnqueueMarker(queue, done);
+    if(CL_SUCCESS == rv)
+        rv = clFlush(queue);
+
+    for(size_t i = 0; i < b->count; ++i)
+        if(NULL != events[i])
+            clReleaseEvent(events[i]);
+    free(events);
+    free(wait_list);
+    batch_clear(b);
+    return rv;
+}
+
+#endif // OCL_LABS_BATCH_C
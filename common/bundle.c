@@ -0,0 +1,292 @@
+#ifndef OCL_LABS_BUNDLE_C
+#define OCL_LABS_BUNDLE_C
+
+/*
+ * Kernel files mapped into memory and bundles of precompiled kernels.
+ *
+ * A bundle keeps several program binaries (e.g. .aocx images built for
+ * different boards or with different kernels) together with metadata:
+ * the target device, kernel names, argument signatures and required
+ * work-group sizes. The file is memory-mapped and only the pages of the
+ * binary selected by a kernel name are ever read.
+ *
+ * Layout (host byte order, all offsets are from the start of the file):
+ *   struct bundle_header
+ *   struct bundle_entry[num_entries]
+ *   string table of strtab_size bytes ('\0'-terminated strings)
+ *   binaries, each aligned to BUNDLE_ALIGNMENT
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define BUNDLE_MAGIC "OCLBNDL1"
+#define BUNDLE_ALIGNMENT 4096
+
+struct bundle_header
+{
+    char magic[8];
+    uint32_t num_entries;
+    uint32_t strtab_size;
+};
+
+struct bundle_entry
+{
+    uint64_t offset;        // offset of the binary
+    uint64_t size;          // size of the binary
+    uint32_t device;        // target device name, "" matches any device
+    uint32_t kernels;       // comma-separated kernel names
+    uint32_t signatures;    // argument lists of the kernels, ';'-separated
+    uint32_t reqd_work_group_size[3]; // zeros if not required
+};
+
+/* A read-only memory mapping of a whole file */
+struct mapped_file
+{
+    unsigned char* data;
+    size_t size;
+};
+
+struct bundle
+{
+    struct mapped_file file;
+    const struct bundle_header* header;
+    const struct bundle_entry* entries;
+    const char* strtab;
+};
+
+/**
+ * Map a file into memory. Returns 0 on success.
+ */
+int
+map_file(const char* file_name, struct mapped_file* file)
+{
+    struct stat st;
+    int fd = open(file_name, O_RDONLY);
+    if(-1 == fd)
+    {
+        perror(file_name);
+        return -1;
+    }
+    if(fstat(fd, &st) || 0 == st.st_size)
+    {
+        fprintf(stderr, "%s: empty or unreadable file\n", file_name);
+        close(fd);
+        return -1;
+    }
+
+    file->size = st.st_size;
+    file->data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping holds its own reference to the file
+    if(MAP_FAILED == file->data)
+    {
+        perror(file_name);
+        file->data = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void
+unmap_file(struct mapped_file* file)
+{
+    if(NULL != file->data)
+        munmap(file->data, file->size);
+    file->data = NULL;
+    file->size = 0;
+}
+
+int
+is_bundle(const unsigned char* data, size_t size)
+{
+    return size >= sizeof(struct bundle_header)
+        && 0 == memcmp(data, BUNDLE_MAGIC, 8);
+}
+
+/**
+ * Look up a string in the string table of a bundle.
+ */
+const char*
+bundle_string(const struct bundle* b, uint32_t offset)
+{
+    return b->strtab + offset;
+}
+
+/**
+ * Attach to a mapped bundle and validate its tables.
+ */
+int
+bundle_attach(struct bundle* b, const struct mapped_file* file)
+{
+    const struct bundle_header* header = (const void*) file->data;
+    size_t tables_size;
+
+    if(!is_bundle(file->data, file->size)
+            || header->num_entries > file->size / sizeof(struct bundle_entry))
+        return -1;
+    tables_size = sizeof(*header)
+        + (size_t) header->num_entries * sizeof(struct bundle_entry);
+    if(tables_size + header->strtab_size > file->size
+            || 0 == header->strtab_size
+            || '\0' != file->data[tables_size + header->strtab_size - 1])
+        return -1;
+
+    b->file = *file;
+    b->header = header;
+    b->entries = (const void*) (file->data + sizeof(*header));
+    b->strtab = (const char*) file->data + tables_size;
+
+    for(uint32_t i = 0; i < header->num_entries; ++i)
+    {
+        const struct bundle_entry* e = &b->entries[i];
+        if(e->offset > file->size || e->size > file->size - e->offset
+                || e->device >= header->strtab_size
+                || e->kernels >= header->strtab_size
+                || e->signatures >= header->strtab_size)
+            return -1;
+    }
+
+    // the entries are looked up one by one, don't read ahead the binaries
+    posix_madvise(file->data, file->size, POSIX_MADV_RANDOM);
+    return 0;
+}
+
+/**
+ * Open a bundle file. Returns 0 on success.
+ */
+int
+bundle_open(struct bundle* b, const char* file_name)
+{
+    struct mapped_file file;
+    if(map_file(file_name, &file))
+        return -1;
+    if(bundle_attach(b, &file))
+    {
+        fprintf(stderr, "%s: not a valid kernel bundle\n", file_name);
+        unmap_file(&file);
+        return -1;
+    }
+    return 0;
+}
+
+void
+bundle_close(struct bundle* b)
+{
+    unmap_file(&b->file);
+}
+
+/**
+ * Find a name in a comma-separated list of names. Returns its index or -1.
+ */
+static int
+bundle_list_index(const char* list, const char* name)
+{
+    size_t len = strlen(name);
+    for(int i = 0; '\0' != *list; ++i)
+    {
+        const char* end = strchr(list, ',');
+        size_t item_len = (NULL != end) ? (size_t) (end - list) : strlen(list);
+        if(item_len == len && 0 == strncmp(list, name, len))
+            return i;
+        list += item_len + (NULL != end);
+    }
+    return -1;
+}
+
+/**
+ * Find an entry that has the kernel and targets the device.
+ * A NULL kernel name matches any entry; an entry matches a device when its
+ * device string is empty or is a part of the device name (the board name
+ * given to aoc is a prefix of CL_DEVICE_NAME on Intel FPGA platforms).
+ */
+const struct bundle_entry*
+bundle_find(const struct bundle* b, const char* kernel_name,
+        const char* device_name)
+{
+    for(uint32_t i = 0; i < b->header->num_entries; ++i)
+    {
+        const struct bundle_entry* e = &b->entries[i];
+        const char* device = bundle_string(b, e->device);
+        if(NULL != kernel_name
+                && 0 > bundle_list_index(bundle_string(b, e->kernels),
+                    kernel_name))
+            continue;
+        if(NULL != device_name && '\0' != *device
+                && NULL == strstr(device_name, device))
+            continue;
+        return e;
+    }
+    return NULL;
+}
+
+/**
+ * Get the binary of an entry. Only its pages get loaded from the disk.
+ */
+const unsigned char*
+bundle_binary(const struct bundle* b, const struct bundle_entry* e)
+{
+    uint64_t page = e->offset & ~(uint64_t) (BUNDLE_ALIGNMENT - 1);
+    posix_madvise(b->file.data + page, e->size + (e->offset - page),
+            POSIX_MADV_WILLNEED);
+    return b->file.data + e->offset;
+}
+
+/**
+ * The number of arguments of a kernel of the entry by its signature.
+ * Returns -1 if the entry has no signature for the kernel.
+ */
+int
+bundle_num_args(const struct bundle* b, const struct bundle_entry* e,
+        const char* kernel_name)
+{
+    const char* sig = bundle_string(b, e->signatures);
+    const char* end;
+    int num_args = 1;
+    int k = bundle_list_index(bundle_string(b, e->kernels), kernel_name);
+
+    // the signatures go in the order of the kernel names
+    for(; k > 0 && NULL != sig; --k)
+        if(NULL != (sig = strchr(sig, ';')))
+            ++sig;
+    if(0 != k || NULL == sig)
+        return -1;
+    if(NULL == (end = strchr(sig, ';')))
+        end = sig + strlen(sig);
+    while(sig < end && isspace((unsigned char) *sig))
+        ++sig;
+    while(end > sig && isspace((unsigned char) end[-1]))
+        --end;
+    if(sig == end)
+        return -1;
+    if(4 == end - sig && 0 == strncmp(sig, "void", 4))
+        return 0;
+    for(; sig < end; ++sig)
+        num_args += ',' == *sig;
+    return num_args;
+}
+
+void
+bundle_print(const struct bundle* b, FILE* fp)
+{
+    for(uint32_t i = 0; i < b->header->num_entries; ++i)
+    {
+        const struct bundle_entry* e = &b->entries[i];
+        fprintf(fp, "Entry #%u: %llu bytes\n", i + 1,
+                (unsigned long long) e->size);
+        fprintf(fp, "\tDevice: %s\n", bundle_string(b, e->device));
+        fprintf(fp, "\tKernels: %s\n", bundle_string(b, e->kernels));
+        fprintf(fp, "\tSignatures: %s\n", bundle_string(b, e->signatures));
+        fprintf(fp, "\tRequired work group size: %ux%ux%u\n",
+                e->reqd_work_group_size[0], e->reqd_work_group_size[1],
+                e->reqd_work_group_size[2]);
+    }
+}
+
+#endif // OCL_LABS_BUNDLE_C
@@ -0,0 +1,438 @@
+#ifndef OCL_LABS_CAPS_C
+#define OCL_LABS_CAPS_C
+
+/*
+ * Capabilities of OpenCL devices and a cache of them.
+ *
+ * caps_query() fills a struct with the limits of a device; strings are
+ * allocated to their full size. A database of all devices is written as
+ * JSON with one device per line, lab0 writes it to the cache file so that
+ * other programs can look their device up with caps_get() by its name and
+ * driver version instead of querying every parameter again. A device
+ * missing from the cache (e.g. after a driver update) is queried and added
+ * to it.
+ *
+ * Environment:
+ *  OCL_CAPS_CACHE  cache file, ".oclcaps.json" by default, "off" to
+ *                  disable the cache
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "CL/opencl.h"
+
+#include "devices.c"
+
+#define CAPS_CACHE_ENV "OCL_CAPS_CACHE"
+#define CAPS_CACHE_DEFAULT ".oclcaps.json"
+
+struct device_caps
+{
+    cl_uint platform_index;
+    cl_uint device_index;
+    char* platform;
+    char* name;
+    char* vendor;
+    char* version;
+    char* driver_version;
+    char* extensions;
+    cl_device_type type;
+    cl_uint compute_units;
+    cl_uint clock_frequency;        // MHz
+    cl_uint address_bits;
+    cl_uint mem_base_addr_align;    // bits
+    cl_uint max_work_item_dimensions;
+    size_t max_work_group_size;
+    size_t max_work_item_sizes[3];
+    cl_ulong max_mem_alloc_size;
+    cl_ulong global_mem_size;
+    cl_ulong local_mem_size;
+    cl_ulong max_constant_buffer_size;
+    cl_device_local_mem_type local_mem_type;
+    cl_command_queue_properties queue_properties;
+};
+
+struct caps_db
+{
+    struct device_caps* devices;
+    size_t count;
+    size_t capacity;
+};
+
+/**
+ * Get a string parameter of a platform or a device of whatever length.
+ * Returns NULL if it's not available.
+ */
+char*
+caps_info_str(cl_platform_id platform, cl_device_id device, cl_uint param)
+{
+    cl_int rv;
+    size_t size = 0;
+    char* value;
+
+    rv = (NULL != device)
+        ? clGetDeviceInfo(device, param, 0, NULL, &size)
+        : clGetPlatformInfo(platform, param, 0, NULL, &size);
+    if(CL_SUCCESS != rv || NULL == (value = calloc(size + 1, 1)))
+        return NULL;
+    rv = (NULL != device)
+        ? clGetDeviceInfo(device, param, size, value, NULL)
+        : clGetPlatformInfo(platform, param, size, value, NULL);
+    if(CL_SUCCESS != rv)
+    {
+        free(value);
+        return NULL;
+    }
+    return value;
+}
+
+void
+caps_free(struct device_caps* caps)
+{
+    free(caps->platform);
+    free(caps->name);
+    free(caps->vendor);
+    free(caps->version);
+    free(caps->driver_version);
+    free(caps->extensions);
+    memset(caps, 0, sizeof(*caps));
+}
+
+/**
+ * Query the capabilities of a device. Parameters the device doesn't report
+ * are left zero (or NULL for strings), the indices are left to the caller.
+ */
+void
+caps_query(cl_device_id id, struct device_caps* caps)
+{
+    cl_platform_id platform = NULL;
+
+    memset(caps, 0, sizeof(*caps));
+    clGetDeviceInfo(id, CL_DEVICE_PLATFORM, sizeof(platform), &platform,
+            NULL);
+    caps->platform = caps_info_str(platform, NULL, CL_PLATFORM_NAME);
+    caps->name = caps_info_str(NULL, id, CL_DEVICE_NAME);
+    caps->vendor = caps_info_str(NULL, id, CL_DEVICE_VENDOR);
+    caps->version = caps_info_str(NULL, id, CL_DEVICE_VERSION);
+    caps->driver_version = caps_info_str(NULL, id, CL_DRIVER_VERSION);
+    caps->extensions = caps_info_str(NULL, id, CL_DEVICE_EXTENSIONS);
+
+#define CAPS_QUERY(param, field) \
+    clGetDeviceInfo(id, param, sizeof(caps->field), &caps->field, NULL)
+    CAPS_QUERY(CL_DEVICE_TYPE, type);
+    CAPS_QUERY(CL_DEVICE_MAX_COMPUTE_UNITS, compute_units);
+    CAPS_QUERY(CL_DEVICE_MAX_CLOCK_FREQUENCY, clock_frequency);
+    CAPS_QUERY(CL_DEVICE_ADDRESS_BITS, address_bits);
+    CAPS_QUERY(CL_DEVICE_MEM_BASE_ADDR_ALIGN, mem_base_addr_align);
+    CAPS_QUERY(CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS, max_work_item_dimensions);
+    CAPS_QUERY(CL_DEVICE_MAX_WORK_GROUP_SIZE, max_work_group_size);
+    CAPS_QUERY(CL_DEVICE_MAX_WORK_ITEM_SIZES, max_work_item_sizes);
+    CAPS_QUERY(CL_DEVICE_MAX_MEM_ALLOC_SIZE, max_mem_alloc_size);
+    CAPS_QUERY(CL_DEVICE_GLOBAL_MEM_SIZE, global_mem_size);
+    CAPS_QUERY(CL_DEVICE_LOCAL_MEM_SIZE, local_mem_size);
+    CAPS_QUERY(CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE, max_constant_buffer_size);
+    CAPS_QUERY(CL_DEVICE_LOCAL_MEM_TYPE, local_mem_type);
+    CAPS_QUERY(CL_DEVICE_QUEUE_PROPERTIES, queue_properties);
+#undef CAPS_QUERY
+}
+
+static struct device_caps*
+caps_db_new(struct caps_db* db)
+{
+    struct device_caps* caps;
+    if(db->count == db->capacity)
+    {
+        size_t capacity = db->capacity ? 2 * db->capacity : 8;
+        caps = realloc(db->devices, capacity * sizeof(*caps));
+        if(NULL == caps)
+            return NULL;
+        db->devices = caps;
+        db->capacity = capacity;
+    }
+    caps = &db->devices[db->count++];
+    memset(caps, 0, sizeof(*caps));
+    return caps;
+}
+
+void
+caps_db_free(struct caps_db* db)
+{
+    for(size_t i = 0; i < db->count; ++i)
+        caps_free(&db->devices[i]);
+    free(db->devices);
+    memset(db, 0, sizeof(*db));
+}
+
+/**
+ * Query the capabilities of every device of every platform.
+ */
+cl_int
+caps_query_all(struct caps_db* db)
+{
+    cl_int rv;
+    struct device_list list;
+
+    memset(db, 0, sizeof(*db));
+    if(CL_SUCCESS != (rv = enumerate_devices(&list)))
+        return rv;
+    for(cl_uint i = 0; i < list.count; ++i)
+    {
+        struct device_caps* caps = caps_db_new(db);
+        if(NULL == caps)
+        {
+            rv = CL_OUT_OF_HOST_MEMORY;
+            break;
+        }
+        caps_query(list.devices[i].id, caps);
+        caps->platform_index = list.devices[i].platform_index;
+        caps->device_index = list.devices[i].device_index;
+    }
+    free_device_list(&list);
+    return rv;
+}
+
+static void
+caps_write_str(FILE* fp, const char* key, const char* value)
+{
+    fprintf(fp, "\"%s\": \"", key);
+    for(const char* p = (NULL != value) ? value : ""; '\0' != *p; ++p)
+    {
+        if('"' == *p || '\\' == *p)
+            fputc('\\', fp);
+        if((unsigned char) *p >= ' ')
+            fputc(*p, fp);
+    }
+    fputc('"', fp);
+}
+
+void
+caps_write_device_json(const struct device_caps* c, FILE* fp)
+{
+    fprintf(fp, "{\"platform_index\": %u, \"device_index\": %u, "
+            "\"type\": %llu, \"compute_units\": %u, "
+            "\"clock_frequency\": %u, \"address_bits\": %u, "
+            "\"mem_base_addr_align\": %u, \"max_work_item_dimensions\": %u, "
+            "\"max_work_group_size\": %zu, "
+            "\"max_work_item_sizes\": [%zu, %zu, %zu], "
+            "\"max_mem_alloc_size\": %llu, \"global_mem_size\": %llu, "
+            "\"local_mem_size\": %llu, \"max_constant_buffer_size\": %llu, "
+            "\"local_mem_type\": %u, \"queue_properties\": %llu, ",
+            c->platform_index, c->device_index,
+            (unsigned long long) c->type, c->compute_units,
+            c->clock_frequency, c->address_bits, c->mem_base_addr_align,
+            c->max_work_item_dimensions, c->max_work_group_size,
+            c->max_work_item_sizes[0], c->max_work_item_sizes[1],
+            c->max_work_item_sizes[2],
+            (unsigned long long) c->max_mem_alloc_size,
+            (unsigned long long) c->global_mem_size,
+            (unsigned long long) c->local_mem_size,
+            (unsigned long long) c->max_constant_buffer_size,
+            (unsigned int) c->local_mem_type,
+            (unsigned long long) c->queue_properties);
+    // strings go last, so they can't shadow the keys above
+    caps_write_str(fp, "platform", c->platform);
+    fputs(", ", fp);
+    caps_write_str(fp, "name", c->name);
+    fputs(", ", fp);
+    caps_write_str(fp, "vendor", c->vendor);
+    fputs(", ", fp);
+    caps_write_str(fp, "version", c->version);
+    fputs(", ", fp);
+    caps_write_str(fp, "driver_version", c->driver_version);
+    fputs(", ", fp);
+    caps_write_str(fp, "extensions", c->extensions);
+    fputc('}', fp);
+}
+
+void
+caps_write_json(const struct caps_db* db, FILE* fp)
+{
+    fputs("{\"devices\": [\n", fp);
+    for(size_t i = 0; i < db->count; ++i)
+    {
+        caps_write_device_json(&db->devices[i], fp);
+        fputs((i + 1 < db->count) ? ",\n" : "\n", fp);
+    }
+    fputs("]}\n", fp);
+}
+
+static const char*
+caps_json_value(const char* line, const char* key)
+{
+    char pattern[64];
+    const char* p;
+    snprintf(pattern, sizeof(pattern), "\"%s\": ", key);
+    p = strstr(line, pattern);
+    return (NULL != p) ? p + strlen(pattern) : NULL;
+}
+
+static cl_ulong
+caps_json_ulong(const char* line, const char* key)
+{
+    const char* p = caps_json_value(line, key);
+    return (NULL != p) ? strtoull(p, NULL, 10) : 0;
+}
+
+static char*
+caps_json_str(const char* line, const char* key)
+{
+    const char* p = caps_json_value(line, key);
+    char* value;
+    size_t n = 0;
+
+    if(NULL == p || '"' != *p++ || NULL == (value = malloc(strlen(p) + 1)))
+        return NULL;
+    for(; '\0' != *p && '"' != *p; ++p)
+    {
+        if('\\' == *p && '\0' != p[1])
+            ++p;
+        value[n++] = *p;
+    }
+    value[n] = '\0';
+    return value;
+}
+
+/**
+ * Parse a line written by caps_write_device_json(). Returns 0 on success.
+ */
+int
+caps_read_device_json(const char* line, struct device_caps* c)
+{
+    const char* sizes;
+
+    memset(c, 0, sizeof(*c));
+    if(NULL == (c->name = caps_json_str(line, "name")))
+        return -1;
+    c->platform = caps_json_str(line, "platform");
+    c->vendor = caps_json_str(line, "vendor");
+    c->version = caps_json_str(line, "version");
+    c->driver_version = caps_json_str(line, "driver_version");
+    c->extensions = caps_json_str(line, "extensions");
+    c->platform_index = caps_json_ulong(line, "platform_index");
+    c->device_index = caps_json_ulong(line, "device_index");
+    c->type = caps_json_ulong(line, "type");
+    c->compute_units = caps_json_ulong(line, "compute_units");
+    c->clock_frequency = caps_json_ulong(line, "clock_frequency");
+    c->address_bits = caps_json_ulong(line, "address_bits");
+    c->mem_base_addr_align = caps_json_ulong(line, "mem_base_addr_align");
+    c->max_work_item_dimensions =
+        caps_json_ulong(line, "max_work_item_dimensions");
+    c->max_work_group_size = caps_json_ulong(line, "max_work_group_size");
+    c->max_mem_alloc_size = caps_json_ulong(line, "max_mem_alloc_size");
+    c->global_mem_size = caps_json_ulong(line, "global_mem_size");
+    c->local_mem_size = caps_json_ulong(line, "local_mem_size");
+    c->max_constant_buffer_size =
+        caps_json_ulong(line, "max_constant_buffer_size");
+    c->local_mem_type = caps_json_ulong(line, "local_mem_type");
+    c->queue_properties = caps_json_ulong(line, "queue_properties");
+    sizes = caps_json_value(line, "max_work_item_sizes");
+    if(NULL != sizes)
+        sscanf(sizes, "[%zu, %zu, %zu]", &c->max_work_item_sizes[0],
+                &c->max_work_item_sizes[1], &c->max_work_item_sizes[2]);
+    return 0;
+}
+
+/**
+ * Path of the cache file or NULL if the cache is disabled.
+ */
+const char*
+caps_cache_path(void)
+{
+    const char* path = getenv(CAPS_CACHE_ENV);
+    if(NULL == path || '\0' == *path)
+        return CAPS_CACHE_DEFAULT;
+    return (0 == strcmp(path, "off")) ? NULL : path;
+}
+
+/**
+ * Read the database from a file. Lines longer than the buffer are read
+ * in full, nothing is truncated.
+ */
+int
+caps_read_file(const char* path, struct caps_db* db)
+{
+    FILE* fp;
+    char* line = NULL;
+    size_t size = 0;
+
+    memset(db, 0, sizeof(*db));
+    if(NULL == path || NULL == (fp = fopen(path, "r")))
+        return -1;
+    while(-1 != getline(&line, &size, fp))
+    {
+        struct device_caps c;
+        struct device_caps* slot;
+        if(0 != caps_read_device_json(line, &c))
+            continue;
+        if(NULL == (slot = caps_db_new(db)))
+        {
+            caps_free(&c);
+            break;
+        }
+        *slot = c;
+    }
+    free(line);
+    fclose(fp);
+    return 0;
+}
+
+int
+caps_write_file(const char* path, const struct caps_db* db)
+{
+    FILE* fp;
+    if(NULL == path || NULL == (fp = fopen(path, "w")))
+        return -1;
+    caps_write_json(db, fp);
+    return fclose(fp);
+}
+
+static int
+caps_same_str(const char* a, const char* b)
+{
+    return NULL != a && NULL != b && 0 == strcmp(a, b);
+}
+
+/**
+ * Capabilities of a device from the database, looked up by its name and
+ * driver version. A device which is not there yet is queried and added to
+ * the cache file. Returns NULL on failure. The pointer is valid until the
+ * next call.
+ */
+const struct device_caps*
+caps_get(struct caps_db* db, cl_device_id device)
+{
+    char* name = caps_info_str(NULL, device, CL_DEVICE_NAME);
+    char* driver_version = caps_info_str(NULL, device, CL_DRIVER_VERSION);
+    struct device_caps* caps = NULL;
+
+    for(size_t i = 0; i < db->count && NULL == caps; ++i)
+    {
+        struct device_caps* c = &db->devices[i];
+        if(caps_same_str(c->name, name)
+                && caps_same_str(c->driver_version, driver_version))
+            caps = c;
+    }
+    free(name);
+    free(driver_version);
+    if(NULL != caps)
+        return caps;
+
+    if(NULL == (caps = caps_db_new(db)))
+        return NULL;
+    caps_query(device, caps);
+    caps_write_file(caps_cache_path(), db);
+    return caps;
+}
+
+/**
+ * Load the cache into the database, empty if there's no cache yet.
+ */
+void
+caps_load(struct caps_db* db)
+{
+    caps_read_file(caps_cache_path(), db);
+}
+
+#endif // OCL_LABS_CAPS_C
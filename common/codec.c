@@ -0,0 +1,498 @@
+#ifndef OCL_LABS_CODEC_C
+#define OCL_LABS_CODEC_C
+
+/*
+ * Compressed transfers of int arrays.
+ *
+ * The codec cuts the ints into blocks of CODEC_BLOCK and stores a block as
+ * its first value, the bit width of its deltas and the deltas of the
+ * following values, zigzag-encoded (small negative deltas become small
+ * numbers) and packed at that width. Slowly changing data such as sensor
+ * samples or counters packs into a few bits per value, random data doesn't
+ * pack at all. The stream of words is
+ *  count, number of blocks, offset of every block, end of the stream,
+ *  the blocks
+ * with the offsets in words from the start of the stream, so that every
+ * block can be decoded on its own. lab1/codec.cl has the same codec for
+ * the device.
+ *
+ * codec_write() encodes on the host, writes the stream and decodes it into
+ * the destination buffer on the device; codec_read() encodes the buffer on
+ * the device, reads the stream and decodes it on the host. A policy per
+ * buffer decides whether a transfer is compressed: in the auto mode it
+ * times both ways end to end, keeps the faster one and tries the other one
+ * again every CODEC_PROBE_INTERVAL transfers, since the data may change.
+ * A stream that isn't smaller than the data goes as it is.
+ *
+ * Environment:
+ *  OCL_CODEC  auto (default), on or off
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "CL/opencl.h"
+
+#include "stats.c"
+#include "trace.c"
+
+#define CODEC_BLOCK 256                     // as in codec.cl
+#define CODEC_HEADER 2
+#define CODEC_SLOT (2 + CODEC_BLOCK)
+#define CODEC_PROBE_INTERVAL 16
+
+enum codec_mode
+{
+    CODEC_UNSET = -1,
+    CODEC_AUTO,
+    CODEC_ON,
+    CODEC_OFF,
+    CODEC_NUM_MODES
+};
+
+struct codec_policy
+{
+    enum codec_mode mode;
+    double plain_ns;            // per byte of the last plain transfer
+    double packed_ns;           // per byte of the last compressed one
+    double ratio;               // of the data to the last stream
+    unsigned int num_transfers;
+    unsigned int num_packed;
+};
+
+/* The kernels of lab1/codec.cl and their buffers */
+struct codec_device
+{
+    cl_command_queue queue;
+    cl_kernel decode;
+    cl_kernel encode;
+    cl_kernel offsets;
+    cl_kernel compact;
+    cl_mem stream;
+    cl_mem slots;
+    cl_mem sizes;
+    cl_uint* host_stream;
+    size_t max_count;
+};
+
+static const char * const g_codec_mode_names[] = { "auto", "on", "off" };
+static enum codec_mode g_codec_mode = CODEC_UNSET;
+
+const char*
+codec_mode_str(enum codec_mode mode)
+{
+    return (mode >= CODEC_AUTO && mode < CODEC_NUM_MODES)
+        ? g_codec_mode_names[mode] : "?";
+}
+
+cl_int
+codec_mode_from_str(const char* name, enum codec_mode* mode)
+{
+    for(int i = CODEC_AUTO; i < CODEC_NUM_MODES; ++i)
+    {
+        if(0 == strcmp(name, g_codec_mode_names[i]))
+        {
+            *mode = i;
+            return CL_SUCCESS;
+        }
+    }
+    fprintf(stderr, "Unknown compression mode: %s\n", name);
+    return CL_INVALID_VALUE;
+}
+
+/**
+ * Default mode; the first call picks it up from OCL_CODEC.
+ */
+enum codec_mode
+codec_mode(void)
+{
+    if(CODEC_UNSET == g_codec_mode)
+    {
+        const char* env = getenv("OCL_CODEC");
+        g_codec_mode = CODEC_AUTO;
+        if(NULL != env && '\0' != *env
+                && CL_SUCCESS != codec_mode_from_str(env, &g_codec_mode))
+            g_codec_mode = CODEC_AUTO;
+    }
+    return g_codec_mode;
+}
+
+size_t
+codec_num_blocks(size_t count)
+{
+    return (count + CODEC_BLOCK - 1) / CODEC_BLOCK;
+}
+
+/**
+ * Words of the longest stream of count ints.
+ */
+size_t
+codec_max_words(size_t count)
+{
+    size_t num_blocks = codec_num_blocks(count);
+    return CODEC_HEADER + num_blocks + 1 + num_blocks * CODEC_SLOT;
+}
+
+static cl_uint
+codec_zigzag(cl_uint delta)
+{
+    return (delta << 1) ^ (cl_uint) ((cl_int) delta >> 31);
+}
+
+/**
+ * Encode count ints into a stream of at most codec_max_words(count) words.
+ * Returns the number of words.
+ */
+size_t
+codec_encode(const cl_int* in, size_t count, cl_uint* out)
+{
+    size_t num_blocks = codec_num_blocks(count);
+    size_t offset = CODEC_HEADER + num_blocks + 1;
+
+    out[0] = count;
+    out[1] = num_blocks;
+    for(size_t b = 0; b < num_blocks; ++b)
+    {
+        const cl_uint* values = (const cl_uint*) in + b * CODEC_BLOCK;
+        size_t n = (count - b * CODEC_BLOCK < CODEC_BLOCK)
+            ? count - b * CODEC_BLOCK : CODEC_BLOCK;
+        cl_uint* block = out + offset;
+        cl_uint bits = 0, width = 0;
+        size_t num_words;
+
+        for(size_t j = 1; j < n; ++j)
+            bits |= codec_zigzag(values[j] - values[j - 1]);
+        while(width < 32 && 0 != (bits >> width))
+            ++width;
+        num_words = ((n - 1) * width + 31) / 32;
+
+        out[CODEC_HEADER + b] = offset;
+        block[0] = values[0];
+        block[1] = width;
+        memset(block + 2, 0, num_words * sizeof(cl_uint));
+        for(size_t j = 1; j < n && 0 != width; ++j)
+        {
+            cl_uint z = codec_zigzag(values[j] - values[j - 1]);
+            size_t bit = (j - 1) * width;
+            size_t shift = bit % 32;
+            block[2 + bit / 32] |= z << shift;
+            if(shift + width > 32)
+                block[3 + bit / 32] |= z >> (32 - shift);
+        }
+        offset += 2 + num_words;
+    }
+    out[CODEC_HEADER + num_blocks] = offset;
+    return offset;
+}
+
+/**
+ * Decode a stream of num_words words into count ints. Returns 0 on
+ * success, -1 if the stream is not one of count ints.
+ */
+int
+codec_decode(const cl_uint* in, size_t num_words, cl_int* out, size_t count)
+{
+    size_t num_blocks = codec_num_blocks(count);
+
+    if(num_words < CODEC_HEADER + num_blocks + 1 || in[0] != count
+            || in[1] != num_blocks || in[CODEC_HEADER + num_blocks] > num_words)
+        return -1;
+    for(size_t b = 0; b < num_blocks; ++b)
+    {
+        size_t offset = in[CODEC_HEADER + b];
+        const cl_uint* block = in + offset;
+        cl_uint* values = (cl_uint*) out + b * CODEC_BLOCK;
+        size_t n = (count - b * CODEC_BLOCK < CODEC_BLOCK)
+            ? count - b * CODEC_BLOCK : CODEC_BLOCK;
+        cl_uint width, value;
+        cl_ulong mask;
+
+        // the first value and the width must be in the stream to be read
+        if(offset < CODEC_HEADER + num_blocks + 1 || offset + 2 > num_words)
+            return -1;
+        width = block[1];
+        value = block[0];
+        if(width > 32 || offset + 2 + ((n - 1) * width + 31) / 32 > num_words)
+            return -1;
+        mask = ((cl_ulong) 1 << width) - 1;
+        values[0] = value;
+        for(size_t j = 1; j < n; ++j)
+        {
+            size_t bit = (j - 1) * width;
+            size_t shift = bit % 32;
+            cl_ulong v = (0 != width) ? block[2 + bit / 32] : 0;
+            cl_uint z;
+            if(shift + width > 32)
+                v |= (cl_ulong) block[3 + bit / 32] << 32;
+            z = (cl_uint) ((v >> shift) & mask);
+            value += (z >> 1) ^ -(z & 1);
+            values[j] = value;
+        }
+    }
+    return 0;
+}
+
+void
+codec_policy_init(struct codec_policy* p, enum codec_mode mode)
+{
+    memset(p, 0, sizeof(*p));
+    p->mode = (CODEC_UNSET == mode) ? codec_mode() : mode;
+}
+
+/**
+ * Whether the next transfer should be compressed.
+ */
+int
+codec_policy_pack(const struct codec_policy* p)
+{
+    int packed_wins;
+
+    if(CODEC_AUTO != p->mode)
+        return CODEC_ON == p->mode;
+    // measure both ways first
+    if(0.0 == p->plain_ns)
+        return 0;
+    if(0.0 == p->packed_ns)
+        return 1;
+    packed_wins = p->packed_ns < p->plain_ns;
+    if(0 == p->num_transfers % CODEC_PROBE_INTERVAL)
+        return !packed_wins;
+    return packed_wins;
+}
+
+/**
+ * Record how long a transfer of bytes took; packed tells whether it was
+ * meant to be compressed, even if it went as it was.
+ */
+void
+codec_policy_update(struct codec_policy* p, int packed, size_t bytes,
+        double seconds)
+{
+    double ns = seconds * 1e9 / ((0 != bytes) ? bytes : 1);
+    if(packed)
+        p->packed_ns = ns;
+    else
+        p->plain_ns = ns;
+    ++p->num_transfers;
+}
+
+void
+codec_print_policy(const struct codec_policy* p, FILE* fp)
+{
+    fprintf(fp, "%s: %u of %u transfer(s) compressed, ratio %.2f, "
+            "%.3f ns/B plain, %.3f ns/B compressed\n", codec_mode_str(p->mode),
+            p->num_packed, p->num_transfers, p->ratio, p->plain_ns,
+            p->packed_ns);
+}
+
+void
+codec_device_release(struct codec_device* cd)
+{
+    cl_kernel kernels[] = { cd->decode, cd->encode, cd->offsets, cd->compact };
+    cl_mem buffers[] = { cd->stream, cd->slots, cd->sizes };
+
+    for(size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); ++i)
+        if(NULL != kernels[i])
+            clReleaseKernel(kernels[i]);
+    for(size_t i = 0; i < sizeof(buffers) / sizeof(buffers[0]); ++i)
+        if(NULL != buffers[i])
+            clReleaseMemObject(buffers[i]);
+    free(cd->host_stream);
+    memset(cd, 0, sizeof(*cd));
+}
+
+/**
+ * Create the kernels of the program (built from lab1/codec.cl) and the
+ * buffers for transfers of up to max_count ints. The commands go to the
+ * queue, which must be in-order.
+ */
+cl_int
+codec_device_init(struct codec_device* cd, cl_context context,
+        cl_command_queue queue, cl_program program, size_t max_count)
+{
+    cl_int rv = CL_SUCCESS;
+    size_t num_blocks = codec_num_blocks(max_count);
+    size_t stream_size = codec_max_words(max_count) * sizeof(cl_uint);
+    const char* names[] = {
+        "codec_decode", "codec_encode", "codec_offsets", "codec_compact"
+    };
+    cl_kernel* kernels[] = {
+        &cd->decode, &cd->encode, &cd->offsets, &cd->compact
+    };
+
+    memset(cd, 0, sizeof(*cd));
+    cd->queue = queue;
+    cd->max_count = max_count;
+    for(size_t i = 0; i < 4 && CL_SUCCESS == rv; ++i)
+    {
+        *kernels[i] = clCreateKernel(program, names[i], &rv);
+        if(CL_SUCCESS != rv)
+            fprintf(stderr, "No kernel %s: %s\n", names[i],
+                    cl_error_str(rv));
+    }
+    if(CL_SUCCESS == rv)
+        cd->stream = clCreateBuffer(context, CL_MEM_READ_WRITE, stream_size,
+                NULL, &rv);
+    if(CL_SUCCESS == rv)
+        cd->slots = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                num_blocks * CODEC_SLOT * sizeof(cl_uint), NULL, &rv);
+    if(CL_SUCCESS == rv)
+        cd->sizes = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                num_blocks * sizeof(cl_uint), NULL, &rv);
+    if(CL_SUCCESS == rv && NULL == (cd->host_stream = malloc(stream_size)))
+        rv = CL_OUT_OF_HOST_MEMORY;
+    if(CL_SUCCESS != rv)
+        codec_device_release(cd);
+    return rv;
+}
+
+static cl_int
+codec_write_packed(struct codec_device* cd, struct codec_policy* p,
+        cl_mem dst, const cl_int* src, size_t count)
+{
+    cl_int rv;
+    size_t num_words = codec_encode(src, count, cd->host_stream);
+    size_t global_size = codec_num_blocks(count);
+
+    p->ratio = (double) count / num_words;
+    // not worth the decoding
+    if(num_words >= count)
+        return clEnqueueWriteBuffer(cd->queue, dst, CL_TRUE, 0,
+                count * sizeof(cl_int), src, 0, NULL,
+                trace_event("codec write", count * sizeof(cl_int)));
+
+    rv = clEnqueueWriteBuffer(cd->queue, cd->stream, CL_FALSE, 0,
+            num_words * sizeof(cl_uint), cd->host_stream, 0, NULL,
+            trace_event("codec write packed", num_words * sizeof(cl_uint)));
+    rv |= clSetKernelArg(cd->decode, 0, sizeof(cl_mem), &dst);
+    rv |= clSetKernelArg(cd->decode, 1, sizeof(cl_mem), &cd->stream);
+    if(CL_SUCCESS == rv)
+        rv = clEnqueueNDRangeKernel(cd->queue, cd->decode, 1, NULL,
+                &global_size, NULL, 0, NULL,
+                trace_event("codec decode", count * sizeof(cl_int)));
+    if(CL_SUCCESS == rv)
+        rv = clFinish(cd->queue);
+    if(CL_SUCCESS == rv)
+        ++p->num_packed;
+    return rv;
+}
+
+/**
+ * Write count ints to a buffer, compressed if the policy says so. Returns
+ * when the data is in the buffer.
+ */
+cl_int
+codec_write(struct codec_device* cd, struct codec_policy* p, cl_mem dst,
+        const cl_int* src, size_t count)
+{
+    cl_int rv;
+    int packed = codec_policy_pack(p);
+    double start = stats_now();
+
+    if(count > cd->max_count)
+        return CL_INVALID_BUFFER_SIZE;
+    if(packed)
+        rv = codec_write_packed(cd, p, dst, src, count);
+    else
+        rv = clEnqueueWriteBuffer(cd->queue, dst, CL_TRUE, 0,
+                count * sizeof(cl_int), src, 0, NULL,
+                trace_event("codec write", count * sizeof(cl_int)));
+    if(CL_SUCCESS == rv)
+        codec_policy_update(p, packed, count * sizeof(cl_int),
+                stats_now() - start);
+    return rv;
+}
+
+static cl_int
+codec_read_packed(struct codec_device* cd, struct codec_policy* p,
+        cl_mem src, cl_int* dst, size_t count)
+{
+    cl_int rv;
+    cl_uint n = count;
+    cl_uint num_blocks = codec_num_blocks(count);
+    size_t global_size = num_blocks;
+    size_t header = CODEC_HEADER + num_blocks + 1;
+    size_t num_words;
+
+    rv  = clSetKernelArg(cd->encode, 0, sizeof(cl_mem), &cd->slots);
+    rv |= clSetKernelArg(cd->encode, 1, sizeof(cl_mem), &cd->sizes);
+    rv |= clSetKernelArg(cd->encode, 2, sizeof(cl_mem), &src);
+    rv |= clSetKernelArg(cd->encode, 3, sizeof(cl_uint), &n);
+    rv |= clSetKernelArg(cd->offsets, 0, sizeof(cl_mem), &cd->stream);
+    rv |= clSetKernelArg(cd->offsets, 1, sizeof(cl_mem), &cd->sizes);
+    rv |= clSetKernelArg(cd->offsets, 2, sizeof(cl_uint), &n);
+    rv |= clSetKernelArg(cd->offsets, 3, sizeof(cl_uint), &num_blocks);
+    rv |= clSetKernelArg(cd->compact, 0, sizeof(cl_mem), &cd->stream);
+    rv |= clSetKernelArg(cd->compact, 1, sizeof(cl_mem), &cd->slots);
+    rv |= clSetKernelArg(cd->compact, 2, sizeof(cl_mem), &cd->sizes);
+    rv |= clSetKernelArg(cd->compact, 3, sizeof(cl_uint), &num_blocks);
+    if(CL_SUCCESS == rv)
+        rv = clEnqueueNDRangeKernel(cd->queue, cd->encode, 1, NULL,
+                &global_size, NULL, 0, NULL,
+                trace_event("codec encode", count * sizeof(cl_int)));
+    if(CL_SUCCESS == rv)
+        rv = clEnqueueTask(cd->queue, cd->offsets, 0, NULL,
+                trace_event("codec offsets", 0));
+    if(CL_SUCCESS == rv)
+        rv = clEnqueueNDRangeKernel(cd->queue, cd->compact, 1, NULL,
+                &global_size, NULL, 0, NULL, trace_event("codec compact", 0));
+    // the header tells how much of the stream there is to read
+    if(CL_SUCCESS == rv)
+        rv = clEnqueueReadBuffer(cd->queue, cd->stream, CL_TRUE, 0,
+                header * sizeof(cl_uint), cd->host_stream, 0, NULL,
+                trace_event("codec read header", header * sizeof(cl_uint)));
+    if(CL_SUCCESS != rv)
+        return rv;
+
+    num_words = cd->host_stream[header - 1];
+    if(num_words < header || num_words > codec_max_words(count))
+        return CL_INVALID_VALUE;
+    p->ratio = (double) count / num_words;
+    // not worth the reading of the stream, the buffer is as small
+    if(num_words >= count)
+        return clEnqueueReadBuffer(cd->queue, src, CL_TRUE, 0,
+                count * sizeof(cl_int), dst, 0, NULL,
+                trace_event("codec read", count * sizeof(cl_int)));
+    rv = clEnqueueReadBuffer(cd->queue, cd->stream, CL_TRUE,
+            header * sizeof(cl_uint), (num_words - header) * sizeof(cl_uint),
+            cd->host_stream + header, 0, NULL, trace_event("codec read packed",
+                (num_words - header) * sizeof(cl_uint)));
+    if(CL_SUCCESS != rv)
+        return rv;
+    if(0 != codec_decode(cd->host_stream, num_words, dst, count))
+    {
+        fputs("The stream read from the device is broken\n", stderr);
+        return CL_INVALID_VALUE;
+    }
+    ++p->num_packed;
+    return CL_SUCCESS;
+}
+
+/**
+ * Read count ints from a buffer, compressed if the policy says so. The
+ * commands before must be in the queue of the codec.
+ */
+cl_int
+codec_read(struct codec_device* cd, struct codec_policy* p, cl_mem src,
+        cl_int* dst, size_t count)
+{
+    cl_int rv;
+    int packed = codec_policy_pack(p);
+    double start = stats_now();
+
+    if(count > cd->max_count)
+        return CL_INVALID_BUFFER_SIZE;
+    if(packed)
+        rv = codec_read_packed(cd, p, src, dst, count);
+    else
+        rv = clEnqueueReadBuffer(cd->queue, src, CL_TRUE, 0,
+                count * sizeof(cl_int), dst, 0, NULL,
+                trace_event("codec read", count * sizeof(cl_int)));
+    if(CL_SUCCESS == rv)
+        codec_policy_update(p, packed, count * sizeof(cl_int),
+                stats_now() - start);
+    return rv;
+}
+
+#endif // OCL_LABS_CODEC_C
@@ -0,0 +1,257 @@
+#ifndef OCL_LABS_CPUREF_C
+#define OCL_LABS_CPUREF_C
+
+/*
+ * Reference implementation of the lab kernels on the host CPU.
+ *
+ * It serves as a fallback when there is no OpenCL device, as the expected
+ * output the device results are checked against and as the baseline an
+ * offload has to beat. The copy of lab3/core.cl (all its variants move
+ * the same data) has a portable C path and SIMD paths for SSE2, AVX2 and
+ * NEON; the best one the CPU supports is picked at run time, the others
+ * are built with per-function target attributes so one binary runs
+ * everywhere.
+ *
+ * Environment:
+ *  OCL_CPUREF  scalar, sse2, avx2 or neon to force a path; one the CPU
+ *              doesn't support falls back to the best available
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "CL/opencl.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPUREF_HAVE_X86
+#include <immintrin.h>
+#elif defined(__aarch64__) || defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define CPUREF_HAVE_NEON
+#define CPUREF_TARGET_NEON
+#include <arm_neon.h>
+#elif defined(__arm__) && __GNUC__ >= 8
+/* the default armhf target has no NEON, enable it for its path only */
+#define CPUREF_HAVE_NEON
+#define CPUREF_TARGET_NEON __attribute__((target("fpu=neon")))
+#include <arm_neon.h>
+#endif
+
+#if defined(__arm__) && defined(CPUREF_HAVE_NEON)
+#include <sys/auxv.h>
+#define CPUREF_HWCAP_NEON (1 << 12)
+#endif
+
+enum cpuref_isa
+{
+    CPUREF_UNSET = -1,
+    CPUREF_SCALAR,
+    CPUREF_SSE2,
+    CPUREF_AVX2,
+    CPUREF_NEON,
+    CPUREF_NUM_ISAS
+};
+
+/* out[i] = in[i] for count ints, the inout kernel of lab3 */
+typedef void (*cpuref_copy_fn)(cl_int* out, const cl_int* in, size_t count);
+
+struct cpuref
+{
+    enum cpuref_isa isa;
+    cpuref_copy_fn copy;
+};
+
+static const char * const g_cpuref_isa_names[] = {
+    "scalar", "sse2", "avx2", "neon"
+};
+
+const char*
+cpuref_isa_str(enum cpuref_isa isa)
+{
+    return (isa >= CPUREF_SCALAR && isa < CPUREF_NUM_ISAS)
+        ? g_cpuref_isa_names[isa] : "?";
+}
+
+cl_int
+cpuref_isa_from_str(const char* name, enum cpuref_isa* isa)
+{
+    for(int i = CPUREF_SCALAR; i < CPUREF_NUM_ISAS; ++i)
+    {
+        if(0 == strcmp(name, g_cpuref_isa_names[i]))
+        {
+            *isa = i;
+            return CL_SUCCESS;
+        }
+    }
+    fprintf(stderr, "Unknown instruction set: %s\n", name);
+    return CL_INVALID_VALUE;
+}
+
+/**
+ * The inout kernel of lab1/core.cl.
+ */
+void
+cpuref_inout(cl_int* out, cl_int in)
+{
+    *out = in;
+}
+
+static void
+cpuref_copy_scalar(cl_int* out, const cl_int* in, size_t count)
+{
+    for(size_t i = 0; i < count; ++i)
+        out[i] = in[i];
+}
+
+#ifdef CPUREF_HAVE_X86
+__attribute__((target("sse2"))) static void
+cpuref_copy_sse2(cl_int* out, const cl_int* in, size_t count)
+{
+    size_t i = 0;
+    // four 16-byte vectors an iteration, a cache line
+    for(; i + 16 <= count; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*) (in + i));
+        __m128i b = _mm_loadu_si128((const __m128i*) (in + i + 4));
+        __m128i c = _mm_loadu_si128((const __m128i*) (in + i + 8));
+        __m128i d = _mm_loadu_si128((const __m128i*) (in + i + 12));
+        _mm_storeu_si128((__m128i*) (out + i), a);
+        _mm_storeu_si128((__m128i*) (out + i + 4), b);
+        _mm_storeu_si128((__m128i*) (out + i + 8), c);
+        _mm_storeu_si128((__m128i*) (out + i + 12), d);
+    }
+    cpuref_copy_scalar(out + i, in + i, count - i);
+}
+
+__attribute__((target("avx2"))) static void
+cpuref_copy_avx2(cl_int* out, const cl_int* in, size_t count)
+{
+    size_t i = 0;
+    for(; i + 32 <= count; i += 32)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i*) (in + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*) (in + i + 8));
+        __m256i c = _mm256_loadu_si256((const __m256i*) (in + i + 16));
+        __m256i d = _mm256_loadu_si256((const __m256i*) (in + i + 24));
+        _mm256_storeu_si256((__m256i*) (out + i), a);
+        _mm256_storeu_si256((__m256i*) (out + i + 8), b);
+        _mm256_storeu_si256((__m256i*) (out + i + 16), c);
+        _mm256_storeu_si256((__m256i*) (out + i + 24), d);
+    }
+    cpuref_copy_scalar(out + i, in + i, count - i);
+}
+#endif // CPUREF_HAVE_X86
+
+#ifdef CPUREF_HAVE_NEON
+CPUREF_TARGET_NEON static void
+cpuref_copy_neon(cl_int* out, const cl_int* in, size_t count)
+{
+    size_t i = 0;
+    for(; i + 16 <= count; i += 16)
+    {
+        int32x4_t a = vld1q_s32(in + i);
+        int32x4_t b = vld1q_s32(in + i + 4);
+        int32x4_t c = vld1q_s32(in + i + 8);
+        int32x4_t d = vld1q_s32(in + i + 12);
+        vst1q_s32(out + i, a);
+        vst1q_s32(out + i + 4, b);
+        vst1q_s32(out + i + 8, c);
+        vst1q_s32(out + i + 12, d);
+    }
+    cpuref_copy_scalar(out + i, in + i, count - i);
+}
+#endif // CPUREF_HAVE_NEON
+
+/**
+ * Check whether this build has the path and the CPU can run it.
+ */
+int
+cpuref_supported(enum cpuref_isa isa)
+{
+    switch(isa)
+    {
+        case CPUREF_SCALAR:
+            return 1;
+#ifdef CPUREF_HAVE_X86
+        case CPUREF_SSE2:
+            return __builtin_cpu_supports("sse2");
+        case CPUREF_AVX2:
+            return __builtin_cpu_supports("avx2");
+#endif
+#ifdef CPUREF_HAVE_NEON
+        case CPUREF_NEON:
+#ifdef CPUREF_HWCAP_NEON
+            return 0 != (getauxval(AT_HWCAP) & CPUREF_HWCAP_NEON);
+#else
+            return 1; // a part of the base instruction set
+#endif
+#endif
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Set up the reference on a given path, the best supported one for
+ * CPUREF_UNSET. Returns CL_INVALID_VALUE if the CPU can't run the path.
+ */
+cl_int
+cpuref_init_isa(struct cpuref* ref, enum cpuref_isa isa)
+{
+    if(CPUREF_UNSET == isa)
+    {
+        for(isa = CPUREF_NUM_ISAS - 1; isa > CPUREF_SCALAR; --isa)
+            if(cpuref_supported(isa))
+                break;
+    }
+    if(!cpuref_supported(isa))
+        return CL_INVALID_VALUE;
+
+    ref->isa = isa;
+    switch(isa)
+    {
+#ifdef CPUREF_HAVE_X86
+        case CPUREF_SSE2: ref->copy = cpuref_copy_sse2; break;
+        case CPUREF_AVX2: ref->copy = cpuref_copy_avx2; break;
+#endif
+#ifdef CPUREF_HAVE_NEON
+        case CPUREF_NEON: ref->copy = cpuref_copy_neon; break;
+#endif
+        default: ref->copy = cpuref_copy_scalar; break;
+    }
+    return CL_SUCCESS;
+}
+
+/**
+ * Set up the reference on the path from OCL_CPUREF or the best one.
+ */
+void
+cpuref_init(struct cpuref* ref)
+{
+    const char* env = getenv("OCL_CPUREF");
+    enum cpuref_isa isa = CPUREF_UNSET;
+
+    if(NULL != env && '\0' != *env
+            && CL_SUCCESS == cpuref_isa_from_str(env, &isa)
+            && !cpuref_supported(isa))
+    {
+        fprintf(stderr, "The CPU can't run the %s path\n", env);
+        isa = CPUREF_UNSET;
+    }
+    cpuref_init_isa(ref, isa);
+}
+
+/**
+ * Compare count ints of a device result with the reference. Returns the
+ * index of the first mismatch or count if they are equal.
+ */
+size_t
+cpuref_diff(const cl_int* result, const cl_int* expected, size_t count)
+{
+    for(size_t i = 0; i < count; ++i)
+        if(result[i] != expected[i])
+            return i;
+    return count;
+}
+
+#endif // OCL_LABS_CPUREF_C
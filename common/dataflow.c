@@ -0,0 +1,222 @@
+#ifndef OCL_LABS_DATAFLOW_C
+#define OCL_LABS_DATAFLOW_C
+
+/*
+ * Kernels connected into a chain of stages, each stage on its own queue.
+ *
+ * The stages of a chain pass their data to each other by channels (Intel
+ * FPGA), by pipes (OpenCL 2.0) or through global memory; the kernels and
+ * their arguments are up to the program, this module launches them:
+ *  - DATAFLOW_CONCURRENT starts all the stages at once. It is for
+ *    channels, whose reads and writes block, so the stages must run at the
+ *    same time and pace each other.
+ *  - DATAFLOW_HANDOFF starts a stage on a block when the previous stage is
+ *    done with the block and the next one is done with the block before,
+ *    so a stage never waits for its input and never finds its output full.
+ *    It is for pipes, whose reads and writes fail instead of blocking, and
+ *    for stages going through global memory. A pipe must have room for
+ *    the packets of a block.
+ * The queues are flushed after every block, so the runtime may run
+ * different stages of neighbouring blocks at the same time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "CL/opencl.h"
+
+#include "trace.c"
+
+#define DATAFLOW_MAX_STAGES 8
+
+enum dataflow_sync
+{
+    DATAFLOW_CONCURRENT,
+    DATAFLOW_HANDOFF
+};
+
+struct dataflow_stage
+{
+    cl_kernel kernel;
+    cl_command_queue queue;
+    int single_work_item;       // launched as a task, not per element
+    cl_event done;              // of the last block, NULL if none yet
+};
+
+struct dataflow
+{
+    struct dataflow_stage stages[DATAFLOW_MAX_STAGES];
+    unsigned int num_stages;
+    enum dataflow_sync sync;
+};
+
+void
+dataflow_release(struct dataflow* df)
+{
+    for(unsigned int i = 0; i < df->num_stages; ++i)
+    {
+        struct dataflow_stage* s = &df->stages[i];
+        if(NULL != s->done)
+            clReleaseEvent(s->done);
+        if(NULL != s->kernel)
+            clReleaseKernel(s->kernel);
+        if(NULL != s->queue)
+            clReleaseCommandQueue(s->queue);
+    }
+    memset(df, 0, sizeof(*df));
+}
+
+/**
+ * Create a queue and a kernel object for each of the stages, named in the
+ * order the data goes through them. The kernel arguments are set by the
+ * caller on df->stages[i].kernel.
+ */
+cl_int
+dataflow_init(struct dataflow* df, cl_context context, cl_device_id device,
+        cl_program program, const char* const* kernel_names,
+        unsigned int num_stages, enum dataflow_sync sync)
+{
+    cl_int rv = CL_SUCCESS;
+
+    memset(df, 0, sizeof(*df));
+    if(0 == num_stages || num_stages > DATAFLOW_MAX_STAGES)
+        return CL_INVALID_VALUE;
+    df->num_stages = num_stages;
+    df->sync = sync;
+    for(unsigned int i = 0; i < num_stages && CL_SUCCESS == rv; ++i)
+    {
+        struct dataflow_stage* s = &df->stages[i];
+        // the tracer needs the timestamps of the stages
+        s->queue = clCreateCommandQueue(context, device,
+                trace_enabled() ? CL_QUEUE_PROFILING_ENABLE : 0, &rv);
+        if(CL_SUCCESS != rv)
+        {
+            print_cl_error("Failed to create a command queue:", rv, stderr);
+            break;
+        }
+        s->kernel = clCreateKernel(program, kernel_names[i], &rv);
+        if(CL_SUCCESS != rv)
+            fprintf(stderr, "No kernel %s: %s\n", kernel_names[i],
+                    cl_error_str(rv));
+    }
+    if(CL_SUCCESS != rv)
+        dataflow_release(df);
+    return rv;
+}
+
+/**
+ * Launch every stage over count elements starting at offset (the global
+ * offset of the work items). A single work-item stage is launched once,
+ * its kernel gets the range through its arguments.
+ */
+cl_int
+dataflow_enqueue(struct dataflow* df, size_t offset, size_t count)
+{
+    cl_int rv = CL_SUCCESS;
+    cl_event done[DATAFLOW_MAX_STAGES];
+    unsigned int num_enqueued = 0;
+
+    for(; num_enqueued < df->num_stages; ++num_enqueued)
+    {
+        unsigned int i = num_enqueued;
+        struct dataflow_stage* s = &df->stages[i];
+        cl_event wait[2];
+        cl_uint num_wait = 0;
+
+        if(DATAFLOW_HANDOFF == df->sync)
+        {
+            if(i > 0)
+                wait[num_wait++] = done[i - 1];
+            if(i + 1 < df->num_stages && NULL != df->stages[i + 1].done)
+                wait[num_wait++] = df->stages[i + 1].done;
+        }
+        if(s->single_work_item)
+            rv = clEnqueueTask(s->queue, s->kernel, num_wait,
+                    num_wait ? wait : NULL, &done[i]);
+        else
+            rv = clEnqueueNDRangeKernel(s->queue, s->kernel, 1, &offset,
+                    &count, NULL, num_wait, num_wait ? wait : NULL,
+                    &done[i]);
+        if(CL_SUCCESS != rv)
+            break;
+        trace_add(done[i], "dataflow stage", 0);
+    }
+
+    for(unsigned int i = 0; i < num_enqueued; ++i)
+    {
+        struct dataflow_stage* s = &df->stages[i];
+        clFlush(s->queue);
+        if(CL_SUCCESS != rv)
+        {
+            clReleaseEvent(done[i]);
+            continue;
+        }
+        if(NULL != s->done)
+            clReleaseEvent(s->done);
+        s->done = done[i];
+    }
+    return rv;
+}
+
+/**
+ * Wait for all the stages to finish.
+ */
+cl_int
+dataflow_finish(struct dataflow* df)
+{
+    cl_int rv = CL_SUCCESS;
+    for(unsigned int i = 0; i < df->num_stages; ++i)
+    {
+        struct dataflow_stage* s = &df->stages[i];
+        cl_int status = clFinish(s->queue);
+        if(CL_SUCCESS == rv)
+            rv = status;
+        if(NULL != s->done)
+        {
+            clReleaseEvent(s->done);
+            s->done = NULL;
+        }
+    }
+    return rv;
+}
+
+/**
+ * Whether the device runs kernels with pipes, which takes OpenCL 2.0 on
+ * both the device and the host headers (and CL_DEVICE_PIPE_SUPPORT on 3.0).
+ */
+int
+dataflow_pipes_supported(cl_device_id device)
+{
+#ifdef CL_VERSION_2_0
+    char* version;
+    size_t size = 0;
+    int major = 0;
+
+    // "OpenCL <major>.<minor> <platform-specific information>"
+    if(CL_SUCCESS == clGetDeviceInfo(device, CL_DEVICE_VERSION, 0, NULL,
+                &size) && NULL != (version = calloc(size + 1, 1)))
+    {
+        if(CL_SUCCESS == clGetDeviceInfo(device, CL_DEVICE_VERSION, size,
+                    version, NULL))
+            sscanf(version, "OpenCL %d", &major);
+        free(version);
+    }
+    if(major < 2)
+        return 0;
+#ifdef CL_VERSION_3_0
+    if(major >= 3)
+    {
+        cl_bool support = CL_FALSE;
+        clGetDeviceInfo(device, CL_DEVICE_PIPE_SUPPORT, sizeof(support),
+                &support, NULL);
+        return CL_TRUE == support;
+    }
+#endif
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+#endif // OCL_LABS_DATAFLOW_C
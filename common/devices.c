@@ -0,0 +1,334 @@
+#ifndef OCL_LABS_DEVICES_C
+#define OCL_LABS_DEVICES_C
+
+/*
+ * Selection of OpenCL devices across all platforms.
+ *
+ * A selector is a comma-separated list of terms, a device is selected if it
+ * matches any of them:
+ *   default      the default device of the first platform
+ *   all          every device
+ *   cpu, gpu, accelerator
+ *                devices of the type
+ *   <p>.<d>      device <d> of platform <p> (both 0-based)
+ *   <n>          device <n> in the list of all devices
+ *   name=<text>  devices whose name contains the text
+ * The OCL_DEVICE environment variable overrides the default selector of
+ * a program, a command line option overrides both.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ctype.h>
+
+#include "CL/opencl.h"
+
+#ifndef CL_PLATFORM_NOT_FOUND_KHR
+#define CL_PLATFORM_NOT_FOUND_KHR -1001 // of cl_khr_icd, no platform at all
+#endif
+
+#define DEVICE_SELECTOR_ENV "OCL_DEVICE"
+#define DEVICE_SELECTOR_DEFAULT "default"
+
+struct ocl_device
+{
+    cl_platform_id platform;
+    cl_device_id id;
+    cl_device_type type;
+    cl_uint platform_index;
+    cl_uint device_index;
+    int is_default;         // the default device of the first platform
+    char* name;
+};
+
+struct device_list
+{
+    struct ocl_device* devices;
+    cl_uint count;
+};
+
+void
+free_device_list(struct device_list* list)
+{
+    for(cl_uint i = 0; i < list->count; ++i)
+        free(list->devices[i].name);
+    free(list->devices);
+    list->devices = NULL;
+    list->count = 0;
+}
+
+/*
+ * Add the devices of a platform to the list. A platform failing to list
+ * its devices, e.g. a broken ICD, is skipped so the others can be used.
+ */
+static cl_int
+add_platform_devices(struct device_list* list, cl_platform_id platform,
+        cl_uint platform_index)
+{
+    cl_int rv;
+    cl_uint num_devices;
+    cl_device_id* ids;
+    cl_device_id default_id = NULL;
+    struct ocl_device* devices;
+
+    rv = clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 0, NULL, &num_devices);
+    if(CL_DEVICE_NOT_FOUND == rv)
+        return CL_SUCCESS;
+    if(CL_SUCCESS != rv)
+    {
+        fprintf(stderr, "Skipping platform #%u: clGetDeviceIDs(1) failed: "
+                "%s\n", platform_index, cl_error_str(rv));
+        return CL_SUCCESS;
+    }
+    if(0 == platform_index)
+        clGetDeviceIDs(platform, CL_DEVICE_TYPE_DEFAULT, 1, &default_id, NULL);
+
+    ids = malloc(num_devices * sizeof(cl_device_id));
+    devices = realloc(list->devices,
+            (list->count + num_devices) * sizeof(struct ocl_device));
+    // keep the moved list even if ids failed, so freeing it is safe
+    if(NULL != devices)
+        list->devices = devices;
+    if(NULL == ids || NULL == devices)
+    {
+        free(ids);
+        return CL_OUT_OF_HOST_MEMORY;
+    }
+    rv = clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, num_devices, ids, NULL);
+    if(CL_SUCCESS != rv)
+    {
+        fprintf(stderr, "Skipping platform #%u: clGetDeviceIDs(2) failed: "
+                "%s\n", platform_index, cl_error_str(rv));
+        free(ids);
+        return CL_SUCCESS;
+    }
+
+    for(cl_uint i = 0; i < num_devices; ++i)
+    {
+        struct ocl_device* d = &list->devices[list->count++];
+        size_t size = 0;
+        d->platform = platform;
+        d->id = ids[i];
+        d->platform_index = platform_index;
+        d->device_index = i;
+        d->is_default = (ids[i] == default_id);
+        d->type = 0;
+        clGetDeviceInfo(ids[i], CL_DEVICE_TYPE, sizeof(d->type), &d->type,
+                NULL);
+        clGetDeviceInfo(ids[i], CL_DEVICE_NAME, 0, NULL, &size);
+        d->name = calloc(size + 1, 1);
+        if(NULL != d->name)
+            clGetDeviceInfo(ids[i], CL_DEVICE_NAME, size, d->name, NULL);
+    }
+    free(ids);
+    return CL_SUCCESS;
+}
+
+/**
+ * Get the list of all devices of all platforms.
+ */
+cl_int
+enumerate_devices(struct device_list* list)
+{
+    cl_int rv;
+    cl_uint num_platforms;
+    cl_platform_id* platforms;
+
+    list->devices = NULL;
+    list->count = 0;
+
+    rv = clGetPlatformIDs(0, NULL, &num_platforms);
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("clGetPlatformIDs(1) failed:", rv, stderr);
+        return rv;
+    }
+    platforms = malloc(num_platforms * sizeof(cl_platform_id));
+    if(NULL == platforms)
+        return CL_OUT_OF_HOST_MEMORY;
+    rv = clGetPlatformIDs(num_platforms, platforms, NULL);
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("clGetPlatformIDs(2) failed:", rv, stderr);
+        free(platforms);
+        return rv;
+    }
+
+    for(cl_uint i = 0; i < num_platforms && CL_SUCCESS == rv; ++i)
+        rv = add_platform_devices(list, platforms[i], i);
+    free(platforms);
+    if(CL_SUCCESS != rv)
+        free_device_list(list);
+    return rv;
+}
+
+/**
+ * Check whether a device with the global index matches a selector term.
+ */
+static int
+device_matches(const struct ocl_device* d, cl_uint index, const char* term)
+{
+    unsigned long p, n;
+    char* end;
+
+    if(0 == strcmp(term, "all"))
+        return 1;
+    if(0 == strcmp(term, "default"))
+        return d->is_default;
+    if(0 == strcmp(term, "cpu"))
+        return 0 != (CL_DEVICE_TYPE_CPU & d->type);
+    if(0 == strcmp(term, "gpu"))
+        return 0 != (CL_DEVICE_TYPE_GPU & d->type);
+    if(0 == strcmp(term, "accelerator"))
+        return 0 != (CL_DEVICE_TYPE_ACCELERATOR & d->type);
+    if(0 == strncmp(term, "name=", 5))
+        return NULL != d->name && NULL != strstr(d->name, term + 5);
+
+    // either a global index or a pair of platform and device indices
+    p = strtoul(term, &end, 10);
+    if(end == term)
+        return 0;
+    if('\0' == *end)
+        return p == index;
+    if('.' != *end)
+        return 0;
+    term = end + 1;
+    n = strtoul(term, &end, 10);
+    return end != term && '\0' == *end
+        && p == d->platform_index && n == d->device_index;
+}
+
+/*
+ * Check the syntax of a selector term, so a typo is told apart from a
+ * device which is not there.
+ */
+static int
+device_term_valid(const char* term)
+{
+    static const char * const names[] = {
+        "all", "default", "cpu", "gpu", "accelerator"
+    };
+    char* end;
+
+    for(size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+        if(0 == strcmp(term, names[i]))
+            return 1;
+    if(0 == strncmp(term, "name=", 5))
+        return 1;
+    if(!isdigit((unsigned char) *term))
+        return 0;
+    strtoul(term, &end, 10);
+    if('\0' == *end)
+        return 1;
+    if('.' != *end || !isdigit((unsigned char) end[1]))
+        return 0;
+    strtoul(end + 1, &end, 10);
+    return '\0' == *end;
+}
+
+/**
+ * Pick the selector to use: the command line value if given, then the value
+ * of OCL_DEVICE, then the default one.
+ */
+const char*
+device_selector(const char* cli_value, const char* default_value)
+{
+    const char* env;
+    if(NULL != cli_value)
+        return cli_value;
+    env = getenv(DEVICE_SELECTOR_ENV);
+    if(NULL != env && '\0' != *env)
+        return env;
+    return (NULL != default_value) ? default_value : DEVICE_SELECTOR_DEFAULT;
+}
+
+/**
+ * Get the list of devices which match a selector. Returns
+ * CL_INVALID_VALUE for a malformed selector and CL_DEVICE_NOT_FOUND if
+ * no device matches it.
+ */
+cl_int
+select_devices(const char* selector, struct device_list* selected)
+{
+    cl_int rv;
+    struct device_list all;
+    char* terms;
+
+    selected->devices = NULL;
+    selected->count = 0;
+    if(NULL == (terms = malloc(strlen(selector) + 1)))
+        return CL_OUT_OF_HOST_MEMORY;
+    strcpy(terms, selector);
+    for(char* term = strtok(terms, ","); NULL != term;
+            term = strtok(NULL, ","))
+    {
+        if(!device_term_valid(term))
+        {
+            fprintf(stderr, "Bad device selector term \"%s\"\n", term);
+            free(terms);
+            return CL_INVALID_VALUE;
+        }
+    }
+    if(CL_SUCCESS != (rv = enumerate_devices(&all)))
+    {
+        free(terms);
+        return rv;
+    }
+
+    selected->devices = malloc((all.count + 1) * sizeof(struct ocl_device));
+    if(NULL == selected->devices)
+    {
+        free(terms);
+        free_device_list(&all);
+        return CL_OUT_OF_HOST_MEMORY;
+    }
+
+    for(cl_uint i = 0; i < all.count; ++i)
+    {
+        int matches = 0;
+        strcpy(terms, selector);
+        for(char* term = strtok(terms, ","); NULL != term && !matches;
+                term = strtok(NULL, ","))
+            matches = device_matches(&all.devices[i], i, term);
+        if(matches)
+        {
+            // move the device with its name into the selected list
+            selected->devices[selected->count++] = all.devices[i];
+            all.devices[i].name = NULL;
+        }
+    }
+    free(terms);
+    free_device_list(&all);
+
+    if(0 == selected->count)
+    {
+        fprintf(stderr, "No OpenCL device matches \"%s\"\n", selector);
+        free_device_list(selected);
+        return CL_DEVICE_NOT_FOUND;
+    }
+    return CL_SUCCESS;
+}
+
+const char*
+device_type_str(cl_device_type type)
+{
+    if(CL_DEVICE_TYPE_CPU & type) return "CPU";
+    if(CL_DEVICE_TYPE_GPU & type) return "GPU";
+    if(CL_DEVICE_TYPE_ACCELERATOR & type) return "accelerator";
+    return "other";
+}
+
+void
+print_device_list(const struct device_list* list, FILE* fp)
+{
+    for(cl_uint i = 0; i < list->count; ++i)
+    {
+        const struct ocl_device* d = &list->devices[i];
+        fprintf(fp, "\t%u.%u: %s (%s)\n", d->platform_index, d->device_index,
+                NULL != d->name ? d->name : "?", device_type_str(d->type));
+    }
+}
+
+#endif // OCL_LABS_DEVICES_C
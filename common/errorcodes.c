@@ -59,22 +59,26 @@ static struct errorcode error_codes[] = {
 { CL_INVALID_GLOBAL_WORK_SIZE,        "Invalid global work size"            },
 };
 
-void
-print_cl_error(char* prefix, cl_int status, FILE* fp)
+/**
+ * Readable name of a status code, "" for CL_SUCCESS and unknown codes.
+ */
+const char*
+cl_error_str(cl_int status)
 {
-    if(CL_SUCCESS == status)
-        return;
-
     const int numErrorCodes = sizeof(error_codes) / sizeof(struct errorcode);
-    char* meaning = "";
     for(int i = 0; i < numErrorCodes; i++)
     {
         if(error_codes[i].status_code == status)
-        {
-            meaning = error_codes[i].meaning;
-            break;
-        }
+            return error_codes[i].meaning;
     }
+    return "";
+}
+
+void
+print_cl_error(char* prefix, cl_int status, FILE* fp)
+{
+    if(CL_SUCCESS == status)
+        return;
 
-    fprintf(fp, "%s %s\n", prefix, meaning);
+    fprintf(fp, "%s %s\n", prefix, cl_error_str(status));
 }
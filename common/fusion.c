@@ -0,0 +1,361 @@
+#ifndef OCL_LABS_FUSION_C
+#define OCL_LABS_FUSION_C
+
+/*
+ * Fusion of element-wise kernels.
+ *
+ * A chain of element-wise stages is declared on the host:
+ *  map      an OpenCL C expression of x, e.g. "x * x + 1"
+ *  scale    x * factor + offset, computed in float
+ *  clamp    x limited to [lo, hi], compared in float
+ *  convert  to another type, saturating for the integer types
+ * and fusion_source() generates an OpenCL C program for it: either a
+ * single kernel "fused" doing all the stages on an element in registers,
+ * or a kernel "stage<k>" per stage, each a pass over global memory as a
+ * chain of hand-written kernels would be. Both keep FP_CONTRACT off, so
+ * they compute bit-identical results.
+ *
+ * fusion_build() writes the source to fused_<hash>.cl (or unfused_...)
+ * and builds it with build_program(), so the program cache keeps it
+ * across runs. An accelerator can't build source at run time: it gets
+ * the binary with the same name and .aocx, compiled offline from the
+ * written .cl, e.g. aoc fused_0123456789abcdef.cl.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "CL/opencl.h"
+
+#define FUSION_MAX_STAGES 16
+#define FUSION_EXPR_SIZE 128
+#define FUSION_TYPE_SIZE 8
+#define FUSION_SOURCE_SIZE (FUSION_MAX_STAGES * 512 + 1024)
+#define FUSION_PATH_SIZE 64
+#define FUSION_NAME_SIZE 32     // "stage" and the digits of any size_t
+
+enum fusion_op
+{
+    FUSION_MAP,
+    FUSION_SCALE,
+    FUSION_CLAMP,
+    FUSION_CONVERT
+};
+
+struct fusion_stage
+{
+    enum fusion_op op;
+    char expr[FUSION_EXPR_SIZE];        // of a map
+    float a;                            // factor of a scale, lo of a clamp
+    float b;                            // offset of a scale, hi of a clamp
+    char in_type[FUSION_TYPE_SIZE];
+    char out_type[FUSION_TYPE_SIZE];    // differs for a convert only
+};
+
+struct fusion_chain
+{
+    char in_type[FUSION_TYPE_SIZE];
+    struct fusion_stage stages[FUSION_MAX_STAGES];
+    size_t count;
+};
+
+static const char * const g_fusion_op_names[] = {
+    "map", "scale", "clamp", "convert"
+};
+
+static const struct
+{
+    const char* name;
+    size_t size;
+} g_fusion_types[] = {
+    { "char", 1 }, { "uchar", 1 }, { "short", 2 }, { "ushort", 2 },
+    { "int", 4 }, { "uint", 4 }, { "float", 4 }
+};
+
+/**
+ * Bytes of an element type, 0 for a type the chains don't support.
+ */
+size_t
+fusion_type_size(const char* type)
+{
+    for(size_t i = 0; i < sizeof(g_fusion_types) / sizeof(g_fusion_types[0]);
+            ++i)
+        if(0 == strcmp(type, g_fusion_types[i].name))
+            return g_fusion_types[i].size;
+    return 0;
+}
+
+/**
+ * Start a chain over elements of the type.
+ */
+cl_int
+fusion_init(struct fusion_chain* chain, const char* in_type)
+{
+    memset(chain, 0, sizeof(*chain));
+    if(0 == fusion_type_size(in_type))
+    {
+        fprintf(stderr, "Unsupported element type: %s\n", in_type);
+        return CL_INVALID_VALUE;
+    }
+    strcpy(chain->in_type, in_type);
+    return CL_SUCCESS;
+}
+
+/**
+ * The type of the elements after the chain.
+ */
+const char*
+fusion_out_type(const struct fusion_chain* chain)
+{
+    return (0 != chain->count)
+        ? chain->stages[chain->count - 1].out_type : chain->in_type;
+}
+
+static struct fusion_stage*
+fusion_add(struct fusion_chain* chain, enum fusion_op op)
+{
+    struct fusion_stage* s;
+    const char* in_type = fusion_out_type(chain);
+
+    if(FUSION_MAX_STAGES == chain->count)
+    {
+        fputs("Too many stages in the chain\n", stderr);
+        return NULL;
+    }
+    s = &chain->stages[chain->count];
+    memset(s, 0, sizeof(*s));
+    s->op = op;
+    strcpy(s->in_type, in_type);
+    strcpy(s->out_type, in_type);
+    ++chain->count;
+    return s;
+}
+
+cl_int
+fusion_map(struct fusion_chain* chain, const char* expr)
+{
+    struct fusion_stage* s;
+    if(strlen(expr) >= FUSION_EXPR_SIZE)
+        return CL_INVALID_VALUE;
+    if(NULL == (s = fusion_add(chain, FUSION_MAP)))
+        return CL_INVALID_VALUE;
+    strcpy(s->expr, expr);
+    return CL_SUCCESS;
+}
+
+cl_int
+fusion_scale(struct fusion_chain* chain, float factor, float offset)
+{
+    struct fusion_stage* s = fusion_add(chain, FUSION_SCALE);
+    if(NULL == s)
+        return CL_INVALID_VALUE;
+    s->a = factor;
+    s->b = offset;
+    return CL_SUCCESS;
+}
+
+cl_int
+fusion_clamp(struct fusion_chain* chain, float lo, float hi)
+{
+    struct fusion_stage* s = fusion_add(chain, FUSION_CLAMP);
+    if(NULL == s)
+        return CL_INVALID_VALUE;
+    s->a = lo;
+    s->b = hi;
+    return CL_SUCCESS;
+}
+
+cl_int
+fusion_convert(struct fusion_chain* chain, const char* type)
+{
+    struct fusion_stage* s;
+    if(0 == fusion_type_size(type))
+    {
+        fprintf(stderr, "Unsupported element type: %s\n", type);
+        return CL_INVALID_VALUE;
+    }
+    if(NULL == (s = fusion_add(chain, FUSION_CONVERT)))
+        return CL_INVALID_VALUE;
+    strcpy(s->out_type, type);
+    return CL_SUCCESS;
+}
+
+/**
+ * Bytes a pass of the stages [first, last) over count elements reads and
+ * writes in global memory as one kernel.
+ */
+size_t
+fusion_bytes(const struct fusion_chain* chain, size_t first, size_t last,
+        size_t count)
+{
+    return count * (fusion_type_size(chain->stages[first].in_type)
+            + fusion_type_size(chain->stages[last - 1].out_type));
+}
+
+/* A float literal OpenCL C takes without the double extension */
+static void
+fusion_float(char* buf, size_t size, float value)
+{
+    snprintf(buf, size, "%#.9gf", value);
+}
+
+/* The statement computing v<k + 1> from v<k> */
+static int
+fusion_statement(char* buf, size_t size, const struct fusion_stage* s,
+        size_t k)
+{
+    char a[32], b[32];
+    int is_float = 0 == strcmp(s->out_type, "float");
+
+    fusion_float(a, sizeof(a), s->a);
+    fusion_float(b, sizeof(b), s->b);
+    switch(s->op)
+    {
+        case FUSION_MAP:
+            return snprintf(buf, size, "    %s v%zu;\n"
+                    "    { %s x = v%zu; v%zu = (%s) (%s); }\n", s->out_type,
+                    k + 1, s->in_type, k, k + 1, s->out_type, s->expr);
+        case FUSION_SCALE:
+            return is_float
+                ? snprintf(buf, size, "    float v%zu = v%zu * %s + %s;\n",
+                        k + 1, k, a, b)
+                : snprintf(buf, size, "    %s v%zu = convert_%s_sat_rte("
+                        "convert_float(v%zu) * %s + %s);\n", s->out_type,
+                        k + 1, s->out_type, k, a, b);
+        case FUSION_CLAMP:
+            return is_float
+                ? snprintf(buf, size, "    float v%zu = clamp(v%zu, %s, "
+                        "%s);\n", k + 1, k, a, b)
+                : snprintf(buf, size, "    %s v%zu = convert_%s_sat_rte("
+                        "clamp(convert_float(v%zu), %s, %s));\n",
+                        s->out_type, k + 1, s->out_type, k, a, b);
+        case FUSION_CONVERT:
+        default:
+            return snprintf(buf, size, "    %s v%zu = convert_%s%s(v%zu);\n",
+                    s->out_type, k + 1, s->out_type,
+                    is_float ? "" : "_sat_rte", k);
+    }
+}
+
+/* A kernel doing the stages [first, last) */
+static int
+fusion_kernel(char* buf, size_t size, const struct fusion_chain* chain,
+        size_t first, size_t last, const char* name)
+{
+    int len, n;
+    len = snprintf(buf, size, "__kernel void\n%s(__global %s * restrict out, "
+            "__global const %s * restrict in,\n        uint n)\n{\n"
+            "    size_t i = get_global_id(0);\n"
+            "    if(i >= n)\n        return;\n    %s v%zu = in[i];\n",
+            name, chain->stages[last - 1].out_type,
+            chain->stages[first].in_type, chain->stages[first].in_type,
+            first);
+    for(size_t k = first; k < last && len >= 0 && (size_t) len < size; ++k)
+    {
+        n = snprintf(buf + len, size - len, "    // %s\n",
+                g_fusion_op_names[chain->stages[k].op]);
+        if(n < 0 || (size_t) (len += n) >= size)
+            return -1;
+        n = fusion_statement(buf + len, size - len, &chain->stages[k], k);
+        if(n < 0)
+            return -1;
+        len += n;
+    }
+    if(len < 0 || (size_t) len >= size)
+        return -1;
+    n = snprintf(buf + len, size - len, "    out[i] = v%zu;\n}\n\n", last);
+    return (n < 0) ? -1 : len + n;
+}
+
+/**
+ * Generate the program of the chain: one fused kernel or a kernel per
+ * stage. Returns the length of the source or -1 if it doesn't fit.
+ */
+int
+fusion_source(const struct fusion_chain* chain, int fused, char* buf,
+        size_t size)
+{
+    int len, n;
+    char name[FUSION_NAME_SIZE];
+
+    if(0 == chain->count)
+        return -1;
+    len = snprintf(buf, size, "/* Generated by common/fusion.c */\n\n"
+            "#pragma OPENCL FP_CONTRACT OFF\n\n");
+    if(fused)
+    {
+        n = fusion_kernel(buf + len, size - len, chain, 0, chain->count,
+                "fused");
+        len = (n < 0) ? -1 : len + n;
+    }
+    for(size_t k = 0; !fused && k < chain->count && len >= 0
+            && (size_t) len < size; ++k)
+    {
+        snprintf(name, sizeof(name), "stage%zu", k);
+        n = fusion_kernel(buf + len, size - len, chain, k, k + 1, name);
+        len = (n < 0) ? -1 : len + n;
+    }
+    return (len < 0 || (size_t) len >= size) ? -1 : len;
+}
+
+/**
+ * Generate the program of the chain and build it, from source through
+ * the program cache or, on accelerators, from the binary compiled offline
+ * from the written source.
+ */
+cl_int
+fusion_build(const struct fusion_chain* chain, int fused, cl_context context,
+        cl_device_id device, cl_program* program)
+{
+    cl_int rv;
+    char* source = malloc(FUSION_SOURCE_SIZE);
+    char path[FUSION_PATH_SIZE];
+    char binary[FUSION_PATH_SIZE];
+    cl_device_type type = 0;
+    int len;
+    FILE* fp;
+
+    if(NULL == source)
+        return CL_OUT_OF_HOST_MEMORY;
+    if(0 > (len = fusion_source(chain, fused, source, FUSION_SOURCE_SIZE)))
+    {
+        fputs("The chain is too long to generate\n", stderr);
+        free(source);
+        return CL_INVALID_VALUE;
+    }
+    // the name tells the programs of different chains apart
+    snprintf(path, sizeof(path), "%s_%016llx.cl", fused ? "fused" : "unfused",
+            (unsigned long long) progcache_hash(0xCBF29CE484222325ULL,
+                source, len));
+    fp = fopen(path, "w");
+    if(NULL == fp || (size_t) len != fwrite(source, 1, len, fp))
+    {
+        perror(path);
+        if(NULL != fp)
+            fclose(fp);
+        free(source);
+        return CL_INVALID_VALUE;
+    }
+    fclose(fp);
+    free(source);
+
+    clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+    if(CL_DEVICE_TYPE_ACCELERATOR & type)
+    {
+        snprintf(binary, sizeof(binary), "%.*s.aocx",
+                (int) (strlen(path) - 3), path);
+        if(0 != access(binary, R_OK))
+        {
+            fprintf(stderr, "No %s, compile %s offline\n", binary, path);
+            return CL_INVALID_BINARY;
+        }
+        rv = build_program(program, &context, &device, binary);
+    }
+    else
+        rv = build_program(program, &context, &device, path);
+    return rv;
+}
+
+#endif // OCL_LABS_FUSION_C
@@ -0,0 +1,337 @@
+#ifndef OCL_LABS_KSRV_C
+#define OCL_LABS_KSRV_C
+
+/*
+ * Protocol between the kernel server (tools/kserver.c) and its clients.
+ *
+ * A client connects to the server over a UNIX domain socket. The payloads
+ * never go through the socket: the client creates a ring of num_slots
+ * slots in shared memory, each an input and an output area of slot_size
+ * bytes, and passes its file descriptor with the KSRV_ATTACH request
+ * (SCM_RIGHTS). A KSRV_RUN request names a slot and the size of its input;
+ * the server runs the job from the input area into the output area and
+ * replies with the same slot. Requests of a client are served in order,
+ * so a client may keep up to num_slots of them in flight. The server takes
+ * the sizes from the client: a ring of more than KSRV_MAX_SLOTS slots or
+ * slots of more than KSRV_MAX_SLOT_SIZE bytes is refused.
+ *
+ * Environment:
+ *  OCL_KSRV_SOCKET  path of the socket, /tmp/ocl_kserver.sock by default
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define KSRV_DEFAULT_SOCKET "/tmp/ocl_kserver.sock"
+#define KSRV_MAX_SLOTS 1024
+#define KSRV_MAX_SLOT_SIZE ((size_t) 64 << 20)
+
+enum ksrv_op
+{
+    KSRV_ATTACH,    // slot is the number of slots, bytes the slot size
+    KSRV_RUN,
+    KSRV_DETACH
+};
+
+struct ksrv_request
+{
+    uint32_t op;
+    uint32_t slot;
+    uint64_t bytes;
+};
+
+struct ksrv_reply
+{
+    int32_t status;         // a cl_int
+    uint32_t slot;
+    uint64_t service_ns;    // from reading the request to the reply
+    uint64_t device_ns;     // of the kernel, 0 if not known
+};
+
+struct ksrv_ring
+{
+    unsigned char* base;
+    size_t size;
+    size_t slot_size;
+    uint32_t num_slots;
+    int fd;
+};
+
+const char*
+ksrv_socket_path(void)
+{
+    const char* path = getenv("OCL_KSRV_SOCKET");
+    return (NULL != path && '\0' != *path) ? path : KSRV_DEFAULT_SOCKET;
+}
+
+unsigned char*
+ksrv_slot_in(const struct ksrv_ring* ring, uint32_t slot)
+{
+    return ring->base + 2 * (size_t) slot * ring->slot_size;
+}
+
+unsigned char*
+ksrv_slot_out(const struct ksrv_ring* ring, uint32_t slot)
+{
+    return ksrv_slot_in(ring, slot) + ring->slot_size;
+}
+
+/*
+ * Bytes of a ring, 0 if the sizes are out of the limits. Within them the
+ * product fits a size_t even of 32 bits.
+ */
+static size_t
+ksrv_ring_size(uint64_t num_slots, uint64_t slot_size)
+{
+    if(0 == num_slots || num_slots > KSRV_MAX_SLOTS
+            || 0 == slot_size || slot_size > KSRV_MAX_SLOT_SIZE)
+        return 0;
+    if(slot_size > SIZE_MAX / 2 / num_slots)
+        return 0;
+    return 2 * (size_t) num_slots * (size_t) slot_size;
+}
+
+static int
+ksrv_ring_map(struct ksrv_ring* ring, int fd, uint32_t num_slots,
+        size_t slot_size)
+{
+    ring->num_slots = num_slots;
+    ring->slot_size = slot_size;
+    ring->size = ksrv_ring_size(num_slots, slot_size);
+    ring->base = mmap(NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+            fd, 0);
+    if(MAP_FAILED == ring->base)
+    {
+        perror("Failed to map the ring");
+        ring->base = NULL;
+        return -1;
+    }
+    ring->fd = fd;
+    return 0;
+}
+
+/**
+ * Create a ring in an anonymous shared memory object. The slot size is
+ * rounded up to a whole number of ints.
+ */
+int
+ksrv_ring_create(struct ksrv_ring* ring, uint32_t num_slots,
+        size_t slot_size)
+{
+    char name[64];
+    int fd;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+    if(0 == ksrv_ring_size(num_slots, slot_size))
+    {
+        fprintf(stderr, "A ring is up to %d slots of up to %zu bytes\n",
+                KSRV_MAX_SLOTS, KSRV_MAX_SLOT_SIZE);
+        return -1;
+    }
+    slot_size = (slot_size + sizeof(int32_t) - 1) & ~(sizeof(int32_t) - 1);
+    snprintf(name, sizeof(name), "/ocl_ksrv.%ld", (long) getpid());
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if(-1 == fd)
+    {
+        perror(name);
+        return -1;
+    }
+    // the server gets the descriptor, nobody needs the name
+    shm_unlink(name);
+    if(0 != ftruncate(fd, ksrv_ring_size(num_slots, slot_size)))
+    {
+        perror("Failed to size the ring");
+        close(fd);
+        return -1;
+    }
+    if(ksrv_ring_map(ring, fd, num_slots, slot_size))
+    {
+        close(fd);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Map the ring of a client from the descriptor it sent. The sizes come
+ * from the client and are checked against the limits and the object.
+ */
+int
+ksrv_ring_attach(struct ksrv_ring* ring, int fd, uint32_t num_slots,
+        uint64_t slot_size)
+{
+    struct stat st;
+    size_t size = ksrv_ring_size(num_slots, slot_size);
+
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+    if(0 == size || 0 != fstat(fd, &st) || st.st_size < 0
+            || (uint64_t) st.st_size < size)
+    {
+        fputs("The ring doesn't match its description\n", stderr);
+        return -1;
+    }
+    return ksrv_ring_map(ring, fd, num_slots, slot_size);
+}
+
+void
+ksrv_ring_release(struct ksrv_ring* ring)
+{
+    if(NULL != ring->base)
+        munmap(ring->base, ring->size);
+    if(ring->fd >= 0)
+        close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+int
+ksrv_write_all(int sock, const void* data, size_t size)
+{
+    const char* p = data;
+    while(size > 0)
+    {
+        ssize_t n = write(sock, p, size);
+        if(n < 0 && EINTR == errno)
+            continue;
+        if(n <= 0)
+            return -1;
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+/**
+ * Read a whole message. Returns 1 at the end of the stream, -1 on errors.
+ */
+int
+ksrv_read_all(int sock, void* data, size_t size)
+{
+    char* p = data;
+    while(size > 0)
+    {
+        ssize_t n = read(sock, p, size);
+        if(n < 0 && EINTR == errno)
+            continue;
+        if(0 == n)
+            return 1;
+        if(n < 0)
+            return -1;
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+/**
+ * Send a request with a file descriptor attached.
+ */
+int
+ksrv_send_fd(int sock, const struct ksrv_request* req, int fd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    union
+    {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct cmsghdr* cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    iov.iov_base = (void*) req;
+    iov.iov_len = sizeof(*req);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    return (sizeof(*req) == sendmsg(sock, &msg, 0)) ? 0 : -1;
+}
+
+/**
+ * Receive a request and the file descriptor attached to it, -1 if none.
+ * Returns as ksrv_read_all() does.
+ */
+int
+ksrv_recv(int sock, struct ksrv_request* req, int* fd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    union
+    {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct cmsghdr* cmsg;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = req;
+    iov.iov_len = sizeof(*req);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    *fd = -1;
+    do
+        n = recvmsg(sock, &msg, 0);
+    while(n < 0 && EINTR == errno);
+    if(0 == n)
+        return 1;
+    if(n < 0)
+        return -1;
+
+    for(cmsg = CMSG_FIRSTHDR(&msg); NULL != cmsg;
+            cmsg = CMSG_NXTHDR(&msg, cmsg))
+        if(SOL_SOCKET == cmsg->cmsg_level && SCM_RIGHTS == cmsg->cmsg_type)
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    // a stream socket may split the request
+    if((size_t) n < sizeof(*req))
+        return ksrv_read_all(sock, (char*) req + n, sizeof(*req) - n);
+    return 0;
+}
+
+/**
+ * Connect to the server. Returns the socket or -1.
+ */
+int
+ksrv_connect(const char* path)
+{
+    struct sockaddr_un addr;
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if(-1 == sock)
+    {
+        perror("socket");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    if(0 != connect(sock, (struct sockaddr*) &addr, sizeof(addr)))
+    {
+        perror(path);
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+#endif // OCL_LABS_KSRV_C
@@ -0,0 +1,356 @@
+#ifndef OCL_LABS_PRIMITIVES_C
+#define OCL_LABS_PRIMITIVES_C
+
+/*
+ * Host side of the data-parallel primitives (lab1/primitives.cl).
+ *
+ * A reduction launches a pass of at most PRIM_MAX_GROUPS work-groups, each
+ * leaving one partial result, and then passes over the partial results
+ * until one is left. A scan launches scan_blocks over blocks of two ints
+ * per work item, scans the block totals the same way, recursively, and adds
+ * them back with scan_add. A histogram is counted per work-group and the
+ * counts are merged by another kernel. The temporary buffers are kept
+ * between the calls, so a repeated call creates no memory objects.
+ *
+ * The work-group size is the largest power of two up to PRIM_LOCAL_SIZE
+ * that the device and every kernel allow and whose scan block fits the
+ * local memory. Every call finishes its commands before returning.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "CL/opencl.h"
+
+#include "trace.c"
+
+#define PRIM_LOCAL_SIZE 256
+#define PRIM_MAX_GROUPS 1024        // work-groups of a reduction pass
+#define PRIM_MAX_LEVELS 8           // of the scan, for (2 * local)^8 ints
+#define PRIM_HISTOGRAM_BINS 256     // as HISTOGRAM_BINS in primitives.cl
+
+enum prim_op
+{
+    PRIM_SUM,
+    PRIM_MIN,
+    PRIM_MAX,
+    PRIM_NUM_OPS
+};
+
+struct prim_level
+{
+    cl_mem sums;                // totals of the blocks
+    cl_mem offsets;             // their exclusive scan
+    size_t capacity;            // ints
+};
+
+struct prim
+{
+    cl_command_queue queue;
+    cl_context context;
+    size_t local_size;
+    cl_kernel reduce[PRIM_NUM_OPS];
+    cl_kernel scan_blocks;
+    cl_kernel scan_add;
+    cl_kernel histogram_groups;
+    cl_kernel histogram_merge;
+    cl_mem partial[2];          // of the reduction passes
+    cl_mem histogram_partial;   // bins of every work-group
+    cl_mem histogram_bins;
+    struct prim_level levels[PRIM_MAX_LEVELS];
+};
+
+static const char * const g_prim_reduce_names[PRIM_NUM_OPS] = {
+    "reduce_sum", "reduce_min", "reduce_max"
+};
+
+const char*
+prim_op_str(enum prim_op op)
+{
+    static const char * const names[PRIM_NUM_OPS] = { "sum", "min", "max" };
+    return (op < PRIM_NUM_OPS) ? names[op] : "unknown";
+}
+
+void
+prim_release(struct prim* p)
+{
+    cl_kernel kernels[] = {
+        p->reduce[PRIM_SUM], p->reduce[PRIM_MIN], p->reduce[PRIM_MAX],
+        p->scan_blocks, p->scan_add, p->histogram_groups, p->histogram_merge
+    };
+    cl_mem buffers[] = {
+        p->partial[0], p->partial[1], p->histogram_partial,
+        p->histogram_bins
+    };
+
+    for(size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); ++i)
+        if(NULL != kernels[i])
+            clReleaseKernel(kernels[i]);
+    for(size_t i = 0; i < sizeof(buffers) / sizeof(buffers[0]); ++i)
+        if(NULL != buffers[i])
+            clReleaseMemObject(buffers[i]);
+    for(int i = 0; i < PRIM_MAX_LEVELS; ++i)
+    {
+        if(NULL != p->levels[i].sums)
+            clReleaseMemObject(p->levels[i].sums);
+        if(NULL != p->levels[i].offsets)
+            clReleaseMemObject(p->levels[i].offsets);
+    }
+    memset(p, 0, sizeof(*p));
+}
+
+static cl_kernel
+prim_kernel(struct prim* p, cl_program program, cl_device_id device,
+        const char* name, cl_int* rv)
+{
+    size_t limit = 0;
+    cl_kernel kernel = clCreateKernel(program, name, rv);
+
+    if(CL_SUCCESS != *rv)
+    {
+        fprintf(stderr, "No kernel %s: %s\n", name, cl_error_str(*rv));
+        return NULL;
+    }
+    if(CL_SUCCESS == clGetKernelWorkGroupInfo(kernel, device,
+                CL_KERNEL_WORK_GROUP_SIZE, sizeof(limit), &limit, NULL))
+        while(p->local_size > limit && p->local_size > 1)
+            p->local_size /= 2;
+    return kernel;
+}
+
+/**
+ * Create the kernels of the program (built from lab1/primitives.cl) and
+ * the buffers of a fixed size. The commands go to the queue, which must
+ * be in-order.
+ */
+cl_int
+prim_init(struct prim* p, cl_context context, cl_device_id device,
+        cl_command_queue queue, cl_program program)
+{
+    cl_int rv = CL_SUCCESS;
+    size_t max_work_group_size = 0;
+    cl_ulong local_mem_size = 0;
+
+    memset(p, 0, sizeof(*p));
+    p->queue = queue;
+    p->context = context;
+    p->local_size = PRIM_LOCAL_SIZE;
+    clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE,
+            sizeof(max_work_group_size), &max_work_group_size, NULL);
+    clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE,
+            sizeof(local_mem_size), &local_mem_size, NULL);
+    while(p->local_size > 1 && (p->local_size > max_work_group_size
+                || 2 * p->local_size * sizeof(cl_int) > local_mem_size))
+        p->local_size /= 2;
+
+    for(int i = 0; i < PRIM_NUM_OPS && CL_SUCCESS == rv; ++i)
+        p->reduce[i] = prim_kernel(p, program, device,
+                g_prim_reduce_names[i], &rv);
+    if(CL_SUCCESS == rv)
+        p->scan_blocks = prim_kernel(p, program, device, "scan_blocks", &rv);
+    if(CL_SUCCESS == rv)
+        p->scan_add = prim_kernel(p, program, device, "scan_add", &rv);
+    if(CL_SUCCESS == rv)
+        p->histogram_groups = prim_kernel(p, program, device,
+                "histogram_groups", &rv);
+    if(CL_SUCCESS == rv)
+        p->histogram_merge = prim_kernel(p, program, device,
+                "histogram_merge", &rv);
+
+    for(int i = 0; i < 2 && CL_SUCCESS == rv; ++i)
+        p->partial[i] = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                PRIM_MAX_GROUPS * sizeof(cl_int), NULL, &rv);
+    if(CL_SUCCESS == rv)
+        p->histogram_partial = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                PRIM_MAX_GROUPS * PRIM_HISTOGRAM_BINS * sizeof(cl_uint),
+                NULL, &rv);
+    if(CL_SUCCESS == rv)
+        p->histogram_bins = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
+                PRIM_HISTOGRAM_BINS * sizeof(cl_uint), NULL, &rv);
+    if(CL_SUCCESS != rv)
+        prim_release(p);
+    return rv;
+}
+
+static size_t
+prim_num_groups(size_t count, size_t per_group, size_t max)
+{
+    size_t groups = (count + per_group - 1) / per_group;
+    return (0 != max && groups > max) ? max : groups;
+}
+
+static cl_int
+prim_reduce_pass(struct prim* p, cl_kernel kernel, cl_mem in, cl_mem out,
+        size_t count, size_t* num_groups)
+{
+    cl_int rv;
+    cl_uint n = count;
+    size_t global_size;
+
+    *num_groups = prim_num_groups(count, p->local_size, PRIM_MAX_GROUPS);
+    global_size = *num_groups * p->local_size;
+    rv  = clSetKernelArg(kernel, 0, sizeof(cl_mem), &in);
+    rv |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &out);
+    rv |= clSetKernelArg(kernel, 2, sizeof(cl_uint), &n);
+    rv |= clSetKernelArg(kernel, 3, p->local_size * sizeof(cl_int), NULL);
+    if(CL_SUCCESS != rv)
+        return rv;
+    return clEnqueueNDRangeKernel(p->queue, kernel, 1, NULL, &global_size,
+            &p->local_size, 0, NULL,
+            trace_event("reduce", count * sizeof(cl_int)));
+}
+
+/**
+ * Reduce count ints of a buffer to their sum, minimum or maximum. The sum
+ * wraps around as int arithmetic does on the device.
+ */
+cl_int
+prim_reduce(struct prim* p, enum prim_op op, cl_mem in, size_t count,
+        cl_int* result)
+{
+    cl_int rv;
+    size_t num_groups;
+    int current = 0;
+
+    if(op >= PRIM_NUM_OPS || 0 == count)
+        return CL_INVALID_VALUE;
+    rv = prim_reduce_pass(p, p->reduce[op], in, p->partial[0], count,
+            &num_groups);
+    while(CL_SUCCESS == rv && num_groups > 1)
+    {
+        rv = prim_reduce_pass(p, p->reduce[op], p->partial[current],
+                p->partial[1 - current], num_groups, &num_groups);
+        current = 1 - current;
+    }
+    if(CL_SUCCESS == rv)
+        rv = clEnqueueReadBuffer(p->queue, p->partial[current], CL_TRUE, 0,
+                sizeof(cl_int), result, 0, NULL,
+                trace_event("reduce result", sizeof(cl_int)));
+    return rv;
+}
+
+static cl_int
+prim_level_reserve(struct prim* p, struct prim_level* level, size_t count)
+{
+    cl_int rv = CL_SUCCESS;
+
+    if(level->capacity >= count)
+        return CL_SUCCESS;
+    if(NULL != level->sums)
+        clReleaseMemObject(level->sums);
+    if(NULL != level->offsets)
+        clReleaseMemObject(level->offsets);
+    level->capacity = 0;
+    level->sums = clCreateBuffer(p->context, CL_MEM_READ_WRITE,
+            count * sizeof(cl_int), NULL, &rv);
+    if(CL_SUCCESS == rv)
+        level->offsets = clCreateBuffer(p->context, CL_MEM_READ_WRITE,
+                count * sizeof(cl_int), NULL, &rv);
+    if(CL_SUCCESS == rv)
+        level->capacity = count;
+    return rv;
+}
+
+static cl_int
+prim_scan_level(struct prim* p, int depth, cl_mem in, cl_mem out,
+        size_t count, cl_uint exclusive)
+{
+    cl_int rv;
+    struct prim_level* level = &p->levels[depth];
+    size_t block = 2 * p->local_size;
+    size_t num_groups = prim_num_groups(count, block, 0);
+    size_t global_size = num_groups * p->local_size;
+    cl_uint n = count;
+
+    if(depth >= PRIM_MAX_LEVELS)
+        return CL_INVALID_BUFFER_SIZE;
+    if(CL_SUCCESS != (rv = prim_level_reserve(p, level, num_groups)))
+        return rv;
+
+    rv  = clSetKernelArg(p->scan_blocks, 0, sizeof(cl_mem), &in);
+    rv |= clSetKernelArg(p->scan_blocks, 1, sizeof(cl_mem), &out);
+    rv |= clSetKernelArg(p->scan_blocks, 2, sizeof(cl_mem), &level->sums);
+    rv |= clSetKernelArg(p->scan_blocks, 3, sizeof(cl_uint), &n);
+    rv |= clSetKernelArg(p->scan_blocks, 4, sizeof(cl_uint), &exclusive);
+    rv |= clSetKernelArg(p->scan_blocks, 5, block * sizeof(cl_int), NULL);
+    if(CL_SUCCESS == rv)
+        rv = clEnqueueNDRangeKernel(p->queue, p->scan_blocks, 1, NULL,
+                &global_size, &p->local_size, 0, NULL,
+                trace_event("scan blocks", 2 * count * sizeof(cl_int)));
+    if(CL_SUCCESS != rv || 1 == num_groups)
+        return rv;
+
+    // the totals of the blocks before each block
+    rv = prim_scan_level(p, depth + 1, level->sums, level->offsets,
+            num_groups, 1);
+    if(CL_SUCCESS != rv)
+        return rv;
+    global_size = prim_num_groups(count, p->local_size, 0) * p->local_size;
+    rv  = clSetKernelArg(p->scan_add, 0, sizeof(cl_mem), &out);
+    rv |= clSetKernelArg(p->scan_add, 1, sizeof(cl_mem), &level->offsets);
+    rv |= clSetKernelArg(p->scan_add, 2, sizeof(cl_uint), &n);
+    if(CL_SUCCESS == rv)
+        rv = clEnqueueNDRangeKernel(p->queue, p->scan_add, 1, NULL,
+                &global_size, &p->local_size, 0, NULL,
+                trace_event("scan add", 2 * count * sizeof(cl_int)));
+    return rv;
+}
+
+/**
+ * Prefix sums of count ints from in to out, which must be different
+ * buffers. An inclusive scan counts the element itself, an exclusive one
+ * starts from 0.
+ */
+cl_int
+prim_scan(struct prim* p, cl_mem in, cl_mem out, size_t count,
+        int exclusive)
+{
+    cl_int rv;
+    if(0 == count)
+        return CL_INVALID_VALUE;
+    rv = prim_scan_level(p, 0, in, out, count, exclusive ? 1 : 0);
+    return (CL_SUCCESS == rv) ? clFinish(p->queue) : rv;
+}
+
+/**
+ * Count the bytes of a buffer into PRIM_HISTOGRAM_BINS bins.
+ */
+cl_int
+prim_histogram(struct prim* p, cl_mem in, size_t num_bytes, cl_uint* bins)
+{
+    cl_int rv;
+    cl_uint n = num_bytes;
+    cl_uint num_groups = prim_num_groups(num_bytes, p->local_size,
+            PRIM_MAX_GROUPS);
+    size_t global_size = num_groups * p->local_size;
+    size_t num_bins = PRIM_HISTOGRAM_BINS;
+
+    if(0 == num_bytes)
+        return CL_INVALID_VALUE;
+    rv  = clSetKernelArg(p->histogram_groups, 0, sizeof(cl_mem), &in);
+    rv |= clSetKernelArg(p->histogram_groups, 1, sizeof(cl_mem),
+            &p->histogram_partial);
+    rv |= clSetKernelArg(p->histogram_groups, 2, sizeof(cl_uint), &n);
+    rv |= clSetKernelArg(p->histogram_merge, 0, sizeof(cl_mem),
+            &p->histogram_partial);
+    rv |= clSetKernelArg(p->histogram_merge, 1, sizeof(cl_mem),
+            &p->histogram_bins);
+    rv |= clSetKernelArg(p->histogram_merge, 2, sizeof(cl_uint),
+            &num_groups);
+    if(CL_SUCCESS == rv)
+        rv = clEnqueueNDRangeKernel(p->queue, p->histogram_groups, 1, NULL,
+                &global_size, &p->local_size, 0, NULL,
+                trace_event("histogram groups", num_bytes));
+    if(CL_SUCCESS == rv)
+        rv = clEnqueueNDRangeKernel(p->queue, p->histogram_merge, 1, NULL,
+                &num_bins, NULL, 0, NULL, trace_event("histogram merge", 0));
+    if(CL_SUCCESS == rv)
+        rv = clEnqueueReadBuffer(p->queue, p->histogram_bins, CL_TRUE, 0,
+                PRIM_HISTOGRAM_BINS * sizeof(cl_uint), bins, 0, NULL,
+                trace_event("histogram bins",
+                    PRIM_HISTOGRAM_BINS * sizeof(cl_uint)));
+    return rv;
+}
+
+#endif // OCL_LABS_PRIMITIVES_C
@@ -0,0 +1,371 @@
+#ifndef OCL_LABS_PROGCACHE_C
+#define OCL_LABS_PROGCACHE_C
+
+/*
+ * On-disk cache of built OpenCL programs.
+ *
+ * An entry is keyed by a 64-bit FNV-1a hash of the kernel file content,
+ * the device name, the driver version and the build options. The entry
+ * holds the binary returned by clGetProgramInfo(CL_PROGRAM_BINARIES), so
+ * a program built from .cl source (e.g. on PoCL) is reloaded with
+ * clCreateProgramWithBinary() on the next run. Precompiled binaries (.aocx)
+ * gain nothing from it and are never cached.
+ *
+ * Environment:
+ *  OCL_PROGCACHE      on (default), off, refresh (rebuild and overwrite
+ *                     the entry) or clear (remove all entries first)
+ *  OCL_PROGCACHE_DIR  cache directory, ".oclcache" by default
+ *  OCL_PROGCACHE_STATS  print hit/miss counters to stderr at exit if set
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "CL/opencl.h"
+
+#define PROGCACHE_DEFAULT_DIR ".oclcache"
+#define PROGCACHE_MAGIC "OCLPC01"
+#define PROGCACHE_PATH_SIZE 4096
+#define PROGCACHE_KEY_SIZE 17 // 16 hex digits and '\0'
+
+enum progcache_mode
+{
+    PROGCACHE_UNSET = -1,
+    PROGCACHE_ON,
+    PROGCACHE_OFF,
+    PROGCACHE_REFRESH,
+    PROGCACHE_CLEAR
+};
+
+struct progcache_stats
+{
+    unsigned int hits;
+    unsigned int misses;
+    unsigned int stores;
+    unsigned int errors;
+};
+
+/* Header of a cache file, followed by the program binary itself */
+struct progcache_header
+{
+    char magic[8];
+    cl_ulong binary_size;
+};
+
+struct progcache_stats g_progcache_stats;
+static enum progcache_mode g_progcache_mode = PROGCACHE_UNSET;
+
+/**
+ * Continue a 64-bit FNV-1a hash over a block of data.
+ */
+cl_ulong
+progcache_hash(cl_ulong hash, const void* data, size_t size)
+{
+    const unsigned char* p = data;
+    for(size_t i = 0; i < size; ++i)
+    {
+        hash ^= p[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+const char*
+progcache_dir(void)
+{
+    const char* dir = getenv("OCL_PROGCACHE_DIR");
+    return (NULL != dir && '\0' != *dir) ? dir : PROGCACHE_DEFAULT_DIR;
+}
+
+/**
+ * Remove all entries from the cache directory.
+ */
+void
+progcache_clear(void)
+{
+    char path[PROGCACHE_PATH_SIZE];
+    struct dirent* entry;
+    DIR* dir = opendir(progcache_dir());
+    if(NULL == dir)
+        return;
+
+    while(NULL != (entry = readdir(dir)))
+    {
+        size_t len = strlen(entry->d_name);
+        if(len < 4 || strcmp(entry->d_name + len - 4, ".bin"))
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", progcache_dir(), entry->d_name);
+        remove(path);
+    }
+    closedir(dir);
+}
+
+/**
+ * Select a mode by its name ("on", "off", "refresh" or "clear").
+ */
+cl_int
+progcache_set_mode_str(const char* name)
+{
+    static const char * const names[] = { "on", "off", "refresh", "clear" };
+    for(int i = PROGCACHE_ON; i <= PROGCACHE_CLEAR; ++i)
+    {
+        if(0 == strcmp(name, names[i]))
+        {
+            g_progcache_mode = i;
+            if(PROGCACHE_CLEAR == g_progcache_mode)
+            {
+                progcache_clear();
+                g_progcache_mode = PROGCACHE_ON;
+            }
+            return CL_SUCCESS;
+        }
+    }
+    fprintf(stderr, "Unknown program cache mode: %s\n", name);
+    return CL_INVALID_VALUE;
+}
+
+void
+progcache_print_stats(FILE* fp)
+{
+    fprintf(fp, "Program cache: %u hit(s), %u miss(es), %u store(s), "
+            "%u error(s)\n", g_progcache_stats.hits, g_progcache_stats.misses,
+            g_progcache_stats.stores, g_progcache_stats.errors);
+}
+
+static void
+progcache_print_stats_at_exit(void)
+{
+    progcache_print_stats(stderr);
+}
+
+/**
+ * Current mode; the first call picks it up from OCL_PROGCACHE.
+ */
+enum progcache_mode
+progcache_mode(void)
+{
+    if(PROGCACHE_UNSET == g_progcache_mode)
+    {
+        const char* env = getenv("OCL_PROGCACHE");
+        g_progcache_mode = PROGCACHE_ON;
+        if(NULL != env && '\0' != *env)
+            progcache_set_mode_str(env);
+        if(NULL != getenv("OCL_PROGCACHE_STATS"))
+            atexit(progcache_print_stats_at_exit);
+    }
+    return g_progcache_mode;
+}
+
+/**
+ * Hash a string property of a device into the key.
+ */
+static cl_int
+progcache_hash_device_info(cl_ulong* hash, cl_device_id device,
+        cl_device_info param)
+{
+    cl_int rv;
+    size_t size;
+    char* value;
+
+    rv = clGetDeviceInfo(device, param, 0, NULL, &size);
+    if(CL_SUCCESS != rv)
+        return rv;
+    if(NULL == (value = malloc(size)))
+        return CL_OUT_OF_HOST_MEMORY;
+    rv = clGetDeviceInfo(device, param, size, value, NULL);
+    if(CL_SUCCESS == rv)
+        *hash = progcache_hash(*hash, value, size);
+    free(value);
+    return rv;
+}
+
+/**
+ * Compute the cache key for a kernel file content built for the device
+ * with the given options.
+ */
+cl_int
+progcache_key(char key[PROGCACHE_KEY_SIZE], cl_device_id device,
+        const unsigned char* content, size_t size, const char* options)
+{
+    cl_int rv;
+    cl_ulong hash = 0xCBF29CE484222325ULL;
+
+    hash = progcache_hash(hash, content, size);
+    if(CL_SUCCESS != (rv = progcache_hash_device_info(&hash, device,
+                    CL_DEVICE_NAME)))
+        return rv;
+    if(CL_SUCCESS != (rv = progcache_hash_device_info(&hash, device,
+                    CL_DRIVER_VERSION)))
+        return rv;
+    hash = progcache_hash(hash, options, strlen(options) + 1);
+
+    snprintf(key, PROGCACHE_KEY_SIZE, "%016llx", (unsigned long long) hash);
+    return CL_SUCCESS;
+}
+
+static void
+progcache_path(char* path, size_t size, const char* key)
+{
+    snprintf(path, size, "%s/%s.bin", progcache_dir(), key);
+}
+
+/**
+ * Try to create and build a program from the cache entry.
+ * Returns CL_SUCCESS on a hit.
+ */
+cl_int
+progcache_load(cl_program* program, cl_context context, cl_device_id device,
+        const char* key, const char* options)
+{
+    cl_int rv, status;
+    char path[PROGCACHE_PATH_SIZE];
+    const struct progcache_header* header;
+    struct stat st;
+    void* data;
+    int fd;
+
+    if(PROGCACHE_ON != progcache_mode())
+    {
+        ++g_progcache_stats.misses;
+        return CL_INVALID_BINARY;
+    }
+
+    // the binary is passed to the runtime right from the mapped entry
+    progcache_path(path, sizeof(path), key);
+    if(-1 == (fd = open(path, O_RDONLY)))
+    {
+        ++g_progcache_stats.misses;
+        return CL_INVALID_BINARY;
+    }
+    data = MAP_FAILED;
+    if(0 == fstat(fd, &st) && (size_t) st.st_size > sizeof(*header))
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(MAP_FAILED == data)
+    {
+        ++g_progcache_stats.misses;
+        return CL_INVALID_BINARY;
+    }
+    header = data;
+    if(memcmp(header->magic, PROGCACHE_MAGIC, sizeof(header->magic))
+            || header->binary_size != st.st_size - sizeof(*header))
+    {
+        munmap(data, st.st_size);
+        ++g_progcache_stats.misses;
+        return CL_INVALID_BINARY;
+    }
+
+    const size_t lengths[1] = {header->binary_size};
+    const unsigned char* binaries[1] = {
+        (const unsigned char*) data + sizeof(*header)
+    };
+    *program = clCreateProgramWithBinary(context, 1, &device,
+            lengths, binaries, &status, &rv);
+    munmap(data, st.st_size);
+    if(CL_SUCCESS != rv || CL_SUCCESS != status)
+    {
+        if(CL_SUCCESS == rv)
+            clReleaseProgram(*program);
+        // a stale entry, e.g. written by another runtime: rebuild it
+        ++g_progcache_stats.misses;
+        return CL_INVALID_BINARY;
+    }
+
+    rv = clBuildProgram(*program, 1, &device, options, NULL, NULL);
+    if(CL_SUCCESS != rv)
+    {
+        clReleaseProgram(*program);
+        ++g_progcache_stats.misses;
+        return rv;
+    }
+
+    ++g_progcache_stats.hits;
+    return CL_SUCCESS;
+}
+
+/**
+ * Save the binary of a built program to the cache.
+ */
+cl_int
+progcache_store(cl_program program, const char* key)
+{
+    cl_int rv;
+    char path[PROGCACHE_PATH_SIZE];
+    char tmp_path[PROGCACHE_PATH_SIZE + sizeof(".tmp")];
+    struct progcache_header header;
+    size_t binary_size;
+    unsigned char* binary;
+    FILE* fp;
+
+    if(PROGCACHE_OFF == progcache_mode())
+        return CL_SUCCESS;
+
+    // the program is built for exactly one device
+    rv = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES,
+            sizeof(binary_size), &binary_size, NULL);
+    if(CL_SUCCESS != rv || 0 == binary_size)
+    {
+        ++g_progcache_stats.errors;
+        return CL_SUCCESS != rv ? rv : CL_INVALID_BINARY;
+    }
+    if(NULL == (binary = malloc(binary_size)))
+    {
+        ++g_progcache_stats.errors;
+        return CL_OUT_OF_HOST_MEMORY;
+    }
+    rv = clGetProgramInfo(program, CL_PROGRAM_BINARIES,
+            sizeof(binary), &binary, NULL);
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Failed to query program binaries:", rv, stderr);
+        free(binary);
+        ++g_progcache_stats.errors;
+        return rv;
+    }
+
+    if(mkdir(progcache_dir(), 0755) && EEXIST != errno)
+    {
+        perror(progcache_dir());
+        free(binary);
+        ++g_progcache_stats.errors;
+        return CL_INVALID_VALUE;
+    }
+
+    // write a temporary file and rename it, so readers never see a partial
+    progcache_path(path, sizeof(path), key);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    memcpy(header.magic, PROGCACHE_MAGIC, sizeof(header.magic));
+    header.binary_size = binary_size;
+    fp = fopen(tmp_path, "wb");
+    if(NULL == fp
+            || 1 != fwrite(&header, sizeof(header), 1, fp)
+            || 1 != fwrite(binary, binary_size, 1, fp))
+    {
+        if(NULL != fp)
+            fclose(fp);
+        remove(tmp_path);
+        free(binary);
+        ++g_progcache_stats.errors;
+        return CL_INVALID_VALUE;
+    }
+    free(binary);
+    if(fclose(fp) || rename(tmp_path, path))
+    {
+        remove(tmp_path);
+        ++g_progcache_stats.errors;
+        return CL_INVALID_VALUE;
+    }
+
+    ++g_progcache_stats.stores;
+    return CL_SUCCESS;
+}
+
+#endif // OCL_LABS_PROGCACHE_C
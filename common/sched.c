@@ -0,0 +1,214 @@
+#ifndef OCL_LABS_SCHED_C
+#define OCL_LABS_SCHED_C
+
+/*
+ * Splitting of a 1-D workload across several devices.
+ *
+ * Every device gets its own context and an in-order queue with profiling
+ * enabled, so devices of different platforms can be mixed. A run splits
+ * the range of work items proportionally to the throughput each device
+ * showed on the previous runs, enqueues the shares through a callback and
+ * measures how long each device took to update the throughput.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "CL/opencl.h"
+
+#include "devices.c"
+
+struct sched_device
+{
+    cl_device_id device;
+    cl_device_type type;
+    cl_context context;
+    cl_command_queue queue;
+    void* state;        // per-device state of the workload
+    double throughput;  // work items per second, 0 until measured
+    size_t offset;      // the share of the last run
+    size_t count;
+    double elapsed;     // seconds the share of the last run took
+};
+
+/*
+ * Enqueue the work items [offset, offset + count) on a device.
+ * The events of the first and the last commands must be returned (the same
+ * event if there's only one command), the time between them is the time
+ * the device spent on the share.
+ */
+typedef cl_int (*sched_enqueue_fn)(struct sched_device* dev,
+        size_t offset, size_t count, void* arg,
+        cl_event* first, cl_event* last);
+
+/**
+ * Create a context and a command queue for each selected device.
+ */
+cl_int
+sched_init(struct sched_device* devs, const struct device_list* list)
+{
+    cl_int rv;
+
+    for(cl_uint i = 0; i < list->count; ++i)
+    {
+        struct sched_device* d = &devs[i];
+        d->device = list->devices[i].id;
+        d->type = list->devices[i].type;
+        d->state = NULL;
+        d->throughput = 0.0;
+        d->offset = d->count = 0;
+        d->elapsed = 0.0;
+
+        d->context = clCreateContext(NULL, 1, &d->device,
+                &ocl_context_cb, NULL, &rv);
+        if(CL_SUCCESS != rv)
+        {
+            print_cl_error("Cannot create an OpenCL context:", rv, stderr);
+            return rv;
+        }
+        d->queue = clCreateCommandQueue(d->context, d->device,
+                CL_QUEUE_PROFILING_ENABLE, &rv);
+        if(CL_SUCCESS != rv)
+        {
+            print_cl_error("Failed to create a command queue:", rv, stderr);
+            return rv;
+        }
+    }
+    return CL_SUCCESS;
+}
+
+void
+sched_release(struct sched_device* devs, cl_uint num_devs)
+{
+    for(cl_uint i = 0; i < num_devs; ++i)
+    {
+        clReleaseCommandQueue(devs[i].queue);
+        clReleaseContext(devs[i].context);
+    }
+}
+
+static double
+sched_weight(const struct sched_device* dev, double guess)
+{
+    return (dev->throughput > 0.0) ? dev->throughput : guess;
+}
+
+/**
+ * Split the range of total work items into shares proportional to the
+ * throughput of the devices. Shares are multiples of the granularity,
+ * the remainder goes to the fastest device. Devices which have not been
+ * measured yet are assumed to be as fast as the average one.
+ */
+void
+sched_split(struct sched_device* devs, cl_uint num_devs,
+        size_t total, size_t granularity)
+{
+    double known = 0.0, guess, weights = 0.0;
+    cl_uint num_known = 0, fastest = 0;
+    size_t units = total / granularity, offset = 0;
+
+    for(cl_uint i = 0; i < num_devs; ++i)
+    {
+        if(devs[i].throughput > 0.0)
+        {
+            known += devs[i].throughput;
+            ++num_known;
+        }
+    }
+    guess = (0 != num_known) ? known / num_known : 1.0;
+
+    for(cl_uint i = 0; i < num_devs; ++i)
+    {
+        weights += sched_weight(&devs[i], guess);
+        if(sched_weight(&devs[i], guess) > sched_weight(&devs[fastest], guess))
+            fastest = i;
+    }
+    for(cl_uint i = 0; i < num_devs; ++i)
+    {
+        double share = sched_weight(&devs[i], guess) / weights;
+        devs[i].count = (size_t) (units * share) * granularity;
+        offset += devs[i].count;
+    }
+    devs[fastest].count += total - offset;
+
+    offset = 0;
+    for(cl_uint i = 0; i < num_devs; ++i)
+    {
+        devs[i].offset = offset;
+        offset += devs[i].count;
+    }
+}
+
+static double
+sched_event_time(cl_event event, cl_profiling_info param)
+{
+    cl_ulong t = 0;
+    clGetEventProfilingInfo(event, param, sizeof(t), &t, NULL);
+    return t * 1e-9;
+}
+
+/**
+ * Run the workload of total work items on all devices and update their
+ * throughput with the measured one.
+ */
+cl_int
+sched_run(struct sched_device* devs, cl_uint num_devs,
+        size_t total, size_t granularity, sched_enqueue_fn enqueue, void* arg)
+{
+    cl_int rv = CL_SUCCESS;
+    cl_event* first = calloc(num_devs, sizeof(cl_event));
+    cl_event* last = calloc(num_devs, sizeof(cl_event));
+    if(NULL == first || NULL == last)
+    {
+        free(first);
+        free(last);
+        return CL_OUT_OF_HOST_MEMORY;
+    }
+
+    sched_split(devs, num_devs, total, granularity);
+    for(cl_uint i = 0; i < num_devs && CL_SUCCESS == rv; ++i)
+    {
+        if(0 == devs[i].count)
+            continue;
+        rv = enqueue(&devs[i], devs[i].offset, devs[i].count, arg,
+                &first[i], &last[i]);
+        // let the device start while the next one is being fed
+        if(CL_SUCCESS == rv)
+            rv = clFlush(devs[i].queue);
+    }
+
+    for(cl_uint i = 0; i < num_devs; ++i)
+    {
+        if(NULL == last[i])
+        {
+            if(NULL != first[i])
+                clReleaseEvent(first[i]);
+            continue;
+        }
+        if(CL_SUCCESS == rv)
+            rv = clWaitForEvents(1, &last[i]);
+        if(CL_SUCCESS == rv)
+        {
+            devs[i].elapsed =
+                sched_event_time(last[i], CL_PROFILING_COMMAND_END)
+                - sched_event_time(first[i], CL_PROFILING_COMMAND_QUEUED);
+            if(devs[i].elapsed > 0.0)
+            {
+                double measured = devs[i].count / devs[i].elapsed;
+                devs[i].throughput = (devs[i].throughput > 0.0)
+                    ? 0.5 * (devs[i].throughput + measured) : measured;
+            }
+        }
+        if(first[i] != last[i])
+            clReleaseEvent(first[i]);
+        clReleaseEvent(last[i]);
+    }
+
+    free(first);
+    free(last);
+    if(CL_SUCCESS != rv)
+        print_cl_error("Failed to run the workload:", rv, stderr);
+    return rv;
+}
+
+#endif // OCL_LABS_SCHED_C
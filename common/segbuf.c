@@ -0,0 +1,260 @@
+#ifndef OCL_LABS_SEGBUF_C
+#define OCL_LABS_SEGBUF_C
+
+/*
+ * Segmented device buffers.
+ *
+ * A device may refuse a buffer larger than CL_DEVICE_MAX_MEM_ALLOC_SIZE
+ * even when it has the memory for it. A segmented buffer is a logical
+ * buffer of any size split into device buffers (segments) no larger than
+ * that; every segment holds a whole number of elements, so that no
+ * element straddles two of them. Reads and writes are split at the
+ * segment boundaries, and a kernel over the buffer runs once per segment
+ * with the global work offset of the segment's first element: the kernel
+ * sees get_global_id() as the index in the logical buffer and finds the
+ * element at get_global_id(0) - get_global_offset(0) of its segment (see
+ * lab1/segments.cl). The global work offset needs OpenCL 1.1.
+ *
+ * A pool accounts the bytes of all the segments of a device against
+ * CL_DEVICE_GLOBAL_MEM_SIZE and refuses a buffer that wouldn't fit; the
+ * ratio of the two is the memory pressure.
+ *
+ * Environment:
+ *  OCL_SEGMENT_SIZE  largest segment in bytes, if smaller than the device
+ *                    allows (to try the splitting on a device with a
+ *                    large limit)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "CL/opencl.h"
+
+#include "trace.c"
+
+#define SEGBUF_SIZE_ENV "OCL_SEGMENT_SIZE"
+
+struct segbuf_pool
+{
+    cl_context context;
+    cl_ulong max_alloc;         // bytes of a device buffer at most
+    cl_ulong global_mem;        // bytes of the device memory
+    size_t segment_limit;       // bytes of a segment at most
+    size_t in_use;              // bytes of all the segments
+    size_t high_water;          // most bytes in use at once
+    size_t num_segments;        // alive
+};
+
+struct segbuf
+{
+    struct segbuf_pool* pool;
+    size_t size;                // bytes
+    size_t elem_size;
+    size_t segment_size;        // bytes of every segment but the last
+    size_t num_segments;
+    cl_mem* segments;
+};
+
+/**
+ * Set up a pool for the buffers of the device.
+ */
+cl_int
+segbuf_pool_init(struct segbuf_pool* pool, cl_context context,
+        cl_device_id device)
+{
+    cl_int rv;
+    const char* env = getenv(SEGBUF_SIZE_ENV);
+
+    memset(pool, 0, sizeof(*pool));
+    pool->context = context;
+    rv  = clGetDeviceInfo(device, CL_DEVICE_MAX_MEM_ALLOC_SIZE,
+            sizeof(pool->max_alloc), &pool->max_alloc, NULL);
+    rv |= clGetDeviceInfo(device, CL_DEVICE_GLOBAL_MEM_SIZE,
+            sizeof(pool->global_mem), &pool->global_mem, NULL);
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Failed to get the memory limits:", rv, stderr);
+        return rv;
+    }
+    pool->segment_limit = (pool->max_alloc < (size_t) -1)
+        ? (size_t) pool->max_alloc : (size_t) -1;
+    if(NULL != env && '\0' != *env)
+    {
+        size_t limit = strtoull(env, NULL, 0);
+        if(0 != limit && limit < pool->segment_limit)
+            pool->segment_limit = limit;
+    }
+    return CL_SUCCESS;
+}
+
+/**
+ * The part of the device memory the segments of the pool take.
+ */
+double
+segbuf_pressure(const struct segbuf_pool* pool)
+{
+    return (0 != pool->global_mem)
+        ? (double) pool->in_use / pool->global_mem : 0.0;
+}
+
+void
+segbuf_print_pool(const struct segbuf_pool* pool, FILE* fp)
+{
+    fprintf(fp, "Segments: %zu of up to %zu bytes, %zu bytes in use "
+            "(high-water mark %zu) of %llu, pressure %.1f%%\n",
+            pool->num_segments, pool->segment_limit, pool->in_use,
+            pool->high_water, (unsigned long long) pool->global_mem,
+            100.0 * segbuf_pressure(pool));
+}
+
+static size_t
+segbuf_segment_bytes(const struct segbuf* b, size_t i)
+{
+    return (i + 1 < b->num_segments)
+        ? b->segment_size : b->size - i * b->segment_size;
+}
+
+void
+segbuf_release(struct segbuf* b)
+{
+    for(size_t i = 0; i < b->num_segments && NULL != b->segments; ++i)
+    {
+        if(NULL == b->segments[i])
+            continue;
+        clReleaseMemObject(b->segments[i]);
+        b->pool->in_use -= segbuf_segment_bytes(b, i);
+        --b->pool->num_segments;
+    }
+    free(b->segments);
+    memset(b, 0, sizeof(*b));
+}
+
+/**
+ * Create a buffer of size bytes of elements of elem_size bytes in as few
+ * segments as the pool allows. Fails with CL_MEM_OBJECT_ALLOCATION_FAILURE
+ * if the device memory is short of it.
+ */
+cl_int
+segbuf_create(struct segbuf* b, struct segbuf_pool* pool,
+        cl_mem_flags flags, size_t size, size_t elem_size)
+{
+    cl_int rv = CL_SUCCESS;
+
+    memset(b, 0, sizeof(*b));
+    if(0 == size || 0 == elem_size || 0 != size % elem_size
+            || pool->segment_limit < elem_size)
+        return CL_INVALID_BUFFER_SIZE;
+    if(size > pool->global_mem - pool->in_use)
+    {
+        fprintf(stderr, "No room for a buffer of %zu bytes: %zu of %llu "
+                "bytes in use\n", size, pool->in_use,
+                (unsigned long long) pool->global_mem);
+        return CL_MEM_OBJECT_ALLOCATION_FAILURE;
+    }
+    b->pool = pool;
+    b->size = size;
+    b->elem_size = elem_size;
+    b->segment_size = pool->segment_limit / elem_size * elem_size;
+    if(b->segment_size > size)
+        b->segment_size = size;
+    b->num_segments = (size + b->segment_size - 1) / b->segment_size;
+    if(NULL == (b->segments = calloc(b->num_segments, sizeof(cl_mem))))
+    {
+        memset(b, 0, sizeof(*b));
+        return CL_OUT_OF_HOST_MEMORY;
+    }
+    for(size_t i = 0; i < b->num_segments && CL_SUCCESS == rv; ++i)
+    {
+        size_t bytes = segbuf_segment_bytes(b, i);
+        b->segments[i] = clCreateBuffer(pool->context, flags, bytes, NULL,
+                &rv);
+        if(CL_SUCCESS != rv)
+        {
+            b->segments[i] = NULL;
+            print_cl_error("Failed to create a segment:", rv, stderr);
+            break;
+        }
+        pool->in_use += bytes;
+        ++pool->num_segments;
+    }
+    if(pool->in_use > pool->high_water)
+        pool->high_water = pool->in_use;
+    if(CL_SUCCESS != rv)
+        segbuf_release(b);
+    return rv;
+}
+
+/* Read (write != 0: write) size bytes at offset of the logical buffer */
+static cl_int
+segbuf_copy(cl_command_queue queue, struct segbuf* b, int write,
+        cl_bool blocking, size_t offset, size_t size, void* ptr)
+{
+    cl_int rv = CL_SUCCESS;
+    char* p = ptr;
+
+    if(offset > b->size || size > b->size - offset)
+        return CL_INVALID_VALUE;
+    while(0 != size && CL_SUCCESS == rv)
+    {
+        size_t i = offset / b->segment_size;
+        size_t in_segment = offset - i * b->segment_size;
+        size_t bytes = segbuf_segment_bytes(b, i) - in_segment;
+        // the queue is in-order, so blocking on the last piece will do
+        cl_bool last;
+        if(bytes > size)
+            bytes = size;
+        last = (bytes == size) ? blocking : CL_FALSE;
+        rv = write
+            ? clEnqueueWriteBuffer(queue, b->segments[i], last, in_segment,
+                    bytes, p, 0, NULL, trace_event("segment write", bytes))
+            : clEnqueueReadBuffer(queue, b->segments[i], last, in_segment,
+                    bytes, p, 0, NULL, trace_event("segment read", bytes));
+        offset += bytes;
+        size -= bytes;
+        p += bytes;
+    }
+    return rv;
+}
+
+cl_int
+segbuf_write(cl_command_queue queue, struct segbuf* b, cl_bool blocking,
+        size_t offset, size_t size, const void* ptr)
+{
+    return segbuf_copy(queue, b, 1, blocking, offset, size, (void*) ptr);
+}
+
+cl_int
+segbuf_read(cl_command_queue queue, struct segbuf* b, cl_bool blocking,
+        size_t offset, size_t size, void* ptr)
+{
+    return segbuf_copy(queue, b, 0, blocking, offset, size, ptr);
+}
+
+/**
+ * Run a kernel with a work item per element of the buffer, which goes to
+ * argument arg_index, once per segment. The other arguments must be set.
+ * Only one segmented buffer can be passed this way: the segments of two
+ * buffers need not line up, so the other arguments are ordinary buffers
+ * or values that all the segments share.
+ */
+cl_int
+segbuf_enqueue_kernel(cl_command_queue queue, struct segbuf* b,
+        cl_kernel kernel, cl_uint arg_index)
+{
+    cl_int rv = CL_SUCCESS;
+    for(size_t i = 0; i < b->num_segments && CL_SUCCESS == rv; ++i)
+    {
+        size_t offset = i * b->segment_size / b->elem_size;
+        size_t global_size = segbuf_segment_bytes(b, i) / b->elem_size;
+        rv = clSetKernelArg(kernel, arg_index, sizeof(cl_mem),
+                &b->segments[i]);
+        if(CL_SUCCESS == rv)
+            rv = clEnqueueNDRangeKernel(queue, kernel, 1, &offset,
+                    &global_size, NULL, 0, NULL,
+                    trace_event("segment kernel", segbuf_segment_bytes(b, i)));
+    }
+    return rv;
+}
+
+#endif // OCL_LABS_SEGBUF_C
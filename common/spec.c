@@ -0,0 +1,192 @@
+#ifndef OCL_LABS_SPEC_C
+#define OCL_LABS_SPEC_C
+
+/*
+ * Kernels specialized at build time.
+ *
+ * A host describes its problem with struct spec_params and the kernel is
+ * built with the parameters as constants:
+ *   -DNUM_ELEMENTS=<n> -DVECTOR_WIDTH=<w> -DWORK_GROUP_SIZE=<g>
+ *   -DDATA_TYPE=<type>
+ * so the sizes the host uses and the ones the kernel was compiled for come
+ * from the same place, and the compiler can unroll loops and drop bounds
+ * checks. Built programs are kept per parameter tuple for the life of the
+ * cache, and across runs by the program cache since the options are a
+ * part of its key.
+ *
+ * A precompiled binary can't be rebuilt with other options. For <name>.aocx
+ * the specialized binary is <name>_n<n>_v<w>_g<g>_<type>.aocx, compiled
+ * offline with the options above. If there is no such file, or building
+ * the specialized source fails, the program is built without the options
+ * and marked generic: the kernel then has to take the sizes at run time
+ * and the host launches it without a required work-group size.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "CL/opencl.h"
+
+#define SPEC_TYPE_SIZE 16
+#define SPEC_OPTIONS_SIZE 256
+#define SPEC_PATH_SIZE 4096
+
+struct spec_params
+{
+    cl_uint num_elements;       // of data_type, not vectors
+    cl_uint vector_width;       // 1 for scalars
+    size_t work_group_size;     // 0 to leave it to the runtime
+    char data_type[SPEC_TYPE_SIZE];
+};
+
+struct spec_program
+{
+    struct spec_params params;
+    cl_program program;
+    int generic;                // built without the parameters
+};
+
+struct spec_cache
+{
+    cl_context context;
+    cl_device_id device;
+    const char* kernel_file_name;
+    struct spec_program** programs;     // the entries don't move
+    size_t count;
+};
+
+void
+spec_cache_init(struct spec_cache* cache, cl_context context,
+        cl_device_id device, const char* kernel_file_name)
+{
+    memset(cache, 0, sizeof(*cache));
+    cache->context = context;
+    cache->device = device;
+    cache->kernel_file_name = kernel_file_name;
+}
+
+void
+spec_cache_release(struct spec_cache* cache)
+{
+    for(size_t i = 0; i < cache->count; ++i)
+    {
+        if(NULL != cache->programs[i]->program)
+            clReleaseProgram(cache->programs[i]->program);
+        free(cache->programs[i]);
+    }
+    free(cache->programs);
+    cache->programs = NULL;
+    cache->count = 0;
+}
+
+/**
+ * The build options for a parameter tuple.
+ */
+void
+spec_options(const struct spec_params* p, char* options, size_t size)
+{
+    snprintf(options, size, "-DNUM_ELEMENTS=%u -DVECTOR_WIDTH=%u "
+            "-DWORK_GROUP_SIZE=%zu -DDATA_TYPE=%s", p->num_elements,
+            p->vector_width, p->work_group_size, p->data_type);
+}
+
+/**
+ * The name of the binary precompiled for a parameter tuple: the extension
+ * of the generic one goes after the parameters.
+ */
+void
+spec_binary_name(const char* kernel_file_name, const struct spec_params* p,
+        char* name, size_t size)
+{
+    const char* ext = strrchr(kernel_file_name, '.');
+    int base_len = (NULL != ext) ? (int) (ext - kernel_file_name)
+        : (int) strlen(kernel_file_name);
+
+    snprintf(name, size, "%.*s_n%u_v%u_g%zu_%s%s", base_len, kernel_file_name,
+            p->num_elements, p->vector_width, p->work_group_size,
+            p->data_type, (NULL != ext) ? ext : "");
+}
+
+static int
+spec_params_equal(const struct spec_params* a, const struct spec_params* b)
+{
+    return a->num_elements == b->num_elements
+        && a->vector_width == b->vector_width
+        && a->work_group_size == b->work_group_size
+        && 0 == strcmp(a->data_type, b->data_type);
+}
+
+static cl_int
+spec_build(struct spec_cache* cache, struct spec_program* sp)
+{
+    cl_int rv;
+    char options[SPEC_OPTIONS_SIZE];
+    char binary_name[SPEC_PATH_SIZE];
+
+    sp->generic = 0;
+    if(is_kernel_source(cache->kernel_file_name))
+    {
+        spec_options(&sp->params, options, sizeof(options));
+        rv = build_program_opts(&sp->program, &cache->context,
+                &cache->device, cache->kernel_file_name, NULL, options);
+        if(CL_SUCCESS == rv)
+            return rv;
+        // the generic program must not replace one still held
+        if(NULL != sp->program)
+            clReleaseProgram(sp->program);
+        sp->program = NULL;
+        // e.g. the work-group size is over the limit of the device
+        fprintf(stderr, "Failed to build %s with %s, using the generic "
+                "kernel\n", cache->kernel_file_name, options);
+    }
+    else
+    {
+        spec_binary_name(cache->kernel_file_name, &sp->params,
+                binary_name, sizeof(binary_name));
+        if(0 == access(binary_name, R_OK))
+            return build_program(&sp->program, &cache->context,
+                    &cache->device, binary_name);
+        fprintf(stderr, "No %s, using the generic kernel\n", binary_name);
+    }
+
+    sp->generic = 1;
+    return build_program(&sp->program, &cache->context, &cache->device,
+            cache->kernel_file_name);
+}
+
+/**
+ * Get the program specialized for the parameters, building it on the first
+ * request. Returns NULL if neither it nor the generic program could be
+ * built. The entry stays valid until spec_cache_release(), whatever is
+ * requested later.
+ */
+const struct spec_program*
+spec_get(struct spec_cache* cache, const struct spec_params* params)
+{
+    struct spec_program** programs;
+    struct spec_program* sp;
+
+    for(size_t i = 0; i < cache->count; ++i)
+        if(spec_params_equal(&cache->programs[i]->params, params))
+            return cache->programs[i];
+
+    programs = realloc(cache->programs,
+            (cache->count + 1) * sizeof(*programs));
+    if(NULL == programs)
+        return NULL;
+    cache->programs = programs;
+    if(NULL == (sp = calloc(1, sizeof(*sp))))
+        return NULL;
+    sp->params = *params;
+    if(CL_SUCCESS != spec_build(cache, sp))
+    {
+        free(sp);
+        return NULL;
+    }
+    cache->programs[cache->count++] = sp;
+    return sp;
+}
+
+#endif // OCL_LABS_SPEC_C
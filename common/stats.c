@@ -0,0 +1,235 @@
+#ifndef OCL_LABS_STATS_C
+#define OCL_LABS_STATS_C
+
+/*
+ * Statistics over repeated measurements and benchmark reports.
+ *
+ * A report is a list of named results, each summarizing the times of one
+ * repeated measurement (in microseconds) by min/median/p99/mean. Results
+ * of transfers also keep the number of bytes moved per run, which gives the
+ * bandwidth at the median time. Reports are saved as JSON with one result
+ * per line, so a saved report can be read back as a baseline and compared
+ * with the current run.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define STATS_NAME_SIZE 64
+#define STATS_LINE_SIZE 512
+
+struct stats_summary
+{
+    size_t count;
+    double min;
+    double median;
+    double p99;
+    double mean;
+};
+
+struct stats_result
+{
+    char name[STATS_NAME_SIZE];
+    size_t bytes;               // moved per run, 0 if not a transfer
+    struct stats_summary summary;
+};
+
+struct stats_report
+{
+    struct stats_result* results;
+    size_t count;
+    size_t capacity;
+};
+
+double
+stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int
+stats_cmp_double(const void* a, const void* b)
+{
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Summarize samples; the samples get sorted.
+ */
+void
+stats_summarize(double* samples, size_t count, struct stats_summary* s)
+{
+    double sum = 0.0;
+
+    memset(s, 0, sizeof(*s));
+    if(0 == count)
+        return;
+    qsort(samples, count, sizeof(double), stats_cmp_double);
+    for(size_t i = 0; i < count; ++i)
+        sum += samples[i];
+
+    s->count = count;
+    s->min = samples[0];
+    s->median = (count % 2) ? samples[count / 2]
+        : 0.5 * (samples[count / 2 - 1] + samples[count / 2]);
+    // nearest rank, for small counts it is the maximum
+    s->p99 = samples[(size_t) (0.99 * (count - 1) + 0.5)];
+    s->mean = sum / count;
+}
+
+/**
+ * Megabytes per second at the median time of a result.
+ */
+double
+stats_bandwidth(const struct stats_result* r)
+{
+    return (r->summary.median > 0.0) ? r->bytes / r->summary.median : 0.0;
+}
+
+/**
+ * Summarize the times of runs in microseconds and add the result to the
+ * report; the samples get sorted.
+ */
+void
+stats_add(struct stats_report* report, const char* name, size_t bytes,
+        double* samples, size_t count)
+{
+    struct stats_result* r;
+
+    if(report->count == report->capacity)
+    {
+        size_t capacity = report->capacity ? 2 * report->capacity : 32;
+        r = realloc(report->results, capacity * sizeof(*r));
+        if(NULL == r)
+            return;
+        report->results = r;
+        report->capacity = capacity;
+    }
+    r = &report->results[report->count++];
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->bytes = bytes;
+    stats_summarize(samples, count, &r->summary);
+}
+
+const struct stats_result*
+stats_find(const struct stats_report* report, const char* name)
+{
+    for(size_t i = 0; i < report->count; ++i)
+        if(0 == strcmp(report->results[i].name, name))
+            return &report->results[i];
+    return NULL;
+}
+
+void
+stats_free(struct stats_report* report)
+{
+    free(report->results);
+    report->results = NULL;
+    report->count = report->capacity = 0;
+}
+
+void
+stats_print(const struct stats_report* report, FILE* fp)
+{
+    fprintf(fp, "%-40s %11s %11s %11s %10s\n",
+            "Benchmark", "min, us", "median, us", "p99, us", "MB/s");
+    for(size_t i = 0; i < report->count; ++i)
+    {
+        const struct stats_result* r = &report->results[i];
+        fprintf(fp, "%-40s %11.2f %11.2f %11.2f", r->name,
+                r->summary.min, r->summary.median, r->summary.p99);
+        if(0 != r->bytes)
+            fprintf(fp, " %10.1f", stats_bandwidth(r));
+        fputc('\n', fp);
+    }
+}
+
+void
+stats_write_json(const struct stats_report* report, const char* device,
+        FILE* fp)
+{
+    fprintf(fp, "{\"device\": \"%s\", \"unit\": \"us\", \"results\": [\n",
+            device);
+    for(size_t i = 0; i < report->count; ++i)
+    {
+        const struct stats_result* r = &report->results[i];
+        fprintf(fp, "{\"name\": \"%s\", \"bytes\": %zu, \"n\": %zu, "
+                "\"min\": %.6g, \"median\": %.6g, \"p99\": %.6g, "
+                "\"mean\": %.6g, \"mb_per_s\": %.6g}%s\n", r->name, r->bytes,
+                r->summary.count, r->summary.min, r->summary.median,
+                r->summary.p99, r->summary.mean, stats_bandwidth(r),
+                (i + 1 < report->count) ? "," : "");
+    }
+    fputs("]}\n", fp);
+}
+
+/**
+ * Read a report written by stats_write_json(). Returns 0 on success.
+ */
+int
+stats_read_json(const char* file_name, struct stats_report* report)
+{
+    char line[STATS_LINE_SIZE];
+    FILE* fp = fopen(file_name, "r");
+    if(NULL == fp)
+    {
+        perror(file_name);
+        return -1;
+    }
+
+    memset(report, 0, sizeof(*report));
+    while(NULL != fgets(line, sizeof(line), fp))
+    {
+        struct stats_result r;
+        if(7 != sscanf(line, "{\"name\": \"%63[^\"]\", \"bytes\": %zu, "
+                    "\"n\": %zu, \"min\": %lf, \"median\": %lf, "
+                    "\"p99\": %lf, \"mean\": %lf",
+                    r.name, &r.bytes, &r.summary.count, &r.summary.min,
+                    &r.summary.median, &r.summary.p99, &r.summary.mean))
+            continue;
+        stats_add(report, r.name, r.bytes, NULL, 0);
+        if(0 != report->count)
+            report->results[report->count - 1].summary = r.summary;
+    }
+    fclose(fp);
+    return 0;
+}
+
+/**
+ * Compare median times of the current results with a baseline. A result
+ * which is slower by more than threshold percent is a regression.
+ * Returns the number of regressions.
+ */
+int
+stats_compare(const struct stats_report* current,
+        const struct stats_report* baseline, double threshold, FILE* fp)
+{
+    int regressions = 0;
+
+    fprintf(fp, "%-40s %12s %12s %9s\n",
+            "Benchmark", "baseline", "current", "change");
+    for(size_t i = 0; i < current->count; ++i)
+    {
+        const struct stats_result* r = &current->results[i];
+        const struct stats_result* b = stats_find(baseline, r->name);
+        double change;
+        int worse;
+        if(NULL == b || 0.0 == b->summary.median)
+            continue;
+        change = 100.0 * (r->summary.median - b->summary.median)
+            / b->summary.median;
+        worse = change > threshold;
+        regressions += worse;
+        fprintf(fp, "%-40s %12.3f %12.3f %+8.1f%%%s\n", r->name,
+                b->summary.median, r->summary.median, change,
+                worse ? "  REGRESSION" : "");
+    }
+    return regressions;
+}
+
+#endif // OCL_LABS_STATS_C
@@ -0,0 +1,327 @@
+#ifndef OCL_LABS_STREAM_C
+#define OCL_LABS_STREAM_C
+
+/*
+ * Streaming of an input of any size through a kernel in chunks.
+ *
+ * The stream owns depth slots, each a pair of device buffers with the host
+ * memory for one chunk, and three in-order queues: for uploads, for the
+ * kernel and for downloads. Chunk k goes to slot k % depth; its kernel
+ * waits for its upload and its download waits for its kernel through
+ * events, so while chunk k runs, chunk k + 1 is being uploaded and chunk
+ * k - 1 downloaded. A slot is reused only after the download of its
+ * previous chunk has been handed to the consumer.
+ *
+ * The kernel takes (__global out*, __global const in*) and gets one work
+ * item per element, where an element may be a vector. A kernel of a single
+ * work item is launched as a task and takes the number of elements as the
+ * third (uint) argument. A partial last chunk is padded with zeros up to
+ * a whole element, or a whole work-group if the kernel requires its size.
+ *
+ * The slot buffers are transfer buffers (see common/xfer.c) of the default
+ * mode: a chunk is filled right in the mapped input and drained right from
+ * the mapped output, so with alloc or use on shared memory no chunk is
+ * ever copied. In copy mode the unmap of the input is the upload and the
+ * map of the output the download, as plain writes and reads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "CL/opencl.h"
+
+#include "trace.c"
+#include "xfer.c"
+
+#define STREAM_NUM_QUEUES 3
+
+enum stream_queue
+{
+    STREAM_UPLOAD,
+    STREAM_EXECUTE,
+    STREAM_DOWNLOAD
+};
+
+struct stream_slot
+{
+    struct xfer_buffer in;
+    struct xfer_buffer out;
+    void* host_in;      // the mapped input while the chunk is filled
+    void* host_out;     // the mapped output, valid once downloaded
+    size_t bytes;       // of the chunk in the slot, 0 if the slot is free
+    size_t chunk;       // index of the chunk in the slot
+    cl_event uploaded;
+    cl_event executed;
+    cl_event downloaded;
+};
+
+/* The kernel a stream runs and how to launch it */
+struct stream_kernel
+{
+    cl_kernel kernel;
+    size_t element_size;    // bytes a work item (a loop iteration) moves
+    size_t local_size;      // required work-group size, 0 if none
+    int single_work_item;
+};
+
+struct stream
+{
+    cl_command_queue queues[STREAM_NUM_QUEUES];
+    struct stream_kernel kernel;
+    size_t granule;     // bytes a chunk is padded to
+    size_t chunk_size;  // bytes, a multiple of the granule
+    cl_uint depth;
+    struct stream_slot* slots;
+    size_t total_bytes; // streamed so far
+    size_t num_chunks;
+};
+
+/*
+ * Put up to max_bytes of the next chunk into data. Returns the number of
+ * bytes put, 0 at the end of the input.
+ */
+typedef size_t (*stream_fill_fn)(void* data, size_t max_bytes, void* arg);
+
+/*
+ * Take the result of a chunk. The data is valid until the function returns.
+ */
+typedef cl_int (*stream_drain_fn)(const void* data, size_t bytes,
+        size_t chunk, void* arg);
+
+void
+stream_release(struct stream* s)
+{
+    for(cl_uint i = 0; NULL != s->slots && i < s->depth; ++i)
+    {
+        struct stream_slot* slot = &s->slots[i];
+        xfer_release(&slot->in);
+        xfer_release(&slot->out);
+    }
+    for(int i = 0; i < STREAM_NUM_QUEUES; ++i)
+        if(NULL != s->queues[i])
+            clReleaseCommandQueue(s->queues[i]);
+    free(s->slots);
+    memset(s, 0, sizeof(*s));
+}
+
+/**
+ * Create the queues and depth slots of chunk_size bytes (rounded up to
+ * a whole granule). The kernel arguments are set per chunk.
+ */
+cl_int
+stream_init(struct stream* s, cl_context context, cl_device_id device,
+        const struct stream_kernel* kernel, size_t chunk_size, cl_uint depth)
+{
+    cl_int rv = CL_SUCCESS;
+
+    memset(s, 0, sizeof(*s));
+    if(0 == kernel->element_size || 0 == chunk_size || 0 == depth)
+        return CL_INVALID_VALUE;
+    s->kernel = *kernel;
+    s->granule = kernel->element_size
+        * (kernel->local_size ? kernel->local_size : 1);
+    s->chunk_size = (chunk_size + s->granule - 1) / s->granule * s->granule;
+    s->depth = depth;
+
+    for(int i = 0; i < STREAM_NUM_QUEUES && CL_SUCCESS == rv; ++i)
+        s->queues[i] = clCreateCommandQueue(context, device,
+                CL_QUEUE_PROFILING_ENABLE, &rv);
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Failed to create a command queue:", rv, stderr);
+        stream_release(s);
+        return rv;
+    }
+
+    if(NULL == (s->slots = calloc(depth, sizeof(*s->slots))))
+    {
+        stream_release(s);
+        return CL_OUT_OF_HOST_MEMORY;
+    }
+    for(cl_uint i = 0; i < depth && CL_SUCCESS == rv; ++i)
+    {
+        struct stream_slot* slot = &s->slots[i];
+        rv = xfer_create(&slot->in, context, CL_MEM_READ_ONLY,
+                s->chunk_size, xfer_mode());
+        if(CL_SUCCESS == rv)
+            rv = xfer_create(&slot->out, context, CL_MEM_WRITE_ONLY,
+                    s->chunk_size, xfer_mode());
+        if(CL_SUCCESS != rv)
+            print_cl_error("Failed to create a buffer object:", rv, stderr);
+    }
+    if(CL_SUCCESS != rv)
+        stream_release(s);
+    return rv;
+}
+
+static void
+stream_release_events(struct stream_slot* slot)
+{
+    if(NULL != slot->uploaded)
+        clReleaseEvent(slot->uploaded);
+    if(NULL != slot->executed)
+        clReleaseEvent(slot->executed);
+    if(NULL != slot->downloaded)
+        clReleaseEvent(slot->downloaded);
+    slot->uploaded = slot->executed = slot->downloaded = NULL;
+}
+
+/*
+ * Give the mapped buffers of the slot back, an input nobody uploads with
+ * nothing written. The output is unmapped on the kernel queue, so the
+ * next kernel of the slot can't overwrite it before.
+ */
+static void
+stream_unmap(struct stream* s, struct stream_slot* slot)
+{
+    if(NULL != slot->in.mapped)
+    {
+        xfer_shrink(&slot->in, 0);
+        xfer_unmap(&slot->in, s->queues[STREAM_UPLOAD], NULL);
+    }
+    if(NULL != slot->out.mapped)
+        xfer_unmap(&slot->out, s->queues[STREAM_EXECUTE], NULL);
+    slot->host_in = slot->host_out = NULL;
+}
+
+/**
+ * Wait for the chunk in the slot and hand its result to the consumer.
+ */
+static cl_int
+stream_retire(struct stream* s, struct stream_slot* slot,
+        stream_drain_fn drain, void* arg)
+{
+    cl_int rv = CL_SUCCESS;
+
+    if(0 == slot->bytes)
+        return CL_SUCCESS;
+    if(NULL != slot->downloaded)
+        rv = clWaitForEvents(1, &slot->downloaded);
+    if(CL_SUCCESS == rv)
+        rv = drain(slot->host_out, slot->bytes, slot->chunk, arg);
+    stream_unmap(s, slot);
+    stream_release_events(slot);
+    slot->bytes = 0;
+    return rv;
+}
+
+/**
+ * Upload the chunk in the slot, run the kernel over it and download the
+ * result, each command waiting for the previous one.
+ */
+static cl_int
+stream_submit(struct stream* s, struct stream_slot* slot)
+{
+    cl_int rv;
+    const struct stream_kernel* k = &s->kernel;
+    size_t padded = (slot->bytes + s->granule - 1) / s->granule * s->granule;
+    size_t global_work_size = padded / k->element_size;
+    cl_uint num_elements = global_work_size;
+
+    if(padded != slot->bytes)
+        memset((char*) slot->host_in + slot->bytes, 0, padded - slot->bytes);
+
+    xfer_shrink(&slot->in, padded);
+    rv = xfer_unmap(&slot->in, s->queues[STREAM_UPLOAD], &slot->uploaded);
+    slot->host_in = NULL;
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Couldn\'t enqueue the command to write the data:",
+                rv, stderr);
+        return rv;
+    }
+
+    rv  = clSetKernelArg(k->kernel, 0, sizeof(cl_mem), &slot->out.mem);
+    rv |= clSetKernelArg(k->kernel, 1, sizeof(cl_mem), &slot->in.mem);
+    if(k->single_work_item)
+        rv |= clSetKernelArg(k->kernel, 2, sizeof(cl_uint), &num_elements);
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Failed to set an argument:", rv, stderr);
+        return rv;
+    }
+    if(k->single_work_item)
+        rv = clEnqueueTask(s->queues[STREAM_EXECUTE], k->kernel, 1,
+                &slot->uploaded, &slot->executed);
+    else
+        rv = clEnqueueNDRangeKernel(s->queues[STREAM_EXECUTE], k->kernel, 1,
+                NULL, &global_work_size,
+                (0 != k->local_size) ? &k->local_size : NULL,
+                1, &slot->uploaded, &slot->executed);
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Couldn\'t enqueue the kernel:", rv, stderr);
+        return rv;
+    }
+    trace_add(slot->executed, "kernel", 2 * padded);
+
+    slot->host_out = xfer_map_read_after(&slot->out,
+            s->queues[STREAM_DOWNLOAD], 0, slot->bytes, 1, &slot->executed,
+            &slot->downloaded, &rv);
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Failed to enqueue the command to read the data:",
+                rv, stderr);
+        return rv;
+    }
+
+    // the commands wait on each other across queues, so let all of them go
+    for(int i = 0; i < STREAM_NUM_QUEUES && CL_SUCCESS == rv; ++i)
+        rv = clFlush(s->queues[i]);
+    return rv;
+}
+
+/**
+ * Stream the whole input through the kernel. Results are drained in the
+ * order of the chunks.
+ */
+cl_int
+stream_run(struct stream* s, stream_fill_fn fill, stream_drain_fn drain,
+        void* arg)
+{
+    cl_int rv = CL_SUCCESS;
+    size_t chunk;
+
+    for(chunk = 0; CL_SUCCESS == rv; ++chunk)
+    {
+        struct stream_slot* slot = &s->slots[chunk % s->depth];
+        if(CL_SUCCESS != (rv = stream_retire(s, slot, drain, arg)))
+            break;
+        slot->host_in = xfer_map(&slot->in, s->queues[STREAM_UPLOAD],
+                CL_MAP_WRITE, 0, s->chunk_size, NULL, &rv);
+        if(CL_SUCCESS != rv)
+        {
+            print_cl_error("Failed to map the input:", rv, stderr);
+            break;
+        }
+        slot->bytes = fill(slot->host_in, s->chunk_size, arg);
+        if(0 == slot->bytes)
+        {
+            stream_unmap(s, slot);
+            break;
+        }
+        slot->chunk = chunk;
+        s->total_bytes += slot->bytes;
+        ++s->num_chunks;
+        rv = stream_submit(s, slot);
+    }
+
+    if(CL_SUCCESS != rv)
+        for(int i = 0; i < STREAM_NUM_QUEUES; ++i)
+            clFinish(s->queues[i]);
+
+    // the chunks still in flight, oldest first
+    for(size_t i = 1; i <= s->depth; ++i)
+    {
+        struct stream_slot* slot = &s->slots[(chunk + i) % s->depth];
+        if(CL_SUCCESS == rv)
+            rv = stream_retire(s, slot, drain, arg);
+        stream_unmap(s, slot);
+        stream_release_events(slot);
+        slot->bytes = 0;
+    }
+    return rv;
+}
+
+#endif // OCL_LABS_STREAM_C
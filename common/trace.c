@@ -0,0 +1,448 @@
+#ifndef OCL_LABS_TRACE_C
+#define OCL_LABS_TRACE_C
+
+/*
+ * Timeline of the enqueued commands built from event profiling.
+ *
+ * Tracing is enabled by OCL_TRACE=<prefix>. Every traced command keeps its
+ * event together with the host time it was enqueued at; trace_finish()
+ * collects QUEUED/SUBMIT/START/END of all commands, moves the device
+ * timestamps onto the host clock and writes:
+ *   <prefix>.json  the timeline in the Chrome trace format
+ *                  (chrome://tracing, https://ui.perfetto.dev)
+ *   <prefix>.csv   a summary of queueing, submission, execution and idle
+ *                  time per command name
+ * The command queues must be created with CL_QUEUE_PROFILING_ENABLE; the
+ * tracer keeps them alive, so they may be released before trace_finish().
+ * When tracing is disabled trace_event() returns NULL, so it may be passed
+ * as the event argument of any clEnqueue* call at no cost.
+ * The tracer is not thread-safe: commands are traced from one host thread,
+ * or the calls to it are serialized by the caller.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "CL/opencl.h"
+
+#define TRACE_ENV "OCL_TRACE"
+#define TRACE_PATH_SIZE 4096
+
+struct trace_record
+{
+    cl_event event;
+    const char* name;
+    size_t bytes;
+    cl_ulong host_ns;           // host clock right before the enqueue
+    cl_ulong t[4];              // QUEUED, SUBMIT, START, END
+    cl_command_type type;
+    cl_command_queue queue;
+    cl_device_id device;
+    cl_uint queue_index;
+    cl_uint device_index;
+};
+
+struct trace
+{
+    int enabled;                // -1 until OCL_TRACE is checked
+    char prefix[TRACE_PATH_SIZE];
+    struct trace_record* records;
+    size_t count;
+    size_t capacity;
+};
+
+static struct trace g_trace = { -1, "", NULL, 0, 0 };
+
+cl_ulong
+trace_host_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (cl_ulong) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Start tracing to the files with the given prefix (e.g. from a command
+ * line option). Without a call the prefix is taken from OCL_TRACE.
+ */
+void
+trace_start(const char* prefix)
+{
+    g_trace.enabled = (NULL != prefix && '\0' != *prefix);
+    if(g_trace.enabled)
+        snprintf(g_trace.prefix, sizeof(g_trace.prefix), "%s", prefix);
+}
+
+int
+trace_enabled(void)
+{
+    if(-1 == g_trace.enabled)
+        trace_start(getenv(TRACE_ENV));
+    return g_trace.enabled;
+}
+
+/*
+ * Retain the queue of a traced command, its profiling data is collected
+ * after the caller may have released it.
+ */
+static void
+trace_hold_queue(struct trace_record* r)
+{
+    if(NULL != r->event && NULL == r->queue
+            && CL_SUCCESS == clGetEventInfo(r->event, CL_EVENT_COMMAND_QUEUE,
+                sizeof(r->queue), &r->queue, NULL))
+        clRetainCommandQueue(r->queue);
+}
+
+static struct trace_record*
+trace_new_record(const char* name, size_t bytes)
+{
+    struct trace_record* r;
+    // the slot of the previous command is filled by now
+    if(0 != g_trace.count)
+        trace_hold_queue(&g_trace.records[g_trace.count - 1]);
+    if(g_trace.count == g_trace.capacity)
+    {
+        size_t capacity = g_trace.capacity ? 2 * g_trace.capacity : 256;
+        r = realloc(g_trace.records, capacity * sizeof(*r));
+        if(NULL == r)
+            return NULL;
+        g_trace.records = r;
+        g_trace.capacity = capacity;
+    }
+    r = &g_trace.records[g_trace.count++];
+    memset(r, 0, sizeof(*r));
+    r->name = name;
+    r->bytes = bytes;
+    r->host_ns = trace_host_ns();
+    return r;
+}
+
+/**
+ * Get an event slot for a command about to be enqueued, e.g.
+ *   clEnqueueWriteBuffer(q, buf, CL_FALSE, 0, size, p, 0, NULL,
+ *           trace_event("write in", size));
+ * The name must outlive the trace and the slot must be filled before the
+ * next call to the tracer: the pointer is only valid until the next
+ * command is traced, recording one may move the slots. Returns NULL if
+ * tracing is disabled.
+ */
+cl_event*
+trace_event(const char* name, size_t bytes)
+{
+    struct trace_record* r;
+    if(!trace_enabled() || NULL == (r = trace_new_record(name, bytes)))
+        return NULL;
+    return &r->event;
+}
+
+/**
+ * Trace a command whose event is owned by the caller. Call it right after
+ * the enqueue; the event is retained until trace_finish().
+ */
+void
+trace_add(cl_event event, const char* name, size_t bytes)
+{
+    struct trace_record* r;
+    if(NULL == event || !trace_enabled()
+            || NULL == (r = trace_new_record(name, bytes)))
+        return;
+    r->event = event;
+    clRetainEvent(event);
+    trace_hold_queue(r);
+}
+
+static const char*
+trace_category(cl_command_type type)
+{
+    switch(type)
+    {
+        case CL_COMMAND_NDRANGE_KERNEL:
+        case CL_COMMAND_TASK:
+            return "kernel";
+        case CL_COMMAND_WRITE_BUFFER:
+            return "write";
+        case CL_COMMAND_READ_BUFFER:
+            return "read";
+        case CL_COMMAND_COPY_BUFFER:
+            return "copy";
+        case CL_COMMAND_MAP_BUFFER:
+            return "map";
+        case CL_COMMAND_UNMAP_MEM_OBJECT:
+            return "unmap";
+        default:
+            return "other";
+    }
+}
+
+/**
+ * Get an index of a handle in a list of handles seen so far.
+ */
+static cl_uint
+trace_index(void** seen, cl_uint* num_seen, void* handle)
+{
+    for(cl_uint i = 0; i < *num_seen; ++i)
+        if(seen[i] == handle)
+            return i;
+    seen[*num_seen] = handle;
+    return (*num_seen)++;
+}
+
+/**
+ * Query the profiling data of all traced commands and move the device
+ * timestamps onto the host clock. Returns the number of devices.
+ */
+static cl_uint
+trace_collect(cl_long* offsets)
+{
+    static const cl_profiling_info params[4] = {
+        CL_PROFILING_COMMAND_QUEUED, CL_PROFILING_COMMAND_SUBMIT,
+        CL_PROFILING_COMMAND_START, CL_PROFILING_COMMAND_END
+    };
+    void** queues = malloc(g_trace.count * sizeof(void*));
+    void** devices = malloc(g_trace.count * sizeof(void*));
+    cl_uint num_queues = 0, num_devices = 0;
+    size_t n = 0;
+
+    for(size_t i = 0; i < g_trace.count; ++i)
+    {
+        struct trace_record* r = &g_trace.records[i];
+        cl_int rv;
+        if(NULL == r->event) // the enqueue has failed
+            continue;
+        trace_hold_queue(r);
+        rv = clWaitForEvents(1, &r->event);
+        for(int j = 0; j < 4 && CL_SUCCESS == rv; ++j)
+            rv = clGetEventProfilingInfo(r->event, params[j],
+                    sizeof(cl_ulong), &r->t[j], NULL);
+        if(CL_SUCCESS == rv)
+            rv = clGetEventInfo(r->event, CL_EVENT_COMMAND_TYPE,
+                    sizeof(r->type), &r->type, NULL);
+        if(CL_SUCCESS == rv && NULL == r->queue)
+            rv = CL_INVALID_COMMAND_QUEUE;
+        if(CL_SUCCESS == rv)
+            rv = clGetCommandQueueInfo(r->queue, CL_QUEUE_DEVICE,
+                    sizeof(r->device), &r->device, NULL);
+        clReleaseEvent(r->event);
+        if(CL_SUCCESS != rv)
+        {
+            print_cl_error("Failed to get profiling info:", rv, stderr);
+            if(NULL != r->queue)
+                clReleaseCommandQueue(r->queue);
+            continue;
+        }
+        r->queue_index = trace_index(queues, &num_queues, r->queue);
+        r->device_index = trace_index(devices, &num_devices, r->device);
+        g_trace.records[n++] = *r;
+    }
+    g_trace.count = n;
+    for(size_t i = 0; i < n; ++i)
+        clReleaseCommandQueue(g_trace.records[i].queue);
+    free(queues);
+    free(devices);
+
+    /*
+     * A command is queued right after the host time was taken, so
+     * host = device + offset where the offset is the largest difference
+     * between the host enqueue time and the device QUEUED time.
+     */
+    for(cl_uint d = 0; d < num_devices; ++d)
+    {
+        int found = 0;
+        for(size_t i = 0; i < g_trace.count; ++i)
+        {
+            struct trace_record* r = &g_trace.records[i];
+            cl_long diff = (cl_long) (r->host_ns - r->t[0]);
+            if(r->device_index == d && (!found || diff > offsets[d]))
+            {
+                offsets[d] = diff;
+                found = 1;
+            }
+        }
+    }
+    for(size_t i = 0; i < g_trace.count; ++i)
+    {
+        struct trace_record* r = &g_trace.records[i];
+        for(int j = 0; j < 4; ++j)
+            r->t[j] += offsets[r->device_index];
+    }
+    return num_devices;
+}
+
+static void
+trace_write_json(FILE* fp, cl_ulong base, cl_uint num_devices)
+{
+    fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n", fp);
+    for(size_t i = 0; i < g_trace.count; ++i)
+    {
+        const struct trace_record* r = &g_trace.records[i];
+        const char* cat = trace_category(r->type);
+
+        // the lane of a queue shows execution, the next one waiting
+        fprintf(fp, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+                "\"pid\":%u,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,"
+                "\"args\":{\"bytes\":%zu,\"queued_us\":%.3f,"
+                "\"submit_us\":%.3f}},\n",
+                r->name, cat, r->device_index, 2 * r->queue_index,
+                (r->t[2] - base) / 1e3, (r->t[3] - r->t[2]) / 1e3, r->bytes,
+                (r->t[1] - r->t[0]) / 1e3, (r->t[2] - r->t[1]) / 1e3);
+        fprintf(fp, "{\"name\":\"%s\",\"cat\":\"wait\",\"ph\":\"X\","
+                "\"pid\":%u,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f},\n",
+                r->name, r->device_index, 2 * r->queue_index + 1,
+                (r->t[0] - base) / 1e3, (r->t[2] - r->t[0]) / 1e3);
+    }
+    char* named = calloc(g_trace.count, 1);
+    for(size_t i = 0; i < g_trace.count && NULL != named; ++i)
+    {
+        const struct trace_record* r = &g_trace.records[i];
+        if(named[r->queue_index])
+            continue;
+        named[r->queue_index] = 1;
+        fprintf(fp, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,"
+                "\"tid\":%u,\"args\":{\"name\":\"queue %u\"}},\n",
+                r->device_index, 2 * r->queue_index, r->queue_index);
+        fprintf(fp, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,"
+                "\"tid\":%u,\"args\":{\"name\":\"queue %u (waiting)\"}},\n",
+                r->device_index, 2 * r->queue_index + 1, r->queue_index);
+    }
+    free(named);
+    for(cl_uint d = 0; d < num_devices; ++d)
+        fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,"
+                "\"args\":{\"name\":\"device %u\"}}%s\n", d, d,
+                (d + 1 < num_devices) ? "," : "");
+    fputs("]}\n", fp);
+}
+
+/* Order of commands by queue and then by start time */
+static int
+trace_cmp_start(const void* a, const void* b)
+{
+    const struct trace_record* ra = &g_trace.records[*(const size_t*) a];
+    const struct trace_record* rb = &g_trace.records[*(const size_t*) b];
+    if(ra->queue_index != rb->queue_index)
+        return ra->queue_index < rb->queue_index ? -1 : 1;
+    if(ra->t[2] != rb->t[2])
+        return ra->t[2] < rb->t[2] ? -1 : 1;
+    return 0;
+}
+
+static void
+trace_write_csv(FILE* fp)
+{
+    cl_ulong* gaps = calloc(g_trace.count, sizeof(cl_ulong));
+    size_t* order = malloc(g_trace.count * sizeof(size_t));
+    int* done = calloc(g_trace.count, sizeof(int));
+    cl_ulong busy_until = 0;
+    if(NULL == gaps || NULL == order || NULL == done)
+    {
+        free(gaps);
+        free(order);
+        free(done);
+        return;
+    }
+
+    // the idle gap before a command is counted from the end of the previous
+    // commands of the same queue
+    for(size_t i = 0; i < g_trace.count; ++i)
+        order[i] = i;
+    qsort(order, g_trace.count, sizeof(size_t), trace_cmp_start);
+    for(size_t k = 0; k < g_trace.count; ++k)
+    {
+        const struct trace_record* r = &g_trace.records[order[k]];
+        if(0 == k
+                || g_trace.records[order[k - 1]].queue_index != r->queue_index)
+        {
+            busy_until = r->t[3];
+            continue;
+        }
+        if(r->t[2] > busy_until)
+            gaps[order[k]] = r->t[2] - busy_until;
+        if(r->t[3] > busy_until)
+            busy_until = r->t[3];
+    }
+    free(order);
+
+    fputs("name,category,count,bytes,queued_us,submit_us,exec_us,gap_us,"
+            "exec_mb_per_s\n", fp);
+    for(size_t i = 0; i < g_trace.count; ++i)
+    {
+        const struct trace_record* r = &g_trace.records[i];
+        cl_ulong count = 0, bytes = 0, queued = 0, submit = 0, exec = 0;
+        cl_ulong gap = 0;
+        if(done[i])
+            continue;
+        for(size_t j = i; j < g_trace.count; ++j)
+        {
+            const struct trace_record* s = &g_trace.records[j];
+            if(done[j] || strcmp(s->name, r->name) || s->type != r->type)
+                continue;
+            done[j] = 1;
+            ++count;
+            bytes += s->bytes;
+            queued += s->t[1] - s->t[0];
+            submit += s->t[2] - s->t[1];
+            exec += s->t[3] - s->t[2];
+            gap += gaps[j];
+        }
+        fprintf(fp, "%s,%s,%llu,%llu,%.3f,%.3f,%.3f,%.3f,%.1f\n",
+                r->name, trace_category(r->type), count, bytes,
+                queued / 1e3, submit / 1e3, exec / 1e3, gap / 1e3,
+                (0 != exec) ? bytes * 1e3 / exec : 0.0);
+    }
+    free(gaps);
+    free(done);
+}
+
+/**
+ * Wait for all traced commands and write the trace files.
+ */
+void
+trace_finish(void)
+{
+    char path[TRACE_PATH_SIZE + 8];
+    cl_long* offsets;
+    cl_ulong base;
+    cl_uint num_devices;
+    FILE* fp;
+
+    if(!trace_enabled() || 0 == g_trace.count)
+        return;
+    offsets = calloc(g_trace.count, sizeof(cl_long));
+    if(NULL == offsets)
+        return;
+    num_devices = trace_collect(offsets);
+    free(offsets);
+
+    base = (0 != g_trace.count) ? g_trace.records[0].t[0] : 0;
+    for(size_t i = 0; i < g_trace.count; ++i)
+        if(g_trace.records[i].t[0] < base)
+            base = g_trace.records[i].t[0];
+
+    snprintf(path, sizeof(path), "%s.json", g_trace.prefix);
+    if(NULL != (fp = fopen(path, "w")))
+    {
+        trace_write_json(fp, base, num_devices);
+        fclose(fp);
+    }
+    else
+        perror(path);
+
+    snprintf(path, sizeof(path), "%s.csv", g_trace.prefix);
+    if(NULL != (fp = fopen(path, "w")))
+    {
+        trace_write_csv(fp);
+        fclose(fp);
+    }
+    else
+        perror(path);
+
+    printf("Trace of %zu commands is written to %s.{json,csv}\n",
+            g_trace.count, g_trace.prefix);
+    free(g_trace.records);
+    g_trace.records = NULL;
+    g_trace.count = g_trace.capacity = 0;
+}
+
+#endif // OCL_LABS_TRACE_C
@@ -1,41 +1,46 @@
+#include <string.h>
+
+#include "progcache.c"
+#include "bundle.c"
+#include "devices.c"
+
 /**
  * A callback to be used by OpenCL implementation to report information
- * on errors that occur in this context.
+ * on errors that occur in this context. It may be called on any thread of
+ * the runtime, so the stream is locked for the whole message.
  */
 void
 ocl_context_cb(const char* errinfo,
         const void* private_info, size_t cb, void* user_data)
 {
-    printf("[context-error] %s\n", errinfo); // not thread safe
+    flockfile(stdout);
+    fputs("[context-error] ", stdout);
+    fputs(errinfo, stdout);
+    putc_unlocked('\n', stdout);
+    fflush(stdout);
+    funlockfile(stdout);
 }
 
 /**
- * Get an availiable OpenCL device and create a context.
+ * Get an OpenCL device picked by a selector (see common/devices.c) and
+ * create a context. A NULL selector takes OCL_DEVICE or the default device.
  */
 cl_int
-platform_layer(cl_device_id* device, cl_context* context)
+platform_layer_select(const char* selector,
+        cl_device_id* device, cl_context* context)
 {
     cl_int rv;
-    cl_platform_id platform;
-    cl_uint num_platforms;
-    cl_uint num_devices;
+    struct device_list devices;
 
-    /* Get an available platform on SOC-DE1 */
-    rv = clGetPlatformIDs(1, &platform, &num_platforms);
+    /* Get an OpenCL device, the default one of SOC-DE1 if not specified */
+    rv = select_devices(device_selector(selector, NULL), &devices);
     if(CL_SUCCESS != rv)
     {
-        print_cl_error("clGetPlatfromIDs failed:\n", rv, stderr);
-        return rv;
-    }
-
-    /* Get an OpenCL device */
-    rv = clGetDeviceIDs(platform, CL_DEVICE_TYPE_DEFAULT, 1, 
-            device, &num_devices);
-    if(CL_SUCCESS != rv)
-    {
-        print_cl_error("clGetDeviceIDs failed:\n", rv, stderr);
+        print_cl_error("Failed to select a device:", rv, stderr);
         return rv;
     }
+    *device = devices.devices[0].id;
+    free_device_list(&devices);
 
     /* Actually create an OpenCL context */
     *context = clCreateContext(NULL, 1, device,
@@ -50,54 +55,240 @@ platform_layer(cl_device_id* device, cl_context* context)
 }
 
 /**
- * For a given file name return its content and size.
+ * Get an availiable OpenCL device and create a context.
+ */
+cl_int
+platform_layer(cl_device_id* device, cl_context* context)
+{
+    return platform_layer_select(NULL, device, context);
+}
+
+/**
+ * For a given file name map its content into memory (see common/bundle.c)
+ * and return its size. Returns 0 on failure; release with unmap_file().
  */
 size_t
-read_binary_kernel(const char* kernel_file_name, unsigned char** kernel_binary)
+read_binary_kernel(const char* kernel_file_name, struct mapped_file* file)
 {
-    FILE* kernel_file = fopen(kernel_file_name, "r");
-    fseek(kernel_file, 0, SEEK_END);
-    size_t kernel_file_size = ftell(kernel_file);
-    rewind(kernel_file);
-    *kernel_binary = malloc(kernel_file_size);
-    fread(*kernel_binary, sizeof(unsigned char), kernel_file_size, kernel_file);
-    fclose(kernel_file);
-    return kernel_file_size;
+    return map_file(kernel_file_name, file) ? 0 : file->size;
 }
 
 /**
- * Build a program for a given file name.
+ * Print out the build log of a program for the device.
+ */
+void
+print_build_log(cl_program program, cl_device_id device)
+{
+    size_t log_size;
+    char* log;
+
+    if(CL_SUCCESS != clGetProgramBuildInfo(program, device,
+                CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size)
+            || NULL == (log = malloc(log_size)))
+        return;
+    if(CL_SUCCESS == clGetProgramBuildInfo(program, device,
+                CL_PROGRAM_BUILD_LOG, log_size, log, NULL))
+        fprintf(stderr, "Build log:\n%s\n", log);
+    free(log);
+}
+
+/**
+ * Check whether a kernel file holds OpenCL C source rather than a binary.
+ */
+int
+is_kernel_source(const char* kernel_file_name)
+{
+    size_t len = strlen(kernel_file_name);
+    return len > 3 && 0 == strcmp(kernel_file_name + len - 3, ".cl");
+}
+
+/**
+ * Query the name of a device. The result should be freed by the caller.
+ */
+char*
+get_device_name(cl_device_id device)
+{
+    size_t size;
+    char* name;
+
+    if(CL_SUCCESS != clGetDeviceInfo(device, CL_DEVICE_NAME, 0, NULL, &size)
+            || NULL == (name = malloc(size)))
+        return NULL;
+    if(CL_SUCCESS != clGetDeviceInfo(device, CL_DEVICE_NAME, size, name, NULL))
+    {
+        free(name);
+        return NULL;
+    }
+    return name;
+}
+
+/**
+ * Check a kernel of a built program against the metadata of its bundle
+ * entry: the number of arguments and the required work-group size.
+ */
+static cl_int
+check_bundled_kernel(cl_program program, cl_device_id device,
+        const char* kernel_name, int num_args, const size_t reqd[3])
+{
+    cl_int rv;
+    cl_uint kernel_args;
+    size_t compiled[3];
+    cl_kernel kernel = clCreateKernel(program, kernel_name, &rv);
+
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("The bundled program lacks the kernel:", rv, stderr);
+        return rv;
+    }
+    rv = clGetKernelInfo(kernel, CL_KERNEL_NUM_ARGS, sizeof(kernel_args),
+            &kernel_args, NULL);
+    if(CL_SUCCESS == rv && num_args >= 0 && (cl_uint) num_args != kernel_args)
+    {
+        fprintf(stderr, "%s: %u arguments, the bundle says %d\n",
+                kernel_name, kernel_args, num_args);
+        rv = CL_INVALID_BINARY;
+    }
+    if(CL_SUCCESS == rv && 0 != reqd[0])
+        rv = clGetKernelWorkGroupInfo(kernel, device,
+                CL_KERNEL_COMPILE_WORK_GROUP_SIZE, sizeof(compiled), compiled,
+                NULL);
+    if(CL_SUCCESS == rv && 0 != reqd[0] && (compiled[0] != reqd[0]
+                || compiled[1] != reqd[1] || compiled[2] != reqd[2]))
+    {
+        fprintf(stderr, "%s: work group size %zux%zux%zu, "
+                "the bundle says %zux%zux%zu\n", kernel_name, compiled[0],
+                compiled[1], compiled[2], reqd[0], reqd[1], reqd[2]);
+        rv = CL_INVALID_BINARY;
+    }
+    clReleaseKernel(kernel);
+    return rv;
+}
+
+/**
+ * Build a program for a given file name with the build options.
+ * The file may be a precompiled binary (.aocx), a source (.cl) or a bundle
+ * (see common/bundle.c); the latter is searched for an entry that has the
+ * kernel (any kernel if NULL) and targets the device, and the kernel is
+ * checked against the signature and work-group size the entry declares.
+ * Programs built from source are kept in the on-disk cache (see
+ * common/progcache.c).
  */
 cl_int
-build_program(cl_program *program,
+build_program_opts(cl_program *program,
         const cl_context* context, const cl_device_id* device,
-        const char* kernel_file_name)
-{   
+        const char* kernel_file_name, const char* kernel_name,
+        const char* options)
+{
     cl_int rv;
-    size_t kernel_file_size;
-    unsigned char* kernel_binary;
+    struct mapped_file kernel_file;
+    struct bundle bundle;
+    size_t kernel_size;
+    const unsigned char* kernel_binary;
+    char cache_key[PROGCACHE_KEY_SIZE];
+    int use_cache;
+    int num_args = -1;              // of a bundled kernel, -1 if unknown
+    size_t reqd[3] = {0, 0, 0};     // of a bundled kernel, zeros if any
 
-    /* 7. Read the kernel binary code from a file (see common/utils.c) */
-    kernel_file_size = read_binary_kernel(kernel_file_name, &kernel_binary);
+    /* 7. Map the kernel binary code from a file into memory */
+    if(map_file(kernel_file_name, &kernel_file))
+        return CL_INVALID_VALUE;
+    kernel_binary = kernel_file.data;
+    kernel_size = kernel_file.size;
+
+    if(is_bundle(kernel_file.data, kernel_file.size))
+    {
+        char* device_name = get_device_name(*device);
+        const struct bundle_entry* entry = NULL;
+        if(0 == bundle_attach(&bundle, &kernel_file))
+            entry = bundle_find(&bundle, kernel_name, device_name);
+        free(device_name);
+        if(NULL == entry)
+        {
+            fprintf(stderr, "%s: no entry for the kernel %s on the device\n",
+                    kernel_file_name, NULL != kernel_name ? kernel_name : "");
+            unmap_file(&kernel_file);
+            return CL_INVALID_BINARY;
+        }
+        kernel_binary = bundle_binary(&bundle, entry);
+        kernel_size = entry->size;
+        if(NULL != kernel_name)
+        {
+            num_args = bundle_num_args(&bundle, entry, kernel_name);
+            for(int i = 0; i < 3; ++i)
+                reqd[i] = entry->reqd_work_group_size[i];
+        }
+    }
+
+    /* look up the program built by one of the previous runs; a binary is
+       passed to the runtime as mapped, caching it would only copy it */
+    use_cache = is_kernel_source(kernel_file_name)
+        && PROGCACHE_OFF != progcache_mode()
+        && CL_SUCCESS == progcache_key(cache_key, *device,
+                kernel_binary, kernel_size, options);
+    if(use_cache && CL_SUCCESS == progcache_load(program, *context, *device,
+                cache_key, options))
+    {
+        unmap_file(&kernel_file);
+        return CL_SUCCESS;
+    }
 
     /* 8. Creating program object and building an executable for the device */
-    const size_t lengths[1] = {kernel_file_size};
-    const unsigned char* binaries[1] = {kernel_binary};
-    *program = clCreateProgramWithBinary(*context, 1, device,
-            lengths, binaries, NULL, &rv);
-    if(CL_SUCCESS != NULL)
+    const size_t lengths[1] = {kernel_size};
+    if(is_kernel_source(kernel_file_name))
+    {
+        const char* sources[1] = {(const char*) kernel_binary};
+        *program = clCreateProgramWithSource(*context, 1, sources,
+                lengths, &rv);
+    }
+    else
+    {
+        const unsigned char* binaries[1] = {kernel_binary};
+        *program = clCreateProgramWithBinary(*context, 1, device,
+                lengths, binaries, NULL, &rv);
+    }
+    unmap_file(&kernel_file);
+    if(CL_SUCCESS != rv)
     {
         print_cl_error("Couldn\'t create the program", rv, stderr);
         return rv;
     }
-    free(kernel_binary);
 
-    rv = clBuildProgram(*program, 1, device, "", NULL, NULL);
+    rv = clBuildProgram(*program, 1, device, options, NULL, NULL);
     if(CL_SUCCESS != rv)
     {
         print_cl_error("Couldn\'t build an executable", rv, stderr);
+        print_build_log(*program, *device);
+        clReleaseProgram(*program);
+        *program = NULL;
         return rv;
-    }  
+    }
+    if(NULL != kernel_name && (num_args >= 0 || 0 != reqd[0]))
+    {
+        rv = check_bundled_kernel(*program, *device, kernel_name, num_args,
+                reqd);
+        if(CL_SUCCESS != rv)
+        {
+            clReleaseProgram(*program);
+            *program = NULL;
+            return rv;
+        }
+    }
+
+    // a failure to store the entry only costs a rebuild next time
+    if(use_cache)
+        progcache_store(*program, cache_key);
 
     return CL_SUCCESS;
 }
+
+/**
+ * Build a program for a given file name.
+ */
+cl_int
+build_program(cl_program *program,
+        const cl_context* context, const cl_device_id* device,
+        const char* kernel_file_name)
+{
+    return build_program_opts(program, context, device, kernel_file_name,
+            NULL, "");
+}
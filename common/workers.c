@@ -0,0 +1,235 @@
+#ifndef OCL_LABS_WORKERS_C
+#define OCL_LABS_WORKERS_C
+
+/*
+ * Host threads feeding a device with independent jobs.
+ *
+ * The threads share the context and the built program; each one has its
+ * own in-order command queue and its own kernel object, since the
+ * arguments of a kernel object are not safe to set from several threads.
+ * workers_init() starts the threads, which then sleep on a condition
+ * variable. workers_run() wakes them for a run: they take job indices from
+ * a shared counter until all jobs are taken, so a thread that waits for
+ * the device doesn't hold up the others, and go back to sleep. A run thus
+ * costs no thread creation. The first error stops the taking of jobs.
+ * workers_release() stops and joins the threads.
+ *
+ * Link with the threads library (${CMAKE_THREAD_LIBS_INIT}).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "CL/opencl.h"
+
+struct worker;
+
+/*
+ * Run job number job on a worker thread with the worker's queue and kernel.
+ */
+typedef cl_int (*worker_fn)(struct worker* w, size_t job, void* arg);
+
+struct worker
+{
+    unsigned int index;
+    cl_command_queue queue;
+    cl_kernel kernel;
+    void* data;                 // for the jobs, set by the caller
+    size_t num_jobs;            // done in the last run
+    struct worker_group* group;
+    pthread_t thread;
+};
+
+struct worker_group
+{
+    struct worker* workers;
+    unsigned int num_workers;
+    unsigned int num_threads;   // started
+    pthread_mutex_t lock;
+    pthread_cond_t start;       // a run or the stop, for the threads
+    pthread_cond_t done;        // the last thread of a run is done
+    int sync_init;              // the above are initialized
+    unsigned long run;          // number of the current run
+    unsigned int num_busy;      // threads still in the run
+    int stop;
+    size_t next_job;
+    size_t num_jobs;
+    worker_fn fn;
+    void* arg;
+    cl_int status;              // the first error of the run
+};
+
+void
+workers_release(struct worker_group* g)
+{
+    if(g->sync_init)
+    {
+        pthread_mutex_lock(&g->lock);
+        g->stop = 1;
+        pthread_cond_broadcast(&g->start);
+        pthread_mutex_unlock(&g->lock);
+        for(unsigned int i = 0; i < g->num_threads; ++i)
+            pthread_join(g->workers[i].thread, NULL);
+        pthread_cond_destroy(&g->done);
+        pthread_cond_destroy(&g->start);
+        pthread_mutex_destroy(&g->lock);
+    }
+    for(unsigned int i = 0; NULL != g->workers && i < g->num_workers; ++i)
+    {
+        struct worker* w = &g->workers[i];
+        if(NULL != w->kernel)
+            clReleaseKernel(w->kernel);
+        if(NULL != w->queue)
+            clReleaseCommandQueue(w->queue);
+    }
+    free(g->workers);
+    memset(g, 0, sizeof(*g));
+}
+
+static void* workers_thread(void* arg);
+
+/**
+ * Create a queue and a kernel object of the program for each of
+ * num_workers threads and start the threads.
+ */
+cl_int
+workers_init(struct worker_group* g, cl_context context, cl_device_id device,
+        cl_program program, const char* kernel_name, unsigned int num_workers)
+{
+    cl_int rv = CL_SUCCESS;
+
+    memset(g, 0, sizeof(*g));
+    if(0 == num_workers)
+        return CL_INVALID_VALUE;
+    if(NULL == (g->workers = calloc(num_workers, sizeof(*g->workers))))
+        return CL_OUT_OF_HOST_MEMORY;
+    g->num_workers = num_workers;
+
+    for(unsigned int i = 0; i < num_workers && CL_SUCCESS == rv; ++i)
+    {
+        struct worker* w = &g->workers[i];
+        w->index = i;
+        w->group = g;
+        w->queue = clCreateCommandQueue(context, device, 0, &rv);
+        if(CL_SUCCESS != rv)
+        {
+            print_cl_error("Failed to create a command queue:", rv, stderr);
+            break;
+        }
+        w->kernel = clCreateKernel(program, kernel_name, &rv);
+        if(CL_SUCCESS != rv)
+            print_cl_error("Failed to create a kernel object:", rv, stderr);
+    }
+    if(CL_SUCCESS == rv)
+    {
+        if(0 != pthread_mutex_init(&g->lock, NULL))
+            rv = CL_OUT_OF_RESOURCES;
+        else if(0 != pthread_cond_init(&g->start, NULL))
+        {
+            pthread_mutex_destroy(&g->lock);
+            rv = CL_OUT_OF_RESOURCES;
+        }
+        else if(0 != pthread_cond_init(&g->done, NULL))
+        {
+            pthread_cond_destroy(&g->start);
+            pthread_mutex_destroy(&g->lock);
+            rv = CL_OUT_OF_RESOURCES;
+        }
+        else
+            g->sync_init = 1;
+    }
+    // only the threads that started are joined
+    while(CL_SUCCESS == rv && g->num_threads < num_workers)
+    {
+        if(0 != pthread_create(&g->workers[g->num_threads].thread, NULL,
+                    workers_thread, &g->workers[g->num_threads]))
+        {
+            perror("Failed to start a host thread");
+            rv = CL_OUT_OF_RESOURCES;
+        }
+        else
+            ++g->num_threads;
+    }
+    if(CL_SUCCESS != rv)
+        workers_release(g);
+    return rv;
+}
+
+/* Take jobs until all are taken or one fails */
+static void
+workers_take_jobs(struct worker* w)
+{
+    struct worker_group* g = w->group;
+
+    for(;;)
+    {
+        cl_int rv;
+        size_t job = __atomic_fetch_add(&g->next_job, 1, __ATOMIC_RELAXED);
+        if(job >= g->num_jobs
+                || CL_SUCCESS != __atomic_load_n(&g->status, __ATOMIC_RELAXED))
+            break;
+        if(CL_SUCCESS != (rv = g->fn(w, job, g->arg)))
+        {
+            cl_int ok = CL_SUCCESS;
+            __atomic_compare_exchange_n(&g->status, &ok, rv, 0,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+            break;
+        }
+        ++w->num_jobs;
+    }
+}
+
+static void*
+workers_thread(void* arg)
+{
+    struct worker* w = arg;
+    struct worker_group* g = w->group;
+    unsigned long run = 0;
+
+    pthread_mutex_lock(&g->lock);
+    for(;;)
+    {
+        while(!g->stop && run == g->run)
+            pthread_cond_wait(&g->start, &g->lock);
+        if(g->stop)
+            break;
+        run = g->run;
+        pthread_mutex_unlock(&g->lock);
+
+        workers_take_jobs(w);
+
+        pthread_mutex_lock(&g->lock);
+        if(0 == --g->num_busy)
+            pthread_cond_signal(&g->done);
+    }
+    pthread_mutex_unlock(&g->lock);
+    return NULL;
+}
+
+/**
+ * Run num_jobs jobs on the threads and wait for all of them. Returns the
+ * first error a job returned.
+ */
+cl_int
+workers_run(struct worker_group* g, size_t num_jobs, worker_fn fn, void* arg)
+{
+    pthread_mutex_lock(&g->lock);
+    g->next_job = 0;
+    g->num_jobs = num_jobs;
+    g->fn = fn;
+    g->arg = arg;
+    g->status = CL_SUCCESS;
+    for(unsigned int i = 0; i < g->num_workers; ++i)
+        g->workers[i].num_jobs = 0;
+    g->num_busy = g->num_threads;
+    ++g->run;
+    pthread_cond_broadcast(&g->start);
+    while(0 != g->num_busy)
+        pthread_cond_wait(&g->done, &g->lock);
+    pthread_mutex_unlock(&g->lock);
+    return g->status;
+}
+
+#endif // OCL_LABS_WORKERS_C
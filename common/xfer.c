@@ -0,0 +1,320 @@
+#ifndef OCL_LABS_XFER_C
+#define OCL_LABS_XFER_C
+
+/*
+ * Host<->device transfers of buffer contents.
+ *
+ * A transfer buffer pairs a memory object with the host memory the host
+ * side works on. The host gets a pointer with xfer_map() and gives it back
+ * with xfer_unmap(), how the data gets there depends on the mode:
+ *  copy      a plain buffer and a page-aligned host copy of it; mapping for
+ *            reading reads the buffer into the copy, unmapping after writing
+ *            writes the copy into the buffer, as lab1 does;
+ *  alloc     CL_MEM_ALLOC_HOST_PTR, the runtime allocates memory both sides
+ *            can access and the host maps it with clEnqueueMapBuffer();
+ *  use       CL_MEM_USE_HOST_PTR over a page-aligned host allocation.
+ * On boards where the host and the device share DRAM (de1soc_sharedonly)
+ * the last two make no copies at all. A mapping without CL_MAP_READ holds
+ * undefined contents in every mode, the host has to write all it maps:
+ * copy mode doesn't read the buffer in, and the other two map for writing
+ * with CL_MAP_WRITE_INVALIDATE_REGION where the device has OpenCL 1.2.
+ *
+ * The commands of both sides are traced (see common/trace.c) as
+ * "map"/"unmap", whatever the mode turns them into.
+ *
+ * Environment:
+ *  OCL_XFER  copy (default), alloc or use
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "CL/opencl.h"
+
+#include "trace.c"
+
+enum xfer_mode
+{
+    XFER_UNSET = -1,
+    XFER_COPY,
+    XFER_ALLOC_HOST_PTR,
+    XFER_USE_HOST_PTR,
+    XFER_NUM_MODES
+};
+
+struct xfer_buffer
+{
+    cl_mem mem;
+    enum xfer_mode mode;
+    size_t size;
+    void* host;             // page-aligned host memory, NULL in alloc mode
+    void* mapped;           // what the last xfer_map() returned
+    cl_map_flags write_only;    // the flags of a map for writing only
+    cl_map_flags map_flags;
+    size_t map_offset;
+    size_t map_size;
+};
+
+static const char * const g_xfer_mode_names[] = { "copy", "alloc", "use" };
+static enum xfer_mode g_xfer_mode = XFER_UNSET;
+
+const char*
+xfer_mode_str(enum xfer_mode mode)
+{
+    return (mode >= XFER_COPY && mode < XFER_NUM_MODES)
+        ? g_xfer_mode_names[mode] : "?";
+}
+
+cl_int
+xfer_mode_from_str(const char* name, enum xfer_mode* mode)
+{
+    for(int i = XFER_COPY; i < XFER_NUM_MODES; ++i)
+    {
+        if(0 == strcmp(name, g_xfer_mode_names[i]))
+        {
+            *mode = i;
+            return CL_SUCCESS;
+        }
+    }
+    fprintf(stderr, "Unknown transfer mode: %s\n", name);
+    return CL_INVALID_VALUE;
+}
+
+cl_int
+xfer_set_mode_str(const char* name)
+{
+    enum xfer_mode mode;
+    cl_int rv = xfer_mode_from_str(name, &mode);
+    if(CL_SUCCESS == rv)
+        g_xfer_mode = mode;
+    return rv;
+}
+
+/**
+ * Default mode; the first call picks it up from OCL_XFER.
+ */
+enum xfer_mode
+xfer_mode(void)
+{
+    if(XFER_UNSET == g_xfer_mode)
+    {
+        const char* env = getenv("OCL_XFER");
+        g_xfer_mode = XFER_COPY;
+        if(NULL != env && '\0' != *env)
+            xfer_set_mode_str(env);
+    }
+    return g_xfer_mode;
+}
+
+static void*
+xfer_alloc_host(size_t size)
+{
+    void* ptr;
+    long page_size = sysconf(_SC_PAGESIZE);
+    if(page_size <= 0)
+        page_size = 4096;
+    // keep whole pages, so a mapping never shares a page with other data
+    size = (size + page_size - 1) / page_size * page_size;
+    return (0 == posix_memalign(&ptr, page_size, size)) ? ptr : NULL;
+}
+
+/*
+ * The flags of a mapping for writing only: OpenCL 1.2 lets the runtime skip
+ * reading the region in, as copy mode does.
+ */
+static cl_map_flags
+xfer_write_only_flags(cl_context context)
+{
+#ifdef CL_MAP_WRITE_INVALIDATE_REGION
+    size_t size = 0;
+    cl_device_id* devices;
+    char version[256] = "";
+    int major = 0, minor = 0;
+
+    if(CL_SUCCESS != clGetContextInfo(context, CL_CONTEXT_DEVICES, 0, NULL,
+                &size) || size < sizeof(cl_device_id)
+            || NULL == (devices = malloc(size)))
+        return CL_MAP_WRITE;
+    if(CL_SUCCESS == clGetContextInfo(context, CL_CONTEXT_DEVICES, size,
+                devices, NULL))
+        clGetDeviceInfo(devices[0], CL_DEVICE_VERSION, sizeof(version) - 1,
+                version, NULL);
+    free(devices);
+    // "OpenCL <major>.<minor> <vendor-specific information>"
+    if(2 == sscanf(version, "OpenCL %d.%d", &major, &minor)
+            && (major > 1 || minor >= 2))
+        return CL_MAP_WRITE_INVALIDATE_REGION;
+#endif
+    return CL_MAP_WRITE;
+}
+
+/**
+ * Create a buffer of size bytes; flags tell how the kernels access it
+ * (CL_MEM_READ_ONLY etc.), the host pointer flags are added by the mode.
+ */
+cl_int
+xfer_create(struct xfer_buffer* buf, cl_context context, cl_mem_flags flags,
+        size_t size, enum xfer_mode mode)
+{
+    cl_int rv;
+
+    memset(buf, 0, sizeof(*buf));
+    buf->mode = mode;
+    buf->size = size;
+    buf->write_only = (XFER_COPY != mode) ? xfer_write_only_flags(context)
+        : CL_MAP_WRITE;
+    if(XFER_ALLOC_HOST_PTR != mode)
+    {
+        if(NULL == (buf->host = xfer_alloc_host(size)))
+            return CL_OUT_OF_HOST_MEMORY;
+    }
+    if(XFER_ALLOC_HOST_PTR == mode)
+        flags |= CL_MEM_ALLOC_HOST_PTR;
+    else if(XFER_USE_HOST_PTR == mode)
+        flags |= CL_MEM_USE_HOST_PTR;
+
+    buf->mem = clCreateBuffer(context, flags, size,
+            (XFER_USE_HOST_PTR == mode) ? buf->host : NULL, &rv);
+    if(CL_SUCCESS != rv)
+    {
+        free(buf->host);
+        buf->host = NULL;
+    }
+    return rv;
+}
+
+void
+xfer_release(struct xfer_buffer* buf)
+{
+    if(NULL != buf->mem)
+        clReleaseMemObject(buf->mem);
+    free(buf->host);
+    memset(buf, 0, sizeof(*buf));
+}
+
+/*
+ * The event slot for a command of the transfer: the caller's one or, for
+ * the tracer, a local one released by xfer_trace().
+ */
+static cl_event*
+xfer_event(cl_event* event, cl_event* local)
+{
+    *local = NULL;
+    return (NULL != event || !trace_enabled()) ? event : local;
+}
+
+static void
+xfer_trace(cl_event* slot, cl_event* local, const char* name, size_t bytes)
+{
+    if(NULL == slot || NULL == *slot)
+        return;
+    trace_add(*slot, name, bytes);
+    if(slot == local)
+        clReleaseEvent(*local);
+}
+
+static void*
+xfer_map_wait(struct xfer_buffer* buf, cl_command_queue queue,
+        cl_bool blocking, cl_map_flags flags, size_t offset, size_t size,
+        cl_uint num_wait, const cl_event* wait_list, cl_event* event,
+        cl_int* rv)
+{
+    cl_event local;
+    cl_event* slot = xfer_event(event, &local);
+
+    buf->map_flags = flags;
+    buf->map_offset = offset;
+    buf->map_size = size;
+    if(NULL != event)
+        *event = NULL;
+
+    if(XFER_COPY != buf->mode)
+    {
+        if(CL_MAP_WRITE == flags)
+            flags = buf->write_only;
+        buf->mapped = clEnqueueMapBuffer(queue, buf->mem, blocking, flags,
+                offset, size, num_wait, wait_list, slot, rv);
+        xfer_trace(slot, &local, "map", size);
+        return buf->mapped;
+    }
+
+    buf->mapped = (char*) buf->host + offset;
+    *rv = CL_SUCCESS;
+    if(CL_MAP_READ & flags)
+        *rv = clEnqueueReadBuffer(queue, buf->mem, blocking, offset, size,
+                buf->mapped, num_wait, wait_list, slot);
+    xfer_trace(slot, &local, "map", size);
+    return (CL_SUCCESS == *rv) ? buf->mapped : NULL;
+}
+
+/**
+ * Make size bytes of the buffer at offset available to the host and return
+ * a pointer to them. Blocks until the data can be accessed, with
+ * CL_MAP_READ the pointer holds the current contents of the buffer,
+ * without it the contents are undefined.
+ * The event, if requested, is the command which made the data available
+ * or NULL if none was needed (copy mode without CL_MAP_READ).
+ */
+void*
+xfer_map(struct xfer_buffer* buf, cl_command_queue queue,
+        cl_map_flags flags, size_t offset, size_t size,
+        cl_event* event, cl_int* rv)
+{
+    return xfer_map_wait(buf, queue, CL_TRUE, flags, offset, size, 0, NULL,
+            event, rv);
+}
+
+/**
+ * Enqueue a mapping of size bytes at offset for reading after the events
+ * in the wait list without blocking. The data may be accessed once the
+ * event completes.
+ */
+void*
+xfer_map_read_after(struct xfer_buffer* buf, cl_command_queue queue,
+        size_t offset, size_t size, cl_uint num_wait,
+        const cl_event* wait_list, cl_event* event, cl_int* rv)
+{
+    return xfer_map_wait(buf, queue, CL_FALSE, CL_MAP_READ, offset, size,
+            num_wait, wait_list, event, rv);
+}
+
+/**
+ * Only the first size bytes of the data mapped for writing have been
+ * written, so only they need to reach the device on xfer_unmap().
+ */
+void
+xfer_shrink(struct xfer_buffer* buf, size_t size)
+{
+    if(size < buf->map_size)
+        buf->map_size = size;
+}
+
+/**
+ * Give the data mapped by xfer_map() back to the device. With CL_MAP_WRITE
+ * the changes are visible to the commands enqueued after this one. The host
+ * must not touch the data until the event completes. The event is NULL if
+ * no command was needed (copy mode without CL_MAP_WRITE).
+ */
+cl_int
+xfer_unmap(struct xfer_buffer* buf, cl_command_queue queue, cl_event* event)
+{
+    cl_int rv = CL_SUCCESS;
+    void* mapped = buf->mapped;
+    cl_event local;
+    cl_event* slot = xfer_event(event, &local);
+
+    buf->mapped = NULL;
+    if(NULL != event)
+        *event = NULL;
+    if(XFER_COPY != buf->mode)
+        rv = clEnqueueUnmapMemObject(queue, buf->mem, mapped, 0, NULL, slot);
+    else if((CL_MAP_WRITE & buf->map_flags) && 0 != buf->map_size)
+        rv = clEnqueueWriteBuffer(queue, buf->mem, CL_FALSE,
+                buf->map_offset, buf->map_size, mapped, 0, NULL, slot);
+    xfer_trace(slot, &local, "unmap", buf->map_size);
+    return rv;
+}
+
+#endif // OCL_LABS_XFER_C
@@ -1,9 +1,12 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "CL/opencl.h"
 
 #include "../common/errorcodes.c"
+#include "../common/caps.c"
 
 #define CHECK_AND_PRINT(format, str, val) { \
     if(CL_SUCCESS != rv) \
@@ -14,9 +17,6 @@
 
 #define ARR_SIZE(a) (sizeof((a)) / sizeof((*a)))
 
-#define INFO_SIZE 512
-char* g_info;
-
 void
 print_extensions(char * const ext_list, const char* indents)
 {
@@ -51,9 +51,10 @@ print_platform_info(const cl_platform_id platform)
 
     for(size_t i = 0; i < ARR_SIZE(pl_params); ++i)
     {
-        rv = clGetPlatformInfo(platform, pl_params[i],
-                INFO_SIZE, g_info, NULL);
-        CHECK_AND_PRINT("\t%s: %s\n", pl_params_str[i], g_info);
+        char* info = caps_info_str(platform, NULL, pl_params[i]);
+        rv = (NULL != info) ? CL_SUCCESS : CL_INVALID_VALUE;
+        CHECK_AND_PRINT("\t%s: %s\n", pl_params_str[i], info);
+        free(info);
     }
 
     // get information on extensions
@@ -119,9 +120,10 @@ print_device_info(const cl_device_id device)
 
     for(i = 0; i < ARR_SIZE(dev_params_char); ++i)
     {
-        rv = clGetDeviceInfo(device, dev_params_char[i],
-                INFO_SIZE, g_info, NULL);
-        CHECK_AND_PRINT("\t\t%s: %s\n", dev_params_char_str[i], g_info);
+        char* info = caps_info_str(NULL, device, dev_params_char[i]);
+        rv = (NULL != info) ? CL_SUCCESS : CL_INVALID_VALUE;
+        CHECK_AND_PRINT("\t\t%s: %s\n", dev_params_char_str[i], info);
+        free(info);
     }
 
     cl_device_type type;
@@ -234,7 +236,6 @@ platform_layer_info(void)
     cl_uint num_platforms;
     cl_device_id* devices; // list of devices on the specific platform
     cl_uint num_devices;
-    g_info = malloc(INFO_SIZE * sizeof(char)); // buffer for text values
 
     /* Find out how many platforms are attached on SOC-DE1 and get their ids */
     rv = clGetPlatformIDs(0, NULL, &num_platforms);
@@ -291,16 +292,60 @@ platform_layer_info(void)
     }
 
     free(platforms);
-    free(g_info);
+    return CL_SUCCESS;
+}
+
+/**
+ * Collect the capabilities of all devices, save them to the cache file
+ * read by the other programs (see common/caps.c) and print them as JSON
+ * if asked to.
+ */
+cl_int
+platform_layer_caps(int print_json)
+{
+    cl_int rv;
+    struct caps_db db;
+    const char* cache_path = caps_cache_path();
+
+    if(CL_SUCCESS != (rv = caps_query_all(&db)))
+        return rv;
+    if(print_json)
+        caps_write_json(&db, stdout);
+    if(NULL != cache_path && 0 != caps_write_file(cache_path, &db))
+        perror(cache_path);
+    else if(NULL != cache_path && !print_json)
+        printf("Capabilities of %zu device(s) saved to %s\n", db.count,
+                cache_path);
+    caps_db_free(&db);
     return CL_SUCCESS;
 }
 
 cl_int
-main(void)
+main(int argc, char** argv)
 {
     cl_int rv;
+    int print_json = 0;
+    int opt;
 
-    if(CL_SUCCESS != (rv = platform_layer_info()))
+    while(-1 != (opt = getopt(argc, argv, "jh")))
+    {
+        switch(opt)
+        {
+            case 'j': print_json = 1; break;
+            default:
+                fprintf(stderr, "Usage: %s [-j]\n"
+                        "\t-j  print the capabilities as JSON instead\n",
+                        argv[0]);
+                return CL_INVALID_VALUE;
+        }
+    }
+
+    if(!print_json && CL_SUCCESS != (rv = platform_layer_info()))
+    {
+        fprintf(stderr, "Critical error on platform layer: %d\n", rv);
+        return rv;
+    }
+    if(CL_SUCCESS != (rv = platform_layer_caps(print_json)))
     {
         fprintf(stderr, "Critical error on platform layer: %d\n", rv);
         return rv;
@@ -0,0 +1,137 @@
+/*
+ * Device side of the block codec of common/codec.c (see there for the
+ * format) and a compute kernel to run between the decoding and the
+ * encoding. A work item decodes or encodes one block of CODEC_BLOCK ints.
+ */
+
+#define CODEC_BLOCK 256
+#define CODEC_HEADER 2                      // count and number of blocks
+#define CODEC_SLOT (2 + CODEC_BLOCK)        // words of an encoded block, max
+
+uint
+codec_width(uint bits)
+{
+    return (0 == bits) ? 0 : 32 - clz(bits);
+}
+
+uint
+codec_unpack(__global const uint * restrict words, uint j, uint width)
+{
+    uint bit = j * width;
+    uint word = bit / 32;
+    uint shift = bit % 32;
+    ulong v = words[word];
+    if(shift + width > 32)
+        v |= (ulong) words[word + 1] << 32;
+    return (uint) (v >> shift) & (uint) (((ulong) 1 << width) - 1);
+}
+
+/* Expand the stream into count ints */
+__kernel void
+codec_decode(__global int * restrict out, __global const uint * restrict in)
+{
+    uint b = get_global_id(0);
+    uint count = in[0];
+    uint num_blocks = in[1];
+    if(b >= num_blocks)
+        return;
+
+    __global const uint * block = in + in[CODEC_HEADER + b];
+    uint first = b * CODEC_BLOCK;
+    uint n = min((uint) CODEC_BLOCK, count - first);
+    uint width = block[1];
+    uint value = block[0];
+
+    out[first] = value;
+    for(uint j = 1; j < n; ++j)
+    {
+        uint z = (0 != width) ? codec_unpack(block + 2, j - 1, width) : 0;
+        value += (z >> 1) ^ -(z & 1);   // zigzag
+        out[first + j] = value;
+    }
+}
+
+/*
+ * Encode count ints, each block into its own slot of CODEC_SLOT words;
+ * the number of words a block took goes to sizes.
+ */
+__kernel void
+codec_encode(__global uint * restrict slots, __global uint * restrict sizes,
+        __global const int * restrict in, uint count)
+{
+    uint b = get_global_id(0);
+    uint first = b * CODEC_BLOCK;
+    if(first >= count)
+        return;
+
+    uint n = min((uint) CODEC_BLOCK, count - first);
+    __global uint * slot = slots + b * CODEC_SLOT;
+    uint bits = 0;
+
+    for(uint j = 1; j < n; ++j)
+    {
+        uint d = (uint) in[first + j] - (uint) in[first + j - 1];
+        bits |= (d << 1) ^ (uint) ((int) d >> 31);
+    }
+    uint width = codec_width(bits);
+    uint num_words = ((n - 1) * width + 31) / 32;
+
+    slot[0] = in[first];
+    slot[1] = width;
+    for(uint w = 0; w < num_words; ++w)
+        slot[2 + w] = 0;
+    for(uint j = 1; j < n && 0 != width; ++j)
+    {
+        uint d = (uint) in[first + j] - (uint) in[first + j - 1];
+        uint z = (d << 1) ^ (uint) ((int) d >> 31);
+        uint bit = (j - 1) * width;
+        uint word = bit / 32;
+        uint shift = bit % 32;
+        slot[2 + word] |= z << shift;
+        if(shift + width > 32)
+            slot[3 + word] |= z >> (32 - shift);
+    }
+    sizes[b] = 2 + num_words;
+}
+
+/*
+ * The header of the stream: the offset of every block and, after them,
+ * the size of the whole stream. A single work item, the blocks are few.
+ */
+__kernel void
+codec_offsets(__global uint * restrict out,
+        __global const uint * restrict sizes, uint count, uint num_blocks)
+{
+    uint offset = CODEC_HEADER + num_blocks + 1;
+    out[0] = count;
+    out[1] = num_blocks;
+    for(uint b = 0; b < num_blocks; ++b)
+    {
+        out[CODEC_HEADER + b] = offset;
+        offset += sizes[b];
+    }
+    out[CODEC_HEADER + num_blocks] = offset;
+}
+
+/* Move the encoded blocks from their slots to their place in the stream */
+__kernel void
+codec_compact(__global uint * restrict out,
+        __global const uint * restrict slots,
+        __global const uint * restrict sizes, uint num_blocks)
+{
+    uint b = get_global_id(0);
+    if(b >= num_blocks)
+        return;
+    __global uint * block = out + out[CODEC_HEADER + b];
+    __global const uint * slot = slots + b * CODEC_SLOT;
+    for(uint w = 0; w < sizes[b]; ++w)
+        block[w] = slot[w];
+}
+
+/* The computation between the transfers: add a value to every int */
+__kernel void
+add_value(__global int * restrict data, int value)
+{
+    size_t i = get_global_id(0);
+    data[i] += value;
+}
@@ -0,0 +1,142 @@
+/*
+ * Data-parallel primitives over ints in work-group local memory: reduction,
+ * prefix scan and histogram. The host side is common/primitives.c, which
+ * launches as many passes as the size of the input needs. The work-group
+ * size must be a power of two.
+ */
+
+#pragma OPENCL EXTENSION cl_khr_local_int32_base_atomics : enable
+
+/*
+ * Reduction: a work item folds a grid-stride slice of the input, then the
+ * work-group folds the values of its work items by a tree in local memory,
+ * halving the active work items every step, and writes one partial result.
+ */
+#define REDUCE_KERNEL(name, OP, IDENTITY) \
+__kernel void \
+name(__global const int * restrict in, __global int * restrict out, \
+        uint n, __local int * scratch) \
+{ \
+    uint lid = get_local_id(0); \
+    int acc = IDENTITY; \
+    for(uint i = get_global_id(0); i < n; i += get_global_size(0)) \
+        acc = OP(acc, in[i]); \
+    scratch[lid] = acc; \
+    barrier(CLK_LOCAL_MEM_FENCE); \
+    for(uint s = get_local_size(0) / 2; s > 0; s /= 2) \
+    { \
+        if(lid < s) \
+            scratch[lid] = OP(scratch[lid], scratch[lid + s]); \
+        barrier(CLK_LOCAL_MEM_FENCE); \
+    } \
+    if(0 == lid) \
+        out[get_group_id(0)] = scratch[0]; \
+}
+
+#define OP_SUM(a, b) ((a) + (b))
+#define OP_MIN(a, b) min(a, b)
+#define OP_MAX(a, b) max(a, b)
+
+REDUCE_KERNEL(reduce_sum, OP_SUM, 0)
+REDUCE_KERNEL(reduce_min, OP_MIN, INT_MAX)
+REDUCE_KERNEL(reduce_max, OP_MAX, INT_MIN)
+
+/*
+ * Scan of a block of two ints per work item (Blelloch): the up-sweep
+ * builds a tree of partial sums in local memory, the down-sweep turns it
+ * into the exclusive prefix sums. The total of the block goes to sums, the
+ * host scans the totals and adds them to the blocks with scan_add.
+ */
+__kernel void
+scan_blocks(__global const int * restrict in, __global int * restrict out,
+        __global int * restrict sums, uint n, uint exclusive,
+        __local int * scratch)
+{
+    uint lid = get_local_id(0);
+    uint half_size = get_local_size(0);
+    uint size = 2 * half_size;
+    uint a = get_group_id(0) * size + lid;
+    uint b = a + half_size;
+    int va = (a < n) ? in[a] : 0;
+    int vb = (b < n) ? in[b] : 0;
+    uint offset = 1;
+
+    scratch[lid] = va;
+    scratch[lid + half_size] = vb;
+    for(uint d = half_size; d > 0; d /= 2)
+    {
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if(lid < d)
+            scratch[offset * (2 * lid + 2) - 1]
+                += scratch[offset * (2 * lid + 1) - 1];
+        offset *= 2;
+    }
+    if(0 == lid)
+    {
+        sums[get_group_id(0)] = scratch[size - 1];
+        scratch[size - 1] = 0;
+    }
+    for(uint d = 1; d < size; d *= 2)
+    {
+        offset /= 2;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if(lid < d)
+        {
+            uint ai = offset * (2 * lid + 1) - 1;
+            uint bi = offset * (2 * lid + 2) - 1;
+            int t = scratch[ai];
+            scratch[ai] = scratch[bi];
+            scratch[bi] += t;
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if(a < n)
+        out[a] = scratch[lid] + (exclusive ? 0 : va);
+    if(b < n)
+        out[b] = scratch[lid + half_size] + (exclusive ? 0 : vb);
+}
+
+/* Add the scanned totals of the blocks before each block to it */
+__kernel void
+scan_add(__global int * restrict out, __global const int * restrict offsets,
+        uint n)
+{
+    uint i = get_global_id(0);
+    if(i < n)
+        out[i] += offsets[i / (2 * get_local_size(0))];
+}
+
+/*
+ * Histogram of bytes: a work-group counts a grid-stride slice of the input
+ * into its bins in local memory and writes them out, histogram_merge adds
+ * up the bins of all the work-groups. No global atomics are needed.
+ */
+#define HISTOGRAM_BINS 256
+
+__kernel void
+histogram_groups(__global const uchar * restrict in,
+        __global uint * restrict partial, uint n)
+{
+    __local uint bins[HISTOGRAM_BINS];
+    uint lid = get_local_id(0);
+
+    for(uint i = lid; i < HISTOGRAM_BINS; i += get_local_size(0))
+        bins[i] = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for(uint i = get_global_id(0); i < n; i += get_global_size(0))
+        atomic_inc(&bins[in[i]]);
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for(uint i = lid; i < HISTOGRAM_BINS; i += get_local_size(0))
+        partial[get_group_id(0) * HISTOGRAM_BINS + i] = bins[i];
+}
+
+__kernel void
+histogram_merge(__global const uint * restrict partial,
+        __global uint * restrict bins, uint num_groups)
+{
+    uint bin = get_global_id(0);
+    uint sum = 0;
+    for(uint g = 0; g < num_groups; ++g)
+        sum += partial[g * HISTOGRAM_BINS + bin];
+    bins[bin] = sum;
+}
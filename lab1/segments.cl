@@ -0,0 +1,12 @@
+/*
+ * A kernel over a segmented buffer (common/segbuf.c): it runs once per
+ * segment, get_global_id() is the index in the whole buffer and the
+ * segment holds the ints from get_global_offset() on.
+ */
+__kernel void
+scale_index(__global int * restrict data, int factor)
+{
+    size_t i = get_global_id(0);
+    size_t j = i - get_global_offset(0);
+    data[j] = data[j] * factor + (int) i;
+}
@@ -0,0 +1,6 @@
+__kernel void
+inout(__global int * restrict out, __global const int * restrict in)
+{
+    int i = get_global_id(0);
+    out[i] = in[i];
+}
@@ -0,0 +1,271 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "CL/opencl.h"
+
+#include "../common/errorcodes.c"
+#include "../common/utils.c"
+#include "../common/sched.c"
+#include "../common/trace.c"
+
+#define BINARY_FILE_NAME "lab2.aocx"
+#define SOURCE_FILE_NAME "lab2.cl"
+#define NUM_ELEMENTS (1 << 20)
+#define NUM_ITERATIONS 10
+#define GRANULARITY 64
+
+/* Buffers and the kernel of one device */
+struct copy_state
+{
+    cl_program program;
+    cl_kernel kernel;
+    cl_mem buf_in;
+    cl_mem buf_out;
+    size_t capacity; // in elements
+};
+
+/* The whole workload */
+struct copy_job
+{
+    cl_int* in_data;
+    cl_int* out_data;
+};
+
+void
+usage(const char* prog)
+{
+    fprintf(stderr, "Usage: %s [-d devices] [-n elements] [-i iterations] "
+            "[-b binary] [-s source] [-t trace]\n"
+            "\t-d  device selector, \"all\" by default (see common/devices.c)\n"
+            "\t-b  kernel for accelerators (%s)\n"
+            "\t-s  kernel for other devices (%s)\n"
+            "\t-t  write a trace of the commands to <trace>.{json,csv}\n",
+            prog, BINARY_FILE_NAME, SOURCE_FILE_NAME);
+}
+
+double
+wall_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Make sure the device buffers can hold count elements.
+ */
+cl_int
+reserve_buffers(struct sched_device* dev, struct copy_state* st, size_t count)
+{
+    cl_int rv;
+    size_t data_size = count * sizeof(cl_int);
+
+    if(count <= st->capacity)
+        return CL_SUCCESS;
+    if(NULL != st->buf_in)
+    {
+        clReleaseMemObject(st->buf_in);
+        clReleaseMemObject(st->buf_out);
+    }
+    st->capacity = 0;
+
+    st->buf_in =
+        clCreateBuffer(dev->context, CL_MEM_READ_ONLY, data_size, NULL, &rv);
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Failed to create a buffer object (in):", rv, stderr);
+        return rv;
+    }
+    st->buf_out =
+        clCreateBuffer(dev->context, CL_MEM_WRITE_ONLY, data_size, NULL, &rv);
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Failed to create a buffer object (out):", rv, stderr);
+        return rv;
+    }
+    st->capacity = count;
+
+    rv  = clSetKernelArg(st->kernel, 0, sizeof(cl_mem), &st->buf_out);
+    rv |= clSetKernelArg(st->kernel, 1, sizeof(cl_mem), &st->buf_in);
+    if(CL_SUCCESS != rv)
+        print_cl_error("Failed to set an argument:", rv, stderr);
+    return rv;
+}
+
+/**
+ * Copy a share of the input to the device, run the kernel over it and
+ * read the result back.
+ */
+cl_int
+enqueue_copy(struct sched_device* dev, size_t offset, size_t count,
+        void* arg, cl_event* first, cl_event* last)
+{
+    cl_int rv;
+    struct copy_job* job = arg;
+    struct copy_state* st = dev->state;
+    size_t data_size = count * sizeof(cl_int);
+
+    if(CL_SUCCESS != (rv = reserve_buffers(dev, st, count)))
+        return rv;
+
+    rv = clEnqueueWriteBuffer(dev->queue, st->buf_in, CL_FALSE, 0,
+            data_size, job->in_data + offset, 0, NULL, first);
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Couldn\'t enqueue the command to write the data:",
+                rv, stderr);
+        return rv;
+    }
+    trace_add(*first, "write in", data_size);
+
+    rv = clEnqueueNDRangeKernel(dev->queue, st->kernel, 1, NULL,
+            &count, NULL, 0, NULL, trace_event("inout", 2 * data_size));
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Couldn\'t enqueue the kernel:", rv, stderr);
+        return rv;
+    }
+
+    rv = clEnqueueReadBuffer(dev->queue, st->buf_out, CL_FALSE, 0,
+            data_size, job->out_data + offset, 0, NULL, last);
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Failed to enqueue the command to read the data:",
+                rv, stderr);
+        return rv;
+    }
+    trace_add(*last, "read out", data_size);
+    return CL_SUCCESS;
+}
+
+int
+main(int argc, char** argv)
+{
+    cl_int rv;
+    const char* selector = NULL;
+    const char* binary_file_name = BINARY_FILE_NAME;
+    const char* source_file_name = SOURCE_FILE_NAME;
+    size_t num_elements = NUM_ELEMENTS;
+    int num_iterations = NUM_ITERATIONS;
+    int opt;
+
+    while(-1 != (opt = getopt(argc, argv, "d:n:i:b:s:t:h")))
+    {
+        switch(opt)
+        {
+            case 'd': selector = optarg; break;
+            case 'n': num_elements = strtoul(optarg, NULL, 0); break;
+            case 'i': num_iterations = atoi(optarg); break;
+            case 'b': binary_file_name = optarg; break;
+            case 's': source_file_name = optarg; break;
+            case 't': trace_start(optarg); break;
+            default:
+                usage(argv[0]);
+                return CL_INVALID_VALUE;
+        }
+    }
+    if(0 == num_elements || num_iterations <= 0)
+    {
+        usage(argv[0]);
+        return CL_INVALID_VALUE;
+    }
+
+    /* 2. Select the devices and create a context for each of them */
+    struct device_list devices;
+    rv = select_devices(device_selector(selector, "all"), &devices);
+    if(CL_SUCCESS != rv)
+        return rv;
+    puts("Selected devices:");
+    print_device_list(&devices, stdout);
+
+    cl_uint num_devs = devices.count;
+    struct sched_device* devs = malloc(num_devs * sizeof(*devs));
+    struct copy_state* states = calloc(num_devs, sizeof(*states));
+    if(NULL == devs || NULL == states)
+        return CL_OUT_OF_HOST_MEMORY;
+    if(CL_SUCCESS != (rv = sched_init(devs, &devices)))
+        return rv;
+    free_device_list(&devices);
+
+    /* 3. Allocate the host memory buffers */
+    struct copy_job job;
+    job.in_data = malloc(num_elements * sizeof(cl_int));
+    job.out_data = malloc(num_elements * sizeof(cl_int));
+    if(NULL == job.in_data || NULL == job.out_data)
+        return CL_OUT_OF_HOST_MEMORY;
+    for(size_t i = 0; i < num_elements; ++i)
+        job.in_data[i] = (cl_int) (i ^ 0xCAFE);
+
+    /* 7-9. Build the program and create the kernel on every device */
+    for(cl_uint i = 0; i < num_devs; ++i)
+    {
+        const char* kernel_file_name =
+            (CL_DEVICE_TYPE_ACCELERATOR & devs[i].type)
+            ? binary_file_name : source_file_name;
+        devs[i].state = &states[i];
+        rv = build_program(&states[i].program, &devs[i].context,
+                &devs[i].device, kernel_file_name);
+        if(CL_SUCCESS != rv)
+        {
+            print_cl_error("Failed to build a program:", rv, stderr);
+            return rv;
+        }
+        states[i].kernel = clCreateKernel(states[i].program, "inout", &rv);
+        if(CL_SUCCESS != rv)
+        {
+            print_cl_error("Failed to create a kernel object:", rv, stderr);
+            return rv;
+        }
+    }
+
+    /* 10-12. Split the copy across the devices, the first run measures them */
+    for(int it = 0; it < num_iterations; ++it)
+    {
+        double start = wall_time();
+        rv = sched_run(devs, num_devs, num_elements, GRANULARITY,
+                enqueue_copy, &job);
+        if(CL_SUCCESS != rv)
+            return rv;
+        double elapsed = wall_time() - start;
+
+        printf("Iteration %d: %.1f MB/s in total\n", it + 1,
+                2.0 * num_elements * sizeof(cl_int) / elapsed / 1e6);
+        for(cl_uint i = 0; i < num_devs; ++i)
+            printf("\tDevice #%u: %zu elements, %.3f ms, %.1f Melem/s\n",
+                    i, devs[i].count, devs[i].elapsed * 1e3,
+                    devs[i].throughput / 1e6);
+    }
+
+    for(size_t i = 0; i < num_elements; ++i)
+    {
+        if(job.out_data[i] != job.in_data[i])
+        {
+            fprintf(stderr, "Mismatch at %zu: %X != %X\n", i,
+                    job.out_data[i], job.in_data[i]);
+            return CL_INVALID_VALUE;
+        }
+    }
+    puts("Output matches the input");
+    trace_finish();
+
+    /* 13. Finalization */
+    for(cl_uint i = 0; i < num_devs; ++i)
+    {
+        clReleaseKernel(states[i].kernel);
+        clReleaseProgram(states[i].program);
+        if(NULL != states[i].buf_in)
+        {
+            clReleaseMemObject(states[i].buf_in);
+            clReleaseMemObject(states[i].buf_out);
+        }
+    }
+    sched_release(devs, num_devs);
+    free(states);
+    free(devs);
+    free(job.in_data);
+    free(job.out_data);
+
+    return 0;
+}
@@ -0,0 +1,99 @@
+__kernel void
+inout(__global int * restrict out, __global const int * restrict in)
+{
+    int i = get_global_id(0);
+    out[i] = in[i];
+}
+
+/* The same copy moving a vector per work item */
+
+__kernel void
+inout_int4(__global int4 * restrict out, __global const int4 * restrict in)
+{
+    int i = get_global_id(0);
+    out[i] = in[i];
+}
+
+__kernel void
+inout_int8(__global int8 * restrict out, __global const int8 * restrict in)
+{
+    int i = get_global_id(0);
+    out[i] = in[i];
+}
+
+__kernel void
+inout_int16(__global int16 * restrict out, __global const int16 * restrict in)
+{
+    int i = get_global_id(0);
+    out[i] = in[i];
+}
+
+/*
+ * A single work item: the offline compiler turns the loop into a pipeline
+ * and the unrolling widens the memory accesses to 64 bytes per clock.
+ */
+__kernel void
+inout_swi(__global int * restrict out, __global const int * restrict in,
+        uint n)
+{
+    #pragma unroll 16
+    for(uint i = 0; i < n; ++i)
+        out[i] = in[i];
+}
+
+/* num_simd_work_items() is only known to the Intel FPGA offline compiler */
+#if defined(INTELFPGA_CL) || defined(ALTERA_CL)
+#define SIMD_WORK_ITEMS(n) __attribute__((num_simd_work_items(n)))
+#else
+#define SIMD_WORK_ITEMS(n)
+#endif
+
+/* NDRange vectorized by the compiler, 16 work items per clock */
+__attribute__((reqd_work_group_size(64, 1, 1)))
+SIMD_WORK_ITEMS(16)
+__kernel void
+inout_simd(__global int * restrict out, __global const int * restrict in)
+{
+    int i = get_global_id(0);
+    out[i] = in[i];
+}
+
+/*
+ * The copy specialized at build time (see common/spec.c). Built with
+ * -DNUM_ELEMENTS, -DVECTOR_WIDTH, -DWORK_GROUP_SIZE and -DDATA_TYPE the
+ * sizes are constants: a work item moves a vector of VECTOR_WIDTH, the
+ * work-group size is fixed and the bounds check is gone when the elements
+ * fill whole work-groups. Without them the kernel is a generic int copy
+ * that checks its index against n, the number of work items needed.
+ */
+#ifndef DATA_TYPE
+#define DATA_TYPE int
+#endif
+#ifndef VECTOR_WIDTH
+#define VECTOR_WIDTH 1
+#endif
+
+#define SPEC_CAT(type, width) type ## width
+#define SPEC_VECTOR(type, width) SPEC_CAT(type, width)
+#if VECTOR_WIDTH > 1
+#define SPEC_TYPE SPEC_VECTOR(DATA_TYPE, VECTOR_WIDTH)
+#else
+#define SPEC_TYPE DATA_TYPE
+#endif
+
+#if defined(WORK_GROUP_SIZE) && WORK_GROUP_SIZE > 0
+__attribute__((reqd_work_group_size(WORK_GROUP_SIZE, 1, 1)))
+#endif
+__kernel void
+inout_spec(__global SPEC_TYPE * restrict out,
+        __global const SPEC_TYPE * restrict in, uint n)
+{
+    uint i = get_global_id(0);
+#if !defined(NUM_ELEMENTS) || !defined(WORK_GROUP_SIZE) \
+        || 0 == WORK_GROUP_SIZE \
+        || 0 != NUM_ELEMENTS % (VECTOR_WIDTH * WORK_GROUP_SIZE)
+    if(i >= n)
+        return;
+#endif
+    out[i] = in[i];
+}
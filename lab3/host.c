@@ -0,0 +1,424 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "CL/opencl.h"
+
+#include "../common/errorcodes.c"
+#include "../common/utils.c"
+#include "../common/stream.c"
+#include "../common/cpuref.c"
+#include "../common/spec.c"
+#include "../common/autotune.c"
+
+#include "variants.c"
+
+#define BINARY_FILE_NAME "lab3.aocx"
+#define SOURCE_FILE_NAME "lab3.cl"
+#define NUM_BYTES (256 << 20)
+#define CHUNK_SIZE (4 << 20)
+#define DEPTH 3
+
+/* Where the chunks come from and where they go */
+struct copy_stream
+{
+    FILE* in;           // NULL to generate num_bytes of data
+    FILE* out;          // NULL to only check the result
+    size_t num_bytes;
+    size_t generated;
+    unsigned int in_hash;
+    unsigned int out_hash;
+    size_t num_drained;
+};
+
+void
+usage(const char* prog)
+{
+    fprintf(stderr, "Usage: %s [-d device] [-f input] [-o output] "
+            "[-n bytes] [-c chunk] [-q depth] [-k kernel] [-v variant] [-V] "
+            "[-T] [-H] [-x mode] [-t trace]\n"
+            "\t-d  device selector (see common/devices.c)\n"
+            "\t-f  file to stream, generated data if omitted\n"
+            "\t-o  file to write the result to\n"
+            "\t-n  size of the generated data (%d)\n"
+            "\t-c  chunk size in bytes (%d)\n"
+            "\t-q  buffer sets in flight, 2 for double buffering (%d)\n"
+            "\t-k  kernel file, %s for accelerators, %s otherwise\n"
+            "\t-v  kernel variant: scalar, int4, int8, int16, swi, simd,\n"
+            "\t    spec (built for the chunk size, see common/spec.c),\n"
+            "\t    the tuned one or picked by the device type and the chunk\n"
+            "\t    size by default\n"
+            "\t-V  check every variant against the CPU reference and exit;\n"
+            "\t    spec* is the one specialized for the chunk size\n"
+            "\t-T  tune the variant and the local size for the chunk size\n"
+            "\t    and save the result (OCL_AUTOTUNE) for later runs\n"
+            "\t-H  stream on the CPU reference (OCL_CPUREF), the fallback\n"
+            "\t    if no OpenCL device is found; a selector matching\n"
+            "\t    nothing falls back too, a malformed one is an error\n"
+            "\t-x  transfer mode of the chunks: copy, alloc or use\n"
+            "\t    (see common/xfer.c, OCL_XFER)\n"
+            "\t-t  write a trace of the commands to <trace>.{json,csv}\n",
+            prog, NUM_BYTES, CHUNK_SIZE, DEPTH,
+            BINARY_FILE_NAME, SOURCE_FILE_NAME);
+}
+
+double
+wall_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * A cheap order-dependent hash (FNV-1a, 32-bit) to check the output.
+ */
+unsigned int
+hash_bytes(unsigned int hash, const void* data, size_t size)
+{
+    const unsigned char* p = data;
+    for(size_t i = 0; i < size; ++i)
+        hash = (hash ^ p[i]) * 16777619u;
+    return hash;
+}
+
+size_t
+fill_chunk(void* data, size_t max_bytes, void* arg)
+{
+    struct copy_stream* cs = arg;
+    size_t bytes;
+
+    if(NULL != cs->in)
+        bytes = fread(data, 1, max_bytes, cs->in);
+    else
+    {
+        unsigned char* p = data;
+        bytes = cs->num_bytes - cs->generated;
+        if(bytes > max_bytes)
+            bytes = max_bytes;
+        for(size_t i = 0; i < bytes; ++i)
+            p[i] = (unsigned char) ((cs->generated + i) * 0x9E37 >> 8);
+        cs->generated += bytes;
+    }
+    cs->in_hash = hash_bytes(cs->in_hash, data, bytes);
+    return bytes;
+}
+
+cl_int
+drain_chunk(const void* data, size_t bytes, size_t chunk, void* arg)
+{
+    struct copy_stream* cs = arg;
+
+    if(chunk != cs->num_drained++)
+    {
+        fprintf(stderr, "Chunk %zu came out of order\n", chunk);
+        return CL_INVALID_VALUE;
+    }
+    cs->out_hash = hash_bytes(cs->out_hash, data, bytes);
+    if(NULL != cs->out && bytes != fwrite(data, 1, bytes, cs->out))
+    {
+        perror("Failed to write the output");
+        return CL_INVALID_VALUE;
+    }
+    return CL_SUCCESS;
+}
+
+cl_int
+check_output(const struct copy_stream* cs)
+{
+    if(cs->in_hash != cs->out_hash)
+    {
+        fprintf(stderr, "Output doesn't match the input: %08X != %08X\n",
+                cs->out_hash, cs->in_hash);
+        return CL_INVALID_VALUE;
+    }
+    puts("Output matches the input");
+    return CL_SUCCESS;
+}
+
+/**
+ * Stream the input through the CPU reference in chunks, the fallback when
+ * there is no OpenCL device.
+ */
+cl_int
+stream_on_host(const struct cpuref* ref, size_t chunk_size,
+        struct copy_stream* cs, size_t* num_chunks, size_t* total_bytes)
+{
+    cl_int rv = CL_SUCCESS;
+    size_t bytes;
+    // room for the padding of a partial last int
+    cl_int* in = xfer_alloc_host(chunk_size + sizeof(cl_int));
+    cl_int* out = xfer_alloc_host(chunk_size + sizeof(cl_int));
+
+    *num_chunks = *total_bytes = 0;
+    if(NULL == in || NULL == out)
+        rv = CL_OUT_OF_HOST_MEMORY;
+    while(CL_SUCCESS == rv && 0 != (bytes = fill_chunk(in, chunk_size, cs)))
+    {
+        // a partial last int is padded as on the device
+        size_t count = (bytes + sizeof(cl_int) - 1) / sizeof(cl_int);
+        memset((char*) in + bytes, 0, count * sizeof(cl_int) - bytes);
+        ref->copy(out, in, count);
+        rv = drain_chunk(out, bytes, (*num_chunks)++, cs);
+        *total_bytes += bytes;
+    }
+    free(in);
+    free(out);
+    return rv;
+}
+
+int
+main(int argc, char** argv)
+{
+    cl_int rv;
+    cl_device_id device;
+    cl_context context;
+    const char* kernel_file_name = NULL;
+    const char* selector = NULL;
+    const char* in_file_name = NULL;
+    const char* out_file_name = NULL;
+    size_t chunk_size = CHUNK_SIZE;
+    int depth = DEPTH;
+    const struct inout_variant* variant = NULL;
+    int verify_only = 0;
+    int on_host = 0;
+    int tune = 0;
+    struct cpuref ref;
+    struct copy_stream cs;
+    int opt;
+
+    memset(&cs, 0, sizeof(cs));
+    cs.num_bytes = NUM_BYTES;
+    cs.in_hash = cs.out_hash = 2166136261u;
+
+    while(-1 != (opt = getopt(argc, argv, "d:f:o:n:c:q:k:v:VTHx:t:h")))
+    {
+        switch(opt)
+        {
+            case 'd': selector = optarg; break;
+            case 'f': in_file_name = optarg; break;
+            case 'o': out_file_name = optarg; break;
+            case 'n': cs.num_bytes = strtoul(optarg, NULL, 0); break;
+            case 'c': chunk_size = strtoul(optarg, NULL, 0); break;
+            case 'q': depth = atoi(optarg); break;
+            case 'k': kernel_file_name = optarg; break;
+            case 'v':
+                if(NULL == (variant = variant_find(optarg)))
+                    return CL_INVALID_VALUE;
+                break;
+            case 'V': verify_only = 1; break;
+            case 'T': tune = 1; break;
+            case 'H': on_host = 1; break;
+            case 'x':
+                if(CL_SUCCESS != xfer_set_mode_str(optarg))
+                    return CL_INVALID_VALUE;
+                break;
+            case 't': trace_start(optarg); break;
+            default:
+                usage(argv[0]);
+                return CL_INVALID_VALUE;
+        }
+    }
+    if(0 == chunk_size || depth <= 0)
+    {
+        usage(argv[0]);
+        return CL_INVALID_VALUE;
+    }
+    if(on_host && (verify_only || tune))
+    {
+        fputs("-V and -T need an OpenCL device, not -H\n", stderr);
+        return CL_INVALID_VALUE;
+    }
+
+    if(NULL != in_file_name && NULL == (cs.in = fopen(in_file_name, "rb")))
+    {
+        perror(in_file_name);
+        return CL_INVALID_VALUE;
+    }
+    if(NULL != out_file_name && NULL == (cs.out = fopen(out_file_name, "wb")))
+    {
+        perror(out_file_name);
+        return CL_INVALID_VALUE;
+    }
+
+    /* 1-2. Get the platform and the device, create a context */
+    cpuref_init(&ref);
+    if(!on_host)
+    {
+        rv = platform_layer_select(selector, &device, &context);
+        // no device at all falls back to the host, a bad selector doesn't
+        if(CL_SUCCESS != rv && CL_DEVICE_NOT_FOUND != rv
+                && CL_PLATFORM_NOT_FOUND_KHR != rv)
+            return rv;
+        on_host = (CL_SUCCESS != rv);
+    }
+    if(on_host)
+    {
+        if(verify_only || tune)
+            return rv;
+        printf("Streaming on the CPU reference (%s)\n",
+                cpuref_isa_str(ref.isa));
+        size_t num_chunks, total_bytes;
+        double start = wall_time();
+        rv = stream_on_host(&ref, chunk_size, &cs, &num_chunks, &total_bytes);
+        double elapsed = wall_time() - start;
+        if(NULL != cs.in)
+            fclose(cs.in);
+        if(NULL != cs.out)
+            fclose(cs.out);
+        if(CL_SUCCESS != rv)
+        {
+            print_cl_error("Failed to stream the data:", rv, stderr);
+            return rv;
+        }
+        printf("Streamed %zu bytes in %zu chunk(s) of %zu bytes on the host: "
+                "%.3f s, %.1f MB/s\n", total_bytes, num_chunks, chunk_size,
+                elapsed, total_bytes / elapsed / 1e6);
+        return check_output(&cs);
+    }
+
+    /* 7-9. Build the program and create the kernel */
+    cl_device_type type;
+    clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+    if(NULL == kernel_file_name)
+        kernel_file_name = (CL_DEVICE_TYPE_ACCELERATOR & type)
+            ? BINARY_FILE_NAME : SOURCE_FILE_NAME;
+    cl_program program;
+    rv = build_program(&program, &context, &device, kernel_file_name);
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Failed to build a program:", rv, stderr);
+        return rv;
+    }
+    if(verify_only)
+    {
+        puts("Checking the kernel variants:");
+        return variant_verify(context, device, program, kernel_file_name,
+                chunk_size, &ref) ? CL_INVALID_VALUE : 0;
+    }
+
+    struct autotune_db tuned;
+    struct inout_variant tuned_variant;
+    const struct autotune_config* config;
+    autotune_load(&tuned);
+    if(tune)
+    {
+        struct caps_db caps_db;
+        const struct device_caps* caps;
+        struct autotune_config best;
+        caps_load(&caps_db);
+        printf("Tuning the kernel for chunks of %zu bytes:\n",
+                autotune_bucket(chunk_size));
+        rv = (NULL != (caps = caps_get(&caps_db, device)))
+            ? variant_tune(context, device, program, caps, chunk_size, &best)
+            : CL_OUT_OF_HOST_MEMORY;
+        caps_db_free(&caps_db);
+        if(CL_SUCCESS != rv)
+        {
+            print_cl_error("Failed to tune the kernel:", rv, stderr);
+            return rv;
+        }
+        printf("Fastest: %s, %zu int(s) per work item, local size %zu, "
+                "%.1f us\n", best.variant, best.work_per_item,
+                best.local_size, best.kernel_us);
+        if(0 != autotune_store(&tuned, device, kernel_file_name, chunk_size,
+                    &best))
+            fputs("The result is not saved\n", stderr);
+    }
+    if(NULL == variant)
+    {
+        config = autotune_find(&tuned, device, kernel_file_name, chunk_size);
+        if(NULL != config && NULL != variant_tuned(config, &tuned_variant))
+            variant = &tuned_variant;
+        else
+            variant = variant_select(type, chunk_size);
+    }
+    struct spec_cache spec;
+    struct inout_variant spec_variant;
+    cl_program kernel_program = program;
+    int generic = 0;
+    spec_cache_init(&spec, context, device, kernel_file_name);
+    if(variant->specializable)
+    {
+        const struct spec_program* sp = variant_specialize(&spec, type,
+                chunk_size, &spec_variant);
+        if(NULL == sp)
+            return CL_BUILD_PROGRAM_FAILURE;
+        kernel_program = sp->program;
+        generic = sp->generic;
+        variant = &spec_variant;
+    }
+    cl_kernel kernel = clCreateKernel(kernel_program, variant->kernel_name,
+            &rv);
+    if(CL_SUCCESS != rv && 0 != strcmp(variant->name, "scalar"))
+    {
+        // e.g. a binary compiled before the variants were added
+        fprintf(stderr, "No %s variant in %s, using the scalar kernel\n",
+                variant->name, kernel_file_name);
+        variant = variant_find("scalar");
+        kernel = clCreateKernel(program, variant->kernel_name, &rv);
+    }
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Failed to create a kernel object:", rv, stderr);
+        return rv;
+    }
+    printf("Kernel variant: %s%s", variant->name,
+            generic ? " (generic)" : "");
+    if(&tuned_variant == variant)
+        printf(", local size %zu (tuned)", variant->local_size);
+    putchar('\n');
+
+    /* 4-5. Create the queues and the buffer sets */
+    struct stream s;
+    struct stream_kernel sk;
+    variant_stream_kernel(variant, kernel, &sk);
+    rv = stream_init(&s, context, device, &sk, chunk_size, depth);
+    if(CL_SUCCESS != rv)
+        return rv;
+    if(variant->takes_count && !variant->single_work_item)
+    {
+        // no chunk needs more work items than a full one
+        cl_uint num_items = s.chunk_size / sk.element_size;
+        rv = clSetKernelArg(kernel, 2, sizeof(cl_uint), &num_items);
+        if(CL_SUCCESS != rv)
+        {
+            print_cl_error("Failed to set an argument:", rv, stderr);
+            return rv;
+        }
+    }
+
+    /* 6, 11-12. Stream the input through the kernel */
+    double start = wall_time();
+    rv = stream_run(&s, fill_chunk, drain_chunk, &cs);
+    double elapsed = wall_time() - start;
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Failed to stream the data:", rv, stderr);
+        return rv;
+    }
+
+    printf("Streamed %zu bytes in %zu chunk(s) of %zu bytes, %d in flight, "
+            "%s transfers: %.3f s, %.1f MB/s\n", s.total_bytes, s.num_chunks,
+            s.chunk_size, depth, xfer_mode_str(xfer_mode()), elapsed,
+            s.total_bytes / elapsed / 1e6);
+    if(CL_SUCCESS != (rv = check_output(&cs)))
+        return rv;
+    trace_finish();
+
+    /* 13. Finalization */
+    stream_release(&s);
+    clReleaseKernel(kernel);
+    spec_cache_release(&spec);
+    autotune_free(&tuned);
+    clReleaseProgram(program);
+    clReleaseContext(context);
+    if(NULL != cs.in)
+        fclose(cs.in);
+    if(NULL != cs.out)
+        fclose(cs.out);
+
+    return 0;
+}
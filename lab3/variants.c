@@ -0,0 +1,381 @@
+/*
+ * Variants of the copy kernel (core.cl) and the choice between them.
+ */
+
+#define VERIFY_ELEMENTS (1 << 16)   // a multiple of every granule
+
+struct inout_variant
+{
+    const char* name;
+    const char* kernel_name;
+    size_t width;           // ints a work item (a loop iteration) moves
+    size_t local_size;      // required work-group size, 0 if none
+    int single_work_item;
+    int takes_count;        // the third argument is the number of items
+    int specializable;      // built per chunk size, see variant_specialize
+};
+
+static const struct inout_variant g_variants[] = {
+    { "scalar", "inout",       1,  0, 0, 0, 0 },
+    { "int4",   "inout_int4",  4,  0, 0, 0, 0 },
+    { "int8",   "inout_int8",  8,  0, 0, 0, 0 },
+    { "int16",  "inout_int16", 16, 0, 0, 0, 0 },
+    { "swi",    "inout_swi",   1,  0, 1, 1, 0 },
+    { "simd",   "inout_simd",  1, 64, 0, 0, 0 },
+    { "spec",   "inout_spec",  1,  0, 0, 1, 1 },  // the generic form
+};
+
+#define NUM_VARIANTS (sizeof(g_variants) / sizeof(g_variants[0]))
+
+const struct inout_variant*
+variant_find(const char* name)
+{
+    for(size_t i = 0; i < NUM_VARIANTS; ++i)
+        if(0 == strcmp(g_variants[i].name, name))
+            return &g_variants[i];
+    fprintf(stderr, "Unknown kernel variant: %s\n", name);
+    return NULL;
+}
+
+/**
+ * Pick a variant for the device and the size of a chunk. Small chunks don't
+ * gain anything from wider accesses. An FPGA gets the pipelined loop, CPUs
+ * the widest vectors (one AVX-512 register or a cache line per work item),
+ * GPUs 16-byte vectors which coalesce well.
+ */
+const struct inout_variant*
+variant_select(cl_device_type type, size_t bytes)
+{
+    if(bytes < (64 << 10))
+        return variant_find("scalar");
+    if(CL_DEVICE_TYPE_ACCELERATOR & type)
+        return variant_find("swi");
+    if(CL_DEVICE_TYPE_CPU & type)
+        return variant_find("int16");
+    return variant_find("int4");
+}
+
+/**
+ * Build the specialized copy for chunks of a given size: a vector of ints
+ * per work item, as wide as variant_select would pick, and a fixed
+ * work-group size. The variant describes how to launch the program that
+ * was built, which is the generic one if there was no way to specialize.
+ */
+const struct spec_program*
+variant_specialize(struct spec_cache* cache, cl_device_type type,
+        size_t bytes, struct inout_variant* v)
+{
+    const struct spec_program* sp;
+    struct spec_params params;
+
+    memset(&params, 0, sizeof(params));
+    params.vector_width = (CL_DEVICE_TYPE_CPU & type) ? 16 : 4;
+    params.work_group_size = 64;
+    snprintf(params.data_type, sizeof(params.data_type), "int");
+    // whole work-groups, the way the stream pads a chunk
+    size_t granule = params.vector_width * params.work_group_size;
+    params.num_elements = (bytes / sizeof(cl_int) + granule - 1)
+        / granule * granule;
+
+    *v = *variant_find("spec");
+    if(NULL == (sp = spec_get(cache, &params)))
+        return NULL;
+    if(!sp->generic)
+    {
+        v->width = params.vector_width;
+        v->local_size = params.work_group_size;
+    }
+    return sp;
+}
+
+/**
+ * The variant a tuned configuration names, with its local size unless the
+ * variant requires its own. NULL if there is no such variant any more.
+ */
+const struct inout_variant*
+variant_tuned(const struct autotune_config* config, struct inout_variant* v)
+{
+    const struct inout_variant* found = NULL;
+
+    for(size_t i = 0; i < NUM_VARIANTS && NULL == found; ++i)
+        if(0 == strcmp(g_variants[i].name, config->variant))
+            found = &g_variants[i];
+    if(NULL == found || found->specializable)
+        return NULL;
+    *v = *found;
+    if(0 == v->local_size && !v->single_work_item)
+        v->local_size = config->local_size;
+    return v;
+}
+
+static cl_int
+variant_tune_one(cl_command_queue queue, const struct device_caps* caps,
+        cl_device_id device, cl_kernel kernel, const struct inout_variant* v,
+        cl_mem buf_out, cl_mem buf_in, size_t count,
+        struct autotune_config* best)
+{
+    cl_int rv;
+    size_t sizes[32];
+    size_t num_sizes;
+    size_t global_size = count / v->width;
+    cl_uint num_items = global_size;
+
+    rv  = clSetKernelArg(kernel, 0, sizeof(cl_mem), &buf_out);
+    rv |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &buf_in);
+    if(v->takes_count)
+        rv |= clSetKernelArg(kernel, 2, sizeof(cl_uint), &num_items);
+    if(CL_SUCCESS != rv)
+        return rv;
+
+    if(v->single_work_item)
+    {
+        sizes[0] = 0;
+        num_sizes = 1;
+        global_size = 0;
+    }
+    else if(0 != v->local_size)
+    {
+        sizes[0] = v->local_size;
+        num_sizes = 1;
+    }
+    else
+        num_sizes = autotune_local_sizes(caps, device, kernel, global_size,
+                sizes, sizeof(sizes) / sizeof(sizes[0]));
+
+    for(size_t i = 0; i < num_sizes; ++i)
+    {
+        double us;
+        rv = autotune_time(queue, kernel, global_size, sizes[i], &us);
+        if(CL_SUCCESS != rv)
+        {
+            // e.g. a local size the kernel can't run with after all
+            printf("\t%-8s %6zu %6zu %s\n", v->name, v->width, sizes[i],
+                    cl_error_str(rv));
+            continue;
+        }
+        printf("\t%-8s %6zu %6zu %10.1f\n", v->name, v->width, sizes[i], us);
+        if(0 == best->variant[0] || us < best->kernel_us)
+        {
+            snprintf(best->variant, sizeof(best->variant), "%s", v->name);
+            best->work_per_item = v->width;
+            best->local_size = sizes[i];
+            best->kernel_us = us;
+        }
+    }
+    return CL_SUCCESS;
+}
+
+/**
+ * Sweep the variants the program has (the work per item) and the local
+ * sizes the device allows for a chunk of bytes and time the kernel of each
+ * configuration. The fastest one goes to best. The specialized variant is
+ * left out, it is built per configuration.
+ */
+cl_int
+variant_tune(cl_context context, cl_device_id device, cl_program program,
+        const struct device_caps* caps, size_t bytes,
+        struct autotune_config* best)
+{
+    cl_int rv;
+    size_t data_size = autotune_bucket(bytes);
+    size_t count = data_size / sizeof(cl_int);
+    cl_command_queue queue = clCreateCommandQueue(context, device,
+            CL_QUEUE_PROFILING_ENABLE, &rv);
+    cl_mem buf_in = clCreateBuffer(context, CL_MEM_READ_ONLY, data_size,
+            NULL, &rv);
+    cl_mem buf_out = clCreateBuffer(context, CL_MEM_WRITE_ONLY, data_size,
+            NULL, &rv);
+
+    memset(best, 0, sizeof(*best));
+    if(NULL == queue || NULL == buf_in || NULL == buf_out || 0 == count)
+        fputs("Failed to set up the tuning\n", stderr);
+    else
+    {
+        printf("\t%-8s %6s %6s %10s\n", "variant", "width", "local",
+                "us");
+        for(size_t i = 0; i < NUM_VARIANTS; ++i)
+        {
+            const struct inout_variant* v = &g_variants[i];
+            cl_kernel kernel;
+            if(v->specializable || 0 != count % v->width)
+                continue;
+            kernel = clCreateKernel(program, v->kernel_name, &rv);
+            if(CL_SUCCESS != rv)
+                continue;
+            rv = variant_tune_one(queue, caps, device, kernel, v, buf_out,
+                    buf_in, count, best);
+            clReleaseKernel(kernel);
+            if(CL_SUCCESS != rv)
+                print_cl_error("Failed to tune a variant:", rv, stderr);
+        }
+    }
+    rv = (0 != best->variant[0]) ? CL_SUCCESS : CL_INVALID_KERNEL;
+
+    if(NULL != buf_in)
+        clReleaseMemObject(buf_in);
+    if(NULL != buf_out)
+        clReleaseMemObject(buf_out);
+    if(NULL != queue)
+        clReleaseCommandQueue(queue);
+    return rv;
+}
+
+void
+variant_stream_kernel(const struct inout_variant* v, cl_kernel kernel,
+        struct stream_kernel* sk)
+{
+    sk->kernel = kernel;
+    sk->element_size = v->width * sizeof(cl_int);
+    sk->local_size = v->local_size;
+    sk->single_work_item = v->single_work_item;
+}
+
+static cl_int
+variant_run(cl_command_queue queue, const struct inout_variant* v,
+        cl_kernel kernel, cl_mem buf_out, cl_mem buf_in, cl_uint count)
+{
+    cl_int rv;
+    size_t global_work_size = count / v->width;
+    cl_uint num_items = global_work_size;
+
+    rv  = clSetKernelArg(kernel, 0, sizeof(cl_mem), &buf_out);
+    rv |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &buf_in);
+    if(v->takes_count)
+        rv |= clSetKernelArg(kernel, 2, sizeof(cl_uint), &num_items);
+    if(CL_SUCCESS != rv)
+        return rv;
+    if(v->single_work_item)
+        rv = clEnqueueTask(queue, kernel, 0, NULL, NULL);
+    else
+        rv = clEnqueueNDRangeKernel(queue, kernel, 1, NULL,
+                &global_work_size, v->local_size ? &v->local_size : NULL,
+                0, NULL, NULL);
+    if(CL_SUCCESS == rv)
+        rv = clFinish(queue);
+    return rv;
+}
+
+/*
+ * Run a variant over the VERIFY_ELEMENTS ints of buf_in and compare the
+ * output with the expected one. Returns 1 if it failed, 0 if it matched or
+ * the program doesn't have it.
+ */
+static int
+variant_check_one(cl_command_queue queue, cl_program program,
+        const struct inout_variant* v, const char* label, cl_mem buf_out,
+        cl_mem buf_in, const cl_int* expected, cl_int* out_data)
+{
+    cl_int rv;
+    size_t mismatch = 0;
+    size_t data_size = VERIFY_ELEMENTS * sizeof(cl_int);
+    cl_kernel kernel = clCreateKernel(program, v->kernel_name, &rv);
+
+    if(CL_SUCCESS != rv)
+    {
+        printf("\t%-8s not in the program\n", label);
+        return 0;
+    }
+    memset(out_data, 0, data_size);
+    rv = clEnqueueWriteBuffer(queue, buf_out, CL_TRUE, 0, data_size,
+            out_data, 0, NULL, NULL);
+    if(CL_SUCCESS == rv)
+        rv = variant_run(queue, v, kernel, buf_out, buf_in, VERIFY_ELEMENTS);
+    if(CL_SUCCESS == rv)
+        rv = clEnqueueReadBuffer(queue, buf_out, CL_TRUE, 0, data_size,
+                out_data, 0, NULL, NULL);
+    clReleaseKernel(kernel);
+    if(CL_SUCCESS == rv)
+        mismatch = cpuref_diff(out_data, expected, VERIFY_ELEMENTS);
+
+    if(CL_SUCCESS == rv && VERIFY_ELEMENTS == mismatch)
+    {
+        printf("\t%-8s OK\n", label);
+        return 0;
+    }
+    printf("\t%-8s FAILED\n", label);
+    if(CL_SUCCESS != rv)
+        print_cl_error("\t\t", rv, stdout);
+    else
+        printf("\t\tat %zu: %X != %X\n", mismatch, out_data[mismatch],
+                expected[mismatch]);
+    return 1;
+}
+
+/**
+ * Check all the variants against the CPU reference: those of the program,
+ * and the copy specialized for chunks of chunk_size bytes the way the
+ * stream would build it. Returns the number of mismatching variants.
+ */
+int
+variant_verify(cl_context context, cl_device_id device, cl_program program,
+        const char* kernel_file_name, size_t chunk_size,
+        const struct cpuref* ref)
+{
+    cl_int rv;
+    int num_failed = NUM_VARIANTS + 1;
+    size_t data_size = VERIFY_ELEMENTS * sizeof(cl_int);
+    cl_int* in_data = malloc(data_size);
+    cl_int* expected = malloc(data_size);
+    cl_int* out_data = malloc(data_size);
+    cl_command_queue queue = clCreateCommandQueue(context, device, 0, &rv);
+    cl_mem buf_in = clCreateBuffer(context, CL_MEM_READ_ONLY, data_size,
+            NULL, &rv);
+    cl_mem buf_out = clCreateBuffer(context, CL_MEM_WRITE_ONLY, data_size,
+            NULL, &rv);
+    cl_device_type type = 0;
+    struct spec_cache spec;
+    struct inout_variant spec_variant;
+    const struct spec_program* sp;
+
+    clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+    spec_cache_init(&spec, context, device, kernel_file_name);
+    if(NULL != in_data && NULL != expected && NULL != out_data
+            && NULL != queue && NULL != buf_in && NULL != buf_out)
+    {
+        for(cl_uint i = 0; i < VERIFY_ELEMENTS; ++i)
+            in_data[i] = (cl_int) (i * 2654435761u);
+        ref->copy(expected, in_data, VERIFY_ELEMENTS);
+        rv = clEnqueueWriteBuffer(queue, buf_in, CL_TRUE, 0, data_size,
+                in_data, 0, NULL, NULL);
+    }
+    else
+    {
+        fputs("Failed to set up the verification\n", stderr);
+        rv = CL_OUT_OF_HOST_MEMORY;
+    }
+
+    if(CL_SUCCESS == rv)
+    {
+        num_failed = 0;
+        for(size_t i = 0; i < NUM_VARIANTS; ++i)
+            num_failed += variant_check_one(queue, program, &g_variants[i],
+                    g_variants[i].name, buf_out, buf_in, expected, out_data);
+        // the specialized program is a build of its own, check it as well
+        sp = variant_specialize(&spec, type, chunk_size, &spec_variant);
+        if(NULL == sp)
+        {
+            printf("\t%-8s FAILED to build\n", "spec*");
+            ++num_failed;
+        }
+        else
+        {
+            if(sp->generic)
+                puts("\tspec*    not specialized, the generic build");
+            num_failed += variant_check_one(queue, sp->program,
+                    &spec_variant, "spec*", buf_out, buf_in, expected,
+                    out_data);
+        }
+    }
+
+    spec_cache_release(&spec);
+    if(NULL != buf_in)
+        clReleaseMemObject(buf_in);
+    if(NULL != buf_out)
+        clReleaseMemObject(buf_out);
+    if(NULL != queue)
+        clReleaseCommandQueue(queue);
+    free(in_data);
+    free(expected);
+    free(out_data);
+    return num_failed;
+}
@@ -0,0 +1,101 @@
+/*
+ * Three stages of a computation: the producer reads the input, the
+ * transform computes TRANSFORM() of every value and the consumer writes
+ * the output. The same stages are connected in three ways:
+ *  gm_*  through global memory, every stage a full pass over a buffer;
+ *  ch_*  by Intel FPGA channels, single work items running at the same time
+ *        and handing the values over through on-chip FIFOs;
+ *  pp_*  by OpenCL 2.0 pipes, a work item per value. A packet carries the
+ *        index of its value, since the work items of a stage write their
+ *        packets in no particular order.
+ */
+
+#define TRANSFORM(x) ((x) * 3 + 1)
+
+__kernel void
+gm_produce(__global int * restrict out, __global const int * restrict in)
+{
+    size_t i = get_global_id(0);
+    out[i] = in[i];
+}
+
+__kernel void
+gm_transform(__global int * restrict out, __global const int * restrict in)
+{
+    size_t i = get_global_id(0);
+    out[i] = TRANSFORM(in[i]);
+}
+
+__kernel void
+gm_consume(__global int * restrict out, __global const int * restrict in)
+{
+    size_t i = get_global_id(0);
+    out[i] = in[i];
+}
+
+#if defined(INTELFPGA_CL)
+#pragma OPENCL EXTENSION cl_intel_channels : enable
+#define CHANNEL_READ read_channel_intel
+#define CHANNEL_WRITE write_channel_intel
+#elif defined(ALTERA_CL)
+#pragma OPENCL EXTENSION cl_altera_channels : enable
+#define CHANNEL_READ read_channel_altera
+#define CHANNEL_WRITE write_channel_altera
+#endif
+
+#ifdef CHANNEL_WRITE
+#define CHANNEL_DEPTH 64
+
+channel int c_produced __attribute__((depth(CHANNEL_DEPTH)));
+channel int c_transformed __attribute__((depth(CHANNEL_DEPTH)));
+
+__kernel void
+ch_produce(__global const int * restrict in, uint n)
+{
+    for(uint i = 0; i < n; ++i)
+        CHANNEL_WRITE(c_produced, in[i]);
+}
+
+__kernel void
+ch_transform(uint n)
+{
+    for(uint i = 0; i < n; ++i)
+        CHANNEL_WRITE(c_transformed, TRANSFORM(CHANNEL_READ(c_produced)));
+}
+
+__kernel void
+ch_consume(__global int * restrict out, uint n)
+{
+    for(uint i = 0; i < n; ++i)
+        out[i] = CHANNEL_READ(c_transformed);
+}
+#endif
+
+/* Built with -cl-std=CL2.0 only */
+#if defined(__OPENCL_C_VERSION__) && __OPENCL_C_VERSION__ >= 200
+__kernel void
+pp_produce(__global const int * restrict in, __write_only pipe int2 out)
+{
+    int i = get_global_id(0);
+    int2 packet = (int2) (i, in[i]);
+    write_pipe(out, &packet);
+}
+
+__kernel void
+pp_transform(__read_only pipe int2 in, __write_only pipe int2 out)
+{
+    int2 packet;
+    if(0 != read_pipe(in, &packet))
+        return;
+    packet.y = TRANSFORM(packet.y);
+    write_pipe(out, &packet);
+}
+
+__kernel void
+pp_consume(__global int * restrict out, __read_only pipe int2 in)
+{
+    int2 packet;
+    if(0 == read_pipe(in, &packet))
+        out[packet.x] = packet.y;
+}
+#endif
@@ -0,0 +1,373 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "CL/opencl.h"
+
+#include "../common/errorcodes.c"
+#include "../common/utils.c"
+#include "../common/dataflow.c"
+
+#define BINARY_FILE_NAME "lab4.aocx"
+#define SOURCE_FILE_NAME "lab4.cl"
+#define NUM_ELEMENTS (1 << 22)
+#define BLOCK_SIZE (1 << 16)
+#define NUM_RUNS 10
+#define NUM_STAGES 3
+
+#define TRANSFORM(x) ((x) * 3 + 1)  // as in core.cl
+
+enum link_kind
+{
+    LINK_GLOBAL_MEMORY,
+    LINK_CHANNELS,
+    LINK_PIPES
+};
+
+static const char * const g_link_names[] = {
+    "global memory", "channels", "pipes"
+};
+
+static const char * const g_stage_names[][NUM_STAGES] = {
+    { "gm_produce", "gm_transform", "gm_consume" },
+    { "ch_produce", "ch_transform", "ch_consume" },
+    { "pp_produce", "pp_transform", "pp_consume" },
+};
+
+/* What the chains of every kind share */
+struct chain
+{
+    cl_device_id device;
+    cl_context context;
+    cl_program program;
+    cl_command_queue queue;     // for the transfers
+    cl_mem in;
+    cl_mem out;
+    cl_mem links[NUM_STAGES - 1];
+    cl_uint num_elements;
+    size_t block_size;
+};
+
+void
+usage(const char* prog)
+{
+    fprintf(stderr, "Usage: %s [-d device] [-k kernel] [-n elements] "
+            "[-b block] [-r runs] [-t prefix]\n"
+            "\t-d  device selector (see common/devices.c)\n"
+            "\t-k  kernel file, %s for accelerators, %s otherwise\n"
+            "\t-n  number of ints to process (%d)\n"
+            "\t-b  ints a pipe holds, the stages hand them over in blocks "
+            "(%d)\n"
+            "\t-r  measured runs of each chain (%d)\n"
+            "\t-t  trace the stages to <prefix>.json and <prefix>.csv\n",
+            prog, BINARY_FILE_NAME, SOURCE_FILE_NAME, NUM_ELEMENTS,
+            BLOCK_SIZE, NUM_RUNS);
+}
+
+double
+wall_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Create the links between the stages and set the kernel arguments.
+ */
+cl_int
+chain_connect(struct chain* c, enum link_kind kind, struct dataflow* df)
+{
+    cl_int rv = CL_SUCCESS;
+    cl_kernel k[NUM_STAGES];
+
+    for(int i = 0; i < NUM_STAGES; ++i)
+        k[i] = df->stages[i].kernel;
+    for(int i = 0; i < NUM_STAGES - 1 && CL_SUCCESS == rv; ++i)
+    {
+        if(LINK_GLOBAL_MEMORY == kind)
+            c->links[i] = clCreateBuffer(c->context, CL_MEM_READ_WRITE,
+                    c->num_elements * sizeof(cl_int), NULL, &rv);
+#ifdef CL_VERSION_2_0
+        else if(LINK_PIPES == kind)
+            c->links[i] = clCreatePipe(c->context, 0, sizeof(cl_int2),
+                    c->block_size, NULL, &rv);
+#endif
+    }
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Failed to create a link between the stages:", rv,
+                stderr);
+        return rv;
+    }
+
+    switch(kind)
+    {
+        case LINK_GLOBAL_MEMORY:
+            rv  = clSetKernelArg(k[0], 0, sizeof(cl_mem), &c->links[0]);
+            rv |= clSetKernelArg(k[0], 1, sizeof(cl_mem), &c->in);
+            rv |= clSetKernelArg(k[1], 0, sizeof(cl_mem), &c->links[1]);
+            rv |= clSetKernelArg(k[1], 1, sizeof(cl_mem), &c->links[0]);
+            rv |= clSetKernelArg(k[2], 0, sizeof(cl_mem), &c->out);
+            rv |= clSetKernelArg(k[2], 1, sizeof(cl_mem), &c->links[1]);
+            break;
+        case LINK_CHANNELS:
+            rv  = clSetKernelArg(k[0], 0, sizeof(cl_mem), &c->in);
+            rv |= clSetKernelArg(k[0], 1, sizeof(cl_uint), &c->num_elements);
+            rv |= clSetKernelArg(k[1], 0, sizeof(cl_uint), &c->num_elements);
+            rv |= clSetKernelArg(k[2], 0, sizeof(cl_mem), &c->out);
+            rv |= clSetKernelArg(k[2], 1, sizeof(cl_uint), &c->num_elements);
+            for(int i = 0; i < NUM_STAGES; ++i)
+                df->stages[i].single_work_item = 1;
+            break;
+        case LINK_PIPES:
+        default:
+            rv  = clSetKernelArg(k[0], 0, sizeof(cl_mem), &c->in);
+            rv |= clSetKernelArg(k[0], 1, sizeof(cl_mem), &c->links[0]);
+            rv |= clSetKernelArg(k[1], 0, sizeof(cl_mem), &c->links[0]);
+            rv |= clSetKernelArg(k[1], 1, sizeof(cl_mem), &c->links[1]);
+            rv |= clSetKernelArg(k[2], 0, sizeof(cl_mem), &c->out);
+            rv |= clSetKernelArg(k[2], 1, sizeof(cl_mem), &c->links[1]);
+            break;
+    }
+    if(CL_SUCCESS != rv)
+        print_cl_error("Failed to set an argument:", rv, stderr);
+    return rv;
+}
+
+void
+chain_disconnect(struct chain* c)
+{
+    for(int i = 0; i < NUM_STAGES - 1; ++i)
+    {
+        if(NULL != c->links[i])
+            clReleaseMemObject(c->links[i]);
+        c->links[i] = NULL;
+    }
+}
+
+/**
+ * One pass of the data through the chain. The stages linked by pipes get
+ * the data in blocks a pipe has room for, the others in one go.
+ */
+cl_int
+chain_run(struct chain* c, enum link_kind kind, struct dataflow* df)
+{
+    cl_int rv = CL_SUCCESS;
+    cl_int status;
+    size_t block = (LINK_PIPES == kind) ? c->block_size : c->num_elements;
+
+    for(size_t offset = 0; offset < c->num_elements && CL_SUCCESS == rv;
+            offset += block)
+    {
+        size_t count = c->num_elements - offset;
+        rv = dataflow_enqueue(df, offset, (count < block) ? count : block);
+    }
+    // wait for the launched stages even after an error
+    status = dataflow_finish(df);
+    return (CL_SUCCESS != rv) ? rv : status;
+}
+
+static cl_int
+chain_check(struct chain* c, const cl_int* expected, cl_int* out_data)
+{
+    cl_int rv = clEnqueueReadBuffer(c->queue, c->out, CL_TRUE, 0,
+            c->num_elements * sizeof(cl_int), out_data, 0, NULL, NULL);
+    if(CL_SUCCESS != rv)
+        return rv;
+    for(cl_uint i = 0; i < c->num_elements; ++i)
+    {
+        if(expected[i] != out_data[i])
+        {
+            fprintf(stderr, "Element %u is %d instead of %d\n", i,
+                    out_data[i], expected[i]);
+            return CL_INVALID_VALUE;
+        }
+    }
+    return CL_SUCCESS;
+}
+
+/**
+ * Run the data through the chain of one kind num_runs times after a
+ * warm-up run, check the output and print the throughput. Sets the
+ * seconds per run.
+ */
+cl_int
+chain_measure(struct chain* c, enum link_kind kind, int num_runs,
+        const cl_int* expected, cl_int* out_data, double* per_run)
+{
+    cl_int rv;
+    struct dataflow df;
+    double start;
+    size_t data_size = c->num_elements * sizeof(cl_int);
+    // bytes read and written in global memory, the links included
+    size_t moved = (LINK_GLOBAL_MEMORY == kind)
+        ? 2 * NUM_STAGES * data_size : 2 * data_size;
+
+    rv = dataflow_init(&df, c->context, c->device, c->program,
+            g_stage_names[kind], NUM_STAGES,
+            (LINK_CHANNELS == kind) ? DATAFLOW_CONCURRENT : DATAFLOW_HANDOFF);
+    if(CL_SUCCESS != rv)
+        return rv;
+    if(CL_SUCCESS != (rv = chain_connect(c, kind, &df)))
+    {
+        chain_disconnect(c);
+        dataflow_release(&df);
+        return rv;
+    }
+
+    // a stale output must not pass the check
+    memset(out_data, 0, data_size);
+    rv = clEnqueueWriteBuffer(c->queue, c->out, CL_TRUE, 0, data_size,
+            out_data, 0, NULL, NULL);
+    if(CL_SUCCESS == rv)
+        rv = chain_run(c, kind, &df);
+    if(CL_SUCCESS == rv)
+        rv = chain_check(c, expected, out_data);
+    start = wall_time();
+    for(int i = 0; i < num_runs && CL_SUCCESS == rv; ++i)
+        rv = chain_run(c, kind, &df);
+    *per_run = (wall_time() - start) / num_runs;
+    chain_disconnect(c);
+    dataflow_release(&df);
+    if(CL_SUCCESS != rv)
+    {
+        fprintf(stderr, "The chain through %s failed: %s\n",
+                g_link_names[kind], cl_error_str(rv));
+        return rv;
+    }
+
+    printf("%-14s %9.3f ms per run, %8.1f MB/s, %6zu MB of global memory "
+            "traffic\n", g_link_names[kind], *per_run * 1e3,
+            data_size / *per_run / 1e6, moved >> 20);
+    return CL_SUCCESS;
+}
+
+int
+main(int argc, char** argv)
+{
+    cl_int rv;
+    const char* kernel_file_name = NULL;
+    const char* selector = NULL;
+    const char* options = "";
+    int num_runs = NUM_RUNS;
+    enum link_kind kind;
+    struct chain c;
+    int opt;
+
+    memset(&c, 0, sizeof(c));
+    c.num_elements = NUM_ELEMENTS;
+    c.block_size = BLOCK_SIZE;
+
+    while(-1 != (opt = getopt(argc, argv, "d:k:n:b:r:t:h")))
+    {
+        switch(opt)
+        {
+            case 'd': selector = optarg; break;
+            case 'k': kernel_file_name = optarg; break;
+            case 'n': c.num_elements = strtoul(optarg, NULL, 0); break;
+            case 'b': c.block_size = strtoul(optarg, NULL, 0); break;
+            case 'r': num_runs = atoi(optarg); break;
+            case 't': trace_start(optarg); break;
+            default:
+                usage(argv[0]);
+                return CL_INVALID_VALUE;
+        }
+    }
+    if(0 == c.num_elements || 0 == c.block_size || num_runs <= 0)
+    {
+        usage(argv[0]);
+        return CL_INVALID_VALUE;
+    }
+
+    /* 1-2. Get the platform and the device, create a context */
+    rv = platform_layer_select(selector, &c.device, &c.context);
+    if(CL_SUCCESS != rv)
+        return rv;
+
+    /* 7-9. Build the program with the kind of links the device has */
+    cl_device_type type;
+    clGetDeviceInfo(c.device, CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+    if(CL_DEVICE_TYPE_ACCELERATOR & type)
+        kind = LINK_CHANNELS;
+    else if(dataflow_pipes_supported(c.device))
+    {
+        kind = LINK_PIPES;
+        options = "-cl-std=CL2.0";
+    }
+    else
+    {
+        kind = LINK_GLOBAL_MEMORY;
+        puts("The device has neither channels nor pipes");
+    }
+    if(NULL == kernel_file_name)
+        kernel_file_name = (CL_DEVICE_TYPE_ACCELERATOR & type)
+            ? BINARY_FILE_NAME : SOURCE_FILE_NAME;
+    rv = build_program_opts(&c.program, &c.context, &c.device,
+            kernel_file_name, NULL, options);
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Failed to build a program:", rv, stderr);
+        return rv;
+    }
+
+    /* 4-6. Create the queue, the buffers and the input */
+    size_t data_size = c.num_elements * sizeof(cl_int);
+    cl_int* in_data = malloc(data_size);
+    cl_int* expected = malloc(data_size);
+    cl_int* out_data = malloc(data_size);
+    if(NULL == in_data || NULL == expected || NULL == out_data)
+    {
+        fputs("Failed to allocate the host memory\n", stderr);
+        return CL_OUT_OF_HOST_MEMORY;
+    }
+    for(cl_uint i = 0; i < c.num_elements; ++i)
+    {
+        in_data[i] = (cl_int) (i * 2654435761u);
+        expected[i] = TRANSFORM(in_data[i]);
+    }
+    c.queue = clCreateCommandQueue(c.context, c.device, 0, &rv);
+    if(CL_SUCCESS == rv)
+        c.in = clCreateBuffer(c.context, CL_MEM_READ_ONLY, data_size, NULL,
+                &rv);
+    if(CL_SUCCESS == rv)
+        c.out = clCreateBuffer(c.context, CL_MEM_WRITE_ONLY, data_size, NULL,
+                &rv);
+    if(CL_SUCCESS == rv)
+        rv = clEnqueueWriteBuffer(c.queue, c.in, CL_TRUE, 0, data_size,
+                in_data, 0, NULL, NULL);
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Failed to set up the buffers:", rv, stderr);
+        return rv;
+    }
+
+    /* 11. Run the chains and compare them */
+    double staged, linked;
+    printf("%u ints through %d stages, %d run(s) each:\n", c.num_elements,
+            NUM_STAGES, num_runs);
+    rv = chain_measure(&c, LINK_GLOBAL_MEMORY, num_runs, expected, out_data,
+            &staged);
+    if(CL_SUCCESS == rv && LINK_GLOBAL_MEMORY != kind)
+    {
+        rv = chain_measure(&c, kind, num_runs, expected, out_data, &linked);
+        if(CL_SUCCESS == rv)
+            printf("Speedup of %s over global memory: %.2fx\n",
+                    g_link_names[kind], staged / linked);
+    }
+    trace_finish();
+
+    /* 13. Finalization */
+    clReleaseMemObject(c.in);
+    clReleaseMemObject(c.out);
+    clReleaseCommandQueue(c.queue);
+    clReleaseProgram(c.program);
+    clReleaseContext(c.context);
+    free(in_data);
+    free(expected);
+    free(out_data);
+
+    return (CL_SUCCESS != rv) ? rv : 0;
+}
@@ -0,0 +1,103 @@
+/*
+ * 2-D convolution of 8-bit grayscale frames with a square filter of
+ * (2 * radius + 1)^2 weights. A work item computes one output pixel;
+ * pixels beyond the frame repeat the nearest edge pixel. The sum is
+ * rounded to the nearest integer and saturated to 0..255.
+ */
+
+#define TILE_SIZE 16            // the work-group is TILE_SIZE^2, see host.c
+
+/* Every input pixel is read from global memory (2 * radius + 1)^2 times */
+__kernel void
+conv_naive(__global uchar * restrict out, __global const uchar * restrict in,
+        __constant float * filter, int width, int height, int radius)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    int size = 2 * radius + 1;
+    float acc = 0.0f;
+
+    if(x >= width || y >= height)
+        return;
+    for(int dy = -radius; dy <= radius; ++dy)
+    {
+        int sy = clamp(y + dy, 0, height - 1);
+        for(int dx = -radius; dx <= radius; ++dx)
+        {
+            int sx = clamp(x + dx, 0, width - 1);
+            acc += filter[(dy + radius) * size + dx + radius]
+                * in[sy * width + sx];
+        }
+    }
+    out[y * width + x] = convert_uchar_sat_rte(acc);
+}
+
+/*
+ * The work-group first copies its tile of the frame and the halo of
+ * radius pixels around it to local memory, each work item a few pixels,
+ * and then computes from there: every input pixel comes from global
+ * memory about once per work-group. The scratch holds
+ * (TILE_SIZE + 2 * radius)^2 pixels.
+ */
+__kernel __attribute__((reqd_work_group_size(TILE_SIZE, TILE_SIZE, 1)))
+void
+conv_tiled(__global uchar * restrict out, __global const uchar * restrict in,
+        __constant float * filter, int width, int height, int radius,
+        __local uchar * tile)
+{
+    int lx = get_local_id(0);
+    int ly = get_local_id(1);
+    int x0 = get_group_id(0) * TILE_SIZE - radius;
+    int y0 = get_group_id(1) * TILE_SIZE - radius;
+    int span = TILE_SIZE + 2 * radius;
+    int size = 2 * radius + 1;
+    float acc = 0.0f;
+
+    for(int ty = ly; ty < span; ty += TILE_SIZE)
+    {
+        int sy = clamp(y0 + ty, 0, height - 1);
+        for(int tx = lx; tx < span; tx += TILE_SIZE)
+            tile[ty * span + tx]
+                = in[sy * width + clamp(x0 + tx, 0, width - 1)];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // the work items beyond the frame have loaded their part of the tile
+    if(x0 + radius + lx >= width || y0 + radius + ly >= height)
+        return;
+    for(int dy = 0; dy < size; ++dy)
+        for(int dx = 0; dx < size; ++dx)
+            acc += filter[dy * size + dx]
+                * tile[(ly + dy) * span + lx + dx];
+    out[(y0 + radius + ly) * width + x0 + radius + lx]
+        = convert_uchar_sat_rte(acc);
+}
+
+/*
+ * The frames are images of CL_R, CL_UNORM_INT8: the texture units of a
+ * GPU cache the 2-D neighbourhood and clamp the coordinates at the edges.
+ * A device without image support would fail to build the whole program,
+ * so the kernel is only there with __IMAGE_SUPPORT__; the host skips it.
+ */
+#ifdef __IMAGE_SUPPORT__
+__constant sampler_t g_sampler = CLK_NORMALIZED_COORDS_FALSE
+    | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;
+
+__kernel void
+conv_image(__write_only image2d_t out, __read_only image2d_t in,
+        __constant float * filter, int radius)
+{
+    int2 pos = (int2) (get_global_id(0), get_global_id(1));
+    int size = 2 * radius + 1;
+    float acc = 0.0f;
+
+    if(pos.x >= get_image_width(out) || pos.y >= get_image_height(out))
+        return;
+    for(int dy = -radius; dy <= radius; ++dy)
+        for(int dx = -radius; dx <= radius; ++dx)
+            acc += filter[(dy + radius) * size + dx + radius]
+                * read_imagef(in, g_sampler, pos + (int2) (dx, dy)).x;
+    // the unorm conversion saturates and rounds as convert_uchar_sat_rte
+    write_imagef(out, pos, (float4) (acc, 0.0f, 0.0f, 1.0f));
+}
+#endif // __IMAGE_SUPPORT__
@@ -0,0 +1,516 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "CL/opencl.h"
+
+#include "../common/errorcodes.c"
+#include "../common/utils.c"
+
+#define BINARY_FILE_NAME "lab5.aocx"
+#define SOURCE_FILE_NAME "lab5.cl"
+#define WIDTH 1024
+#define HEIGHT 768
+#define NUM_FRAMES 16
+#define RADIUS 2
+#define MAX_RADIUS 8
+#define TILE_SIZE 16                // as in core.cl
+#define TOLERANCE 1                 // the kernels may round the sums apart
+
+enum conv_kind
+{
+    CONV_NAIVE,
+    CONV_TILED,
+    CONV_IMAGE,
+    CONV_NUM_KINDS
+};
+
+static const char * const g_conv_names[] = { "naive", "tiled", "image" };
+static const char * const g_kernel_names[] = {
+    "conv_naive", "conv_tiled", "conv_image"
+};
+
+/* The device side of all the kernels */
+struct conv
+{
+    cl_context context;
+    cl_command_queue queue;     // with profiling enabled
+    cl_kernel kernels[CONV_NUM_KINDS];
+    cl_mem filter;
+    cl_mem in;
+    cl_mem out;
+    cl_mem in_image;            // NULL without image support
+    cl_mem out_image;
+    cl_int width;
+    cl_int height;
+    cl_int radius;
+};
+
+/* Frames from a raw file of 8-bit pixels, or generated without one */
+struct frame_source
+{
+    FILE* fp;
+    int num_frames;             // at most
+    int index;                  // of the next frame
+};
+
+void
+usage(const char* prog)
+{
+    fprintf(stderr, "Usage: %s [-d device] [-k kernel] [-f frames.raw] "
+            "[-W width] [-H height] [-n frames] [-r radius]\n"
+            "\t-d  device selector (see common/devices.c)\n"
+            "\t-k  kernel file, %s for accelerators, %s otherwise\n"
+            "\t-f  raw 8-bit grayscale frames, one after another; "
+            "generated without it\n"
+            "\t-W  frame width (%d)\n"
+            "\t-H  frame height (%d)\n"
+            "\t-n  frames to process, at most (%d)\n"
+            "\t-r  filter radius, 0 to %d (%d)\n",
+            prog, BINARY_FILE_NAME, SOURCE_FILE_NAME, WIDTH, HEIGHT,
+            NUM_FRAMES, MAX_RADIUS, RADIUS);
+}
+
+double
+wall_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Gaussian weights of a (2 * radius + 1)^2 filter adding up to 1.
+ */
+void
+make_filter(float* filter, int radius)
+{
+    int size = 2 * radius + 1;
+    float sigma = (radius > 0) ? radius / 2.0f : 1.0f;
+    float sum = 0.0f;
+
+    for(int y = 0; y < size; ++y)
+    {
+        for(int x = 0; x < size; ++x)
+        {
+            float d2 = (x - radius) * (x - radius)
+                + (y - radius) * (y - radius);
+            filter[y * size + x] = expf(-d2 / (2 * sigma * sigma));
+            sum += filter[y * size + x];
+        }
+    }
+    for(int i = 0; i < size * size; ++i)
+        filter[i] /= sum;
+}
+
+/**
+ * The reference: the convolution of conv_naive on the CPU.
+ */
+void
+convolve(unsigned char* out, const unsigned char* in, const float* filter,
+        int width, int height, int radius)
+{
+    int size = 2 * radius + 1;
+    for(int y = 0; y < height; ++y)
+    {
+        for(int x = 0; x < width; ++x)
+        {
+            float acc = 0.0f;
+            for(int dy = -radius; dy <= radius; ++dy)
+            {
+                int sy = y + dy;
+                sy = (sy < 0) ? 0 : (sy >= height) ? height - 1 : sy;
+                for(int dx = -radius; dx <= radius; ++dx)
+                {
+                    int sx = x + dx;
+                    sx = (sx < 0) ? 0 : (sx >= width) ? width - 1 : sx;
+                    acc += filter[(dy + radius) * size + dx + radius]
+                        * in[sy * width + sx];
+                }
+            }
+            acc = rintf(acc);
+            out[y * width + x] = (acc < 0.0f) ? 0
+                : (acc > 255.0f) ? 255 : (unsigned char) acc;
+        }
+    }
+}
+
+/**
+ * Start over from the first frame.
+ */
+void
+frames_rewind(struct frame_source* src)
+{
+    src->index = 0;
+    if(NULL != src->fp)
+        rewind(src->fp);
+}
+
+/**
+ * Get the next frame. Returns 0 when there are no more.
+ */
+int
+frames_next(struct frame_source* src, unsigned char* frame, int width,
+        int height)
+{
+    size_t size = (size_t) width * height;
+    if(src->index >= src->num_frames)
+        return 0;
+    if(NULL != src->fp)
+    {
+        if(size != fread(frame, 1, size, src->fp))
+            return 0;
+    }
+    else
+    {
+        // a pattern moving from frame to frame, with some noise
+        unsigned int seed = 12345u + src->index;
+        for(int y = 0; y < height; ++y)
+        {
+            for(int x = 0; x < width; ++x)
+            {
+                seed = seed * 1664525u + 1013904223u;
+                frame[y * width + x] = (unsigned char) (((x + src->index * 4)
+                            ^ y) + (seed >> 28));
+            }
+        }
+    }
+    ++src->index;
+    return 1;
+}
+
+static cl_mem
+create_image(cl_context context, cl_mem_flags flags, int width, int height,
+        cl_int* rv)
+{
+    cl_image_format format;
+    format.image_channel_order = CL_R;
+    format.image_channel_data_type = CL_UNORM_INT8;
+#ifdef CL_VERSION_1_2
+    cl_image_desc desc;
+    memset(&desc, 0, sizeof(desc));
+    desc.image_type = CL_MEM_OBJECT_IMAGE2D;
+    desc.image_width = width;
+    desc.image_height = height;
+    return clCreateImage(context, flags, &format, &desc, NULL, rv);
+#else
+    return clCreateImage2D(context, flags, &format, width, height, 0, NULL,
+            rv);
+#endif
+}
+
+/**
+ * Create the kernels and the buffers and set the arguments. The image
+ * kernel is left out if the device has no image support.
+ */
+cl_int
+conv_init(struct conv* c, cl_device_id device, cl_program program,
+        const float* filter)
+{
+    cl_int rv = CL_SUCCESS;
+    cl_bool images = CL_FALSE;
+    size_t frame_size = (size_t) c->width * c->height;
+    size_t filter_size = (2 * c->radius + 1) * (2 * c->radius + 1)
+        * sizeof(float);
+    size_t tile_size = (TILE_SIZE + 2 * c->radius)
+        * (TILE_SIZE + 2 * c->radius);
+
+    clGetDeviceInfo(device, CL_DEVICE_IMAGE_SUPPORT, sizeof(images), &images,
+            NULL);
+    c->queue = clCreateCommandQueue(c->context, device,
+            CL_QUEUE_PROFILING_ENABLE, &rv);
+    if(CL_SUCCESS == rv)
+        c->filter = clCreateBuffer(c->context,
+                CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, filter_size,
+                (void*) filter, &rv);
+    if(CL_SUCCESS == rv)
+        c->in = clCreateBuffer(c->context, CL_MEM_READ_ONLY, frame_size,
+                NULL, &rv);
+    if(CL_SUCCESS == rv)
+        c->out = clCreateBuffer(c->context, CL_MEM_WRITE_ONLY, frame_size,
+                NULL, &rv);
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Failed to create the buffers:", rv, stderr);
+        return rv;
+    }
+    if(images)
+    {
+        c->in_image = create_image(c->context, CL_MEM_READ_ONLY, c->width,
+                c->height, &rv);
+        if(CL_SUCCESS == rv)
+            c->out_image = create_image(c->context, CL_MEM_WRITE_ONLY,
+                    c->width, c->height, &rv);
+        if(CL_SUCCESS != rv)
+        {
+            print_cl_error("Failed to create the images:", rv, stderr);
+            rv = CL_SUCCESS;
+        }
+    }
+
+    for(int k = 0; k < CONV_NUM_KINDS && CL_SUCCESS == rv; ++k)
+    {
+        cl_kernel kernel;
+        if(CONV_IMAGE == k && NULL == c->out_image)
+            continue;
+        kernel = c->kernels[k] = clCreateKernel(program, g_kernel_names[k],
+                &rv);
+        if(CL_SUCCESS != rv)
+        {
+            // a binary may have been compiled without the image kernel
+            fprintf(stderr, "No kernel %s: %s\n", g_kernel_names[k],
+                    cl_error_str(rv));
+            c->kernels[k] = NULL;
+            rv = (CONV_IMAGE == k) ? CL_SUCCESS : rv;
+            continue;
+        }
+        if(CONV_IMAGE == k)
+        {
+            rv  = clSetKernelArg(kernel, 0, sizeof(cl_mem), &c->out_image);
+            rv |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &c->in_image);
+            rv |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &c->filter);
+            rv |= clSetKernelArg(kernel, 3, sizeof(cl_int), &c->radius);
+            continue;
+        }
+        rv  = clSetKernelArg(kernel, 0, sizeof(cl_mem), &c->out);
+        rv |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &c->in);
+        rv |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &c->filter);
+        rv |= clSetKernelArg(kernel, 3, sizeof(cl_int), &c->width);
+        rv |= clSetKernelArg(kernel, 4, sizeof(cl_int), &c->height);
+        rv |= clSetKernelArg(kernel, 5, sizeof(cl_int), &c->radius);
+        if(CONV_TILED == k)
+            rv |= clSetKernelArg(kernel, 6, tile_size, NULL);
+    }
+    if(CL_SUCCESS != rv)
+        print_cl_error("Failed to set up the kernels:", rv, stderr);
+    return rv;
+}
+
+void
+conv_release(struct conv* c)
+{
+    cl_mem buffers[] = { c->filter, c->in, c->out, c->in_image, c->out_image };
+    for(int k = 0; k < CONV_NUM_KINDS; ++k)
+        if(NULL != c->kernels[k])
+            clReleaseKernel(c->kernels[k]);
+    for(size_t i = 0; i < sizeof(buffers) / sizeof(buffers[0]); ++i)
+        if(NULL != buffers[i])
+            clReleaseMemObject(buffers[i]);
+    if(NULL != c->queue)
+        clReleaseCommandQueue(c->queue);
+}
+
+/**
+ * Filter one frame: write it, run the kernel and read the result. Adds
+ * the time of the kernel to kernel_s.
+ */
+cl_int
+conv_frame(struct conv* c, enum conv_kind kind, const unsigned char* frame,
+        unsigned char* result, double* kernel_s)
+{
+    cl_int rv;
+    cl_event event;
+    cl_ulong start = 0, end = 0;
+    size_t origin[3] = { 0, 0, 0 };
+    size_t region[3] = { c->width, c->height, 1 };
+    size_t local_size[2] = { TILE_SIZE, TILE_SIZE };
+    // the tiles cover the frame, the kernels skip what is beyond it
+    size_t global_size[2] = {
+        (c->width + TILE_SIZE - 1) / TILE_SIZE * TILE_SIZE,
+        (c->height + TILE_SIZE - 1) / TILE_SIZE * TILE_SIZE
+    };
+
+    rv = (CONV_IMAGE == kind)
+        ? clEnqueueWriteImage(c->queue, c->in_image, CL_FALSE, origin, region,
+                0, 0, frame, 0, NULL, NULL)
+        : clEnqueueWriteBuffer(c->queue, c->in, CL_FALSE, 0,
+                region[0] * region[1], frame, 0, NULL, NULL);
+    if(CL_SUCCESS != rv)
+        return rv;
+    rv = clEnqueueNDRangeKernel(c->queue, c->kernels[kind], 2, NULL,
+            global_size, (CONV_TILED == kind) ? local_size : NULL, 0, NULL,
+            &event);
+    if(CL_SUCCESS != rv)
+        return rv;
+    rv = (CONV_IMAGE == kind)
+        ? clEnqueueReadImage(c->queue, c->out_image, CL_TRUE, origin, region,
+                0, 0, result, 0, NULL, NULL)
+        : clEnqueueReadBuffer(c->queue, c->out, CL_TRUE, 0,
+                region[0] * region[1], result, 0, NULL, NULL);
+    if(CL_SUCCESS == rv)
+    {
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START,
+                sizeof(start), &start, NULL);
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END,
+                sizeof(end), &end, NULL);
+        *kernel_s += (end - start) * 1e-9;
+    }
+    clReleaseEvent(event);
+    return rv;
+}
+
+/**
+ * Stream all the frames through one kernel, check every result against
+ * the reference and print the throughput.
+ */
+cl_int
+conv_measure(struct conv* c, enum conv_kind kind, struct frame_source* src,
+        const float* filter, unsigned char* frame, unsigned char* result,
+        unsigned char* expected)
+{
+    cl_int rv = CL_SUCCESS;
+    double total_s = 0.0, kernel_s = 0.0;
+    double megapixels;
+    int num_frames = 0;
+    int max_error = 0;
+
+    frames_rewind(src);
+    while(CL_SUCCESS == rv && frames_next(src, frame, c->width, c->height))
+    {
+        double start = wall_time();
+        rv = conv_frame(c, kind, frame, result, &kernel_s);
+        total_s += wall_time() - start;
+        if(CL_SUCCESS != rv)
+            break;
+        ++num_frames;
+        convolve(expected, frame, filter, c->width, c->height, c->radius);
+        for(size_t i = 0; i < (size_t) c->width * c->height; ++i)
+        {
+            int error = abs(result[i] - expected[i]);
+            if(error > max_error)
+                max_error = error;
+        }
+    }
+    if(CL_SUCCESS != rv)
+    {
+        fprintf(stderr, "The %s kernel failed: %s\n", g_conv_names[kind],
+                cl_error_str(rv));
+        return rv;
+    }
+    if(0 == num_frames)
+    {
+        fputs("No frames to process\n", stderr);
+        return CL_INVALID_VALUE;
+    }
+
+    megapixels = (double) c->width * c->height * num_frames / 1e6;
+    printf("%-6s %8.1f MP/s with the transfers, %8.1f MP/s in the kernel, "
+            "largest error %d: %s\n", g_conv_names[kind], megapixels / total_s,
+            megapixels / kernel_s, max_error,
+            (max_error <= TOLERANCE) ? "OK" : "FAILED");
+    return (max_error <= TOLERANCE) ? CL_SUCCESS : CL_INVALID_VALUE;
+}
+
+int
+main(int argc, char** argv)
+{
+    cl_int rv;
+    cl_device_id device;
+    cl_program program;
+    const char* kernel_file_name = NULL;
+    const char* selector = NULL;
+    const char* frames_file_name = NULL;
+    struct frame_source src;
+    struct conv c;
+    float filter[(2 * MAX_RADIUS + 1) * (2 * MAX_RADIUS + 1)];
+    int opt;
+
+    memset(&c, 0, sizeof(c));
+    memset(&src, 0, sizeof(src));
+    c.width = WIDTH;
+    c.height = HEIGHT;
+    c.radius = RADIUS;
+    src.num_frames = NUM_FRAMES;
+
+    while(-1 != (opt = getopt(argc, argv, "d:k:f:W:H:n:r:h")))
+    {
+        switch(opt)
+        {
+            case 'd': selector = optarg; break;
+            case 'k': kernel_file_name = optarg; break;
+            case 'f': frames_file_name = optarg; break;
+            case 'W': c.width = atoi(optarg); break;
+            case 'H': c.height = atoi(optarg); break;
+            case 'n': src.num_frames = atoi(optarg); break;
+            case 'r': c.radius = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return CL_INVALID_VALUE;
+        }
+    }
+    if(c.width <= 0 || c.height <= 0 || src.num_frames <= 0
+            || c.radius < 0 || c.radius > MAX_RADIUS)
+    {
+        usage(argv[0]);
+        return CL_INVALID_VALUE;
+    }
+    if(NULL != frames_file_name
+            && NULL == (src.fp = fopen(frames_file_name, "rb")))
+    {
+        perror(frames_file_name);
+        return CL_INVALID_VALUE;
+    }
+    make_filter(filter, c.radius);
+
+    /* 1-2. Get the platform and the device, create a context */
+    rv = platform_layer_select(selector, &device, &c.context);
+    if(CL_SUCCESS != rv)
+        return rv;
+
+    /* 7-8. Build the program */
+    cl_device_type type;
+    clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+    if(NULL == kernel_file_name)
+        kernel_file_name = (CL_DEVICE_TYPE_ACCELERATOR & type)
+            ? BINARY_FILE_NAME : SOURCE_FILE_NAME;
+    rv = build_program(&program, &c.context, &device, kernel_file_name);
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Failed to build a program:", rv, stderr);
+        return rv;
+    }
+
+    /* 4-6, 9-10. Create the queue, the buffers and the kernels */
+    size_t frame_size = (size_t) c.width * c.height;
+    unsigned char* frame = malloc(frame_size);
+    unsigned char* result = malloc(frame_size);
+    unsigned char* expected = malloc(frame_size);
+    if(NULL == frame || NULL == result || NULL == expected)
+    {
+        fputs("Failed to allocate the host memory\n", stderr);
+        return CL_OUT_OF_HOST_MEMORY;
+    }
+    rv = conv_init(&c, device, program, filter);
+
+    /* 11-12. Stream the frames through every kernel */
+    if(CL_SUCCESS == rv)
+        printf("%dx%d frames, %dx%d filter, %s:\n", c.width, c.height,
+                2 * c.radius + 1, 2 * c.radius + 1,
+                (NULL != src.fp) ? frames_file_name : "generated");
+    for(int k = 0; k < CONV_NUM_KINDS && CL_SUCCESS == rv; ++k)
+    {
+        if(NULL == c.kernels[k] && NULL == c.out_image)
+            printf("%-6s skipped, the device has no image support\n",
+                    g_conv_names[k]);
+        else if(NULL == c.kernels[k])
+            printf("%-6s skipped, the program has no %s kernel\n",
+                    g_conv_names[k], g_kernel_names[k]);
+        else
+            rv = conv_measure(&c, k, &src, filter, frame, result, expected);
+    }
+
+    /* 13. Finalization */
+    conv_release(&c);
+    clReleaseProgram(program);
+    clReleaseContext(c.context);
+    if(NULL != src.fp)
+        fclose(src.fp);
+    free(frame);
+    free(result);
+    free(expected);
+
+    return (CL_SUCCESS != rv) ? rv : 0;
+}
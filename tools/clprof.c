@@ -0,0 +1,557 @@
+#define _GNU_SOURCE // RTLD_NEXT
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <dlfcn.h>
+
+#include "CL/opencl.h"
+
+#include "../common/errorcodes.c"
+
+/*
+ * A shim between a host program and the OpenCL runtime which counts the
+ * calls of the API functions used in the labs, their latency on the host,
+ * the bytes passed to the transfer commands and the returned errors.
+ * Preload it to profile any host binary unchanged:
+ *   OCL_PROF=1 LD_PRELOAD=./tools/libclprof.so ./lab1/lab1
+ *
+ * Environment:
+ *   OCL_PROF - where to write the report at exit: "1" or "stderr" for the
+ *              standard error stream, otherwise a file name. When it's
+ *              unset, empty, "0" or "off", the functions are forwarded to
+ *              the runtime without taking the time.
+ */
+
+#define PROF_NUM_CODES 80 // -79..0, the last counter is for the others
+
+#define PROF_APIS(X) \
+    X(clGetPlatformIDs) X(clGetDeviceIDs) X(clCreateContext) \
+    X(clCreateCommandQueue) X(clCreateBuffer) X(clCreateSubBuffer) \
+    X(clCreateProgramWithSource) X(clCreateProgramWithBinary) \
+    X(clBuildProgram) X(clCreateKernel) X(clSetKernelArg) \
+    X(clEnqueueWriteBuffer) X(clEnqueueReadBuffer) X(clEnqueueCopyBuffer) \
+    X(clEnqueueMapBuffer) X(clEnqueueUnmapMemObject) \
+    X(clEnqueueNDRangeKernel) X(clEnqueueTask) X(clEnqueueMarker) \
+    X(clFlush) X(clFinish) X(clWaitForEvents) X(clReleaseMemObject) \
+    X(clReleaseKernel) X(clReleaseProgram) X(clReleaseCommandQueue) \
+    X(clReleaseContext) X(clReleaseEvent)
+
+#define PROF_ENUM(api) PROF_##api,
+#define PROF_NAME(api) #api,
+
+enum prof_api_id { PROF_APIS(PROF_ENUM) PROF_NUM_APIS };
+
+static const char* const g_api_names[] = { PROF_APIS(PROF_NAME) };
+
+struct prof_api
+{
+    const char* name;
+    void* real;
+    uint64_t calls;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t bytes;
+    uint64_t errors;
+    uint64_t codes[PROF_NUM_CODES];
+    cl_int other_code;          // the last one out of the range
+};
+
+static struct prof_api g_apis[PROF_NUM_APIS];
+static int g_enabled;
+static FILE* g_report;
+static uint64_t g_start_ns;
+
+static uint64_t
+prof_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* The function of the runtime hidden by the wrapper */
+static void*
+prof_real(enum prof_api_id id)
+{
+    void* real = __atomic_load_n(&g_apis[id].real, __ATOMIC_ACQUIRE);
+    if(NULL == real)
+    {
+        if(NULL == (real = dlsym(RTLD_NEXT, g_api_names[id])))
+        {
+            fprintf(stderr, "clprof: no %s in the OpenCL runtime\n",
+                    g_api_names[id]);
+            abort();
+        }
+        __atomic_store_n(&g_apis[id].real, real, __ATOMIC_RELEASE);
+    }
+    return real;
+}
+
+static void
+prof_record(enum prof_api_id id, uint64_t start, cl_int status,
+        uint64_t bytes)
+{
+    struct prof_api* api = &g_apis[id];
+    uint64_t ns = prof_ns() - start;
+    uint64_t max = __atomic_load_n(&api->max_ns, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&api->calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&api->total_ns, ns, __ATOMIC_RELAXED);
+    while(ns > max && !__atomic_compare_exchange_n(&api->max_ns, &max, ns,
+                1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    if(CL_SUCCESS != status)
+    {
+        int code = -status;
+        if(code <= 0 || code >= PROF_NUM_CODES - 1)
+        {
+            code = PROF_NUM_CODES - 1;
+            api->other_code = status;
+        }
+        __atomic_fetch_add(&api->errors, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&api->codes[code], 1, __ATOMIC_RELAXED);
+    }
+    else
+        __atomic_fetch_add(&api->bytes, bytes, __ATOMIC_RELAXED);
+}
+
+/*
+ * Every wrapper looks up the runtime function, calls it and, only when
+ * the profiling is on, takes the time around the call.
+ */
+#define PROF_BEGIN(api) \
+    __typeof__(&api) real = (__typeof__(&api)) prof_real(PROF_##api); \
+    uint64_t start = g_enabled ? prof_ns() : 0
+
+#define PROF_END(api, status, bytes) \
+    if(g_enabled) \
+        prof_record(PROF_##api, start, (status), (bytes))
+
+/* Wrappers of the functions which return an object and an error code */
+#define PROF_ERRCODE(errcode_ret) \
+    cl_int prof_rv; \
+    cl_int* prof_errcode_ret = (NULL != (errcode_ret)) \
+        ? (errcode_ret) : &prof_rv
+
+static int
+prof_cmp_total(const void* a, const void* b)
+{
+    const struct prof_api* x = a;
+    const struct prof_api* y = b;
+    return (x->total_ns < y->total_ns) - (x->total_ns > y->total_ns);
+}
+
+static void
+prof_write_report(FILE* fp)
+{
+    struct prof_api apis[PROF_NUM_APIS];
+    double wall_ms = (prof_ns() - g_start_ns) * 1e-6;
+    double api_ms = 0;
+
+    memcpy(apis, g_apis, sizeof(apis));
+    for(int i = 0; i < PROF_NUM_APIS; ++i)
+    {
+        apis[i].name = g_api_names[i];
+        api_ms += apis[i].total_ns * 1e-6;
+    }
+    qsort(apis, PROF_NUM_APIS, sizeof(*apis), prof_cmp_total);
+
+    fprintf(fp, "OpenCL API calls: %.3f ms of %.3f ms (%.1f%%)\n",
+            api_ms, wall_ms, (wall_ms > 0) ? api_ms * 100 / wall_ms : 0);
+    fprintf(fp, "%-26s %8s %12s %10s %10s %12s %6s\n", "function", "calls",
+            "total, ms", "avg, us", "max, us", "bytes", "errors");
+    for(int i = 0; i < PROF_NUM_APIS; ++i)
+    {
+        const struct prof_api* api = &apis[i];
+        if(0 == api->calls)
+            continue;
+        fprintf(fp, "%-26s %8llu %12.3f %10.1f %10.1f %12llu %6llu\n",
+                api->name, (unsigned long long) api->calls,
+                api->total_ns * 1e-6, api->total_ns * 1e-3 / api->calls,
+                api->max_ns * 1e-3, (unsigned long long) api->bytes,
+                (unsigned long long) api->errors);
+    }
+    for(int i = 0; i < PROF_NUM_APIS; ++i)
+    {
+        const struct prof_api* api = &apis[i];
+        for(int code = 1; code < PROF_NUM_CODES && 0 != api->errors; ++code)
+        {
+            if(0 == api->codes[code])
+                continue;
+            if(PROF_NUM_CODES - 1 == code)
+                fprintf(fp, "%s: %llu x other errors, last %d\n", api->name,
+                        (unsigned long long) api->codes[code],
+                        api->other_code);
+            else
+            {
+                const char* meaning = cl_error_str(-code);
+                fprintf(fp, "%s: %llu x %s (%d)\n", api->name,
+                        (unsigned long long) api->codes[code],
+                        ('\0' != *meaning) ? meaning : "Unknown error",
+                        -code);
+            }
+        }
+    }
+}
+
+__attribute__((constructor)) static void
+prof_init(void)
+{
+    const char* dest = getenv("OCL_PROF");
+    g_start_ns = prof_ns();
+    if(NULL == dest || '\0' == *dest || 0 == strcmp(dest, "0")
+            || 0 == strcmp(dest, "off"))
+        return;
+    if(0 == strcmp(dest, "1") || 0 == strcmp(dest, "stderr"))
+        g_report = stderr;
+    else if(NULL == (g_report = fopen(dest, "w")))
+    {
+        perror(dest);
+        return;
+    }
+    g_enabled = 1;
+}
+
+__attribute__((destructor)) static void
+prof_finish(void)
+{
+    if(!g_enabled)
+        return;
+    g_enabled = 0;
+    prof_write_report(g_report);
+    if(stderr != g_report)
+        fclose(g_report);
+}
+
+/* Platform layer */
+
+CL_API_ENTRY cl_int CL_API_CALL
+clGetPlatformIDs(cl_uint num_entries, cl_platform_id* platforms,
+        cl_uint* num_platforms)
+{
+    PROF_BEGIN(clGetPlatformIDs);
+    cl_int rv = real(num_entries, platforms, num_platforms);
+    PROF_END(clGetPlatformIDs, rv, 0);
+    return rv;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clGetDeviceIDs(cl_platform_id platform, cl_device_type device_type,
+        cl_uint num_entries, cl_device_id* devices, cl_uint* num_devices)
+{
+    PROF_BEGIN(clGetDeviceIDs);
+    cl_int rv = real(platform, device_type, num_entries, devices,
+            num_devices);
+    PROF_END(clGetDeviceIDs, rv, 0);
+    return rv;
+}
+
+CL_API_ENTRY cl_context CL_API_CALL
+clCreateContext(const cl_context_properties* properties, cl_uint num_devices,
+        const cl_device_id* devices,
+        void (CL_CALLBACK* pfn_notify)(const char*, const void*, size_t,
+            void*),
+        void* user_data, cl_int* errcode_ret)
+{
+    PROF_ERRCODE(errcode_ret);
+    PROF_BEGIN(clCreateContext);
+    cl_context context = real(properties, num_devices, devices, pfn_notify,
+            user_data, prof_errcode_ret);
+    PROF_END(clCreateContext, *prof_errcode_ret, 0);
+    return context;
+}
+
+/* Runtime: objects */
+
+CL_API_ENTRY cl_command_queue CL_API_CALL
+clCreateCommandQueue(cl_context context, cl_device_id device,
+        cl_command_queue_properties properties, cl_int* errcode_ret)
+{
+    PROF_ERRCODE(errcode_ret);
+    PROF_BEGIN(clCreateCommandQueue);
+    cl_command_queue queue = real(context, device, properties,
+            prof_errcode_ret);
+    PROF_END(clCreateCommandQueue, *prof_errcode_ret, 0);
+    return queue;
+}
+
+CL_API_ENTRY cl_mem CL_API_CALL
+clCreateBuffer(cl_context context, cl_mem_flags flags, size_t size,
+        void* host_ptr, cl_int* errcode_ret)
+{
+    PROF_ERRCODE(errcode_ret);
+    PROF_BEGIN(clCreateBuffer);
+    cl_mem mem = real(context, flags, size, host_ptr, prof_errcode_ret);
+    // the bytes copied from the host memory, if any
+    PROF_END(clCreateBuffer, *prof_errcode_ret,
+            (CL_MEM_COPY_HOST_PTR & flags) ? size : 0);
+    return mem;
+}
+
+CL_API_ENTRY cl_mem CL_API_CALL
+clCreateSubBuffer(cl_mem buffer, cl_mem_flags flags,
+        cl_buffer_create_type buffer_create_type,
+        const void* buffer_create_info, cl_int* errcode_ret)
+{
+    PROF_ERRCODE(errcode_ret);
+    PROF_BEGIN(clCreateSubBuffer);
+    cl_mem mem = real(buffer, flags, buffer_create_type, buffer_create_info,
+            prof_errcode_ret);
+    PROF_END(clCreateSubBuffer, *prof_errcode_ret, 0);
+    return mem;
+}
+
+CL_API_ENTRY cl_program CL_API_CALL
+clCreateProgramWithSource(cl_context context, cl_uint count,
+        const char** strings, const size_t* lengths, cl_int* errcode_ret)
+{
+    PROF_ERRCODE(errcode_ret);
+    PROF_BEGIN(clCreateProgramWithSource);
+    cl_program program = real(context, count, strings, lengths,
+            prof_errcode_ret);
+    PROF_END(clCreateProgramWithSource, *prof_errcode_ret, 0);
+    return program;
+}
+
+CL_API_ENTRY cl_program CL_API_CALL
+clCreateProgramWithBinary(cl_context context, cl_uint num_devices,
+        const cl_device_id* device_list, const size_t* lengths,
+        const unsigned char** binaries, cl_int* binary_status,
+        cl_int* errcode_ret)
+{
+    uint64_t bytes = 0;
+    PROF_ERRCODE(errcode_ret);
+    PROF_BEGIN(clCreateProgramWithBinary);
+    cl_program program = real(context, num_devices, device_list, lengths,
+            binaries, binary_status, prof_errcode_ret);
+    for(cl_uint i = 0; g_enabled && NULL != lengths && i < num_devices; ++i)
+        bytes += lengths[i];
+    PROF_END(clCreateProgramWithBinary, *prof_errcode_ret, bytes);
+    return program;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clBuildProgram(cl_program program, cl_uint num_devices,
+        const cl_device_id* device_list, const char* options,
+        void (CL_CALLBACK* pfn_notify)(cl_program, void*), void* user_data)
+{
+    PROF_BEGIN(clBuildProgram);
+    cl_int rv = real(program, num_devices, device_list, options, pfn_notify,
+            user_data);
+    PROF_END(clBuildProgram, rv, 0);
+    return rv;
+}
+
+CL_API_ENTRY cl_kernel CL_API_CALL
+clCreateKernel(cl_program program, const char* kernel_name,
+        cl_int* errcode_ret)
+{
+    PROF_ERRCODE(errcode_ret);
+    PROF_BEGIN(clCreateKernel);
+    cl_kernel kernel = real(program, kernel_name, prof_errcode_ret);
+    PROF_END(clCreateKernel, *prof_errcode_ret, 0);
+    return kernel;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clSetKernelArg(cl_kernel kernel, cl_uint arg_index, size_t arg_size,
+        const void* arg_value)
+{
+    PROF_BEGIN(clSetKernelArg);
+    cl_int rv = real(kernel, arg_index, arg_size, arg_value);
+    PROF_END(clSetKernelArg, rv, arg_size);
+    return rv;
+}
+
+/* Runtime: commands */
+
+CL_API_ENTRY cl_int CL_API_CALL
+clEnqueueWriteBuffer(cl_command_queue command_queue, cl_mem buffer,
+        cl_bool blocking_write, size_t offset, size_t size, const void* ptr,
+        cl_uint num_events_in_wait_list, const cl_event* event_wait_list,
+        cl_event* event)
+{
+    PROF_BEGIN(clEnqueueWriteBuffer);
+    cl_int rv = real(command_queue, buffer, blocking_write, offset, size,
+            ptr, num_events_in_wait_list, event_wait_list, event);
+    PROF_END(clEnqueueWriteBuffer, rv, size);
+    return rv;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clEnqueueReadBuffer(cl_command_queue command_queue, cl_mem buffer,
+        cl_bool blocking_read, size_t offset, size_t size, void* ptr,
+        cl_uint num_events_in_wait_list, const cl_event* event_wait_list,
+        cl_event* event)
+{
+    PROF_BEGIN(clEnqueueReadBuffer);
+    cl_int rv = real(command_queue, buffer, blocking_read, offset, size, ptr,
+            num_events_in_wait_list, event_wait_list, event);
+    PROF_END(clEnqueueReadBuffer, rv, size);
+    return rv;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clEnqueueCopyBuffer(cl_command_queue command_queue, cl_mem src_buffer,
+        cl_mem dst_buffer, size_t src_offset, size_t dst_offset, size_t size,
+        cl_uint num_events_in_wait_list, const cl_event* event_wait_list,
+        cl_event* event)
+{
+    PROF_BEGIN(clEnqueueCopyBuffer);
+    cl_int rv = real(command_queue, src_buffer, dst_buffer, src_offset,
+            dst_offset, size, num_events_in_wait_list, event_wait_list,
+            event);
+    PROF_END(clEnqueueCopyBuffer, rv, size);
+    return rv;
+}
+
+CL_API_ENTRY void* CL_API_CALL
+clEnqueueMapBuffer(cl_command_queue command_queue, cl_mem buffer,
+        cl_bool blocking_map, cl_map_flags map_flags, size_t offset,
+        size_t size, cl_uint num_events_in_wait_list,
+        const cl_event* event_wait_list, cl_event* event,
+        cl_int* errcode_ret)
+{
+    PROF_ERRCODE(errcode_ret);
+    PROF_BEGIN(clEnqueueMapBuffer);
+    void* ptr = real(command_queue, buffer, blocking_map, map_flags, offset,
+            size, num_events_in_wait_list, event_wait_list, event,
+            prof_errcode_ret);
+    PROF_END(clEnqueueMapBuffer, *prof_errcode_ret, size);
+    return ptr;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clEnqueueUnmapMemObject(cl_command_queue command_queue, cl_mem memobj,
+        void* mapped_ptr, cl_uint num_events_in_wait_list,
+        const cl_event* event_wait_list, cl_event* event)
+{
+    PROF_BEGIN(clEnqueueUnmapMemObject);
+    cl_int rv = real(command_queue, memobj, mapped_ptr,
+            num_events_in_wait_list, event_wait_list, event);
+    PROF_END(clEnqueueUnmapMemObject, rv, 0);
+    return rv;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clEnqueueNDRangeKernel(cl_command_queue command_queue, cl_kernel kernel,
+        cl_uint work_dim, const size_t* global_work_offset,
+        const size_t* global_work_size, const size_t* local_work_size,
+        cl_uint num_events_in_wait_list, const cl_event* event_wait_list,
+        cl_event* event)
+{
+    PROF_BEGIN(clEnqueueNDRangeKernel);
+    cl_int rv = real(command_queue, kernel, work_dim, global_work_offset,
+            global_work_size, local_work_size, num_events_in_wait_list,
+            event_wait_list, event);
+    PROF_END(clEnqueueNDRangeKernel, rv, 0);
+    return rv;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clEnqueueTask(cl_command_queue command_queue, cl_kernel kernel,
+        cl_uint num_events_in_wait_list, const cl_event* event_wait_list,
+        cl_event* event)
+{
+    PROF_BEGIN(clEnqueueTask);
+    cl_int rv = real(command_queue, kernel, num_events_in_wait_list,
+            event_wait_list, event);
+    PROF_END(clEnqueueTask, rv, 0);
+    return rv;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clEnqueueMarker(cl_command_queue command_queue, cl_event* event)
+{
+    PROF_BEGIN(clEnqueueMarker);
+    cl_int rv = real(command_queue, event);
+    PROF_END(clEnqueueMarker, rv, 0);
+    return rv;
+}
+
+/* Runtime: synchronization */
+
+CL_API_ENTRY cl_int CL_API_CALL
+clFlush(cl_command_queue command_queue)
+{
+    PROF_BEGIN(clFlush);
+    cl_int rv = real(command_queue);
+    PROF_END(clFlush, rv, 0);
+    return rv;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clFinish(cl_command_queue command_queue)
+{
+    PROF_BEGIN(clFinish);
+    cl_int rv = real(command_queue);
+    PROF_END(clFinish, rv, 0);
+    return rv;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clWaitForEvents(cl_uint num_events, const cl_event* event_list)
+{
+    PROF_BEGIN(clWaitForEvents);
+    cl_int rv = real(num_events, event_list);
+    PROF_END(clWaitForEvents, rv, 0);
+    return rv;
+}
+
+/* Runtime: finalization */
+
+CL_API_ENTRY cl_int CL_API_CALL
+clReleaseMemObject(cl_mem memobj)
+{
+    PROF_BEGIN(clReleaseMemObject);
+    cl_int rv = real(memobj);
+    PROF_END(clReleaseMemObject, rv, 0);
+    return rv;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clReleaseKernel(cl_kernel kernel)
+{
+    PROF_BEGIN(clReleaseKernel);
+    cl_int rv = real(kernel);
+    PROF_END(clReleaseKernel, rv, 0);
+    return rv;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clReleaseProgram(cl_program program)
+{
+    PROF_BEGIN(clReleaseProgram);
+    cl_int rv = real(program);
+    PROF_END(clReleaseProgram, rv, 0);
+    return rv;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clReleaseCommandQueue(cl_command_queue command_queue)
+{
+    PROF_BEGIN(clReleaseCommandQueue);
+    cl_int rv = real(command_queue);
+    PROF_END(clReleaseCommandQueue, rv, 0);
+    return rv;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clReleaseContext(cl_context context)
+{
+    PROF_BEGIN(clReleaseContext);
+    cl_int rv = real(context);
+    PROF_END(clReleaseContext, rv, 0);
+    return rv;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+clReleaseEvent(cl_event event)
+{
+    PROF_BEGIN(clReleaseEvent);
+    cl_int rv = real(event);
+    PROF_END(clReleaseEvent, rv, 0);
+    return rv;
+}
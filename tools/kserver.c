@@ -0,0 +1,491 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "CL/opencl.h"
+
+#include "../common/errorcodes.c"
+#include "../common/utils.c"
+#include "../common/stats.c"
+#include "../common/ksrv.c"
+
+/*
+ * A resident kernel server. It sets up the context, the queue and the
+ * program once and then runs the copy kernel of lab3 for clients that
+ * connect over a UNIX domain socket and pass the payloads through a ring
+ * in shared memory (see common/ksrv.c), so a short job costs a round trip
+ * over the socket instead of the whole setup, or reconfiguring the FPGA.
+ *
+ * The same program is the client: with -c it sends jobs of a given size
+ * to the server, checks the results and reports the latency of a job.
+ */
+
+#define BINARY_FILE_NAME "lab3.aocx"
+#define SOURCE_FILE_NAME "kserver.cl"
+#define MAX_CLIENTS 16
+#define NUM_JOBS 1000
+#define JOB_SIZE 4096
+#define DEPTH 4
+
+struct server
+{
+    cl_context context;
+    cl_device_id device;
+    cl_command_queue queue;
+    cl_program program;
+    cl_kernel kernel;
+    cl_mem buf_in;
+    cl_mem buf_out;
+    size_t buf_size;
+    size_t max_buf_size;        // of each of the buffers
+    size_t num_jobs;
+};
+
+struct client
+{
+    int sock;
+    struct ksrv_ring ring;
+};
+
+static volatile sig_atomic_t g_stop;
+
+static void
+on_signal(int sig)
+{
+    g_stop = 1;
+}
+
+void
+usage(const char* prog)
+{
+    fprintf(stderr, "Usage: %s [-d device] [-k kernel] [-S socket]\n"
+            "       %s -c [-n jobs] [-b bytes] [-q depth] [-S socket]\n"
+            "\t-d  device selector (see common/devices.c)\n"
+            "\t-k  kernel file, %s for accelerators, %s otherwise\n"
+            "\t-S  socket path (OCL_KSRV_SOCKET, %s)\n"
+            "\t-c  run as a client: send jobs to the server and time them\n"
+            "\t-n  jobs to send (%d)\n"
+            "\t-b  bytes a job (%d)\n"
+            "\t-q  jobs in flight, the slots of the ring (%d)\n",
+            prog, prog, BINARY_FILE_NAME, SOURCE_FILE_NAME,
+            KSRV_DEFAULT_SOCKET, NUM_JOBS, JOB_SIZE, DEPTH);
+}
+
+static cl_int
+server_ensure_buffers(struct server* srv, size_t size)
+{
+    cl_int rv = CL_SUCCESS;
+
+    if(size <= srv->buf_size)
+        return CL_SUCCESS;
+    if(size > srv->max_buf_size)
+        return CL_INVALID_BUFFER_SIZE;
+    if(NULL != srv->buf_in)
+        clReleaseMemObject(srv->buf_in);
+    if(NULL != srv->buf_out)
+        clReleaseMemObject(srv->buf_out);
+    srv->buf_out = NULL;
+    srv->buf_size = 0;
+    srv->buf_in = clCreateBuffer(srv->context, CL_MEM_READ_ONLY, size, NULL,
+            &rv);
+    if(CL_SUCCESS == rv)
+        srv->buf_out = clCreateBuffer(srv->context, CL_MEM_WRITE_ONLY, size,
+                NULL, &rv);
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Failed to create a buffer object:", rv, stderr);
+        return rv;
+    }
+    srv->buf_size = size;
+    return CL_SUCCESS;
+}
+
+/**
+ * Copy the input area of a slot to its output area through the device.
+ */
+static cl_int
+server_run(struct server* srv, const struct ksrv_ring* ring, uint32_t slot,
+        size_t bytes, uint64_t* device_ns)
+{
+    cl_int rv;
+    cl_event event;
+    size_t padded = (bytes + sizeof(cl_int) - 1) & ~(sizeof(cl_int) - 1);
+    size_t global_work_size = padded / sizeof(cl_int);
+    cl_ulong start = 0, end = 0;
+
+    // bytes comes from the client, padded may have wrapped around
+    if(slot >= ring->num_slots || 0 == bytes || bytes > ring->slot_size
+            || padded > ring->slot_size)
+        return CL_INVALID_VALUE;
+    if(CL_SUCCESS != (rv = server_ensure_buffers(srv, ring->slot_size)))
+        return rv;
+
+    rv = clEnqueueWriteBuffer(srv->queue, srv->buf_in, CL_FALSE, 0, padded,
+            ksrv_slot_in(ring, slot), 0, NULL, NULL);
+    if(CL_SUCCESS == rv)
+        rv = clSetKernelArg(srv->kernel, 0, sizeof(cl_mem), &srv->buf_out);
+    if(CL_SUCCESS == rv)
+        rv = clSetKernelArg(srv->kernel, 1, sizeof(cl_mem), &srv->buf_in);
+    if(CL_SUCCESS == rv)
+        rv = clEnqueueNDRangeKernel(srv->queue, srv->kernel, 1, NULL,
+                &global_work_size, NULL, 0, NULL, &event);
+    if(CL_SUCCESS != rv)
+        return rv;
+    rv = clEnqueueReadBuffer(srv->queue, srv->buf_out, CL_TRUE, 0, bytes,
+            ksrv_slot_out(ring, slot), 0, NULL, NULL);
+    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START,
+            sizeof(start), &start, NULL);
+    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END,
+            sizeof(end), &end, NULL);
+    clReleaseEvent(event);
+    *device_ns = end - start;
+    return rv;
+}
+
+/**
+ * Serve one request of a client. Returns non-zero to drop the client.
+ */
+static int
+server_serve(struct server* srv, struct client* c)
+{
+    struct ksrv_request req;
+    struct ksrv_reply reply;
+    int fd;
+    double start = stats_now();
+
+    if(0 != ksrv_recv(c->sock, &req, &fd))
+        return 1;
+    memset(&reply, 0, sizeof(reply));
+    reply.slot = req.slot;
+    switch(req.op)
+    {
+        case KSRV_ATTACH:
+            ksrv_ring_release(&c->ring);
+            // the device buffers are as large as a slot
+            if(req.bytes > srv->max_buf_size)
+                reply.status = CL_INVALID_BUFFER_SIZE;
+            else if(-1 == fd
+                    || ksrv_ring_attach(&c->ring, fd, req.slot, req.bytes))
+                reply.status = CL_INVALID_VALUE;
+            if(CL_SUCCESS != reply.status && -1 != fd)
+                close(fd);
+            break;
+        case KSRV_RUN:
+            reply.status = (NULL == c->ring.base) ? CL_INVALID_VALUE
+                : server_run(srv, &c->ring, req.slot, req.bytes,
+                        &reply.device_ns);
+            ++srv->num_jobs;
+            break;
+        case KSRV_DETACH:
+        default:
+            return 1;
+    }
+    if(-1 != fd && KSRV_ATTACH != req.op)
+        close(fd);
+    reply.service_ns = (stats_now() - start) * 1e9;
+    return ksrv_write_all(c->sock, &reply, sizeof(reply));
+}
+
+static int
+server_listen(const char* path)
+{
+    struct sockaddr_un addr;
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    mode_t mask;
+    int bound;
+
+    if(-1 == sock)
+    {
+        perror("socket");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    unlink(path); // left by a server that was killed
+    // only the user of the server may connect, the socket is born 0600
+    mask = umask(0177);
+    bound = bind(sock, (struct sockaddr*) &addr, sizeof(addr));
+    umask(mask);
+    if(0 != bound || 0 != listen(sock, MAX_CLIENTS))
+    {
+        perror(path);
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static void
+server_drop(struct client* clients, int* num_clients, int i)
+{
+    close(clients[i].sock);
+    ksrv_ring_release(&clients[i].ring);
+    clients[i] = clients[--*num_clients];
+}
+
+static cl_int
+server_loop(struct server* srv, const char* path)
+{
+    struct client clients[MAX_CLIENTS];
+    struct pollfd fds[MAX_CLIENTS + 1];
+    int num_clients = 0;
+    int listener = server_listen(path);
+
+    if(-1 == listener)
+        return CL_INVALID_VALUE;
+    printf("Serving on %s\n", path);
+    fflush(stdout);
+
+    while(!g_stop)
+    {
+        fds[0].fd = listener;
+        fds[0].events = POLLIN;
+        for(int i = 0; i < num_clients; ++i)
+        {
+            fds[i + 1].fd = clients[i].sock;
+            fds[i + 1].events = POLLIN;
+        }
+        if(poll(fds, num_clients + 1, -1) < 0)
+            continue; // interrupted, maybe by a signal to stop
+
+        // from the last one, a dropped client takes the place of the last
+        for(int i = num_clients - 1; i >= 0; --i)
+            if(0 != fds[i + 1].revents
+                    && server_serve(srv, &clients[i]))
+                server_drop(clients, &num_clients, i);
+
+        if(POLLIN & fds[0].revents)
+        {
+            int sock = accept(listener, NULL, NULL);
+            if(sock >= 0 && num_clients < MAX_CLIENTS)
+            {
+                clients[num_clients].sock = sock;
+                memset(&clients[num_clients].ring, 0,
+                        sizeof(clients[num_clients].ring));
+                clients[num_clients].ring.fd = -1;
+                ++num_clients;
+            }
+            else if(sock >= 0)
+                close(sock);
+        }
+    }
+
+    while(num_clients > 0)
+        server_drop(clients, &num_clients, num_clients - 1);
+    close(listener);
+    unlink(path);
+    printf("Served %zu job(s)\n", srv->num_jobs);
+    return CL_SUCCESS;
+}
+
+static cl_int
+server_main(const char* selector, const char* kernel_file_name,
+        const char* path)
+{
+    cl_int rv;
+    struct server srv;
+    cl_device_type type = 0;
+    cl_ulong max_alloc = 0, global_mem = 0;
+
+    memset(&srv, 0, sizeof(srv));
+    if(CL_SUCCESS != (rv = platform_layer_select(selector, &srv.device,
+                    &srv.context)))
+        return rv;
+    clGetDeviceInfo(srv.device, CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+    clGetDeviceInfo(srv.device, CL_DEVICE_MAX_MEM_ALLOC_SIZE,
+            sizeof(max_alloc), &max_alloc, NULL);
+    clGetDeviceInfo(srv.device, CL_DEVICE_GLOBAL_MEM_SIZE,
+            sizeof(global_mem), &global_mem, NULL);
+    // a slot takes an input and an output buffer, leave half the memory
+    srv.max_buf_size = KSRV_MAX_SLOT_SIZE;
+    if(0 != max_alloc && max_alloc < srv.max_buf_size)
+        srv.max_buf_size = max_alloc;
+    if(0 != global_mem && global_mem / 4 < srv.max_buf_size)
+        srv.max_buf_size = global_mem / 4;
+    if(NULL == kernel_file_name)
+        kernel_file_name = (CL_DEVICE_TYPE_ACCELERATOR & type)
+            ? BINARY_FILE_NAME : SOURCE_FILE_NAME;
+
+    srv.queue = clCreateCommandQueue(srv.context, srv.device,
+            CL_QUEUE_PROFILING_ENABLE, &rv);
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Failed to create a command queue:", rv, stderr);
+        return rv;
+    }
+    rv = build_program(&srv.program, &srv.context, &srv.device,
+            kernel_file_name);
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Failed to build a program:", rv, stderr);
+        return rv;
+    }
+    srv.kernel = clCreateKernel(srv.program, "inout", &rv);
+    if(CL_SUCCESS != rv)
+    {
+        print_cl_error("Failed to create a kernel object:", rv, stderr);
+        return rv;
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN); // a client may go away before the reply
+    rv = server_loop(&srv, path);
+
+    if(NULL != srv.buf_in)
+        clReleaseMemObject(srv.buf_in);
+    if(NULL != srv.buf_out)
+        clReleaseMemObject(srv.buf_out);
+    clReleaseKernel(srv.kernel);
+    clReleaseProgram(srv.program);
+    clReleaseCommandQueue(srv.queue);
+    clReleaseContext(srv.context);
+    return rv;
+}
+
+static cl_int
+client_send(int sock, const struct ksrv_ring* ring, uint32_t slot,
+        size_t bytes, size_t job)
+{
+    struct ksrv_request req = { KSRV_RUN, slot, bytes };
+    unsigned char* in = ksrv_slot_in(ring, slot);
+
+    for(size_t i = 0; i < bytes; ++i)
+        in[i] = (unsigned char) ((job + i) * 0x9E37 >> 8);
+    memset(ksrv_slot_out(ring, slot), 0, bytes);
+    return ksrv_write_all(sock, &req, sizeof(req))
+        ? CL_INVALID_VALUE : CL_SUCCESS;
+}
+
+static cl_int
+client_main(const char* path, size_t num_jobs, size_t bytes, uint32_t depth)
+{
+    cl_int rv = CL_SUCCESS;
+    struct ksrv_ring ring;
+    struct ksrv_request req;
+    struct ksrv_reply reply;
+    double* latency = malloc(num_jobs * sizeof(double));
+    double* service = malloc(num_jobs * sizeof(double));
+    double* device = malloc(num_jobs * sizeof(double));
+    double* sent = malloc(depth * sizeof(double));
+    size_t num_sent = 0, num_done = 0;
+    int sock;
+
+    if(NULL == latency || NULL == service || NULL == device || NULL == sent)
+        return CL_OUT_OF_HOST_MEMORY;
+    if(-1 == (sock = ksrv_connect(path)))
+        return CL_INVALID_VALUE;
+    if(ksrv_ring_create(&ring, depth, bytes))
+        return CL_OUT_OF_HOST_MEMORY;
+    // the ring rounds the slots up, the server must see the same layout
+    req.op = KSRV_ATTACH;
+    req.slot = depth;
+    req.bytes = ring.slot_size;
+    if(ksrv_send_fd(sock, &req, ring.fd)
+            || ksrv_read_all(sock, &reply, sizeof(reply))
+            || CL_SUCCESS != reply.status)
+    {
+        fputs("The server refused the ring\n", stderr);
+        return CL_INVALID_VALUE;
+    }
+
+    double start = stats_now();
+    while(num_done < num_jobs && CL_SUCCESS == rv)
+    {
+        // keep the ring full, jobs come back in the order they went
+        while(num_sent < num_jobs && num_sent - num_done < depth
+                && CL_SUCCESS == rv)
+        {
+            uint32_t slot = num_sent % depth;
+            sent[slot] = stats_now();
+            rv = client_send(sock, &ring, slot, bytes, num_sent++);
+        }
+        if(CL_SUCCESS != rv || ksrv_read_all(sock, &reply, sizeof(reply)))
+        {
+            fputs("Lost the connection to the server\n", stderr);
+            rv = CL_INVALID_VALUE;
+            break;
+        }
+        if(CL_SUCCESS != (rv = reply.status))
+        {
+            print_cl_error("The server failed a job:", rv, stderr);
+            break;
+        }
+        latency[num_done] = (stats_now() - sent[reply.slot]) * 1e6;
+        service[num_done] = reply.service_ns / 1e3;
+        device[num_done] = reply.device_ns / 1e3;
+        if(0 != memcmp(ksrv_slot_in(&ring, reply.slot),
+                    ksrv_slot_out(&ring, reply.slot), bytes))
+        {
+            fprintf(stderr, "Job %zu came back corrupted\n", num_done);
+            rv = CL_INVALID_VALUE;
+        }
+        ++num_done;
+    }
+    double elapsed = stats_now() - start;
+
+    req.op = KSRV_DETACH;
+    ksrv_write_all(sock, &req, sizeof(req));
+    close(sock);
+    ksrv_ring_release(&ring);
+
+    if(CL_SUCCESS == rv)
+    {
+        struct stats_report report;
+        memset(&report, 0, sizeof(report));
+        stats_add(&report, "kserver/latency", bytes, latency, num_done);
+        stats_add(&report, "kserver/service", bytes, service, num_done);
+        stats_add(&report, "kserver/device", bytes, device, num_done);
+        stats_print(&report, stdout);
+        printf("%zu job(s) of %zu bytes, %u in flight: %.0f jobs/s\n",
+                num_done, bytes, depth, num_done / elapsed);
+        stats_free(&report);
+    }
+    free(latency);
+    free(service);
+    free(device);
+    free(sent);
+    return rv;
+}
+
+int
+main(int argc, char** argv)
+{
+    const char* selector = NULL;
+    const char* kernel_file_name = NULL;
+    const char* path = ksrv_socket_path();
+    int client = 0;
+    size_t num_jobs = NUM_JOBS;
+    size_t bytes = JOB_SIZE;
+    int depth = DEPTH;
+    int opt;
+
+    while(-1 != (opt = getopt(argc, argv, "d:k:S:cn:b:q:h")))
+    {
+        switch(opt)
+        {
+            case 'd': selector = optarg; break;
+            case 'k': kernel_file_name = optarg; break;
+            case 'S': path = optarg; break;
+            case 'c': client = 1; break;
+            case 'n': num_jobs = strtoul(optarg, NULL, 0); break;
+            case 'b': bytes = strtoul(optarg, NULL, 0); break;
+            case 'q': depth = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return CL_INVALID_VALUE;
+        }
+    }
+    if(0 == num_jobs || 0 == bytes || depth <= 0)
+    {
+        usage(argv[0]);
+        return CL_INVALID_VALUE;
+    }
+
+    return client ? client_main(path, num_jobs, bytes, depth)
+        : server_main(selector, kernel_file_name, path);
+}
@@ -0,0 +1,269 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+
+#include "../common/bundle.c"
+
+#define LINE_SIZE 4096
+#define MAX_ENTRIES 64
+#define STRTAB_FAILED UINT32_MAX    // of strtab_add(), out of memory
+
+/*
+ * Pack precompiled kernels into a bundle (see common/bundle.c) or list
+ * the content of a bundle.
+ *
+ * Each non-empty line of a manifest which doesn't start with '#' describes
+ * one binary with '|'-separated fields:
+ *   file | device | kernel[,kernel...] | signature[;signature...] | x,y,z
+ * For example:
+ *   lab1.aocx | de1soc_sharedonly | inout | __global int* out, int in |
+ * The device, the signatures and the work group size may be left empty;
+ * build_program_opts() checks the kernel it builds against the given ones,
+ * so a work group size goes only with a kernel which requires it.
+ */
+
+struct manifest_entry
+{
+    char* file_name;
+    struct bundle_entry entry;
+    struct mapped_file binary;
+};
+
+struct strtab
+{
+    char* data;
+    uint32_t size;
+};
+
+void
+usage(const char* prog)
+{
+    fprintf(stderr, "Usage: %s -o <bundle> <manifest>\n"
+            "       %s -l <bundle>\n", prog, prog);
+}
+
+char*
+trim(char* s)
+{
+    char* end;
+    while(isspace((unsigned char) *s))
+        ++s;
+    end = s + strlen(s);
+    while(end > s && isspace((unsigned char) end[-1]))
+        --end;
+    *end = '\0';
+    return s;
+}
+
+uint32_t
+strtab_add(struct strtab* t, const char* s)
+{
+    uint32_t offset = t->size;
+    size_t len = strlen(s) + 1;
+    char* data = realloc(t->data, t->size + len);
+    if(NULL == data)
+        return STRTAB_FAILED;
+    t->data = data;
+    memcpy(t->data + offset, s, len);
+    t->size += len;
+    return offset;
+}
+
+int
+parse_manifest(const char* manifest_name, struct manifest_entry* entries,
+        uint32_t* num_entries, struct strtab* strtab)
+{
+    char line[LINE_SIZE];
+    char* fields[5];
+    unsigned int line_no = 0;
+    FILE* fp = fopen(manifest_name, "r");
+    if(NULL == fp)
+    {
+        perror(manifest_name);
+        return -1;
+    }
+
+    *num_entries = 0;
+    while(NULL != fgets(line, sizeof(line), fp))
+    {
+        char* p = trim(line);
+        int n = 0;
+        ++line_no;
+        if('\0' == *p || '#' == *p)
+            continue;
+        if(MAX_ENTRIES == *num_entries)
+        {
+            fprintf(stderr, "%s: too many entries\n", manifest_name);
+            fclose(fp);
+            return -1;
+        }
+
+        // split the line into fields, the last ones may be omitted
+        for(fields[n++] = p; n < 5 && NULL != (p = strchr(p, '|')); )
+        {
+            *p++ = '\0';
+            fields[n++] = p;
+        }
+        for(int i = 0; i < 5; ++i)
+            fields[i] = (i < n) ? trim(fields[i]) : "";
+        if('\0' == *fields[0] || '\0' == *fields[2])
+        {
+            fprintf(stderr, "%s:%u: a file and kernel names are required\n",
+                    manifest_name, line_no);
+            fclose(fp);
+            return -1;
+        }
+
+        struct manifest_entry* me = &entries[(*num_entries)++];
+        memset(me, 0, sizeof(*me));
+        me->file_name = strdup(fields[0]);
+        me->entry.device = strtab_add(strtab, fields[1]);
+        me->entry.kernels = strtab_add(strtab, fields[2]);
+        me->entry.signatures = strtab_add(strtab, fields[3]);
+        if(NULL == me->file_name || STRTAB_FAILED == me->entry.device
+                || STRTAB_FAILED == me->entry.kernels
+                || STRTAB_FAILED == me->entry.signatures)
+        {
+            fputs("Out of memory\n", stderr);
+            fclose(fp);
+            return -1;
+        }
+        if('\0' != *fields[4] && 3 != sscanf(fields[4], "%u,%u,%u",
+                    &me->entry.reqd_work_group_size[0],
+                    &me->entry.reqd_work_group_size[1],
+                    &me->entry.reqd_work_group_size[2]))
+        {
+            fprintf(stderr, "%s:%u: bad work group size\n",
+                    manifest_name, line_no);
+            fclose(fp);
+            return -1;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+int
+write_bundle(const char* bundle_name, struct manifest_entry* entries,
+        uint32_t num_entries, const struct strtab* strtab)
+{
+    static const char zeros[BUNDLE_ALIGNMENT];
+    struct bundle_header header;
+    uint64_t offset;
+    FILE* fp;
+
+    memcpy(header.magic, BUNDLE_MAGIC, sizeof(header.magic));
+    header.num_entries = num_entries;
+    header.strtab_size = strtab->size;
+
+    // place every binary on its own page
+    offset = sizeof(header) + num_entries * sizeof(struct bundle_entry)
+        + strtab->size;
+    for(uint32_t i = 0; i < num_entries; ++i)
+    {
+        if(map_file(entries[i].file_name, &entries[i].binary))
+            return -1;
+        offset = (offset + BUNDLE_ALIGNMENT - 1)
+            & ~(uint64_t) (BUNDLE_ALIGNMENT - 1);
+        entries[i].entry.offset = offset;
+        entries[i].entry.size = entries[i].binary.size;
+        offset += entries[i].binary.size;
+    }
+
+    if(NULL == (fp = fopen(bundle_name, "wb")))
+    {
+        perror(bundle_name);
+        return -1;
+    }
+    offset = 0;
+    if(1 != fwrite(&header, sizeof(header), 1, fp))
+        goto write_error;
+    offset += sizeof(header);
+    for(uint32_t i = 0; i < num_entries; ++i)
+    {
+        if(1 != fwrite(&entries[i].entry, sizeof(struct bundle_entry), 1, fp))
+            goto write_error;
+        offset += sizeof(struct bundle_entry);
+    }
+    if(1 != fwrite(strtab->data, strtab->size, 1, fp))
+        goto write_error;
+    offset += strtab->size;
+    for(uint32_t i = 0; i < num_entries; ++i)
+    {
+        size_t padding = entries[i].entry.offset - offset;
+        if((padding && 1 != fwrite(zeros, padding, 1, fp))
+                || 1 != fwrite(entries[i].binary.data,
+                    entries[i].binary.size, 1, fp))
+            goto write_error;
+        offset += padding + entries[i].binary.size;
+        unmap_file(&entries[i].binary);
+    }
+    if(fclose(fp))
+    {
+        perror(bundle_name);
+        return -1;
+    }
+    return 0;
+
+write_error:
+    perror(bundle_name);
+    fclose(fp);
+    remove(bundle_name);
+    return -1;
+}
+
+int
+main(int argc, char** argv)
+{
+    const char* output = NULL;
+    const char* list = NULL;
+    int opt;
+
+    while(-1 != (opt = getopt(argc, argv, "o:l:h")))
+    {
+        switch(opt)
+        {
+            case 'o':
+                output = optarg;
+                break;
+            case 'l':
+                list = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 'h' == opt ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if(NULL != list)
+    {
+        struct bundle b;
+        if(bundle_open(&b, list))
+            return EXIT_FAILURE;
+        bundle_print(&b, stdout);
+        bundle_close(&b);
+        return EXIT_SUCCESS;
+    }
+
+    if(NULL == output || optind + 1 != argc)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct manifest_entry entries[MAX_ENTRIES];
+    uint32_t num_entries;
+    struct strtab strtab = {NULL, 0};
+    if(parse_manifest(argv[optind], entries, &num_entries, &strtab)
+            || 0 == num_entries
+            || write_bundle(output, entries, num_entries, &strtab))
+    {
+        fprintf(stderr, "Failed to create %s\n", output);
+        return EXIT_FAILURE;
+    }
+
+    printf("Packed %u binaries into %s\n", num_entries, output);
+    return EXIT_SUCCESS;
+}